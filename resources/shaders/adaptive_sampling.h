@@ -0,0 +1,24 @@
+#ifndef VK_GRAPHICS_RT_ADAPTIVE_SAMPLING_H
+#define VK_GRAPHICS_RT_ADAPTIVE_SAMPLING_H
+
+// Adaptive sample density: the probe pass of GenSamples shoots the first SAMPLING_PROBE_POINTS points of every
+// voxel face and gathers the statistics below per voxel slot. The host turns them into the number of points per
+// face of every voxel (SAMPLING_STAT_POINTS) under a global budget, the count and write passes shoot only those.
+// The point sequence is progressive, so any prefix of it covers the face evenly.
+#define SAMPLING_PROBE_POINTS 8
+#define SAMPLING_MIN_POINTS   12  // also given to the voxels the probe missed, thin geometry may still be there
+#define SAMPLING_MAX_POINTS   128
+
+// uint slots of the per voxel statistics
+#define SAMPLING_STAT_HITS   0
+#define SAMPLING_STAT_NORMAL 1 // three slots, sum of the hit normals as ints scaled by SAMPLING_NORMAL_SCALE
+#define SAMPLING_STAT_DIST   4 // sum of the hit distances relative to the voxel size, scaled by SAMPLING_DIST_SCALE
+#define SAMPLING_STAT_DIST2  5 // sum of the squares of the scaled distances
+#define SAMPLING_STAT_PRIMS  6 // mask of the hit primitives hashed to 32 bits, its popcount estimates the distinct ones
+#define SAMPLING_STAT_POINTS 7 // points per face chosen by the host
+#define SAMPLING_STATS_COUNT 8
+
+#define SAMPLING_NORMAL_SCALE 1024.0
+#define SAMPLING_DIST_SCALE   255.0
+
+#endif// VK_GRAPHICS_RT_ADAPTIVE_SAMPLING_H
@@ -0,0 +1,190 @@
+#ifndef VK_GRAPHICS_RT_BRICK_MAP_H
+#define VK_GRAPHICS_RT_BRICK_MAP_H
+
+// Sparse voxel grid: the bbox is split into cells of BRICK_SIZE^3 voxels and only the cells that contain
+// geometry get a brick in the pool. The brick table has one entry per cell with the brick index or BRICK_EMPTY,
+// the brick cells buffer has the cell of every brick. Per voxel data (point counters, final lighting) is
+// addressed by the voxel slot brick * BRICK_VOXELS + local index, so it scales with the surface area.
+// The visible voxels list stores slots as well.
+// The voxels may belong to several grids (cascades), every one has its own part of the brick table and the
+// brick cells entries keep the cascade of the brick in the bits above BRICK_CASCADE_SHIFT.
+// The table of a grid is addressed toroidally: the cell of a brick is wrapped by the offset of the grid, which is
+// the origin of a clipmap cascade in cells modulo the table extent. A scroll of the cascade then leaves the entries
+// and bricks of the cells that stay inside it in place, the exposed slabs reuse the entries of the cells that left.
+// A brick is alive while the table entry of its cell points back to it.
+// The voxel layout of a grid orders the voxels inside a brick and the bricks in the pool. VOXEL_LAYOUT_MORTON
+// puts every aligned 2x2x2 block of a brick into 8 consecutive slots and allocates the bricks in Z-order of
+// their cells, so the trilinear lookups of simple.frag stay within a few cache lines.
+
+#define BRICK_SIZE   4
+#define BRICK_VOXELS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+#define BRICK_EMPTY  0xFFFFFFFFu
+
+#define MAX_CASCADES        4
+#define BRICK_CASCADE_SHIFT 29
+#define BRICK_CELL_MASK     ((1u << BRICK_CASCADE_SHIFT) - 1u)
+
+#define VOXEL_LAYOUT_LINEAR 0
+#define VOXEL_LAYOUT_MORTON 1
+#define VOXEL_LAYOUTS_COUNT 2
+
+#ifdef __cplusplus
+#include <LiteMath.h>
+
+// placement of a voxel grid, matches the std430 layout of the GLSL struct
+struct GridCascade
+{
+  LiteMath::float3 origin;      // min corner of the grid
+  float            voxelSize;
+  LiteMath::uint3  extent;      // voxels per axis
+  uint32_t         tableOffset; // first brick table entry of the grid
+  uint32_t         voxelLayout; // VOXEL_LAYOUT_*
+  uint32_t         wrap[3];     // toroidal offset of the brick table in cells
+};
+
+inline LiteMath::uint3 BricksExtent(LiteMath::uint3 a_voxelsExtent)
+{
+  return LiteMath::uint3((a_voxelsExtent.x + BRICK_SIZE - 1) / BRICK_SIZE, (a_voxelsExtent.y + BRICK_SIZE - 1) / BRICK_SIZE,
+    (a_voxelsExtent.z + BRICK_SIZE - 1) / BRICK_SIZE);
+}
+
+inline uint32_t BrickCell(LiteMath::uint3 a_brickCoord, LiteMath::uint3 a_bricksExtent)
+{
+  return (a_brickCoord.x * a_bricksExtent.y + a_brickCoord.y) * a_bricksExtent.z + a_brickCoord.z;
+}
+
+inline uint32_t CellCascade(uint32_t a_cell)
+{
+  return a_cell >> BRICK_CASCADE_SHIFT;
+}
+
+inline uint32_t LocalVoxelIndex(LiteMath::uint3 a_local, uint32_t a_layout)
+{
+  if (a_layout == VOXEL_LAYOUT_MORTON)
+    return ((a_local.x >> 1) << 5) | ((a_local.y >> 1) << 4) | ((a_local.z >> 1) << 3) | ((a_local.x & 1) << 2)
+      | ((a_local.y & 1) << 1) | (a_local.z & 1);
+  return (a_local.x * BRICK_SIZE + a_local.y) * BRICK_SIZE + a_local.z;
+}
+
+inline LiteMath::uint3 LocalVoxelCoord(uint32_t a_index, uint32_t a_layout)
+{
+  if (a_layout == VOXEL_LAYOUT_MORTON)
+    return LiteMath::uint3(((a_index >> 4) & 2) | ((a_index >> 2) & 1), ((a_index >> 3) & 2) | ((a_index >> 1) & 1),
+      ((a_index >> 2) & 2) | (a_index & 1));
+  return LiteMath::uint3(a_index / BRICK_SIZE / BRICK_SIZE, a_index / BRICK_SIZE % BRICK_SIZE, a_index % BRICK_SIZE);
+}
+
+inline uint32_t VoxelSlot(uint32_t a_brick, LiteMath::uint3 a_voxelCoord, uint32_t a_layout)
+{
+  const LiteMath::uint3 local(a_voxelCoord.x % BRICK_SIZE, a_voxelCoord.y % BRICK_SIZE, a_voxelCoord.z % BRICK_SIZE);
+  return a_brick * BRICK_VOXELS + LocalVoxelIndex(local, a_layout);
+}
+
+// brick table entry of the brick at a_brickCoord of the grid, relative to tableOffset
+inline uint32_t TableCell(const GridCascade &a_grid, LiteMath::uint3 a_brickCoord)
+{
+  const LiteMath::uint3 bricksExtent = BricksExtent(a_grid.extent);
+  return BrickCell(LiteMath::uint3((a_brickCoord.x + a_grid.wrap[0]) % bricksExtent.x, (a_brickCoord.y + a_grid.wrap[1]) % bricksExtent.y,
+    (a_brickCoord.z + a_grid.wrap[2]) % bricksExtent.z), bricksExtent);
+}
+
+// a_cell is the brick cells entry of the slot's brick
+inline LiteMath::uint3 SlotVoxelCoord(uint32_t a_slot, uint32_t a_cell, const GridCascade &a_grid)
+{
+  a_cell &= BRICK_CELL_MASK;
+  const LiteMath::uint3 bricksExtent = BricksExtent(a_grid.extent);
+  const LiteMath::uint3 tableCoord(a_cell / bricksExtent.z / bricksExtent.y, a_cell / bricksExtent.z % bricksExtent.y,
+    a_cell % bricksExtent.z);
+  const LiteMath::uint3 brickCoord((tableCoord.x + bricksExtent.x - a_grid.wrap[0]) % bricksExtent.x,
+    (tableCoord.y + bricksExtent.y - a_grid.wrap[1]) % bricksExtent.y, (tableCoord.z + bricksExtent.z - a_grid.wrap[2]) % bricksExtent.z);
+  return brickCoord * uint32_t(BRICK_SIZE) + LocalVoxelCoord(a_slot % BRICK_VOXELS, a_grid.voxelLayout);
+}
+
+// Z-order code of a voxel, 20 bits per axis are enough for any grid the brick table can address
+inline uint64_t MortonCode(LiteMath::uint3 a_voxelCoord)
+{
+  const auto spread = [](uint64_t v) {
+    v &= 0xFFFFF;
+    v = (v | (v << 32)) & 0x001F00000000FFFFull;
+    v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+    v = (v | (v << 8))  & 0x100F00F00F00F00Full;
+    v = (v | (v << 4))  & 0x10C30C30C30C30C3ull;
+    v = (v | (v << 2))  & 0x1249249249249249ull;
+    return v;
+  };
+  return (spread(a_voxelCoord.x) << 2) | (spread(a_voxelCoord.y) << 1) | spread(a_voxelCoord.z);
+}
+
+#else
+
+struct GridCascade
+{
+  vec3  origin;
+  float voxelSize;
+  uvec3 extent;
+  uint  tableOffset;
+  uint  voxelLayout;
+  uint  wrap[3];
+};
+
+uvec3 BricksExtent(uvec3 a_voxelsExtent)
+{
+  return (a_voxelsExtent + (BRICK_SIZE - 1)) / BRICK_SIZE;
+}
+
+uint BrickCell(uvec3 a_brickCoord, uvec3 a_bricksExtent)
+{
+  return (a_brickCoord.x * a_bricksExtent.y + a_brickCoord.y) * a_bricksExtent.z + a_brickCoord.z;
+}
+
+uint LocalVoxelIndex(uvec3 a_local, uint a_layout)
+{
+  if (a_layout == VOXEL_LAYOUT_MORTON)
+    return ((a_local.x >> 1) << 5) | ((a_local.y >> 1) << 4) | ((a_local.z >> 1) << 3) | ((a_local.x & 1) << 2)
+      | ((a_local.y & 1) << 1) | (a_local.z & 1);
+  return (a_local.x * BRICK_SIZE + a_local.y) * BRICK_SIZE + a_local.z;
+}
+
+uvec3 LocalVoxelCoord(uint a_index, uint a_layout)
+{
+  if (a_layout == VOXEL_LAYOUT_MORTON)
+    return uvec3(((a_index >> 4) & 2) | ((a_index >> 2) & 1), ((a_index >> 3) & 2) | ((a_index >> 1) & 1),
+      ((a_index >> 2) & 2) | (a_index & 1));
+  return uvec3(a_index / BRICK_SIZE / BRICK_SIZE, a_index / BRICK_SIZE % BRICK_SIZE, a_index % BRICK_SIZE);
+}
+
+uint VoxelSlot(uint a_brick, uvec3 a_voxelCoord, uint a_layout)
+{
+  return a_brick * BRICK_VOXELS + LocalVoxelIndex(a_voxelCoord % BRICK_SIZE, a_layout);
+}
+
+uint CellCascade(uint a_cell)
+{
+  return a_cell >> BRICK_CASCADE_SHIFT;
+}
+
+// brick table entry of the brick at a_brickCoord of the grid, relative to tableOffset
+uint TableCell(GridCascade a_grid, uvec3 a_brickCoord)
+{
+  uvec3 bricksExtent = BricksExtent(a_grid.extent);
+  return BrickCell((a_brickCoord + uvec3(a_grid.wrap[0], a_grid.wrap[1], a_grid.wrap[2])) % bricksExtent, bricksExtent);
+}
+
+// a_cell is the brick cells entry of the slot's brick
+uvec3 SlotVoxelCoord(uint a_slot, uint a_cell, GridCascade a_grid)
+{
+  a_cell &= BRICK_CELL_MASK;
+  uvec3 bricksExtent = BricksExtent(a_grid.extent);
+  uvec3 tableCoord = uvec3(a_cell / bricksExtent.z / bricksExtent.y, a_cell / bricksExtent.z % bricksExtent.y, a_cell % bricksExtent.z);
+  uvec3 brickCoord = (tableCoord + bricksExtent - uvec3(a_grid.wrap[0], a_grid.wrap[1], a_grid.wrap[2])) % bricksExtent;
+  return brickCoord * BRICK_SIZE + LocalVoxelCoord(a_slot % BRICK_VOXELS, a_grid.voxelLayout);
+}
+
+vec3 VoxelCenter(GridCascade a_cascade, uvec3 a_voxelCoord)
+{
+  return a_cascade.origin + (vec3(a_voxelCoord) + 0.5) * a_cascade.voxelSize;
+}
+
+#endif
+
+#endif// VK_GRAPHICS_RT_BRICK_MAP_H
@@ -25,13 +25,20 @@ struct UniformParams
   vec4  lightPos;
   vec3  baseColor;
   float exposureValue;
-  vec3 bmin;
   float time;
-  vec3 bmax;
-  float voxelSize;
+  uint cascadesCount; // grids of the voxel lighting, from the finest to the coarsest
   uint interpolation;
 };
 
+// derived from the instance matrices by SceneManager, so that shaders don't invert them per vertex or hit
+struct InstanceDerivedData
+{
+  mat4 normalMatrix; // transpose of the inverse, its upper 3x3 part transforms the normals
+  mat4 inverseMatrix;
+  vec4 bboxMin;      // world space bbox of the instance
+  vec4 bboxMax;
+};
+
 struct MaterialData_pbrMR
 {
   vec4 baseColor;
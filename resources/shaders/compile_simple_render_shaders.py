@@ -19,6 +19,7 @@ if __name__ == '__main__':
         "debug_lines.vert",
         "debug_lines.frag",
         "FinalLighting.comp",
+        "solveRadiosity.comp",
         "packFF.comp",
         "debug_cubes.vert",
         "debug_cubes.frag",
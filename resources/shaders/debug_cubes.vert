@@ -4,25 +4,19 @@
 #extension GL_ARB_shader_draw_parameters  : enable
 
 #include "unpack_attributes.h"
-
-struct SamplePoint
-{
-  vec4 position;
-  vec4 normal;
-  vec4 color;
-};
+#include "brick_map.h"
+#include "sample_points.h"
 
 layout(binding = 0, set = 0) buffer counters { uvec4 indirect_buf[]; };
-layout(binding = 1, set = 0) buffer point_buf { SamplePoint points[]; };
+layout(binding = 1, set = 0) buffer sample_materials_buf { uvec4 sampleMaterials[]; };
+layout(binding = 2, set = 0) buffer brick_cells_buf { uint brickCells[]; };
+layout(binding = 3, set = 0) buffer grid_cascades_buf { GridCascade cascades[]; };
 
 
 layout(push_constant) uniform params_t
 {
     mat4 mProjView;
-    vec3 bmin;
     uint voxelsCount;
-    vec3 bmax;
-    float voxelSize;
     uint maxPointsPerVoxelCount;
     float debugCubesScale;
 } params;
@@ -60,24 +54,18 @@ void main(void)
         pos += (vert & 1) == 0 ? side1 : -side1;
         pos += (vert & 2) == 0 ? side2 : -side2;
     }
-    pos *= params.voxelSize * params.debugCubesScale * 0.5;
-    uvec3 voxelsExtend = uvec3(ceil((params.bmax - params.bmin) / params.voxelSize));
-    uint voxelId = gl_InstanceIndex;
-    uint zVoxel = voxelId % voxelsExtend.z;
-    voxelId /= voxelsExtend.z;
-    uint yVoxel = voxelId % voxelsExtend.y;
-    voxelId /= voxelsExtend.y;
-    uint xVoxel = voxelId % voxelsExtend.x;
-    voxelId /= voxelsExtend.x;
-    vec3 offset = params.bmin + (vec3(xVoxel, yVoxel, zVoxel) + 0.5) * params.voxelSize;
+    // one instance per voxel slot
+    uint voxelSlot = gl_InstanceIndex;
+    uint brickCell = brickCells[voxelSlot / BRICK_VOXELS];
+    GridCascade cascade = cascades[CellCascade(brickCell)];
+    pos *= cascade.voxelSize * params.debugCubesScale * 0.5;
+    vec3 offset = VoxelCenter(cascade, SlotVoxelCoord(voxelSlot, brickCell, cascade));
     gl_Position   = params.mProjView * (vec4(pos + offset, 1));
     vOut.wNorm = vec3(0);
     for (int i = 0; i < indirect_buf[gl_InstanceIndex].x; ++i)
     {
-        uint color = floatBitsToUint(points[params.maxPointsPerVoxelCount * gl_InstanceIndex + i].color.x);
-        float mult = points[params.maxPointsPerVoxelCount * gl_InstanceIndex + i].color.z;
-        vOut.wNorm += (vec3(uvec3((color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF)) / 255.0 * mult)
-            ;//* max(dot(normals[side], points[params.maxPointsPerVoxelCount * gl_InstanceIndex + i].normal.xyz), 0);
+        uvec4 material = sampleMaterials[indirect_buf[gl_InstanceIndex].z + i];
+        vOut.wNorm += DecodeRGB8(material.x) * uintBitsToFloat(material.z);
     }
     if (indirect_buf[gl_InstanceIndex].x == 0)
     {
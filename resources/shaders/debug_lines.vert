@@ -4,6 +4,7 @@
 #extension GL_ARB_shader_draw_parameters  : enable
 
 #include "unpack_attributes.h"
+#include "sample_points.h"
 
 
 layout(push_constant) uniform params_t
@@ -12,8 +13,9 @@ layout(push_constant) uniform params_t
     uint perFacePointsCount;
 } params;
 
-layout(binding = 0, set = 0) buffer Points { vec4 points[]; };
+layout(binding = 0, set = 0) buffer sample_positions_buf { vec4 samplePositions[]; };
 layout(binding = 1, set = 0) buffer debugBuf { uint indices[]; };
+layout(binding = 2, set = 0) buffer sample_normals_buf { uvec2 sampleNormals[]; };
 
 layout (location = 0 ) out VS_OUT
 {
@@ -24,6 +26,6 @@ out gl_PerVertex { vec4 gl_Position; float gl_PointSize; };
 void main(void)
 {
     uint vertexId = indices[gl_VertexIndex];
-    gl_Position   = params.mProjView * vec4(points[3 * vertexId].xyz, 1.0);
-    vOut.wNorm = vec3(points[3 * vertexId + 1].w);
+    gl_Position   = params.mProjView * vec4(samplePositions[vertexId].xyz, 1.0);
+    vOut.wNorm = vec3(uintBitsToFloat(sampleNormals[vertexId].y));
 }
@@ -4,6 +4,7 @@
 #extension GL_ARB_shader_draw_parameters  : enable
 
 #include "unpack_attributes.h"
+#include "sample_points.h"
 
 
 layout(push_constant) uniform params_t
@@ -12,10 +13,8 @@ layout(push_constant) uniform params_t
     uint perFacePointsCount;
 } params;
 
-layout(binding = 0, set = 0) buffer Points
-{
-    vec4 points[];
-};
+layout(binding = 0, set = 0) buffer sample_positions_buf { vec4 samplePositions[]; };
+layout(binding = 1, set = 0) buffer sample_normals_buf { uvec2 sampleNormals[]; };
 
 layout (location = 0 ) out VS_OUT
 {
@@ -25,9 +24,9 @@ layout (location = 0 ) out VS_OUT
 out gl_PerVertex { vec4 gl_Position; float gl_PointSize; };
 void main(void)
 {
-    uint vertexId = gl_VertexIndex + gl_DrawIDARB * 6 * params.perFacePointsCount;
-    gl_Position   = params.mProjView * vec4(points[3 * vertexId].xyz + points[3 * vertexId + 1].xyz * 0.0, 1.0);
-    // vOut.wNorm = (params.mModel * points[2 * gl_VertexIndex + 1]).xyz;
-    vOut.wNorm = vec3(points[3 * vertexId + 1].w);
+    // firstVertex of every draw is the offset of the voxel points
+    uint vertexId = gl_VertexIndex;
+    gl_Position   = params.mProjView * vec4(samplePositions[vertexId].xyz, 1.0);
+    vOut.wNorm = vec3(uintBitsToFloat(sampleNormals[vertexId].y));
     gl_PointSize = 2;
 }
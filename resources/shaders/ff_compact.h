@@ -0,0 +1,117 @@
+#ifndef VK_GRAPHICS_RT_FF_COMPACT_H
+#define VK_GRAPHICS_RT_FF_COMPACT_H
+
+// Compact form factor entry: value in the high 16 bits, column relative to its column block in the low 16 bits.
+// Every row is split into FFColumnBlocks(columns) sub-rows, one per block of FF_COLUMN_BLOCK columns, so the
+// row offsets buffer has rows * FFColumnBlocks(columns) + 1 entries. With less than FF_COLUMN_BLOCK columns
+// there is a single block and the row offsets are the usual ones.
+//
+// FF_ENCODING_FP16 stores the value as a half float, FF_ENCODING_LOG stores -log2 of it with a fixed step,
+// which keeps the same relative precision for the tiny form factors of distant patches.
+
+#define FF_ENCODING_FP16 0
+#define FF_ENCODING_LOG  1
+#ifndef FF_ENCODING
+#define FF_ENCODING FF_ENCODING_LOG
+#endif
+
+#define FF_COLUMN_BLOCK 65536
+// log encoding covers [2^(FF_LOG_MAX - 65535 / FF_LOG_SCALE), 2^FF_LOG_MAX] with a relative step of 2^(1 / FF_LOG_SCALE) - 1
+#define FF_LOG_SCALE 2048.0
+#define FF_LOG_MAX   8.0
+
+#ifdef __cplusplus
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+inline uint32_t FFColumnBlocks(uint32_t a_columns)
+{
+  return std::max((a_columns + FF_COLUMN_BLOCK - 1) / FF_COLUMN_BLOCK, 1u);
+}
+
+inline uint32_t FFFloatToHalf(float a_value)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &a_value, sizeof(bits));
+  const uint32_t sign = (bits >> 16) & 0x8000u;
+  const int exponent = int((bits >> 23) & 0xFF) - 127 + 15;
+  uint32_t mantissa = bits & 0x7FFFFFu;
+  if (exponent >= 31)
+    return sign | 0x7C00u;
+  if (exponent <= 0)
+  {
+    if (exponent < -10)
+      return sign;
+    // subnormal, round to nearest
+    mantissa |= 0x800000u;
+    const uint32_t shift = uint32_t(14 - exponent);
+    return sign | ((mantissa + (1u << (shift - 1))) >> shift);
+  }
+  // a carry out of the mantissa correctly bumps the exponent
+  return (sign | (uint32_t(exponent) << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1u);
+}
+
+inline float FFHalfToFloat(uint32_t a_half)
+{
+  const uint32_t exponent = (a_half >> 10) & 0x1F;
+  const float mantissa = float(a_half & 0x3FF);
+  const float value = exponent == 0 ? std::ldexp(mantissa, -24) : std::ldexp(mantissa + 1024.0f, int(exponent) - 25);
+  return (a_half & 0x8000u) != 0 ? -value : value;
+}
+
+inline uint32_t FFEncode(uint32_t a_column, float a_value, uint32_t a_encoding)
+{
+  uint32_t bits;
+  if (a_encoding == FF_ENCODING_FP16)
+    bits = FFFloatToHalf(a_value);
+  else
+    bits = uint32_t(std::clamp(std::round((FF_LOG_MAX - std::log2(a_value)) * FF_LOG_SCALE), 0.0, 65535.0));
+  return (bits << 16) | (a_column & 0xFFFFu);
+}
+
+inline float FFDecodeValue(uint32_t a_entry, uint32_t a_encoding)
+{
+  if (a_encoding == FF_ENCODING_FP16)
+    return FFHalfToFloat(a_entry >> 16);
+  return float(std::exp2(FF_LOG_MAX - (a_entry >> 16) / FF_LOG_SCALE));
+}
+
+inline uint32_t FFDecodeColumn(uint32_t a_entry)
+{
+  return a_entry & 0xFFFFu;
+}
+
+#else
+
+uint FFColumnBlocks(uint a_columns)
+{
+  return max((a_columns + FF_COLUMN_BLOCK - 1) / FF_COLUMN_BLOCK, 1u);
+}
+
+uint FFEncode(uint a_column, float a_value, uint a_encoding)
+{
+  uint bits;
+  if (a_encoding == FF_ENCODING_FP16)
+    bits = packHalf2x16(vec2(a_value, 0.0)) & 0xFFFFu;
+  else
+    bits = uint(clamp(round((FF_LOG_MAX - log2(a_value)) * FF_LOG_SCALE), 0.0, 65535.0));
+  return (bits << 16) | (a_column & 0xFFFFu);
+}
+
+float FFDecodeValue(uint a_entry, uint a_encoding)
+{
+  if (a_encoding == FF_ENCODING_FP16)
+    return unpackHalf2x16(a_entry >> 16).x;
+  return exp2(FF_LOG_MAX - float(a_entry >> 16) / FF_LOG_SCALE);
+}
+
+uint FFDecodeColumn(uint a_entry)
+{
+  return a_entry & 0xFFFFu;
+}
+
+#endif
+
+#endif// VK_GRAPHICS_RT_FF_COMPACT_H
@@ -0,0 +1,28 @@
+#ifndef VK_GRAPHICS_RT_RADIOSITY_SOLVER_H
+#define VK_GRAPHICS_RT_RADIOSITY_SOLVER_H
+
+// Iterative solvers of R = F (E + A R), where E is the lighting written by initLighting, R is the reflected lighting
+// (irradiance, the surface color is applied when shading) and A is the per patch albedo initLighting writes next to E.
+// Without A nothing is absorbed between the bounces and the iterations diverge in closed scenes.
+// SOLVER_JACOBI       R' = F (E + A R), ping-pong between the reflected lighting and the solver tmp buffer
+// SOLVER_GAUSS_SEIDEL in place update, rows of even and odd visible voxels are updated by separate passes
+// SOLVER_SOUTHWELL    progressive shooting: patches with unshot lighting above threshold * max unshot lighting
+//                     shoot it, receivers add it to the reflected lighting and A times it to the unshot lighting
+#define SOLVER_JACOBI       0
+#define SOLVER_GAUSS_SEIDEL 1
+#define SOLVER_SOUTHWELL    2
+#define SOLVER_MODES_COUNT  3
+
+// passes of solveRadiosity.comp, param is the ping-pong direction, the colour or the unshot stats slot
+#define SOLVER_PASS_JACOBI 0
+#define SOLVER_PASS_GS     1
+#define SOLVER_PASS_SELECT 2 // one thread per patch, the others are one workgroup per row
+#define SOLVER_PASS_SHOOT  3
+
+// uint slots of the solver stats buffer, float values stored as bits so they can be updated with atomicMax
+#define SOLVER_STAT_RESIDUAL 0 // max |R' - R| of the last iteration
+#define SOLVER_STAT_SOLUTION 1 // max |R'| of the last iteration
+#define SOLVER_STAT_UNSHOT   2 // two slots of max unshot lighting, alternated between iterations
+#define SOLVER_STATS_COUNT   4
+
+#endif// VK_GRAPHICS_RT_RADIOSITY_SOLVER_H
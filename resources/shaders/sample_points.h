@@ -0,0 +1,41 @@
+#ifndef VK_GRAPHICS_RT_SAMPLE_POINTS_H
+#define VK_GRAPHICS_RT_SAMPLE_POINTS_H
+
+// Sample points are stored as a structure of arrays, every stream is a buffer of its own. ComputeFF touches
+// only the hot streams in its O(n^2) loop, the materials are read once per point by initLighting.
+//   positions: vec4 per point, xyz is the hit position and w is the index of the hit triangle
+//   normals:   uvec2 per point, x is the octahedral normal as two snorm16, y is the triangle area as float bits
+//   materials: uvec4 per point, x is the albedo as rgb8, y is the emission as rgb8 scaled by z (float bits),
+//              w is the texture id
+#define SAMPLE_POSITION_SIZE 16
+#define SAMPLE_NORMAL_SIZE   8
+#define SAMPLE_MATERIAL_SIZE 16
+#define SAMPLE_POINT_SIZE    (SAMPLE_POSITION_SIZE + SAMPLE_NORMAL_SIZE + SAMPLE_MATERIAL_SIZE)
+
+#ifndef __cplusplus
+
+uint EncodeOctNormal(vec3 a_normal)
+{
+  vec3 n = a_normal / (abs(a_normal.x) + abs(a_normal.y) + abs(a_normal.z));
+  vec2 enc = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+  return packSnorm2x16(enc);
+}
+
+vec3 DecodeOctNormal(uint a_enc)
+{
+  vec2 enc = unpackSnorm2x16(a_enc);
+  vec3 n = vec3(enc, 1.0 - abs(enc.x) - abs(enc.y));
+  float fold = max(-n.z, 0.0);
+  n.x += n.x >= 0.0 ? -fold : fold;
+  n.y += n.y >= 0.0 ? -fold : fold;
+  return normalize(n);
+}
+
+vec3 DecodeRGB8(uint a_enc)
+{
+  return vec3(uvec3((a_enc >> 16) & 0xFF, (a_enc >> 8) & 0xFF, a_enc & 0xFF)) / 255.0;
+}
+
+#endif
+
+#endif// VK_GRAPHICS_RT_SAMPLE_POINTS_H
@@ -7,6 +7,7 @@
 // #extension GL_EXT_spirv_intrinsics : require
 
 #include "common.h"
+#include "brick_map.h"
 
 layout(location = 0) out vec4 out_fragColor;
 
@@ -29,6 +30,8 @@ layout(binding = 2, set = 0) buffer points_buf { uint points_cnt[]; };
 layout(binding = 3, set = 0) buffer materialsBuf { MaterialData_pbrMR materials[]; };
 layout(binding = 5, set = 0) uniform accelerationStructureEXT m_pAccelStruct;
 layout(binding = 6, set = 0) uniform sampler2D textures[];
+layout(binding = 8, set = 0) buffer brick_table_buf { uint brickTable[]; };
+layout(binding = 9, set = 0) buffer grid_cascades_buf { GridCascade cascades[]; };
 
 
 bool m_pAccelStruct_RayQuery_NearestHit(const vec3 rayPos, const vec3 rayDir, float len)
@@ -42,6 +45,27 @@ bool m_pAccelStruct_RayQuery_NearestHit(const vec3 rayPos, const vec3 rayDir, fl
   return (rayQueryGetIntersectionTypeEXT(rayQuery, true) != gl_RayQueryCommittedIntersectionTriangleEXT);
 }
 
+// slot of the lighting and point counters of the voxel, BRICK_EMPTY outside of the allocated bricks
+uint VoxelSlotAt(ivec3 voxelCoord, GridCascade cascade)
+{
+    if (any(lessThan(voxelCoord, ivec3(0))) || any(greaterThanEqual(uvec3(voxelCoord), cascade.extent)))
+        return BRICK_EMPTY;
+    uint brick = brickTable[cascade.tableOffset + TableCell(cascade, uvec3(voxelCoord) / BRICK_SIZE)];
+    return brick == BRICK_EMPTY ? BRICK_EMPTY : VoxelSlot(brick, uvec3(voxelCoord), cascade.voxelLayout);
+}
+
+// the finest cascade that covers the point, the coarsest one if none does
+GridCascade CascadeAt(vec3 pos)
+{
+    for (uint i = 0; i + 1 < Params.cascadesCount; ++i)
+    {
+        vec3 coords = (pos - cascades[i].origin) / cascades[i].voxelSize;
+        if (all(greaterThanEqual(coords, vec3(0))) && all(lessThan(coords, vec3(cascades[i].extent))))
+            return cascades[i];
+    }
+    return cascades[Params.cascadesCount - 1];
+}
+
 float A = 0.15;
 float B = 0.50;
 float C = 0.10;
@@ -67,11 +91,10 @@ vec4 postfx(vec3 texColor)
 
 void main()
 {
-    vec3 coords = (surf.wPos - Params.bmin) / Params.voxelSize;
-    uvec3 voxelCoord = uvec3(coords);
-    uvec3 voxelsExtend = uvec3(ceil((Params.bmax - Params.bmin) / Params.voxelSize));
-    uint voxelsCount = voxelsExtend.x * voxelsExtend.y * voxelsExtend.z;
-    uint voxelIdx = (voxelCoord.x * voxelsExtend.y + voxelCoord.y) * voxelsExtend.z + voxelCoord.z;
+    GridCascade cascade = CascadeAt(surf.wPos);
+    vec3 coords = (surf.wPos - cascade.origin) / cascade.voxelSize;
+    ivec3 voxelCoord = ivec3(floor(coords));
+    uint voxelIdx = VoxelSlotAt(voxelCoord, cascade);
     vec3 lightDir1 = normalize(Params.lightPos.xyz - surf.wPos);
     float traceDist = length(Params.lightPos.xyz - surf.wPos);
     // lightDir1 = vec3(0, 0.948773, 0.31596);
@@ -102,16 +125,16 @@ void main()
                 for (int k = 0; k < 2; ++k)
                 {
                     vec3 voxLight = vec3(0);
-                    ivec3 voxelId = ivec3(voxelCoord) + ivec3(i, j, k) * ivec3(sign(UVW));
-                    uint voxelIdx = (voxelId.x * voxelsExtend.y + voxelId.y) * voxelsExtend.z + voxelId.z;
-                    for (int z = 0; z < 3; ++z)
-                    {
-                        voxLight += lighting[voxelIdx * 6 + z].rgb * max(0, N[z]);
-                        voxLight += lighting[voxelIdx * 6 + 3 + z].rgb * max(0, -N[z]);
-                    }
+                    ivec3 voxelId = voxelCoord + ivec3(i, j, k) * ivec3(sign(UVW));
+                    uint voxelIdx = VoxelSlotAt(voxelId, cascade);
                     float weight = 0;
-                    if (points_cnt[4 * voxelIdx] > 0)
+                    if (voxelIdx != BRICK_EMPTY && points_cnt[4 * voxelIdx] > 0)
                     {
+                        for (int z = 0; z < 3; ++z)
+                        {
+                            voxLight += lighting[voxelIdx * 6 + z].rgb * max(0, N[z]);
+                            voxLight += lighting[voxelIdx * 6 + 3 + z].rgb * max(0, -N[z]);
+                        }
                         weight = 1;
                         weight *= i > 0 ? abs(UVW.x) : 1 - abs(UVW.x);
                         weight *= j > 0 ? abs(UVW.y) : 1 - abs(UVW.y);
@@ -126,7 +149,7 @@ void main()
     else
     {
         light[0] = vec3(0);
-        for (int z = 0; z < 3; ++z)
+        for (int z = 0; z < 3 && voxelIdx != BRICK_EMPTY; ++z)
         {
             light[0] += lighting[voxelIdx * 6 + z].rgb * max(0, N[z]);
             light[0] += lighting[voxelIdx * 6 + 3 + z].rgb * max(0, -N[z]);
@@ -30,6 +30,7 @@ layout (location = 0 ) out VS_OUT
 layout(binding = 3, set = 0) buffer materialsBuf { MaterialData_pbrMR materials[]; };
 layout(binding = 4, set = 0) buffer materialIdsBuf { uint materialIds[]; };
 layout(binding = 7, set = 0) buffer perInstInfo { uvec2 instInfo[]; };
+layout(binding = 10, set = 0) buffer instance_derived_buf { InstanceDerivedData instDerived[]; };
 
 out gl_PerVertex { vec4 gl_Position; };
 void main(void)
@@ -38,8 +39,9 @@ void main(void)
     const vec4 wTang = vec4(DecodeNormal(floatBitsToInt(vTexCoordAndTang.z)), 0.0f);
 
     vOut.wPos     = (params.mModel * vec4(vPosNorm.xyz, 1.0f)).xyz;
-    vOut.wNorm    = normalize(mat3(transpose(inverse(params.mModel))) * wNorm.xyz);
-    vOut.wTangent = normalize(mat3(transpose(inverse(params.mModel))) * wTang.xyz);
+    const mat3 normalMatrix = mat3(instDerived[gl_BaseInstanceARB].normalMatrix);
+    vOut.wNorm    = normalize(normalMatrix * wNorm.xyz);
+    vOut.wTangent = normalize(normalMatrix * wTang.xyz);
     vOut.texCoord = vTexCoordAndTang.xy;
     vOut.color = materials[materialIds[gl_BaseVertexARB]].baseColor.xyz;
     vOut.materialId = materialIds[gl_BaseVertexARB];
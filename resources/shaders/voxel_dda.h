@@ -0,0 +1,123 @@
+#ifndef VK_GRAPHICS_RT_VOXEL_DDA_H
+#define VK_GRAPHICS_RT_VOXEL_DDA_H
+
+// Approximate visibility of the form factors: instead of a ray query per point pair the segment between the points
+// is marched through the voxel grid and blocked by the first occupied voxel. A voxel is occupied when the sample
+// pass gave it points, the occupancy bitmask has a bit per voxel. The voxels around the ends of the segment are
+// not tested, the surfaces of the points fill them, so the pairs closer than the near field distance still use
+// exact ray queries.
+#define FF_VISIBILITY_RAYS        0
+#define FF_VISIBILITY_DDA         1
+#define FF_VISIBILITY_MODES_COUNT 2
+
+#define DDA_SKIPPED_VOXELS 1 // Chebyshev distance from the voxels of the ends that is not tested
+
+#ifdef __cplusplus
+#include <LiteMath.h>
+#include <algorithm>
+#include <cmath>
+
+struct VoxelMarch
+{
+  LiteMath::int3   voxel;
+  LiteMath::int3   step;
+  LiteMath::float3 tMax;   // segment parameter of the next voxel border per axis
+  LiteMath::float3 tDelta; // segment parameter of one voxel per axis
+  float            tExit;
+};
+
+// a_from and a_to are in the voxel units of a grid with a_extent voxels, false when the segment misses the grid
+inline bool StartVoxelMarch(LiteMath::float3 a_from, LiteMath::float3 a_to, LiteMath::uint3 a_extent, VoxelMarch &a_march)
+{
+  LiteMath::float3 delta = a_to - a_from;
+  float tEnter = 0.0f;
+  float tExit = 1.0f;
+  for (int i = 0; i < 3; ++i)
+  {
+    if (std::abs(delta[i]) < 1e-8f)
+      delta[i] = 1e-8f;
+    const float t0 = -a_from[i] / delta[i];
+    const float t1 = (float(a_extent[i]) - a_from[i]) / delta[i];
+    tEnter = std::max(tEnter, std::min(t0, t1));
+    tExit = std::min(tExit, std::max(t0, t1));
+  }
+  if (tEnter >= tExit)
+    return false;
+  for (int i = 0; i < 3; ++i)
+  {
+    a_march.voxel[i] = std::clamp(int(std::floor(a_from[i] + delta[i] * tEnter)), 0, int(a_extent[i]) - 1);
+    a_march.step[i] = delta[i] > 0.0f ? 1 : -1;
+    a_march.tDelta[i] = std::abs(1.0f / delta[i]);
+    a_march.tMax[i] = (float(a_march.voxel[i] + (delta[i] > 0.0f ? 1 : 0)) - a_from[i]) / delta[i];
+  }
+  a_march.tExit = tExit;
+  return true;
+}
+
+// moves to the next voxel along the segment, false after its end
+inline bool NextVoxel(VoxelMarch &a_march)
+{
+  const LiteMath::float3 &t = a_march.tMax;
+  const int axis = t.x < t.y ? (t.x < t.z ? 0 : 2) : (t.y < t.z ? 1 : 2);
+  if (a_march.tMax[axis] >= a_march.tExit)
+    return false;
+  a_march.voxel[axis] += a_march.step[axis];
+  a_march.tMax[axis] += a_march.tDelta[axis];
+  return true;
+}
+
+inline bool NearVoxel(LiteMath::int3 a_voxel, LiteMath::int3 a_end)
+{
+  return std::abs(a_voxel.x - a_end.x) <= DDA_SKIPPED_VOXELS && std::abs(a_voxel.y - a_end.y) <= DDA_SKIPPED_VOXELS
+    && std::abs(a_voxel.z - a_end.z) <= DDA_SKIPPED_VOXELS;
+}
+
+#else
+
+struct VoxelMarch
+{
+  ivec3 voxel;
+  ivec3 step;
+  vec3  tMax;
+  vec3  tDelta;
+  float tExit;
+};
+
+bool StartVoxelMarch(vec3 a_from, vec3 a_to, uvec3 a_extent, out VoxelMarch a_march)
+{
+  vec3 delta = a_to - a_from;
+  delta = mix(delta, vec3(1e-8), lessThan(abs(delta), vec3(1e-8)));
+  vec3 t0 = -a_from / delta;
+  vec3 t1 = (vec3(a_extent) - a_from) / delta;
+  vec3 tNear = min(t0, t1);
+  vec3 tFar = max(t0, t1);
+  float tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+  a_march.tExit = min(min(tFar.x, tFar.y), min(tFar.z, 1.0));
+  if (tEnter >= a_march.tExit)
+    return false;
+  a_march.voxel = clamp(ivec3(floor(a_from + delta * tEnter)), ivec3(0), ivec3(a_extent) - 1);
+  a_march.step = ivec3(greaterThan(delta, vec3(0))) * 2 - 1;
+  a_march.tDelta = abs(1.0 / delta);
+  a_march.tMax = (vec3(a_march.voxel + max(a_march.step, ivec3(0))) - a_from) / delta;
+  return true;
+}
+
+bool NextVoxel(inout VoxelMarch a_march)
+{
+  vec3 t = a_march.tMax;
+  int axis = t.x < t.y ? (t.x < t.z ? 0 : 2) : (t.y < t.z ? 1 : 2);
+  if (a_march.tMax[axis] >= a_march.tExit)
+    return false;
+  a_march.voxel[axis] += a_march.step[axis];
+  a_march.tMax[axis] += a_march.tDelta[axis];
+  return true;
+}
+
+bool NearVoxel(ivec3 a_voxel, ivec3 a_end)
+{
+  return all(lessThanEqual(abs(a_voxel - a_end), ivec3(DDA_SKIPPED_VOXELS)));
+}
+
+#endif
+
+#endif// VK_GRAPHICS_RT_VOXEL_DDA_H
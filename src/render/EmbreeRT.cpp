@@ -262,6 +262,8 @@ bool EmbreeRT::RayQuery_AnyHit(LiteMath::float4 posAndNear, LiteMath::float4 dir
   ray.dir_y = dirAndFar.y;
   ray.dir_z = dirAndFar.z;
   ray.tfar  = dirAndFar.w; // std::numeric_limits<float>::infinity();
+  ray.mask  = -1;
+  ray.flags = 0;
 
   rtcOccluded1(m_scene, &context, &ray);  
 
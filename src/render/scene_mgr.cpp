@@ -214,10 +214,59 @@ uint32_t SceneManager::InstanceMesh(const uint32_t meshId, const LiteMath::float
   info.instBufOffset = (m_instanceMatrices.size() - 1) * sizeof(matr);
 
   m_instanceInfos.push_back(info);
+  m_instanceDerived.emplace_back();
+  UpdateInstanceDerived(info.inst_id);
 
   return info.inst_id;
 }
 
+void SceneManager::SetInstanceMatrix(const uint32_t instId, const LiteMath::float4x4 &matrix)
+{
+  assert(instId < m_instanceMatrices.size());
+  m_instanceMatrices[instId] = matrix;
+  UpdateInstanceDerived(instId);
+
+  if(m_instMatricesBuf != VK_NULL_HANDLE)
+  {
+    m_pCopyHelper->UpdateBuffer(m_instMatricesBuf, instId * sizeof(m_instanceMatrices[0]), &m_instanceMatrices[instId],
+      sizeof(m_instanceMatrices[0]));
+    m_pCopyHelper->UpdateBuffer(m_instDerivedBuf, instId * sizeof(m_instanceDerived[0]), &m_instanceDerived[instId],
+      sizeof(m_instanceDerived[0]));
+  }
+}
+
+void SceneManager::UpdateInstanceDerived(const uint32_t instId)
+{
+  const LiteMath::float4x4 &matrix = m_instanceMatrices[instId];
+  InstanceDerivedData &derived = m_instanceDerived[instId];
+  derived.inverseMatrix = LiteMath::inverse4x4(matrix);
+  derived.normalMatrix  = LiteMath::transpose(derived.inverseMatrix);
+
+  // the vertices are transformed, the corners of the mesh bbox would give a loose box for rotated instances
+  LiteMath::Box4f bbox;
+  const MeshInfo &info = m_meshInfos[m_instanceInfos[instId].mesh_id];
+  if(m_pMeshData != nullptr)
+  {
+    auto vertices = reinterpret_cast<const float*>((const char*)m_pMeshData->VertexData() + info.m_vertexOffset * m_pMeshData->SingleVertexSize());
+    const size_t stride = m_pMeshData->SingleVertexSize() / sizeof(float);
+    for(size_t v = 0; v < info.m_vertNum; ++v)
+      bbox.include(matrix * LiteMath::float4(vertices[v * stride + 0], vertices[v * stride + 1], vertices[v * stride + 2], 1.0f));
+  }
+  derived.bboxMin = bbox.boxMin;
+  derived.bboxMax = bbox.boxMax;
+}
+
+LiteMath::Box4f SceneManager::GetSceneBbox() const
+{
+  LiteMath::Box4f bbox;
+  for(const auto &derived : m_instanceDerived)
+  {
+    bbox.include(derived.bboxMin);
+    bbox.include(derived.bboxMax);
+  }
+  return bbox;
+}
+
 void SceneManager::MarkInstance(const uint32_t instId)
 {
   assert(instId < m_instanceInfos.size());
@@ -340,10 +389,14 @@ void SceneManager::LoadInstanceDataOnGPU()
   VkDeviceSize instMatBufSize = m_instanceMatrices.size() * sizeof(m_instanceMatrices[0]);
   VkBufferUsageFlags flags = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
+  VkDeviceSize instDerivedBufSize = m_instanceDerived.size() * sizeof(m_instanceDerived[0]);
+
   m_instMatricesBuf = vk_utils::createBuffer(m_device, instMatBufSize, flags);
-  m_instMemAlloc    = vk_utils::allocateAndBindWithPadding(m_device, m_physDevice, {m_instMatricesBuf});
+  m_instDerivedBuf  = vk_utils::createBuffer(m_device, instDerivedBufSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  m_instMemAlloc    = vk_utils::allocateAndBindWithPadding(m_device, m_physDevice, {m_instMatricesBuf, m_instDerivedBuf});
 
   m_pCopyHelper->UpdateBuffer(m_instMatricesBuf, 0, m_instanceMatrices.data(), instMatBufSize);
+  m_pCopyHelper->UpdateBuffer(m_instDerivedBuf, 0, m_instanceDerived.data(), instDerivedBufSize);
 }
 
 vk_utils::VulkanImageMem SceneManager::LoadSpecialTexture()
@@ -497,6 +550,12 @@ void SceneManager::DestroyScene()
     m_instMatricesBuf = VK_NULL_HANDLE;
   }
 
+  if(m_instDerivedBuf != VK_NULL_HANDLE)
+  {
+    vkDestroyBuffer(m_device, m_instDerivedBuf, nullptr);
+    m_instDerivedBuf = VK_NULL_HANDLE;
+  }
+
   if(m_instMemAlloc != VK_NULL_HANDLE)
   {
     vkFreeMemory(m_device, m_instMemAlloc, nullptr);
@@ -554,6 +613,7 @@ void SceneManager::DestroyScene()
   m_pMeshData = nullptr;
   m_instanceInfos.clear();
   m_instanceMatrices.clear();
+  m_instanceDerived.clear();
   m_matIDs.clear();
 
   m_materials.clear();
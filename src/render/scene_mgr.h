@@ -75,6 +75,9 @@ struct SceneManager
 
   uint32_t InstanceMesh(uint32_t meshId, const LiteMath::float4x4 &matrix, bool markForRender = true);
 
+  // updates the matrix and the derived data of the instance, on the GPU as well if it is loaded there
+  void SetInstanceMatrix(uint32_t instId, const LiteMath::float4x4 &matrix);
+
   void MarkInstance(uint32_t instId);
   void UnmarkInstance(uint32_t instId);
 
@@ -88,6 +91,7 @@ struct SceneManager
   VkBuffer GetIndexBuffer()        const { return m_geoIdxBuf; }
   VkBuffer GetMeshInfoBuffer()     const { return m_meshInfoBuf; }
   VkBuffer GetInstanceMatBuffer()  const { return m_instMatricesBuf; }
+  VkBuffer GetInstanceDerivedBuffer() const { return m_instDerivedBuf; } // InstanceDerivedData per instance
   VkBuffer GetMaterialsBuffer()    const { return m_materialBuf; }
   VkBuffer GetMaterialIDsBuffer()  const { return m_matIdsBuf; }
   VkBuffer GetMaterialPerVertexIDsBuffer()  const { return m_matPerVertIdsBuf; }
@@ -96,6 +100,9 @@ struct SceneManager
   std::vector<VkImageView>  GetTextureViews() const { return m_textureViews; }
 
   std::shared_ptr<IMeshData> GetMeshData() {return m_pMeshData; }
+  const std::vector<MaterialData_pbrMR> &GetMaterials() const { return m_materials; }
+  const std::vector<uint32_t> &GetMaterialIDs() const { return m_matIDs; } // per triangle
+  const std::vector<ImageFileInfo> &GetTextureInfos() const { return m_textureInfos; }
 
   uint32_t MeshesNum()    const {return m_meshInfos.size();}
   uint32_t InstancesNum() const {return m_instanceInfos.size();}
@@ -104,6 +111,8 @@ struct SceneManager
   MeshInfo GetMeshInfo(uint32_t meshId) const {assert(meshId < m_meshInfos.size()); return m_meshInfos[meshId];}
   InstanceInfo GetInstanceInfo(uint32_t instId) const {assert(instId < m_instanceInfos.size()); return m_instanceInfos[instId];}
   LiteMath::float4x4 GetInstanceMatrix(uint32_t instId) const {assert(instId < m_instanceMatrices.size()); return m_instanceMatrices[instId];}
+  InstanceDerivedData GetInstanceDerived(uint32_t instId) const {assert(instId < m_instanceDerived.size()); return m_instanceDerived[instId];}
+  LiteMath::Box4f GetSceneBbox() const;
 
 //  void DestroyAS();
 
@@ -119,6 +128,7 @@ private:
   void LoadOneMeshOnGPU(uint32_t meshIdx);
   void LoadCommonGeoDataOnGPU();
   void LoadInstanceDataOnGPU();
+  void UpdateInstanceDerived(uint32_t instId);
   void LoadMaterialDataOnGPU();
 
   void AddBLAS(uint32_t meshIdx);
@@ -131,6 +141,7 @@ private:
 
   std::vector<InstanceInfo> m_instanceInfos = {};
   std::vector<LiteMath::float4x4> m_instanceMatrices = {};
+  std::vector<InstanceDerivedData> m_instanceDerived = {};
 
   std::vector<hydra_xml::Camera> m_sceneCameras = {};
 
@@ -145,6 +156,7 @@ private:
   VkDeviceMemory m_geoMemAlloc = VK_NULL_HANDLE;
 
   VkBuffer m_instMatricesBuf    = VK_NULL_HANDLE;
+  VkBuffer m_instDerivedBuf     = VK_NULL_HANDLE;
   VkDeviceMemory m_instMemAlloc = VK_NULL_HANDLE;
 
   VkDeviceSize m_loadedVertices = 0;
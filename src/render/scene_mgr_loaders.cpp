@@ -288,10 +288,10 @@ bool SceneManager::LoadSceneGLTF(const std::string &scenePath)
     LoadCommonGeoDataOnGPU();
   }
 
-  if(m_config.instance_matrix_as_vertex_attribute)
-  {
+  // if(m_config.instance_matrix_as_vertex_attribute)
+  // {
     LoadInstanceDataOnGPU();
-  }
+  // }
 
   if(m_config.load_materials != MATERIAL_LOAD_MODE::NONE)
   {
@@ -0,0 +1,188 @@
+#include "ff_cache.h"
+#include "../../../resources/shaders/voxel_dda.h"
+
+#include <cstdio>
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ff_cache
+{
+  uint64_t Hash(const void *a_data, size_t a_size, uint64_t a_seed)
+  {
+    // FNV-1a
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(a_data);
+    uint64_t hash = a_seed;
+    for (size_t i = 0; i < a_size; ++i)
+    {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  std::string FileName(uint64_t a_sceneHash, float a_voxelSize, uint32_t a_voxelLayout, uint32_t a_perSurfacePoints,
+    bool a_adaptiveSampling, bool a_voxelizedSamples, uint32_t a_ffVisibility, uint32_t a_nearFieldVoxels)
+  {
+    char visibility[32] = "";
+    if (a_ffVisibility == FF_VISIBILITY_DDA)
+      snprintf(visibility, sizeof(visibility), "_dda%u", a_nearFieldVoxels);
+    char name[160];
+    snprintf(name, sizeof(name), "ff_%016llx_%g_l%u_%u%s%s%s.bin", (unsigned long long)a_sceneHash, a_voxelSize, a_voxelLayout,
+      a_perSurfacePoints, a_adaptiveSampling ? "_adaptive" : "", a_voxelizedSamples ? "_voxelized" : "", visibility);
+    return name;
+  }
+
+  bool Write(const std::string &a_path, Header a_header, const std::array<SectionData, SECTIONS_COUNT> &a_sections)
+  {
+    std::error_code ec;
+    const auto dir = std::filesystem::path(a_path).parent_path();
+    if (!dir.empty())
+      std::filesystem::create_directories(dir, ec);
+
+    uint64_t offset = (sizeof(Header) + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    for (uint32_t i = 0; i < SECTIONS_COUNT; ++i)
+    {
+      a_header.offsets[i] = offset;
+      a_header.sizes[i] = a_sections[i].size;
+      offset += (a_sections[i].size + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    }
+
+    // write to a temporary file first so an interrupted run never leaves a broken cache
+    const std::string tmpPath = a_path + ".tmp";
+    bool written = false;
+    {
+      std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+      if (!file)
+      {
+        std::cout << "[ff_cache::Write]: can't open " << tmpPath << std::endl;
+        return false;
+      }
+      const char zeros[SECTION_ALIGNMENT] = {};
+      file.write(reinterpret_cast<const char*>(&a_header), sizeof(Header));
+      uint64_t end = sizeof(Header);
+      for (uint32_t i = 0; i < SECTIONS_COUNT; ++i)
+      {
+        file.write(zeros, a_header.offsets[i] - end);
+        file.write(reinterpret_cast<const char*>(a_sections[i].data), a_sections[i].size);
+        end = a_header.offsets[i] + a_sections[i].size;
+      }
+      file.close();
+      written = bool(file);
+    }
+    if (written)
+      std::filesystem::rename(tmpPath, a_path, ec);
+    // the file is closed before it is removed, Windows can't delete open files
+    if (!written || ec)
+    {
+      std::cout << "[ff_cache::Write]: can't write " << a_path << std::endl;
+      std::remove(tmpPath.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  bool MappedFile::Open(const std::string &a_path)
+  {
+    Close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(a_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return false;
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+    {
+      CloseHandle(file);
+      return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+    m_data = reinterpret_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    m_size = size_t(size.QuadPart);
+#else
+    m_fd = open(a_path.c_str(), O_RDONLY);
+    if (m_fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(m_fd, &st) != 0 || st.st_size == 0)
+    {
+      Close();
+      return false;
+    }
+    void *data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (data == MAP_FAILED)
+    {
+      Close();
+      return false;
+    }
+    // the whole file is uploaded front to back right after mapping, the advice values are not flags
+    madvise(data, size_t(st.st_size), MADV_SEQUENTIAL);
+    madvise(data, size_t(st.st_size), MADV_WILLNEED);
+    m_data = reinterpret_cast<const uint8_t*>(data);
+    m_size = size_t(st.st_size);
+#endif
+    if (m_data == nullptr)
+    {
+      Close();
+      return false;
+    }
+
+    const Header *header = GetHeader();
+    if (header == nullptr || header->magic != MAGIC || header->formatVersion != FORMAT_VERSION)
+    {
+      Close();
+      return false;
+    }
+    for (uint32_t i = 0; i < SECTIONS_COUNT; ++i)
+    {
+      if (header->offsets[i] + header->sizes[i] > m_size)
+      {
+        Close();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void MappedFile::Close()
+  {
+#ifdef _WIN32
+    if (m_data != nullptr)
+      UnmapViewOfFile(m_data);
+    if (m_mapping != nullptr)
+      CloseHandle(m_mapping);
+    if (m_file != nullptr)
+      CloseHandle(m_file);
+    m_mapping = nullptr;
+    m_file = nullptr;
+#else
+    if (m_data != nullptr)
+      munmap(const_cast<uint8_t*>(m_data), m_size);
+    if (m_fd >= 0)
+      close(m_fd);
+    m_fd = -1;
+#endif
+    m_data = nullptr;
+    m_size = 0;
+  }
+
+  const void *MappedFile::Section(ff_cache::Section a_section) const
+  {
+    const Header *header = GetHeader();
+    if (header == nullptr)
+      return nullptr;
+    return m_data + header->offsets[a_section];
+  }
+}
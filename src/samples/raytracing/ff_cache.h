@@ -0,0 +1,91 @@
+#ifndef VK_GRAPHICS_RT_FF_CACHE_H
+#define VK_GRAPHICS_RT_FF_CACHE_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// On-disk cache of the form factor matrix and of the data it was computed from.
+// File layout: Header, then sections aligned to SECTION_ALIGNMENT in the order of ff_cache::Section.
+namespace ff_cache
+{
+  enum Section
+  {
+    SECTION_FF = 0,             // uint[rowOffsets.back()], compact entries of ff_compact.h
+    SECTION_ROW_OFFSETS,        // uint[visibleVoxels * 6 * FFColumnBlocks(visibleVoxels * 6) + 1]
+    SECTION_VISIBLE_VOXELS,     // uint[visibleVoxels], voxel slots of brick_map.h
+    SECTION_VISIBLE_COUNTER,    // uint[8], indirect dispatch arguments written by GenSamples
+    SECTION_POINT_COUNTERS,     // uint4[voxelsCount] per voxel slot, x is the points count, z is the offset of the first point
+    SECTION_PRIM_COUNTER,       // uint[trianglesCount]
+    SECTION_SAMPLE_POSITIONS,   // the sample streams of sample_points.h as they are
+    SECTION_SAMPLE_NORMALS,
+    SECTION_SAMPLE_MATERIALS,
+    SECTION_SAMPLING_STATS,     // uint[voxelsCount * SAMPLING_STATS_COUNT] of adaptive_sampling.h, empty without adaptive sampling
+    SECTIONS_COUNT
+  };
+
+  constexpr uint32_t MAGIC = 0x43464656; // "VFFC"
+  constexpr uint32_t FORMAT_VERSION = 11;
+  constexpr uint64_t SECTION_ALIGNMENT = 64;
+
+  struct Header
+  {
+    uint32_t magic = MAGIC;
+    uint32_t formatVersion = FORMAT_VERSION;
+    uint64_t sceneHash = 0;
+    float    voxelSize = 0;
+    uint32_t perSurfacePoints = 0;
+    uint32_t voxelsCount = 0;  // voxel slots of the allocated bricks
+    uint32_t visibleVoxelsCount = 0;
+    uint32_t trianglesCount = 0;
+    uint32_t ffEncoding = 0;   // FF_ENCODING the values were stored with
+    uint32_t adaptiveSampling = 0; // perSurfacePoints is the maximum, the voxels shot the counts of SECTION_SAMPLING_STATS
+    uint32_t voxelLayout = 0;  // VOXEL_LAYOUT_* of brick_map.h, the voxel slots depend on it
+    uint32_t voxelizedSamples = 0; // the points were placed by the triangle voxelizer instead of the rays
+    uint32_t ffVisibility = 0; // FF_VISIBILITY_* of voxel_dda.h
+    uint32_t nearFieldVoxels = 0; // pairs that traced rays with FF_VISIBILITY_DDA
+    std::array<uint64_t, SECTIONS_COUNT> offsets = {};
+    std::array<uint64_t, SECTIONS_COUNT> sizes = {};
+  };
+
+  struct SectionData
+  {
+    const void *data = nullptr;
+    uint64_t size = 0;
+  };
+
+  uint64_t Hash(const void *a_data, size_t a_size, uint64_t a_seed = 14695981039346656037ull);
+  std::string FileName(uint64_t a_sceneHash, float a_voxelSize, uint32_t a_voxelLayout, uint32_t a_perSurfacePoints,
+    bool a_adaptiveSampling, bool a_voxelizedSamples, uint32_t a_ffVisibility, uint32_t a_nearFieldVoxels);
+
+  bool Write(const std::string &a_path, Header a_header, const std::array<SectionData, SECTIONS_COUNT> &a_sections);
+
+  // read-only memory mapping of a cache file
+  class MappedFile
+  {
+  public:
+    MappedFile() = default;
+    ~MappedFile() { Close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool Open(const std::string &a_path);
+    void Close();
+
+    const Header *GetHeader() const { return m_size >= sizeof(Header) ? reinterpret_cast<const Header*>(m_data) : nullptr; }
+    const void *Section(Section a_section) const;
+
+  private:
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+  };
+}
+
+#endif// VK_GRAPHICS_RT_FF_CACHE_H
@@ -0,0 +1,634 @@
+#include "radiosity_cpu.h"
+
+#include <array>
+#include <chrono>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+using LiteMath::float2;
+using LiteMath::float3;
+using LiteMath::float4;
+using LiteMath::float4x4;
+using LiteMath::int3;
+using LiteMath::uint3;
+
+static float radicalInverse(uint32_t bits)
+{
+  bits = (bits << 16u) | (bits >> 16u);
+  bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+  bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+  bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+  bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+  return float(bits) * 2.3283064365386963e-10f; // / 0x100000000
+}
+
+// same as unpack_attributes.h
+static float3 DecodeNormal(uint32_t a_data)
+{
+  const uint32_t a_enc_x = (a_data  & 0x0000FFFFu);
+  const uint32_t a_enc_y = ((a_data & 0xFFFF0000u) >> 16);
+  const float sign   = (a_enc_x & 0x0001u) != 0 ? -1.0f : 1.0f;
+
+  const int usX = int(a_enc_x & 0x0000FFFEu);
+  const int usY = int(a_enc_y & 0x0000FFFFu);
+
+  const int sX  = (usX <= 32767) ? usX : usX - 65536;
+  const int sY  = (usY <= 32767) ? usY : usY - 65536;
+
+  const float x = sX*(1.0f / 32767.0f);
+  const float y = sY*(1.0f / 32767.0f);
+  const float z = sign*std::sqrt(std::max(1.0f - x*x - y*y, 0.0f));
+
+  return float3(x, y, z);
+}
+
+static float3 DecodeColor(uint32_t a_enc)
+{
+  return float3(float((a_enc >> 16) & 0xFF), float((a_enc >> 8) & 0xFF), float(a_enc & 0xFF)) / 255.0f;
+}
+
+// reproduces the shared memory reduction order of the compute shaders
+template<typename T>
+static T TreeReduce(std::array<T, 256> &a_values)
+{
+  for (uint32_t d = 128; d > 0; d >>= 1)
+    for (uint32_t tid = 0; tid < d; ++tid)
+      a_values[tid] += a_values[tid + d];
+  return a_values[0];
+}
+
+static float Milliseconds(std::chrono::high_resolution_clock::time_point a_start)
+{
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(end - a_start).count() / 1000.f;
+}
+
+void RadiosityCPU::SetScene(std::shared_ptr<ISceneObject> a_pAccelStruct, std::shared_ptr<RadiosityScene> a_pScene)
+{
+  m_pAccelStruct = a_pAccelStruct;
+  m_pScene = a_pScene;
+}
+
+void RadiosityCPU::SetGrid(const float3 &a_bmin, const float3 &a_bmax, float a_voxelSize)
+{
+  m_bmin = a_bmin;
+  m_bmax = a_bmax;
+  m_voxelSize = a_voxelSize;
+  const float3 gridF = (m_bmax - m_bmin) / m_voxelSize;
+  m_voxelsGrid = uint3(uint32_t(std::ceil(gridF.x)), uint32_t(std::ceil(gridF.y)), uint32_t(std::ceil(gridF.z)));
+  m_voxelsCount = m_voxelsGrid.x * m_voxelsGrid.y * m_voxelsGrid.z;
+
+  m_points.resize(m_perSurfacePoints);
+  for (uint32_t i = 0; i < m_perSurfacePoints; ++i)
+    m_points[i] = float2(float(i) / float(m_perSurfacePoints), radicalInverse(i)) - 0.5f;
+}
+
+bool RadiosityCPU::SampleSurface(const float3 &a_pos, const float3 &a_dir, float a_len, float4 a_out[3]) const
+{
+  const CRT_Hit hit = m_pAccelStruct->RayQuery_NearestHit(to_float4(a_pos, 0.0f), to_float4(a_dir, a_len));
+  if (hit.primId == uint32_t(-1))
+    return false;
+
+  const RadiosityScene &scene = *m_pScene;
+  const uint32_t startIdxId = hit.primId + scene.meshInfos[hit.geomId].x / 3;
+  const float4x4 &matrix = scene.instanceMatrices[hit.instId];
+  const float4x4 normalMatrix = LiteMath::transpose(LiteMath::inverse4x4(matrix));
+
+  float4 p[3];
+  float3 n[3];
+  float3 points[3];
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    const uint32_t idx = scene.indices[startIdxId * 3 + i] + scene.meshInfos[hit.geomId].y;
+    p[i] = scene.vertices[idx * 2];
+    n[i] = normalize(to_float3(normalMatrix * to_float4(DecodeNormal(LiteMath::as_uint(p[i].w)), 0.0f)));
+    points[i] = to_float3(matrix * float4(p[i].x, p[i].y, p[i].z, 1.0f));
+  }
+  // CRT_Hit stores barycentrics swapped, see EmbreeRT::RayQuery_NearestHit
+  const float u = hit.coords[1];
+  const float v = hit.coords[0];
+  const float3 normal = normalize(n[0] * (1 - u - v) + n[1] * u + n[2] * v);
+  const float area = length(cross(points[1] - points[0], points[2] - points[0])) * 0.5f;
+  const float3 target = points[0] * (1 - u - v) + points[1] * u + points[2] * v;
+
+  const MaterialData_pbrMR &material = scene.materials[scene.materialIds[startIdxId]];
+  float3 color = to_float3(material.baseColor);
+  const int textureId = material.baseColorTexId;
+  float3 emission = material.emissionColor;
+  if (textureId != -1 && textureId < int(scene.textureColors.size()))
+    color = scene.textureColors[textureId];
+
+  const uint32_t colorEnc = (uint32_t(color.x * 255) << 16) | (uint32_t(color.y * 255) << 8) | (uint32_t(color.z * 255));
+  const float maxEmission = std::max(std::max(emission.x, emission.y), std::max(emission.z, 1.0f));
+  emission /= maxEmission;
+  const uint32_t emissionEnc = ((uint32_t(emission.x * 255) & 0xFF) << 16) | ((uint32_t(emission.y * 255) & 0xFF) << 8)
+    | (uint32_t(emission.z * 255) & 0xFF);
+
+  a_out[0] = to_float4(target, float(startIdxId));
+  a_out[1] = to_float4(normal, std::min(area, 1.0f));
+  a_out[2] = float4(LiteMath::as_float(int(colorEnc)), LiteMath::as_float(int(emissionEnc)), maxEmission, float(textureId));
+  return true;
+}
+
+bool RadiosityCPU::Visible(const float3 &a_pos, const float3 &a_dir, float a_len) const
+{
+  return !m_pAccelStruct->RayQuery_AnyHit(to_float4(a_pos, 0.0f), to_float4(a_dir, a_len));
+}
+
+bool RadiosityCPU::DDAVisible(const float3 &a_from, const float3 &a_to) const
+{
+  const float3 gridFrom = (a_from - m_bmin) / m_voxelSize;
+  const float3 gridTo = (a_to - m_bmin) / m_voxelSize;
+  const int3 fromVoxel(int(std::floor(gridFrom.x)), int(std::floor(gridFrom.y)), int(std::floor(gridFrom.z)));
+  const int3 toVoxel(int(std::floor(gridTo.x)), int(std::floor(gridTo.y)), int(std::floor(gridTo.z)));
+  VoxelMarch march;
+  if (!StartVoxelMarch(gridFrom, gridTo, m_voxelsGrid, march))
+    return true;
+  do
+  {
+    if (NearVoxel(march.voxel, fromVoxel) || NearVoxel(march.voxel, toVoxel))
+      continue;
+    const uint32_t voxelIdx = (uint32_t(march.voxel.x) * m_voxelsGrid.y + uint32_t(march.voxel.y)) * m_voxelsGrid.z + uint32_t(march.voxel.z);
+    if ((m_occupancy[voxelIdx / 32] & (1u << (voxelIdx % 32))) != 0)
+      return false;
+  } while (NextVoxel(march));
+  return true;
+}
+
+void RadiosityCPU::GenSamples()
+{
+  assert(m_pAccelStruct != nullptr && m_pScene != nullptr);
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const uint32_t pointsPerVoxel = PointsPerVoxel();
+  const uint32_t trianglesCount = uint32_t(m_pScene->indices.size() / 3);
+  m_samplePoints.assign(size_t(m_voxelsCount) * pointsPerVoxel * 3, float4(0.0f));
+  m_pointCounters.assign(size_t(m_voxelsCount) * 4, 0);
+  m_primCounter.assign(trianglesCount, 0);
+
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int voxelIdx = 0; voxelIdx < int(m_voxelsCount); ++voxelIdx)
+  {
+    const uint32_t zVoxel = voxelIdx % m_voxelsGrid.z;
+    const uint32_t yVoxel = voxelIdx / m_voxelsGrid.z % m_voxelsGrid.y;
+    const uint32_t xVoxel = voxelIdx / m_voxelsGrid.z / m_voxelsGrid.y;
+    const float3 voxelCenter = float3(float(xVoxel), float(yVoxel), float(zVoxel)) * m_voxelSize + m_bmin + m_voxelSize * 0.5f;
+    const size_t pointsOffset = size_t(voxelIdx) * pointsPerVoxel;
+
+    uint32_t count = 0;
+    for (uint32_t surfaceIdx = 0; surfaceIdx < 6; ++surfaceIdx)
+    {
+      const uint32_t axis = surfaceIdx % 3;
+      const float offsetSign = surfaceIdx / 3 == 0 ? -1.0f : 1.0f;
+      const float3 offsetMask = float3(axis == 0 ? 1.0f : 0.0f, axis == 1 ? 1.0f : 0.0f, axis == 2 ? 1.0f : 0.0f);
+      const float3 sideCenter = voxelCenter + offsetMask * offsetSign * m_voxelSize * 0.5f;
+      const float3 dir = offsetMask * (-offsetSign);
+
+      for (uint32_t onSurfaceIdx = 0; onSurfaceIdx < m_perSurfacePoints; ++onSurfaceIdx)
+      {
+        float3 randPoint(0.0f);
+        for (uint32_t i = 0, idx = 0; i < 3; ++i)
+        {
+          if (i != axis)
+          {
+            randPoint[i] = m_points[onSurfaceIdx][idx];
+            idx++;
+          }
+        }
+        const float3 point = randPoint * m_voxelSize + sideCenter;
+
+        float4 *out = m_samplePoints.data() + (pointsOffset + count) * 3;
+        if (SampleSurface(point, dir, m_voxelSize, out))
+        {
+          count++;
+          #pragma omp atomic
+          m_primCounter[uint32_t(out[0].w)]++;
+        }
+      }
+    }
+    m_pointCounters[voxelIdx * 4 + 0] = count;
+    m_pointCounters[voxelIdx * 4 + 1] = 1;
+  }
+
+  m_voxelIndices.clear();
+  for (uint32_t voxelIdx = 0; voxelIdx < m_voxelsCount; ++voxelIdx)
+    if (m_pointCounters[voxelIdx * 4] > 0)
+      m_voxelIndices.push_back(voxelIdx);
+  m_occupancy.assign((m_voxelsCount + 31) / 32, 0);
+  for (uint32_t voxelIdx : m_voxelIndices)
+    m_occupancy[voxelIdx / 32] |= 1u << (voxelIdx % 32);
+
+  m_timings.genSamples = Milliseconds(start);
+}
+
+void RadiosityCPU::ComputeFFRow(uint32_t a_visVoxelId, std::vector<float> &a_tmpRow) const
+{
+  const uint32_t visibleCount = VisibleVoxelsCount();
+  const uint32_t pointsPerVoxel = PointsPerVoxel();
+  const uint32_t baseVoxelId = m_voxelIndices[a_visVoxelId];
+  const uint32_t pointsCount = m_pointCounters[baseVoxelId * 4];
+  const float4 *sourcePoints = m_samplePoints.data() + size_t(baseVoxelId) * pointsPerVoxel * 3;
+  assert(pointsCount <= 256);
+  a_tmpRow.assign(size_t(visibleCount) * 6 * 6, 0.0f);
+
+  std::array<float3, 256> positiveAreas, negativeAreas;
+  std::array<float3, 256> positiveWeights, negativeWeights;
+  positiveAreas.fill(float3(0.0f));
+  negativeAreas.fill(float3(0.0f));
+  for (uint32_t tid = 0; tid < pointsCount; ++tid)
+  {
+    const float3 normal = to_float3(sourcePoints[tid * 3 + 1]);
+    const float areas = sourcePoints[tid * 3 + 1].w / m_primCounter[uint32_t(sourcePoints[tid * 3].w)];
+    positiveWeights[tid] = max(normal, float3(0.0f));
+    negativeWeights[tid] = max(normal * -1.0f, float3(0.0f));
+    positiveAreas[tid] = max(float3(0.0f), normal * areas);
+    negativeAreas[tid] = max(float3(0.0f), normal * (-areas));
+  }
+  float3 positiveAreaInvSum, negativeAreaInvSum;
+  {
+    std::array<float3, 256> tmp = positiveAreas;
+    const float3 sum = TreeReduce(tmp);
+    for (int i = 0; i < 3; ++i)
+      positiveAreaInvSum[i] = sum[i] > 1e-5f ? 1.0f / sum[i] : 0.0f;
+    tmp = negativeAreas;
+    const float3 negSum = TreeReduce(tmp);
+    for (int i = 0; i < 3; ++i)
+      negativeAreaInvSum[i] = negSum[i] > 1e-5f ? 1.0f / negSum[i] : 0.0f;
+  }
+
+  const float geomMult = 1.0f / 3.1415926535897932f;
+  std::array<std::array<float3, 256>, 6> positiveFF, negativeFF;
+  for (uint32_t targetVisVoxelId = 0; targetVisVoxelId < visibleCount; ++targetVisVoxelId)
+  {
+    const uint32_t targetVoxelId = m_voxelIndices[targetVisVoxelId];
+    const uint32_t targetPointsCount = m_pointCounters[targetVoxelId * 4];
+    const float4 *targetPoints = m_samplePoints.data() + size_t(targetVoxelId) * pointsPerVoxel * 3;
+    for (uint32_t i = 0; i < 6; ++i)
+    {
+      positiveFF[i].fill(float3(0.0f));
+      negativeFF[i].fill(float3(0.0f));
+    }
+
+    for (uint32_t tid = 0; tid < pointsCount; ++tid)
+    {
+      const float3 pos = to_float3(sourcePoints[tid * 3]);
+      const float3 normal = to_float3(sourcePoints[tid * 3 + 1]);
+      for (uint32_t i = 0; i < targetPointsCount; ++i)
+      {
+        if (targetVoxelId == baseVoxelId && i == tid)
+          continue;
+        const float3 target = to_float3(targetPoints[i * 3]);
+        float3 dir = target - pos;
+        const float len = length(dir);
+        if (len < 1e-5f)
+          continue;
+        dir /= len;
+        const float cosTheta = dot(dir, normal);
+        if (cosTheta <= 0.0f)
+          continue;
+        const float3 targetNormal = to_float3(targetPoints[i * 3 + 1]);
+        const float cosTheta1 = -dot(dir, targetNormal);
+        if (cosTheta1 <= 0.0f)
+          continue;
+        const bool visible = m_visibility == FF_VISIBILITY_DDA && len > m_nearFieldVoxels * m_voxelSize ? DDAVisible(pos, target)
+          : Visible(pos + dir * 1e-2f, dir, len - 1e-2f * 2.0f);
+        if (!visible)
+          continue;
+        const float primArea = targetPoints[i * 3 + 1].w / m_primCounter[uint32_t(targetPoints[i * 3].w)];
+        const float ff = std::min((cosTheta * cosTheta1) / len / len * primArea * geomMult, 1.0f);
+
+        const float3 targetPositiveWeights = max(targetNormal, float3(0.0f));
+        const float3 targetNegativeWeights = max(targetNormal * -1.0f, float3(0.0f));
+        for (uint32_t j = 0; j < 3; ++j)
+        {
+          positiveFF[j][tid] += ff * targetPositiveWeights * positiveWeights[tid][j];
+          negativeFF[j][tid] += ff * targetNegativeWeights * positiveWeights[tid][j];
+          positiveFF[j + 3][tid] += ff * targetPositiveWeights * negativeWeights[tid][j];
+          negativeFF[j + 3][tid] += ff * targetNegativeWeights * negativeWeights[tid][j];
+        }
+      }
+    }
+
+    for (uint32_t i = 0; i < 6; ++i)
+    {
+      const float areaInvSum = i < 3 ? positiveAreaInvSum[i] : negativeAreaInvSum[i - 3];
+      for (uint32_t tid = 0; tid < pointsCount; ++tid)
+      {
+        const float area = i < 3 ? positiveAreas[tid][i] : negativeAreas[tid][i - 3];
+        positiveFF[i][tid] *= area;
+        negativeFF[i][tid] *= area;
+      }
+      const float3 positiveSum = TreeReduce(positiveFF[i]);
+      const float3 negativeSum = TreeReduce(negativeFF[i]);
+      for (uint32_t j = 0; j < 3; ++j)
+      {
+        a_tmpRow[(i * visibleCount * 6) + targetVisVoxelId * 6 + j] = positiveSum[j] * areaInvSum;
+        a_tmpRow[(i * visibleCount * 6) + targetVisVoxelId * 6 + 3 + j] = negativeSum[j] * areaInvSum;
+      }
+    }
+  }
+}
+
+void RadiosityCPU::ComputeFF()
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const uint32_t visibleCount = VisibleVoxelsCount();
+  const uint32_t clustersCount = visibleCount * 6;
+  std::vector<std::vector<FFValue>> rows(clustersCount);
+
+  #pragma omp parallel
+  {
+    std::vector<float> tmpRow;
+    #pragma omp for schedule(dynamic, 1)
+    for (int visVoxelId = 0; visVoxelId < int(visibleCount); ++visVoxelId)
+    {
+      ComputeFFRow(visVoxelId, tmpRow);
+      // packFF: keep non-zero values, columns stay sorted
+      for (uint32_t i = 0; i < 6; ++i)
+      {
+        auto &row = rows[visVoxelId * 6 + i];
+        for (uint32_t column = 0; column < clustersCount; ++column)
+        {
+          const float value = tmpRow[i * clustersCount + column];
+          if (value > 0.0f)
+            row.push_back(FFValue{column, value});
+        }
+      }
+    }
+  }
+
+  m_ffRowOffsets.resize(clustersCount + 1);
+  m_ffRowOffsets[0] = 0;
+  for (uint32_t i = 0; i < clustersCount; ++i)
+    m_ffRowOffsets[i + 1] = m_ffRowOffsets[i] + uint32_t(rows[i].size());
+  m_ff.resize(m_ffRowOffsets.back());
+  #pragma omp parallel for
+  for (int i = 0; i < int(clustersCount); ++i)
+    std::copy(rows[i].begin(), rows[i].end(), m_ff.begin() + m_ffRowOffsets[i]);
+
+  m_timings.computeFF = Milliseconds(start);
+}
+
+void RadiosityCPU::InitLighting(const float3 &a_lightPos, bool a_multibounce)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const uint32_t visibleCount = VisibleVoxelsCount();
+  const uint32_t pointsPerVoxel = PointsPerVoxel();
+  m_initLighting.resize(size_t(visibleCount) * 6, float4(0.0f));
+  m_patchAlbedo.resize(m_initLighting.size(), float4(0.0f));
+  if (m_reflLighting.size() != m_initLighting.size())
+    m_reflLighting.assign(m_initLighting.size(), float4(0.0f));
+
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int tid = 0; tid < int(visibleCount); ++tid)
+  {
+    const uint32_t voxelId = m_voxelIndices[tid];
+    const float4 *points = m_samplePoints.data() + size_t(voxelId) * pointsPerVoxel * 3;
+    float3 positiveLight[3];
+    float3 negativeLight[3];
+    float4 positiveAlbedo[3];
+    float4 negativeAlbedo[3];
+    for (int i = 0; i < 3; ++i)
+    {
+      positiveLight[i] = float3(0.0f);
+      negativeLight[i] = float3(0.0f);
+      positiveAlbedo[i] = float4(0.0f);
+      negativeAlbedo[i] = float4(0.0f);
+    }
+    for (uint32_t i = 0; i < m_pointCounters[voxelId * 4]; ++i)
+    {
+      const float3 normal = to_float3(points[i * 3 + 1]);
+      const float3 pos = to_float3(points[i * 3]) + normal * 1e-3f;
+      const float3 toLight = a_lightPos - pos;
+      const float toLightDist = length(toLight);
+      const float3 toLightDir = toLight / toLightDist;
+      const float3 emission = DecodeColor(LiteMath::as_uint(points[i * 3 + 2].y)) * points[i * 3 + 2].z;
+      const float4 albedo = to_float4(DecodeColor(LiteMath::as_uint(points[i * 3 + 2].x)), 1.0f);
+      for (int j = 0; j < 3; ++j)
+      {
+        positiveLight[j] += std::max(0.0f, normal[j]) * emission;
+        negativeLight[j] += std::max(0.0f, -normal[j]) * emission;
+        positiveAlbedo[j] += std::max(0.0f, normal[j]) * albedo;
+        negativeAlbedo[j] += std::max(0.0f, -normal[j]) * albedo;
+      }
+      if (Visible(pos, toLightDir, toLightDist))
+      {
+        const float3 color = DecodeColor(LiteMath::as_uint(points[i * 3 + 2].x));
+        for (int j = 0; j < 3; ++j)
+        {
+          positiveLight[j] += std::max(0.0f, toLightDir[j]) * color;
+          negativeLight[j] += std::max(0.0f, -toLightDir[j]) * color;
+        }
+      }
+    }
+    const float brightness = 200.0f;
+    for (int i = 0; i < 3; ++i)
+    {
+      float3 positive = positiveLight[i] / float(pointsPerVoxel) * brightness;
+      float3 negative = negativeLight[i] / float(pointsPerVoxel) * brightness;
+      if (a_multibounce)
+      {
+        positive += to_float3(m_reflLighting[tid * 6 + i]);
+        negative += to_float3(m_reflLighting[tid * 6 + 3 + i]);
+      }
+      m_initLighting[tid * 6 + i] = to_float4(positive, 0.0f);
+      m_initLighting[tid * 6 + 3 + i] = to_float4(negative, 0.0f);
+      m_patchAlbedo[tid * 6 + i] = positiveAlbedo[i].w > 0 ? to_float4(to_float3(positiveAlbedo[i]) / positiveAlbedo[i].w, 0.0f) : float4(0.0f);
+      m_patchAlbedo[tid * 6 + 3 + i] = negativeAlbedo[i].w > 0 ? to_float4(to_float3(negativeAlbedo[i]) / negativeAlbedo[i].w, 0.0f) : float4(0.0f);
+    }
+  }
+
+  m_timings.initLighting = Milliseconds(start);
+}
+
+void RadiosityCPU::ReflLighting()
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const uint32_t patchesCount = VisibleVoxelsCount() * 6;
+  m_reflLighting.resize(patchesCount);
+
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int rowIdx = 0; rowIdx < int(patchesCount); ++rowIdx)
+  {
+    float4 sum(0.0f);
+    for (uint32_t i = m_ffRowOffsets[rowIdx]; i < m_ffRowOffsets[rowIdx + 1]; ++i)
+      sum += m_ff[i].value * m_initLighting[m_ff[i].idx];
+    m_reflLighting[rowIdx] = sum;
+  }
+
+  m_timings.reflLighting = Milliseconds(start);
+}
+
+uint32_t RadiosityCPU::Solve(uint32_t a_mode, uint32_t a_maxIterations, float a_tolerance, float a_shootThreshold)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const uint32_t patchesCount = VisibleVoxelsCount() * 6;
+  const auto maxComponent = [](const float4 &v) { return std::max(std::max(std::abs(v.x), std::abs(v.y)), std::abs(v.z)); };
+  // with a_emission the source is the reflected lighting, which leaves the patch scaled by its albedo
+  const auto rowSum = [&](int rowIdx, const std::vector<float4> &a_source, const std::vector<float4> *a_emission) {
+    float4 sum(0.0f);
+    for (uint32_t i = m_ffRowOffsets[rowIdx]; i < m_ffRowOffsets[rowIdx + 1]; ++i)
+    {
+      const uint32_t idx = m_ff[i].idx;
+      sum += m_ff[i].value * (a_emission ? (*a_emission)[idx] + m_patchAlbedo[idx] * a_source[idx] : a_source[idx]);
+    }
+    return sum;
+  };
+
+  m_reflLighting.assign(patchesCount, float4(0.0f));
+  std::vector<float4> tmp(patchesCount, float4(0.0f));
+  std::vector<float4> unshot;
+  if (a_mode == SOLVER_SOUTHWELL)
+    unshot = m_initLighting;
+
+  uint32_t iteration = 0;
+  m_solverResidual = 0.0f;
+  while (iteration < a_maxIterations)
+  {
+    float residual = 0.0f;
+    float solution = 0.0f;
+    if (a_mode == SOLVER_JACOBI)
+    {
+      #pragma omp parallel for schedule(dynamic, 256) reduction(max: residual, solution)
+      for (int rowIdx = 0; rowIdx < int(patchesCount); ++rowIdx)
+      {
+        tmp[rowIdx] = rowSum(rowIdx, m_reflLighting, &m_initLighting);
+        residual = std::max(residual, maxComponent(tmp[rowIdx] - m_reflLighting[rowIdx]));
+        solution = std::max(solution, maxComponent(tmp[rowIdx]));
+      }
+      m_reflLighting.swap(tmp);
+    }
+    else if (a_mode == SOLVER_GAUSS_SEIDEL)
+    {
+      for (int color = 0; color < 2; ++color)
+      {
+        #pragma omp parallel for schedule(dynamic, 256) reduction(max: residual, solution)
+        for (int rowIdx = 0; rowIdx < int(patchesCount); ++rowIdx)
+        {
+          if ((rowIdx / 6) % 2 != color)
+            continue;
+          const float4 value = rowSum(rowIdx, m_reflLighting, &m_initLighting);
+          residual = std::max(residual, maxComponent(value - m_reflLighting[rowIdx]));
+          solution = std::max(solution, maxComponent(value));
+          m_reflLighting[rowIdx] = value;
+        }
+      }
+    }
+    else
+    {
+      float maxUnshot = 0.0f;
+      for (const float4 &value : unshot)
+        maxUnshot = std::max(maxUnshot, maxComponent(value));
+      for (uint32_t i = 0; i < patchesCount; ++i)
+      {
+        const bool shoot = maxComponent(unshot[i]) >= a_shootThreshold * maxUnshot;
+        tmp[i] = shoot ? unshot[i] : float4(0.0f);
+        if (shoot)
+          unshot[i] = float4(0.0f);
+      }
+      #pragma omp parallel for schedule(dynamic, 256) reduction(max: residual, solution)
+      for (int rowIdx = 0; rowIdx < int(patchesCount); ++rowIdx)
+      {
+        const float4 delta = rowSum(rowIdx, tmp, nullptr);
+        m_reflLighting[rowIdx] += delta;
+        unshot[rowIdx] += m_patchAlbedo[rowIdx] * delta;
+        residual = std::max(residual, maxComponent(delta));
+        solution = std::max(solution, maxComponent(m_reflLighting[rowIdx]));
+      }
+    }
+    ++iteration;
+    m_solverResidual = residual / std::max(solution, 1e-6f);
+    if (m_solverResidual < a_tolerance)
+      break;
+  }
+
+  m_timings.solve = Milliseconds(start);
+  return iteration;
+}
+
+void RadiosityCPU::CompactFF(uint32_t a_encoding)
+{
+  const uint32_t patchesCount = VisibleVoxelsCount() * 6;
+  const uint32_t blocks = FFColumnBlocks(patchesCount);
+  m_ffCompactEncoding = a_encoding;
+  m_ffCompact.resize(m_ff.size());
+  m_ffCompactRowOffsets.resize(size_t(patchesCount) * blocks + 1);
+
+  // columns of a row are sorted, so every column block is a contiguous range of the row
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int rowIdx = 0; rowIdx < int(patchesCount); ++rowIdx)
+  {
+    uint32_t i = m_ffRowOffsets[rowIdx];
+    for (uint32_t block = 0; block < blocks; ++block)
+    {
+      m_ffCompactRowOffsets[rowIdx * blocks + block] = i;
+      for (; i < m_ffRowOffsets[rowIdx + 1] && m_ff[i].idx / FF_COLUMN_BLOCK == block; ++i)
+        m_ffCompact[i] = FFEncode(m_ff[i].idx, m_ff[i].value, a_encoding);
+    }
+  }
+  m_ffCompactRowOffsets.back() = uint32_t(m_ff.size());
+}
+
+void RadiosityCPU::ReflLightingCompact()
+{
+  auto start = std::chrono::high_resolution_clock::now();
+
+  const uint32_t patchesCount = VisibleVoxelsCount() * 6;
+  const uint32_t blocks = FFColumnBlocks(patchesCount);
+  m_reflLighting.resize(patchesCount);
+
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int rowIdx = 0; rowIdx < int(patchesCount); ++rowIdx)
+  {
+    float4 sum(0.0f);
+    for (uint32_t block = 0; block < blocks; ++block)
+    {
+      const uint32_t *offsets = m_ffCompactRowOffsets.data() + rowIdx * blocks + block;
+      for (uint32_t i = offsets[0]; i < offsets[1]; ++i)
+      {
+        const uint32_t entry = m_ffCompact[i];
+        sum += FFDecodeValue(entry, m_ffCompactEncoding) * m_initLighting[block * FF_COLUMN_BLOCK + FFDecodeColumn(entry)];
+      }
+    }
+    m_reflLighting[rowIdx] = sum;
+  }
+
+  m_timings.reflLighting = Milliseconds(start);
+}
+
+void RadiosityCPU::FinalLighting()
+{
+  m_appliedLighting.assign(size_t(m_voxelsCount) * 6, float4(0.0f));
+  const uint32_t visibleCount = VisibleVoxelsCount();
+  for (uint32_t tid = 0; tid < visibleCount; ++tid)
+    for (uint32_t i = 0; i < 6; ++i)
+      m_appliedLighting[m_voxelIndices[tid] * 6 + i] = m_reflLighting[tid * 6 + i];
+}
+
+void RadiosityCPU::Run(const float3 &a_lightPos, bool a_multibounce)
+{
+  GenSamples();
+  ComputeFF();
+  InitLighting(a_lightPos, a_multibounce);
+  ReflLighting();
+  FinalLighting();
+}
+
+void RadiosityCPU::PrintStats() const
+{
+  const uint32_t visibleCount = VisibleVoxelsCount();
+  const float seconds = m_timings.computeFF / 1000.f;
+  const double pairs = double(visibleCount) * visibleCount;
+  std::cout << "Voxels count " << m_voxelsCount << std::endl;
+  std::cout << "Visible voxels count " << visibleCount << std::endl;
+  std::cout << "FF total count " << m_ff.size() << std::endl;
+  std::cout << "GenSamples   " << m_timings.genSamples << " ms" << std::endl;
+  std::cout << "ComputeFF    " << m_timings.computeFF << " ms (" << (seconds > 0 ? pairs / seconds : 0.0) << " voxel pairs/s)" << std::endl;
+  std::cout << "InitLighting " << m_timings.initLighting << " ms" << std::endl;
+  std::cout << "ReflLighting " << m_timings.reflLighting << " ms" << std::endl;
+}
@@ -0,0 +1,136 @@
+#ifndef VK_GRAPHICS_RT_RADIOSITY_CPU_H
+#define VK_GRAPHICS_RT_RADIOSITY_CPU_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "LiteMath.h"
+#include "render/CrossRT.h"
+#include "../../../resources/shaders/common.h"
+#include "../../../resources/shaders/ff_compact.h"
+#include "../../../resources/shaders/radiosity_solver.h"
+#include "../../../resources/shaders/voxel_dda.h"
+
+// CPU copy of the scene data that GenSamples.comp reads from the SceneManager buffers
+struct RadiosityScene
+{
+  std::vector<LiteMath::float4>   vertices;         // two float4 per vertex, same layout as the GPU vertex buffer
+  std::vector<uint32_t>           indices;
+  std::vector<LiteMath::uint2>    meshInfos;        // (indexOffset, vertexOffset) per mesh
+  std::vector<LiteMath::float4x4> instanceMatrices;
+  std::vector<MaterialData_pbrMR> materials;
+  std::vector<uint32_t>           materialIds;      // per triangle
+  std::vector<LiteMath::float3>   textureColors;    // coarsest mip level of each texture, may be empty
+};
+
+/**
+\brief CPU port of the radiosity kernels (GenSamples, ComputeFF, packFF, initLighting, oneBounce, FinalLighting)
+
+Buffers have the same layout as their GPU counterparts in SimpleRender, so results can be compared directly.
+*/
+class RadiosityCPU
+{
+public:
+  struct FFValue
+  {
+    uint32_t idx;
+    float value;
+  };
+
+  RadiosityCPU(uint32_t a_perSurfacePoints) : m_perSurfacePoints(a_perSurfacePoints) {}
+
+  void SetScene(std::shared_ptr<ISceneObject> a_pAccelStruct, std::shared_ptr<RadiosityScene> a_pScene);
+  void SetGrid(const LiteMath::float3 &a_bmin, const LiteMath::float3 &a_bmax, float a_voxelSize);
+
+  // FF_VISIBILITY_* of voxel_dda.h, with FF_VISIBILITY_DDA the point pairs farther apart than a_nearFieldVoxels voxels
+  // march the occupancy of GenSamples instead of tracing rays
+  void SetVisibility(uint32_t a_mode, uint32_t a_nearFieldVoxels) { m_visibility = a_mode; m_nearFieldVoxels = a_nearFieldVoxels; }
+
+  void GenSamples();
+  void ComputeFF();
+  void ComputeFFRow(uint32_t a_visVoxelId, std::vector<float> &a_tmpRow) const;
+  void InitLighting(const LiteMath::float3 &a_lightPos, bool a_multibounce);
+  void ReflLighting();
+  void FinalLighting();
+
+  // compact copy of the FF (see ff_compact.h), the fp32 FF is kept as the reference
+  void CompactFF(uint32_t a_encoding);
+  void ReflLightingCompact();
+
+  // same iterations as solveRadiosity.comp starting from zero reflected lighting, E is the lighting of InitLighting without
+  // multibounce and A is its PatchAlbedo. Stops when the residual relative to the largest reflected lighting is below a_tolerance, returns the iterations count
+  uint32_t Solve(uint32_t a_mode, uint32_t a_maxIterations, float a_tolerance, float a_shootThreshold = 0.1f);
+
+  void Run(const LiteMath::float3 &a_lightPos, bool a_multibounce = false);
+  void PrintStats() const;
+
+  uint32_t VoxelsCount()        const { return m_voxelsCount; }
+  uint32_t VisibleVoxelsCount() const { return uint32_t(m_voxelIndices.size()); }
+  uint32_t PointsPerVoxel()     const { return 6 * m_perSurfacePoints; }
+  LiteMath::uint3  VoxelsGrid() const { return m_voxelsGrid; }
+  LiteMath::float3 GridMin()    const { return m_bmin; }
+  float            VoxelSize()  const { return m_voxelSize; }
+
+  const std::vector<LiteMath::float4> &SamplePoints()   const { return m_samplePoints; }
+  const std::vector<uint32_t>         &PointCounters()  const { return m_pointCounters; }
+  const std::vector<uint32_t>         &PrimCounter()    const { return m_primCounter; }
+  const std::vector<uint32_t>         &VoxelIndices()   const { return m_voxelIndices; }
+  const std::vector<FFValue>          &FF()             const { return m_ff; }
+  const std::vector<uint32_t>         &FFRowOffsets()   const { return m_ffRowOffsets; }
+  const std::vector<uint32_t>         &FFCompact()      const { return m_ffCompact; }
+  const std::vector<uint32_t>         &FFCompactRowOffsets() const { return m_ffCompactRowOffsets; }
+  float                                ComputeFFMs()    const { return m_timings.computeFF; }
+  float                                ReflLightingMs() const { return m_timings.reflLighting; }
+  float                                SolveMs()        const { return m_timings.solve; }
+  float                                SolverResidual() const { return m_solverResidual; }
+  const std::vector<LiteMath::float4> &InitLight()      const { return m_initLighting; }
+  const std::vector<LiteMath::float4> &PatchAlbedo()    const { return m_patchAlbedo; }
+  const std::vector<LiteMath::float4> &ReflLight()      const { return m_reflLighting; }
+  const std::vector<LiteMath::float4> &AppliedLight()   const { return m_appliedLighting; }
+
+protected:
+  bool SampleSurface(const LiteMath::float3 &a_pos, const LiteMath::float3 &a_dir, float a_len, LiteMath::float4 a_out[3]) const;
+  bool Visible(const LiteMath::float3 &a_pos, const LiteMath::float3 &a_dir, float a_len) const;
+  bool DDAVisible(const LiteMath::float3 &a_from, const LiteMath::float3 &a_to) const;
+
+  uint32_t m_perSurfacePoints;
+  std::vector<LiteMath::float2> m_points;
+
+  LiteMath::float3 m_bmin;
+  LiteMath::float3 m_bmax;
+  float            m_voxelSize = 1.0f;
+  LiteMath::uint3  m_voxelsGrid;
+  uint32_t         m_voxelsCount = 0;
+
+  std::shared_ptr<ISceneObject>   m_pAccelStruct;
+  std::shared_ptr<RadiosityScene> m_pScene;
+
+  std::vector<LiteMath::float4> m_samplePoints;    // 3 float4 per point, PointsPerVoxel() points per voxel
+  std::vector<uint32_t>         m_pointCounters;   // 4 uint per voxel, same as indirection buffer
+  std::vector<uint32_t>         m_primCounter;
+  std::vector<uint32_t>         m_voxelIndices;
+  std::vector<uint32_t>         m_occupancy;       // bit per voxel, set for the voxels with sample points
+  uint32_t                      m_visibility = FF_VISIBILITY_RAYS;
+  uint32_t                      m_nearFieldVoxels = 2;
+  std::vector<FFValue>          m_ff;
+  std::vector<uint32_t>         m_ffRowOffsets;
+  std::vector<uint32_t>         m_ffCompact;
+  std::vector<uint32_t>         m_ffCompactRowOffsets; // one offset per column block of every row
+  uint32_t                      m_ffCompactEncoding = FF_ENCODING;
+  std::vector<LiteMath::float4> m_initLighting;
+  std::vector<LiteMath::float4> m_patchAlbedo;     // rgb reflectance of every patch, same weights as the lighting
+  std::vector<LiteMath::float4> m_reflLighting;
+  std::vector<LiteMath::float4> m_appliedLighting;
+  float                         m_solverResidual = 0.0f;
+
+  struct Timings
+  {
+    float genSamples   = 0.0f;
+    float computeFF    = 0.0f;
+    float initLighting = 0.0f;
+    float reflLighting = 0.0f;
+    float solve        = 0.0f;
+  } m_timings;
+};
+
+#endif// VK_GRAPHICS_RT_RADIOSITY_CPU_H
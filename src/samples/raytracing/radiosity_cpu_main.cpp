@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <geom/cmesh.h>
+#include "loader_utils/hydraxml.h"
+#include "loader_utils/image_loader.h"
+#include "radiosity_cpu.h"
+#include "radiosity_hierarchy.h"
+
+// same encoding as the one used for the GPU vertex buffer (Mesh8F)
+static uint32_t EncodeNormal(const float n[3])
+{
+  const int x = (int)(n[0]*32767.0f);
+  const int y = (int)(n[1]*32767.0f);
+
+  const uint32_t sign = (n[2] >= 0) ? 0 : 1;
+  const uint32_t sx   = ((uint32_t)(x & 0xfffe) | sign);
+  const uint32_t sy   = ((uint32_t)(y & 0xffff) << 16);
+
+  return (sx | sy);
+}
+
+// GenSamples.comp fetches the coarsest mip level, so average colour of the texture is used here
+static LiteMath::float3 AverageTextureColor(const std::string &a_path)
+{
+  ImageFileInfo info = getImageInfo(a_path);
+  if (!info.is_ok || info.bytesPerChannel != 1)
+    return LiteMath::float3(1.0f);
+  auto data = loadImageLDR(info);
+  const size_t pixels = size_t(info.width) * info.height;
+  if (pixels == 0 || data.size() < pixels * 4)
+    return LiteMath::float3(1.0f);
+  LiteMath::float3 sum(0.0f);
+  for (size_t i = 0; i < pixels; ++i)
+    sum += LiteMath::float3(data[i * 4 + 0], data[i * 4 + 1], data[i * 4 + 2]);
+  sum /= float(pixels) * 255.0f;
+  return LiteMath::float3(std::pow(sum.x, 2.2f), std::pow(sum.y, 2.2f), std::pow(sum.z, 2.2f));
+}
+
+static bool LoadScene(const std::string &a_path, RadiosityScene &a_scene, ISceneObject *a_pAccelStruct, LiteMath::Box4f &a_bbox)
+{
+  hydra_xml::HydraScene scene;
+  if (scene.LoadState(a_path) < 0)
+    return false;
+
+  for (auto loc : scene.MeshFiles())
+  {
+    auto mesh = cmesh::LoadMeshFromVSGF(loc.c_str());
+    if (mesh.VerticesNum() == 0)
+    {
+      std::cout << "can't load mesh at " << loc << std::endl;
+      return false;
+    }
+
+    const uint32_t meshId = uint32_t(a_scene.meshInfos.size());
+    a_scene.meshInfos.emplace_back(uint32_t(a_scene.indices.size()), uint32_t(a_scene.vertices.size() / 2));
+    std::vector<LiteMath::float4> positions(mesh.VerticesNum());
+    for (size_t v = 0; v < mesh.VerticesNum(); ++v)
+    {
+      positions[v] = LiteMath::float4(mesh.vPos4f[v * 4 + 0], mesh.vPos4f[v * 4 + 1], mesh.vPos4f[v * 4 + 2], 1.0f);
+      const float normal[3] = {mesh.vNorm4f[v * 4 + 0], mesh.vNorm4f[v * 4 + 1], mesh.vNorm4f[v * 4 + 2]};
+      a_scene.vertices.push_back(positions[v]);
+      a_scene.vertices.back().w = LiteMath::as_float(int(EncodeNormal(normal)));
+      a_scene.vertices.push_back(LiteMath::float4(0.0f));
+    }
+    a_scene.indices.insert(a_scene.indices.end(), mesh.indices.begin(), mesh.indices.end());
+    a_scene.materialIds.insert(a_scene.materialIds.end(), mesh.matIndices.begin(), mesh.matIndices.end());
+
+    const uint32_t geomId = a_pAccelStruct->AddGeom_Triangles4f(positions.data(), positions.size(), mesh.indices.data(), mesh.indices.size());
+    assert(geomId == meshId);
+    for (const auto &matrix : scene.GetAllInstancesOfMeshLoc(loc))
+    {
+      a_pAccelStruct->AddInstance(geomId, matrix);
+      a_scene.instanceMatrices.push_back(matrix);
+      for (const auto &p : positions)
+        a_bbox.include(matrix * p);
+    }
+  }
+
+  for (auto gltfMat : scene.MaterialsGLTF())
+  {
+    MaterialData_pbrMR mat = {};
+    mat.baseColor      = LiteMath::float4(gltfMat.metRoughnessData.baseColor);
+    mat.emissionColor  = LiteMath::float3(gltfMat.emissionColor);
+    mat.baseColorTexId = gltfMat.metRoughnessData.baseColorTexId;
+    a_scene.materials.push_back(mat);
+  }
+
+  for (auto tex : scene.TextureFiles())
+    a_scene.textureColors.push_back(AverageTextureColor(tex));
+
+  a_pAccelStruct->CommitScene();
+  return true;
+}
+
+// relative L1 error of the patch lighting against a reference of the same layout
+static double RelativeError(const std::vector<LiteMath::float4> &a_result, const std::vector<LiteMath::float4> &a_reference)
+{
+  double errorSum = 0.0, referenceSum = 0.0;
+  for (size_t i = 0; i < a_reference.size(); ++i)
+  {
+    errorSum += length(to_float3(a_result[i] - a_reference[i]));
+    referenceSum += length(to_float3(a_reference[i]));
+  }
+  return referenceSum > 0 ? errorSum / referenceSum : 0.0;
+}
+
+// prints the value of a checked quantity against its tolerance, the tool exits with an error when a check fails
+static bool Check(const char *a_name, double a_value, double a_tolerance)
+{
+  const bool passed = a_value <= a_tolerance;
+  std::cout << "Check " << a_name << ": " << a_value << " <= " << a_tolerance << (passed ? " passed" : " FAILED") << std::endl;
+  return passed;
+}
+
+// bounce with the compact FF encodings against the fp32 FF, a_radiosity must have run the flat pipeline.
+// The value error is checked against the rounding step of the encoding over the values it represents without underflow,
+// the smaller ones only count in the bounce error
+static bool CompareCompactFF(RadiosityCPU &a_radiosity)
+{
+  const int RUNS = 10;
+  const double BOUNCE_TOLERANCE = 1e-3;
+  const std::vector<LiteMath::float4> reference = a_radiosity.ReflLight();
+  const auto &ff = a_radiosity.FF();
+  const size_t offsetsBytes = a_radiosity.FFRowOffsets().size() * sizeof(uint32_t);
+
+  float referenceMs = 0.0f;
+  for (int run = 0; run < RUNS; ++run)
+  {
+    a_radiosity.ReflLighting();
+    referenceMs += a_radiosity.ReflLightingMs() / RUNS;
+  }
+  std::cout << "fp32 FF: " << (ff.size() * sizeof(RadiosityCPU::FFValue) + offsetsBytes) / (1024.0 * 1024.0) << " MB, bounce "
+    << referenceMs << " ms" << std::endl;
+
+  const char *names[] = {"fp16", "log"};
+  // smallest normal half float and the lower end of the log range, half of the rounding step relative to the value
+  const double minValues[] = {std::ldexp(1.0, -14), std::exp2(FF_LOG_MAX - 65535.0 / FF_LOG_SCALE)};
+  const double valueTolerances[] = {std::ldexp(1.0, -11), std::exp2(0.5 / FF_LOG_SCALE) - 1.0};
+  bool passed = true;
+  for (uint32_t encoding : {FF_ENCODING_FP16, FF_ENCODING_LOG})
+  {
+    a_radiosity.CompactFF(encoding);
+    float ms = 0.0f;
+    for (int run = 0; run < RUNS; ++run)
+    {
+      a_radiosity.ReflLightingCompact();
+      ms += a_radiosity.ReflLightingMs() / RUNS;
+    }
+
+    double maxValueError = 0.0;
+    size_t underflows = 0;
+    for (size_t i = 0; i < ff.size(); ++i)
+    {
+      const double value = FFDecodeValue(a_radiosity.FFCompact()[i], encoding);
+      if (ff[i].value < minValues[encoding])
+        underflows++;
+      else
+        maxValueError = std::max(maxValueError, std::abs(value - ff[i].value) / ff[i].value);
+    }
+    const double error = RelativeError(a_radiosity.ReflLight(), reference);
+    const size_t bytes = a_radiosity.FFCompact().size() * sizeof(uint32_t) + a_radiosity.FFCompactRowOffsets().size() * sizeof(uint32_t);
+    std::cout << names[encoding] << " FF: " << bytes / (1024.0 * 1024.0) << " MB, bounce " << ms << " ms ("
+      << (ms > 0 ? referenceMs / ms : 0.0f) << "x), " << underflows << " values below " << minValues[encoding] << std::endl;
+    passed = Check((std::string(names[encoding]) + " FF value relative error").c_str(), maxValueError, valueTolerances[encoding] * 1.01) && passed;
+    passed = Check((std::string(names[encoding]) + " FF bounce relative error").c_str(), error, BOUNCE_TOLERANCE) && passed;
+  }
+  // leave the fp32 result in place
+  a_radiosity.ReflLighting();
+  return passed;
+}
+
+// iterations needed by every solver mode to reach the tolerance and the difference from the Jacobi solution.
+// The residual of R = F (E + A R) is recomputed from the full FF, independently of the stopping criterion of Solve
+static bool CompareSolvers(RadiosityCPU &a_radiosity, const LiteMath::float3 &a_lightPos)
+{
+  const uint32_t MAX_ITERATIONS = 1000;
+  const float TOLERANCE = 1e-4f;
+  const double RESIDUAL_TOLERANCE = 1e-3;
+  const double DIFFERENCE_TOLERANCE = 1e-3;
+  const char *names[SOLVER_MODES_COUNT] = {"Jacobi", "Gauss-Seidel", "Southwell"};
+  a_radiosity.InitLighting(a_lightPos, false);
+  const auto &offsets = a_radiosity.FFRowOffsets();
+  const auto &ff = a_radiosity.FF();
+  const auto &emission = a_radiosity.InitLight();
+  const auto &albedo = a_radiosity.PatchAlbedo();
+  std::vector<LiteMath::float4> reference;
+  bool passed = true;
+  for (uint32_t mode = 0; mode < SOLVER_MODES_COUNT; ++mode)
+  {
+    const uint32_t iterations = a_radiosity.Solve(mode, MAX_ITERATIONS, TOLERANCE);
+    const auto &reflLight = a_radiosity.ReflLight();
+    if (mode == SOLVER_JACOBI)
+      reference = reflLight;
+    std::vector<LiteMath::float4> gathered(reflLight.size(), LiteMath::float4(0.0f));
+    for (size_t row = 0; row + 1 < offsets.size(); ++row)
+      for (uint32_t i = offsets[row]; i < offsets[row + 1]; ++i)
+        gathered[row] += ff[i].value * (emission[ff[i].idx] + albedo[ff[i].idx] * reflLight[ff[i].idx]);
+    const double residual = RelativeError(gathered, reflLight);
+    std::cout << names[mode] << ": " << iterations << " iterations, " << a_radiosity.SolveMs() << " ms, stopping residual "
+      << a_radiosity.SolverResidual() << std::endl;
+    passed = Check((std::string(names[mode]) + " iterations").c_str(), iterations, MAX_ITERATIONS - 1) && passed;
+    passed = Check((std::string(names[mode]) + " relative residual").c_str(), residual, RESIDUAL_TOLERANCE) && passed;
+    if (mode != SOLVER_JACOBI)
+      passed = Check((std::string(names[mode]) + " relative difference from Jacobi").c_str(), RelativeError(reflLight, reference),
+        DIFFERENCE_TOLERANCE) && passed;
+  }
+  // leave the single bounce in place, it is the reference of the other comparisons
+  a_radiosity.ReflLighting();
+  return passed;
+}
+
+// FF with the voxel DDA visibility for several near field distances against the ray traced FF, a_radiosity must have
+// run the flat pipeline with rays. The last near field covers the whole grid, so every pair traces rays and the result
+// has to match the reference. The others can only get closer to it as the near field grows, the pure DDA is bounded
+// loosely since it sees the occupancy at the voxel resolution. The last DDA result is left in place
+static bool CompareVisibility(RadiosityCPU &a_radiosity, const LiteMath::float3 &a_lightPos)
+{
+  const double DDA_ROW_SUM_TOLERANCE = 0.25;
+  const double DDA_BOUNCE_TOLERANCE  = 0.5;
+  const double MONOTONY_SLACK        = 1e-3; // the sample noise of two close near fields
+  const double EXACT_TOLERANCE       = 1e-6;
+  const std::vector<LiteMath::float4> reference = a_radiosity.ReflLight();
+  const float referenceMs = a_radiosity.ComputeFFMs();
+  // a row sum is the part of the light leaving a cluster that reaches the others, occlusion errors show up in it
+  const auto rowSums = [](const RadiosityCPU &a_result) {
+    const auto &offsets = a_result.FFRowOffsets();
+    std::vector<double> sums(offsets.size() - 1, 0.0);
+    for (size_t row = 0; row + 1 < offsets.size(); ++row)
+      for (uint32_t i = offsets[row]; i < offsets[row + 1]; ++i)
+        sums[row] += a_result.FF()[i].value;
+    return sums;
+  };
+  const std::vector<double> referenceSums = rowSums(a_radiosity);
+  std::cout << "Ray visibility: ComputeFF " << referenceMs << " ms, FF count " << a_radiosity.FF().size() << std::endl;
+
+  const LiteMath::uint3 grid = a_radiosity.VoxelsGrid();
+  const uint32_t wholeGrid = uint32_t(std::ceil(std::sqrt(double(grid.x * grid.x + grid.y * grid.y + grid.z * grid.z)))) + 1;
+  bool passed = true;
+  double previousError = 0.0;
+  for (uint32_t nearField : {0u, 1u, 2u, 4u, wholeGrid})
+  {
+    a_radiosity.SetVisibility(FF_VISIBILITY_DDA, nearField);
+    a_radiosity.ComputeFF();
+    a_radiosity.InitLighting(a_lightPos, false);
+    a_radiosity.ReflLighting();
+
+    const std::vector<double> sums = rowSums(a_radiosity);
+    double sumError = 0.0, sumReference = 0.0;
+    for (size_t i = 0; i < sums.size(); ++i)
+    {
+      sumError += std::abs(sums[i] - referenceSums[i]);
+      sumReference += referenceSums[i];
+    }
+    const double rowSumError = sumReference > 0 ? sumError / sumReference : 0.0;
+    const double error = RelativeError(a_radiosity.ReflLight(), reference);
+    const float ms = a_radiosity.ComputeFFMs();
+    std::cout << "Voxel DDA beyond " << nearField << " voxels: ComputeFF " << ms << " ms (" << (ms > 0 ? referenceMs / ms : 0.0f)
+      << "x), FF count " << a_radiosity.FF().size() << ", row sum relative error " << rowSumError
+      << ", bounce relative error " << error << std::endl;
+
+    const std::string name = "voxel DDA beyond " + std::to_string(nearField) + " voxels";
+    if (nearField == 0)
+    {
+      passed = Check((name + " row sum relative error").c_str(), rowSumError, DDA_ROW_SUM_TOLERANCE) && passed;
+      passed = Check((name + " bounce relative error").c_str(), error, DDA_BOUNCE_TOLERANCE) && passed;
+    }
+    else
+      passed = Check((name + " bounce relative error growth").c_str(), error - previousError, MONOTONY_SLACK) && passed;
+    if (nearField == wholeGrid)
+      passed = Check((name + " bounce relative error").c_str(), error, EXACT_TOLERANCE) && passed;
+    previousError = error;
+  }
+  return passed;
+}
+
+// hierarchical gather against the flat FF of a_radiosity. The flat FF couples the voxel pairs it has entries for, a link
+// couples two nodes, so the hierarchy has to get by with fewer links than there are flat voxel pairs
+static bool CompareHierarchy(const RadiosityCPU &a_radiosity, const RadiosityHierarchy &a_hierarchy,
+  const std::vector<LiteMath::float4> &a_reflLight)
+{
+  const auto &offsets = a_radiosity.FFRowOffsets();
+  const auto &ff = a_radiosity.FF();
+  // the 6 rows of a voxel reach the clusters of the same source voxels, every pair is counted once
+  size_t flatPairs = 0;
+  std::vector<uint32_t> sources;
+  for (size_t voxel = 0; voxel * 6 + 6 < offsets.size(); ++voxel)
+  {
+    sources.clear();
+    for (uint32_t i = offsets[voxel * 6]; i < offsets[voxel * 6 + 6]; ++i)
+      sources.push_back(ff[i].idx / 6);
+    std::sort(sources.begin(), sources.end());
+    flatPairs += size_t(std::unique(sources.begin(), sources.end()) - sources.begin());
+  }
+  const double flatMB = (ff.size() * sizeof(RadiosityCPU::FFValue) + offsets.size() * sizeof(uint32_t)) / (1024.0 * 1024.0);
+  const double linksRatio = double(a_hierarchy.LinksCount()) / double(std::max<size_t>(flatPairs, 1));
+  const double error = RelativeError(a_reflLight, a_radiosity.ReflLight());
+  std::cout << "Flat FF: " << flatPairs << " voxel pairs, " << ff.size() << " entries, " << flatMB << " MB" << std::endl;
+  std::cout << "Hierarchy: " << a_hierarchy.LinksCount() << " links (" << linksRatio << " of the flat pairs), "
+    << a_hierarchy.MemoryBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+  bool passed = Check("hierarchy links per flat voxel pair", linksRatio, 1.0);
+  passed = Check("hierarchy bounce relative error", error, 0.05) && passed;
+  return passed;
+}
+
+int main(int argc, const char **argv)
+{
+  std::string scenePath = "../../resources/scenes/03_classic_scenes/02_cry_sponza/statex_00001.xml";
+  float voxelSize = 2.5f;
+  float oracleEps = 0.0f;   // > 0 enables hierarchical radiosity
+  bool flat = true;
+  bool compact = false;     // compare the compact FF encodings with the fp32 FF
+  bool solve = false;       // compare the multi-bounce solver modes
+  bool dda = false;         // compare the voxel DDA visibility with the ray traced one
+  if (argc > 1)
+    scenePath = argv[1];
+  if (argc > 2)
+    voxelSize = float(std::atof(argv[2]));
+  if (argc > 3)
+    oracleEps = float(std::atof(argv[3]));
+  // with hierarchical radiosity the full FF matrix is computed only on request, to compare the results
+  bool flatRequested = false;
+  for (int i = 4; i < argc; ++i)
+  {
+    flatRequested = flatRequested || std::string(argv[i]) == "flat";
+    compact = compact || std::string(argv[i]) == "compact";
+    solve = solve || std::string(argv[i]) == "solve";
+    dda = dda || std::string(argv[i]) == "dda";
+  }
+  if (oracleEps > 0.0f)
+    flat = flatRequested || compact || solve || dda;
+
+  const uint32_t PER_SURFACE_POINTS = 42;
+  // the comparisons check their results against tolerances, a failed check makes the exit code nonzero
+  bool passed = true;
+
+  std::shared_ptr<ISceneObject> pAccelStruct(CreateSceneRT("embree"), [](ISceneObject *p) { DeleteSceneRT(p); });
+  pAccelStruct->ClearGeom();
+  auto pScene = std::make_shared<RadiosityScene>();
+  LiteMath::Box4f bbox;
+  if (!LoadScene(scenePath, *pScene, pAccelStruct.get(), bbox))
+  {
+    std::cout << "Can't load scene " << scenePath << std::endl;
+    return 1;
+  }
+  bbox.boxMin -= 1e-3f + voxelSize * 0.5f;
+  bbox.boxMax += 1e-3f + voxelSize * 0.5f;
+
+  RadiosityCPU radiosity(PER_SURFACE_POINTS);
+  radiosity.SetScene(pAccelStruct, pScene);
+  radiosity.SetGrid(to_float3(bbox.boxMin), to_float3(bbox.boxMax), voxelSize);
+  const LiteMath::float3 lightPos(0.0f, 36.0f, 4.9f);
+  if (flat)
+  {
+    radiosity.Run(lightPos);
+    radiosity.PrintStats();
+    if (compact)
+      passed = CompareCompactFF(radiosity) && passed;
+    if (solve)
+      passed = CompareSolvers(radiosity, lightPos) && passed;
+  }
+  else
+  {
+    radiosity.GenSamples();
+    radiosity.InitLighting(lightPos, false);
+  }
+
+  if (oracleEps > 0.0f)
+  {
+    RadiosityHierarchy::Settings settings;
+    settings.oracleEps = oracleEps;
+    RadiosityHierarchy hierarchy(pAccelStruct, settings);
+    hierarchy.Build(radiosity);
+    std::vector<LiteMath::float4> reflLight;
+    hierarchy.Gather(radiosity.InitLight(), reflLight);
+    hierarchy.PrintStats();
+
+    if (flat)
+      passed = CompareHierarchy(radiosity, hierarchy, reflLight) && passed;
+  }
+
+  // replaces the ray traced FF, so it goes after the comparisons that use it as the reference
+  if (dda)
+    passed = CompareVisibility(radiosity, lightPos) && passed;
+
+  return passed ? 0 : 1;
+}
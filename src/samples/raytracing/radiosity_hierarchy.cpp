@@ -0,0 +1,359 @@
+#include "radiosity_hierarchy.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <unordered_map>
+
+using LiteMath::float3;
+using LiteMath::float4;
+using LiteMath::uint2;
+using LiteMath::uint3;
+
+static float Milliseconds(std::chrono::high_resolution_clock::time_point a_start)
+{
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(end - a_start).count() / 1000.f;
+}
+
+// area of the point projected to the patch, patches 0-2 are positive axes, 3-5 are negative ones
+static float PatchWeight(const float3 &a_normal, uint32_t a_patch)
+{
+  return a_patch < 3 ? std::max(a_normal[a_patch], 0.0f) : std::max(-a_normal[a_patch - 3], 0.0f);
+}
+
+void RadiosityHierarchy::BuildTree(const RadiosityCPU &a_radiosity)
+{
+  const auto &voxelIndices = a_radiosity.VoxelIndices();
+  const auto &samplePoints = a_radiosity.SamplePoints();
+  const auto &pointCounters = a_radiosity.PointCounters();
+  const auto &primCounter = a_radiosity.PrimCounter();
+  const uint3 grid = a_radiosity.VoxelsGrid();
+  const float voxelSize = a_radiosity.VoxelSize();
+  const float3 bmin = a_radiosity.GridMin();
+  const uint32_t pointsPerVoxel = a_radiosity.PointsPerVoxel();
+
+  m_nodes.clear();
+  m_children.clear();
+  m_points.clear();
+
+  // leaves, coordinates are kept to group them into parents
+  std::vector<uint3> coords;
+  for (uint32_t visId = 0; visId < voxelIndices.size(); ++visId)
+  {
+    const uint32_t voxelId = voxelIndices[visId];
+    const uint3 coord(voxelId / grid.z / grid.y, voxelId / grid.z % grid.y, voxelId % grid.z);
+    Node node;
+    node.center = (float3(float(coord.x), float(coord.y), float(coord.z)) + 0.5f) * voxelSize + bmin;
+    node.radius = voxelSize * std::sqrt(3.0f) * 0.5f;
+    node.leafId = visId;
+    node.firstPoint = uint32_t(m_points.size());
+    const float4 *points = samplePoints.data() + size_t(voxelId) * pointsPerVoxel * 3;
+    for (uint32_t i = 0; i < pointCounters[voxelId * 4]; ++i)
+    {
+      Point point;
+      point.pos = to_float3(points[i * 3]);
+      point.normal = to_float3(points[i * 3 + 1]);
+      point.area = points[i * 3 + 1].w / std::max(primCounter[uint32_t(points[i * 3].w)], 1u);
+      m_points.push_back(point);
+      node.totalArea += point.area;
+      for (uint32_t j = 0; j < 6; ++j)
+        node.patchArea[j] += PatchWeight(point.normal, j) * point.area;
+    }
+    node.pointsCount = uint32_t(m_points.size()) - node.firstPoint;
+    m_nodes.push_back(node);
+    coords.push_back(coord);
+  }
+  if (m_nodes.empty())
+    return;
+
+  // group nodes of the same octant level by level until a single root is left
+  uint32_t levelBegin = 0;
+  uint32_t levelEnd = uint32_t(m_nodes.size());
+  uint32_t level = 0;
+  while (levelEnd - levelBegin > 1)
+  {
+    ++level;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> groups;
+    std::vector<uint64_t> order;
+    for (uint32_t nodeId = levelBegin; nodeId < levelEnd; ++nodeId)
+    {
+      const uint3 c = uint3(coords[nodeId].x >> 1, coords[nodeId].y >> 1, coords[nodeId].z >> 1);
+      const uint64_t key = (uint64_t(c.x) << 42) | (uint64_t(c.y) << 21) | uint64_t(c.z);
+      auto &group = groups[key];
+      if (group.empty())
+        order.push_back(key);
+      group.push_back(nodeId);
+    }
+    for (uint64_t key : order)
+    {
+      const auto &group = groups[key];
+      Node node;
+      node.level = level;
+      node.firstChild = uint32_t(m_children.size());
+      node.childCount = uint32_t(group.size());
+      float3 boxMin(1e30f), boxMax(-1e30f);
+      for (uint32_t child : group)
+      {
+        m_children.push_back(child);
+        m_nodes[child].parent = uint32_t(m_nodes.size());
+        boxMin = min(boxMin, m_nodes[child].center - m_nodes[child].radius);
+        boxMax = max(boxMax, m_nodes[child].center + m_nodes[child].radius);
+        node.totalArea += m_nodes[child].totalArea;
+        for (uint32_t j = 0; j < 6; ++j)
+          node.patchArea[j] += m_nodes[child].patchArea[j];
+      }
+      node.center = (boxMin + boxMax) * 0.5f;
+      node.radius = length(boxMax - boxMin) * 0.5f;
+
+      // inner nodes keep a subset of the points of their children
+      std::vector<Point> points;
+      for (uint32_t child : group)
+      {
+        std::vector<Point> childPoints;
+        SelectPoints(m_nodes[child], m_settings.nodePoints, childPoints);
+        points.insert(points.end(), childPoints.begin(), childPoints.end());
+      }
+      node.firstPoint = uint32_t(m_points.size());
+      const uint32_t count = std::min(uint32_t(points.size()), m_settings.nodePoints);
+      for (uint32_t i = 0; i < count; ++i)
+        m_points.push_back(points[size_t(i) * points.size() / count]);
+      node.pointsCount = count;
+
+      m_nodes.push_back(node);
+      coords.push_back(uint3(uint32_t(key >> 42), uint32_t(key >> 21) & 0x1FFFFF, uint32_t(key) & 0x1FFFFF));
+    }
+    levelBegin = levelEnd;
+    levelEnd = uint32_t(m_nodes.size());
+  }
+}
+
+void RadiosityHierarchy::SelectPoints(const Node &a_node, uint32_t a_count, std::vector<Point> &a_out) const
+{
+  a_out.clear();
+  const uint32_t count = std::min(a_count, a_node.pointsCount);
+  for (uint32_t i = 0; i < count; ++i)
+    a_out.push_back(m_points[a_node.firstPoint + size_t(i) * a_node.pointsCount / count]);
+}
+
+float RadiosityHierarchy::Estimate(const Node &a_receiver, const Node &a_source) const
+{
+  // unoccluded form factor upper bound of a disk seen from the closest point of the receiver bounding sphere
+  const float dist = length(a_receiver.center - a_source.center) - a_receiver.radius - a_source.radius;
+  if (dist <= 0.0f)
+    return 1.0f;
+  return std::min(a_source.totalArea / (3.1415926535897932f * dist * dist), 1.0f);
+}
+
+void RadiosityHierarchy::Refine(uint32_t a_receiver, uint32_t a_source, std::vector<uint2> &a_pairs) const
+{
+  const Node &receiver = m_nodes[a_receiver];
+  const Node &source = m_nodes[a_source];
+  const bool receiverLeaf = receiver.childCount == 0;
+  const bool sourceLeaf = source.childCount == 0;
+  if (receiverLeaf && sourceLeaf)
+  {
+    a_pairs.push_back(uint2(a_receiver, a_source));
+    return;
+  }
+  if (a_receiver != a_source && std::max(Estimate(receiver, source), Estimate(source, receiver)) < m_settings.oracleEps)
+  {
+    a_pairs.push_back(uint2(a_receiver, a_source));
+    return;
+  }
+
+  if (a_receiver == a_source)
+  {
+    for (uint32_t i = 0; i < receiver.childCount; ++i)
+      for (uint32_t j = 0; j < receiver.childCount; ++j)
+        Refine(m_children[receiver.firstChild + i], m_children[receiver.firstChild + j], a_pairs);
+  }
+  else if (!receiverLeaf && (sourceLeaf || receiver.radius >= source.radius))
+  {
+    for (uint32_t i = 0; i < receiver.childCount; ++i)
+      Refine(m_children[receiver.firstChild + i], a_source, a_pairs);
+  }
+  else
+  {
+    for (uint32_t i = 0; i < source.childCount; ++i)
+      Refine(a_receiver, m_children[source.firstChild + i], a_pairs);
+  }
+}
+
+void RadiosityHierarchy::ComputeLink(uint32_t a_receiver, uint32_t a_source, Link &a_link) const
+{
+  // same estimator as ComputeFF.comp on the subsets of the node points
+  std::vector<Point> receiverPoints, sourcePoints;
+  const Node &receiver = m_nodes[a_receiver];
+  const Node &source = m_nodes[a_source];
+  const bool leaves = receiver.childCount == 0 && source.childCount == 0;
+  SelectPoints(receiver, leaves ? receiver.pointsCount : m_settings.linkPoints, receiverPoints);
+  SelectPoints(source, leaves ? source.pointsCount : m_settings.linkPoints, sourcePoints);
+
+  float sourceArea = 0;
+  for (const auto &point : sourcePoints)
+    sourceArea += point.area;
+  const float sourceScale = sourceArea > 0 ? source.totalArea / sourceArea : 0.0f;
+
+  const float geomMult = 1.0f / 3.1415926535897932f;
+  std::array<float, 6> receiverArea = {};
+  a_link.source = a_source;
+  a_link.ff.fill(0.0f);
+  for (size_t r = 0; r < receiverPoints.size(); ++r)
+  {
+    const Point &p = receiverPoints[r];
+    std::array<float, 6> row = {};
+    for (size_t s = 0; s < sourcePoints.size(); ++s)
+    {
+      if (a_receiver == a_source && r == s)
+        continue;
+      const Point &q = sourcePoints[s];
+      float3 dir = q.pos - p.pos;
+      const float len = length(dir);
+      if (len < 1e-5f)
+        continue;
+      dir /= len;
+      const float cosTheta = dot(dir, p.normal);
+      if (cosTheta <= 0.0f)
+        continue;
+      const float cosTheta1 = -dot(dir, q.normal);
+      if (cosTheta1 <= 0.0f)
+        continue;
+      if (m_pAccelStruct->RayQuery_AnyHit(to_float4(p.pos + dir * 1e-2f, 0.0f), to_float4(dir, len - 1e-2f * 2.0f)))
+        continue;
+      const float ff = std::min(cosTheta * cosTheta1 / len / len * q.area * sourceScale * geomMult, 1.0f);
+      for (uint32_t j = 0; j < 6; ++j)
+        row[j] += ff * PatchWeight(q.normal, j);
+    }
+    // the patch weight of the receiver point goes in twice, once for the projected area and once for the
+    // direction the patch gathers from, as in ComputeFF.comp
+    for (uint32_t i = 0; i < 6; ++i)
+    {
+      const float weight = PatchWeight(p.normal, i);
+      const float area = weight * p.area;
+      receiverArea[i] += area;
+      for (uint32_t j = 0; j < 6; ++j)
+        a_link.ff[i * 6 + j] += row[j] * weight * area;
+    }
+  }
+  for (uint32_t i = 0; i < 6; ++i)
+    for (uint32_t j = 0; j < 6; ++j)
+      a_link.ff[i * 6 + j] = receiverArea[i] > 1e-5f ? a_link.ff[i * 6 + j] / receiverArea[i] : 0.0f;
+}
+
+void RadiosityHierarchy::Build(const RadiosityCPU &a_radiosity)
+{
+  assert(m_pAccelStruct != nullptr);
+  auto start = std::chrono::high_resolution_clock::now();
+  BuildTree(a_radiosity);
+  m_timings.buildTree = Milliseconds(start);
+
+  start = std::chrono::high_resolution_clock::now();
+  m_links.clear();
+  m_linkOffsets.assign(m_nodes.size() + 1, 0);
+  if (m_nodes.empty())
+    return;
+
+  const uint32_t root = uint32_t(m_nodes.size()) - 1;
+  std::vector<uint2> pairs;
+  Refine(root, root, pairs);
+  std::sort(pairs.begin(), pairs.end(), [](const uint2 &a, const uint2 &b) { return a.x < b.x || (a.x == b.x && a.y < b.y); });
+
+  m_links.resize(pairs.size());
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (int i = 0; i < int(pairs.size()); ++i)
+    ComputeLink(pairs[i].x, pairs[i].y, m_links[i]);
+
+  // pairs that do not see each other are not kept, like the zero entries of the flat FF
+  size_t linksCount = 0;
+  for (size_t i = 0; i < pairs.size(); ++i)
+  {
+    if (std::all_of(m_links[i].ff.begin(), m_links[i].ff.end(), [](float v) { return v <= 0.0f; }))
+      continue;
+    m_links[linksCount++] = m_links[i];
+    m_linkOffsets[pairs[i].x + 1]++;
+  }
+  m_links.resize(linksCount);
+  for (size_t i = 1; i < m_linkOffsets.size(); ++i)
+    m_linkOffsets[i] += m_linkOffsets[i - 1];
+  m_timings.refine = Milliseconds(start);
+}
+
+void RadiosityHierarchy::Gather(const std::vector<float4> &a_initLight, std::vector<float4> &a_reflLight) const
+{
+  auto start = std::chrono::high_resolution_clock::now();
+  const size_t nodesCount = m_nodes.size();
+
+  // pull: area weighted average of the children radiosity, per patch
+  std::vector<float4> radiosity(nodesCount * 6, float4(0.0f));
+  for (size_t nodeId = 0; nodeId < nodesCount; ++nodeId)
+  {
+    const Node &node = m_nodes[nodeId];
+    if (node.childCount == 0)
+    {
+      for (uint32_t j = 0; j < 6; ++j)
+        radiosity[nodeId * 6 + j] = a_initLight[node.leafId * 6 + j];
+      continue;
+    }
+    for (uint32_t j = 0; j < 6; ++j)
+    {
+      float4 sum(0.0f);
+      for (uint32_t c = 0; c < node.childCount; ++c)
+      {
+        const uint32_t child = m_children[node.firstChild + c];
+        sum += radiosity[child * 6 + j] * m_nodes[child].patchArea[j];
+      }
+      radiosity[nodeId * 6 + j] = node.patchArea[j] > 0 ? sum / node.patchArea[j] : float4(0.0f);
+    }
+  }
+
+  // gather over the links
+  std::vector<float4> gathered(nodesCount * 6, float4(0.0f));
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int nodeId = 0; nodeId < int(nodesCount); ++nodeId)
+  {
+    for (uint32_t l = m_linkOffsets[nodeId]; l < m_linkOffsets[nodeId + 1]; ++l)
+    {
+      const Link &link = m_links[l];
+      for (uint32_t i = 0; i < 6; ++i)
+        for (uint32_t j = 0; j < 6; ++j)
+          gathered[nodeId * 6 + i] += link.ff[i * 6 + j] * radiosity[link.source * 6 + j];
+    }
+  }
+
+  // push: irradiance gathered by a node is received by all its descendants
+  for (size_t nodeId = nodesCount; nodeId-- > 0;)
+  {
+    const Node &node = m_nodes[nodeId];
+    if (node.parent != INVALID_NODE)
+      for (uint32_t i = 0; i < 6; ++i)
+        gathered[nodeId * 6 + i] += gathered[node.parent * 6 + i];
+  }
+
+  a_reflLight.assign(a_initLight.size(), float4(0.0f));
+  for (size_t nodeId = 0; nodeId < nodesCount; ++nodeId)
+  {
+    const Node &node = m_nodes[nodeId];
+    if (node.childCount == 0)
+      for (uint32_t i = 0; i < 6; ++i)
+        a_reflLight[node.leafId * 6 + i] = gathered[nodeId * 6 + i];
+  }
+  m_timings.gather = Milliseconds(start);
+}
+
+size_t RadiosityHierarchy::MemoryBytes() const
+{
+  return m_nodes.size() * sizeof(Node) + m_children.size() * sizeof(uint32_t) + m_points.size() * sizeof(Point)
+    + m_links.size() * sizeof(Link) + m_linkOffsets.size() * sizeof(uint32_t);
+}
+
+void RadiosityHierarchy::PrintStats() const
+{
+  std::cout << "Hierarchy nodes " << m_nodes.size() << ", levels " << (m_nodes.empty() ? 0 : m_nodes.back().level + 1) << std::endl;
+  std::cout << "Hierarchy links " << m_links.size() << " (" << MemoryBytes() / (1024.0 * 1024.0) << " MB)" << std::endl;
+  std::cout << "BuildTree    " << m_timings.buildTree << " ms" << std::endl;
+  std::cout << "Refine       " << m_timings.refine << " ms" << std::endl;
+  std::cout << "Gather       " << m_timings.gather << " ms" << std::endl;
+}
@@ -0,0 +1,99 @@
+#ifndef VK_GRAPHICS_RT_RADIOSITY_HIERARCHY_H
+#define VK_GRAPHICS_RT_RADIOSITY_HIERARCHY_H
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "LiteMath.h"
+#include "render/CrossRT.h"
+#include "radiosity_cpu.h"
+
+/**
+\brief Hierarchical radiosity over the visible voxels of RadiosityCPU
+
+An octree is built over the visible voxels, every node has the same 6 directional patches as a voxel.
+Node pairs are linked at the coarsest level where the unoccluded form factor estimate is below the oracle threshold,
+so the number of links grows roughly linearly with the number of voxels instead of quadratically.
+Lighting is pulled up the tree, gathered over the links and pushed back down to the voxels.
+It is a CPU reference to measure the link count and the error against the flat FF, the GPU path keeps the flat FF.
+*/
+class RadiosityHierarchy
+{
+public:
+  struct Settings
+  {
+    float    oracleEps  = 0.05f; // refine while the form factor estimate of a pair is above this value
+    uint32_t linkPoints = 16;    // sample points per node used to compute the form factors of a link
+    uint32_t nodePoints = 64;    // sample points kept for an inner node
+  };
+
+  RadiosityHierarchy(std::shared_ptr<ISceneObject> a_pAccelStruct, const Settings &a_settings)
+    : m_pAccelStruct(a_pAccelStruct), m_settings(a_settings) {}
+
+  // a_radiosity must have samples generated
+  void Build(const RadiosityCPU &a_radiosity);
+  // same contract as RadiosityCPU::ReflLighting: a_initLight and a_reflLight have 6 values per visible voxel
+  void Gather(const std::vector<LiteMath::float4> &a_initLight, std::vector<LiteMath::float4> &a_reflLight) const;
+
+  size_t   LinksCount()  const { return m_links.size(); }
+  size_t   NodesCount()  const { return m_nodes.size(); }
+  size_t   MemoryBytes() const;
+  void     PrintStats()  const;
+
+protected:
+  static constexpr uint32_t INVALID_NODE = 0xFFFFFFFFu;
+
+  struct Point
+  {
+    LiteMath::float3 pos;
+    LiteMath::float3 normal;
+    float area;
+  };
+
+  struct Node
+  {
+    LiteMath::float3 center;
+    float            radius      = 0;
+    float            totalArea   = 0;
+    uint32_t         level       = 0;
+    uint32_t         leafId      = INVALID_NODE; // visible voxel index for the leaves
+    uint32_t         parent      = INVALID_NODE;
+    uint32_t         firstChild  = 0;
+    uint32_t         childCount  = 0;
+    uint32_t         firstPoint  = 0;
+    uint32_t         pointsCount = 0;
+    std::array<float, 6> patchArea = {};
+  };
+
+  // form factors from the 6 patches of the receiver to the 6 patches of the source, same layout as a FF row block
+  struct Link
+  {
+    uint32_t source;
+    std::array<float, 36> ff;
+  };
+
+  void BuildTree(const RadiosityCPU &a_radiosity);
+  void Refine(uint32_t a_receiver, uint32_t a_source, std::vector<LiteMath::uint2> &a_pairs) const;
+  float Estimate(const Node &a_receiver, const Node &a_source) const;
+  void ComputeLink(uint32_t a_receiver, uint32_t a_source, Link &a_link) const;
+  void SelectPoints(const Node &a_node, uint32_t a_count, std::vector<Point> &a_out) const;
+
+  std::shared_ptr<ISceneObject> m_pAccelStruct;
+  Settings m_settings;
+
+  std::vector<Node>     m_nodes;      // leaves first, parents always after their children, root is the last one
+  std::vector<uint32_t> m_children;
+  std::vector<Point>    m_points;
+  std::vector<Link>     m_links;      // sorted by receiver
+  std::vector<uint32_t> m_linkOffsets;
+
+  struct Timings
+  {
+    float buildTree = 0.0f;
+    float refine    = 0.0f;
+    mutable float gather = 0.0f;
+  } m_timings;
+};
+
+#endif// VK_GRAPHICS_RT_RADIOSITY_HIERARCHY_H
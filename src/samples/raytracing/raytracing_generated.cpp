@@ -3,6 +3,7 @@
 #include <limits>
 #include <cassert>
 #include <chrono>
+#include <algorithm>
 
 #include "vk_copy.h"
 #include "vk_context.h"
@@ -72,6 +73,24 @@ void RayTracer_Generated::UpdatePlainMembers(std::shared_ptr<vk_utils::ICopyEngi
   a_pCopyEngine->UpdateBuffer(m_classDataBuffer, 0, &m_uboData, sizeof(m_uboData));
 }
 
+void RayTracer_Generated::UpdatePlainMembersCmd(VkCommandBuffer a_commandBuffer)
+{
+  m_uboData.m_invProjView = m_invProjView;
+  m_uboData.m_camPos = m_camPos;
+  m_uboData.m_height = m_height;
+  m_uboData.m_width = m_width;
+
+  // the kernels of the earlier submissions may still read the old data
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, 0, VK_ACCESS_TRANSFER_WRITE_BIT };
+  vkCmdPipelineBarrier(a_commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+    1, &barrier, 0, nullptr, 0, nullptr);
+  vkCmdUpdateBuffer(a_commandBuffer, m_classDataBuffer, 0, sizeof(m_uboData), &m_uboData);
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(a_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+    1, &barrier, 0, nullptr, 0, nullptr);
+}
+
 
 void RayTracer_Generated::UpdateVectorMembers(std::shared_ptr<vk_utils::ICopyEngine> a_pCopyEngine)
 {
@@ -112,32 +131,44 @@ void RayTracer_Generated::CastSingleRayMegaCmd(uint32_t tidX, uint32_t tidY, uin
 }
 
 void RayTracer_Generated::GenSamplesCmd(uint32_t points_per_voxel,
-  LiteMath::float3 bmin,
-  LiteMath::float3 bmax,
-  float voxel_size,
   float time,
   LiteMath::float4x4 matrix,
-  uint32_t max_points_count)
+  uint32_t max_points_count,
+  uint32_t pass,
+  uint32_t first_brick,
+  uint32_t bricks_count,
+  bool adaptive_sampling)
 {
   uint32_t blockSizeX = 256;
 
   struct KernelArgsPC
   {
-    LiteMath::float3 bmin;
     uint32_t perFacePointsCount;
-    LiteMath::float3 bmax;
-    float voxelSize;
-  } pcData;
+    uint32_t pass;
+    uint32_t bricksCount;
+    uint32_t adaptive;
+    uint32_t instanceId;
+    uint32_t meshId;
+    uint32_t trianglesCount;
+    uint32_t cascadesCount;
+    uint32_t firstBrick;
+  } pcData = {};
 
   pcData.perFacePointsCount  = points_per_voxel;
-  pcData.bmin = bmin;
-  pcData.bmax = bmax;
-  pcData.voxelSize = voxel_size;
+  pcData.pass = pass;
+  pcData.bricksCount = bricks_count;
+  pcData.adaptive = adaptive_sampling ? 1 : 0;
+  pcData.firstBrick = first_brick;
 
   vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
 
+  // the group count is limited by 65535 per dimension, the shader flattens the 2D grid back
+  uint32_t groupsCount = (max_points_count + blockSizeX - 1) / blockSizeX;
+  uint32_t groupsX = std::min(groupsCount, 65535u);
+  uint32_t groupsY = (groupsCount + groupsX - 1) / std::max(groupsX, 1u);
+
   vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, GenSamplesPipeline);
-  vkCmdDispatch    (m_currCmdBuffer, (max_points_count + blockSizeX - 1) / blockSizeX, 1, 1);
+  vkCmdDispatch    (m_currCmdBuffer, groupsX, groupsY, 1);
 }
 
 void RayTracer_Generated::copyKernelFloatCmd(uint32_t length)
@@ -201,26 +232,78 @@ void RayTracer_Generated::CastSingleRayCmd(VkCommandBuffer a_commandBuffer, uint
   VkMemoryBarrier memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT }; 
   vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, CastSingleRayMegaLayout, 0, 1, &m_allGeneratedDS[0], 0, nullptr);
   CastSingleRayMegaCmd(tidX, tidY, out_color);
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 }
 
 void RayTracer_Generated::GenSamplesCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel,
-  LiteMath::float3 bmin,
-  LiteMath::float3 bmax,
-  float voxel_size,
   float time,
   LiteMath::float4x4 matrix,
-  uint32_t max_points_count)
+  uint32_t max_points_count,
+  uint32_t pass,
+  uint32_t first_brick,
+  uint32_t bricks_count,
+  bool adaptive_sampling)
+{
+  m_currCmdBuffer = a_commandBuffer;
+  VkMemoryBarrier memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT }; 
+  vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, GenSamplesLayout, 0, 1, &m_allGeneratedDS[1], 0, nullptr);
+  GenSamplesCmd(points_per_voxel, time, matrix, max_points_count, pass, first_brick, bricks_count, adaptive_sampling);
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
+void RayTracer_Generated::VoxelizeSamplesCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel,
+  uint32_t pass,
+  uint32_t instance_id,
+  uint32_t mesh_id,
+  uint32_t triangles_count,
+  uint32_t cascades_count,
+  uint32_t first_brick)
 {
   m_currCmdBuffer = a_commandBuffer;
   VkMemoryBarrier memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT }; 
   vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, GenSamplesLayout, 0, 1, &m_allGeneratedDS[1], 0, nullptr);
-  GenSamplesCmd(points_per_voxel, bmin, bmax, voxel_size, time, matrix, max_points_count);
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+
+  uint32_t blockSizeX = 256;
+
+  // matches the push constants of GenSamples.comp, the voxelize passes follow the ray ones
+  struct KernelArgsPC
+  {
+    uint32_t perFacePointsCount;
+    uint32_t pass;
+    uint32_t bricksCount;
+    uint32_t adaptive;
+    uint32_t instanceId;
+    uint32_t meshId;
+    uint32_t trianglesCount;
+    uint32_t cascadesCount;
+    uint32_t firstBrick;
+  } pcData = {};
+
+  pcData.perFacePointsCount = points_per_voxel;
+  pcData.pass = pass == GEN_SAMPLES_COUNT ? 3 : 4;
+  pcData.instanceId = instance_id;
+  pcData.meshId = mesh_id;
+  pcData.trianglesCount = triangles_count;
+  pcData.cascadesCount = cascades_count;
+  pcData.firstBrick = first_brick;
+
+  vkCmdPushConstants(m_currCmdBuffer, GenSamplesLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
+
+  uint32_t groupsCount = (triangles_count + blockSizeX - 1) / blockSizeX;
+  uint32_t groupsX = std::min(groupsCount, 65535u);
+  uint32_t groupsY = (groupsCount + groupsX - 1) / std::max(groupsX, 1u);
+
+  vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, GenSamplesPipeline);
+  vkCmdDispatch    (m_currCmdBuffer, groupsX, groupsY, 1);
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 }
 
 void RayTracer_Generated::ComputeFFCmd(VkCommandBuffer a_commandBuffer,
-  uint32_t points_per_voxel, uint32_t voxels_count, uint32_t ff_out)
+  uint32_t points_per_voxel, uint32_t voxels_count, uint32_t ff_out, uint32_t tmp_slot,
+  uint32_t visibility, float near_field_distance, uint32_t cascades_count, uint32_t target_first)
 {
   m_currCmdBuffer = a_commandBuffer;
   VkMemoryBarrier memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT }; 
@@ -231,56 +314,86 @@ void RayTracer_Generated::ComputeFFCmd(VkCommandBuffer a_commandBuffer,
     uint32_t perFacePointsCount;
     uint32_t voxelsCount;
     uint32_t ff_out;
+    uint32_t tmpSlot;
+    uint32_t visibility;
+    float nearFieldDistance;
+    uint32_t cascadesCount;
+    uint32_t targetFirst;
   } pcData;
 
   pcData.perFacePointsCount  = points_per_voxel;
   pcData.voxelsCount = voxels_count;
   pcData.ff_out = ff_out;
-
-  vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ComputeFFLayout, 0, 1, &m_allGeneratedDS[2], 0, nullptr);
+  pcData.tmpSlot = tmp_slot;
+  pcData.visibility = visibility;
+  pcData.nearFieldDistance = near_field_distance;
+  pcData.cascadesCount = cascades_count;
+  pcData.targetFirst = target_first;
+
+  vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ComputeFFLayout, 0, 1,
+    m_asyncScratch ? &m_asyncScratchDS[0] : &m_allGeneratedDS[2], 0, nullptr);
   vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
   vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ComputeFFPipeline);
-  vkCmdDispatch    (m_currCmdBuffer, voxels_count, 1, 1);
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+  if (target_first < voxels_count)
+    vkCmdDispatch  (m_currCmdBuffer, voxels_count - target_first, 1, 1);
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 }
 
-void RayTracer_Generated::packFFCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel, uint32_t voxels_count, uint32_t ff_out)
+void RayTracer_Generated::packFFCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel, uint32_t voxels_count, uint32_t ff_first, uint32_t ff_count,
+  uint32_t ff_capacity, uint32_t prev_voxels)
 {
   m_currCmdBuffer = a_commandBuffer;
   VkMemoryBarrier memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT }; 
   uint32_t blockSizeX = 256;
+  assert(ff_count <= FF_PACK_BATCH);
 
   struct KernelArgsPC
   {
     uint32_t clustersCount;
-    uint32_t rowIdx;
-    uint32_t rowGlobalIdx;
+    uint32_t firstRow;
+    uint32_t rowsCount;
+    uint32_t countsOffset;
+    uint32_t pass;
+    uint32_t capacity;
+    uint32_t prevRowsCount;
   } pcData;
 
-  pcData.clustersCount  = voxels_count * 6;
+  pcData.clustersCount = voxels_count * 6;
+  pcData.firstRow = ff_first * 6;
+  pcData.rowsCount = ff_count * 6;
+  pcData.countsOffset = FFRowCountsOffset(voxels_count);
+  pcData.capacity = ff_capacity;
+  pcData.prevRowsCount = prev_voxels * 6;
 
-  vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, packFFLayout, 0, 1, &m_allGeneratedDS[7], 0, nullptr);
+  vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, packFFLayout, 0, 1,
+    m_asyncScratch ? &m_asyncScratchDS[1] : &m_allGeneratedDS[7], 0, nullptr);
   vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, packFFPipeline);
-  for (uint32_t i = 0; i < 6; ++i)
+  // the old form factors of the surviving voxels go to the columns ComputeFF has skipped
+  if (ff_first < prev_voxels)
+  {
+    pcData.pass = 2;
+    vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
+    vkCmdDispatch (m_currCmdBuffer, pcData.rowsCount, 1, 1);
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+  }
+  // count non zero values of every row, then scatter them to the rows offsetted by the prefix sum of the counts
+  for (uint32_t pass = 0; pass < 2; ++pass)
   {
-    pcData.rowIdx = i;
-    pcData.rowGlobalIdx = ff_out * 6 + i;
+    pcData.pass = pass;
     vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
-    vkCmdDispatch (m_currCmdBuffer, voxels_count * 6, 1, 1);
-    VkBufferCopy region = {sizeof(uint32_t) * (ff_out * 6 + i + 1), sizeof(uint32_t) * (ff_out * 6 + i + 2), sizeof(uint32_t)};
-    vkCmdCopyBuffer(m_currCmdBuffer, ffData.ffRowsLenBuffer, ffData.ffRowsLenBuffer, 1, &region);
+    vkCmdDispatch (m_currCmdBuffer, pcData.rowsCount, 1, 1);
+    if (pass == 0 || m_kernelBarriers)
+      vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
   }
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
 }
 
 void RayTracer_Generated::initLightingCmd(VkCommandBuffer a_commandBuffer,
   uint32_t voxels_count,
-  float voxel_size,
-  LiteMath::float3 bmin,
-  LiteMath::float3 bmax,
   LiteMath::float3 light_pos,
   uint32_t per_voxels_points_count,
-  uint32_t multibounceFlag)
+  uint32_t flags,
+  float retrace_cos)
 {
   m_currCmdBuffer = a_commandBuffer;
   VkMemoryBarrier memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT }; 
@@ -288,28 +401,25 @@ void RayTracer_Generated::initLightingCmd(VkCommandBuffer a_commandBuffer,
 
   struct KernelArgsPC
   {
-    LiteMath::float3 bmin;
-    uint32_t voxelsCount;
-    LiteMath::float3 bmax;
-    float voxelSize;
     LiteMath::float3 lightPos;
+    uint32_t voxelsCount;
     uint32_t perVoxelsPointsCount;
-    uint32_t multibounceFlag;
+    uint32_t flags;
+    float retraceCos;
   } pcData;
 
   pcData.voxelsCount = voxels_count;
-  pcData.bmin = bmin;
-  pcData.bmax = bmax;
-  pcData.voxelSize = voxel_size;
   pcData.lightPos = light_pos;
   pcData.perVoxelsPointsCount = per_voxels_points_count;
-  pcData.multibounceFlag = multibounceFlag;
+  pcData.flags = flags;
+  pcData.retraceCos = retrace_cos;
 
   vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, initLightingLayout, 0, 1, &m_allGeneratedDS[3], 0, nullptr);
   vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
   vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, initLightingPipeline);
-  vkCmdDispatch    (m_currCmdBuffer, voxels_count, 1, 1);
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+  vkCmdDispatch    (m_currCmdBuffer, (voxels_count + blockSizeX - 1) / blockSizeX, 1, 1);
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 }
 
 void RayTracer_Generated::reflLightingCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count)
@@ -329,7 +439,8 @@ void RayTracer_Generated::reflLightingCmd(VkCommandBuffer a_commandBuffer, uint3
   vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
   vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, reflLightingPipeline);
   vkCmdDispatch    (m_currCmdBuffer, voxels_count * 6, 1, 1);
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 }
 
 void RayTracer_Generated::aliasLightingCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count)
@@ -356,7 +467,8 @@ void RayTracer_Generated::aliasLightingCmd(VkCommandBuffer a_commandBuffer, uint
   vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
   vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, aliasLightingPipeline);
   vkCmdDispatch    (m_currCmdBuffer, (voxels_count * 6 + blockSizeX - 1) / blockSizeX, 1, 1);
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 }
 
 void RayTracer_Generated::CorrectFFCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count)
@@ -376,7 +488,8 @@ void RayTracer_Generated::CorrectFFCmd(VkCommandBuffer a_commandBuffer, uint32_t
   vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
   vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, correctFFPipeline);
   vkCmdDispatch    (m_currCmdBuffer, voxels_count, 1, 1);
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 }
 
 void RayTracer_Generated::finalLightingCmd(VkCommandBuffer a_commandBuffer, uint32_t visible_voxels_count)
@@ -396,5 +509,84 @@ void RayTracer_Generated::finalLightingCmd(VkCommandBuffer a_commandBuffer, uint
   vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
   vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, finalLightingPipeline);
   vkCmdDispatch    (m_currCmdBuffer, (visible_voxels_count + 255) / 256, 1, 1);
-  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+  if (m_kernelBarriers)
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
+void RayTracer_Generated::resetSolverCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count, uint32_t mode)
+{
+  m_currCmdBuffer = a_commandBuffer;
+  VkMemoryBarrier toTransfer = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT };
+  VkMemoryBarrier toCompute  = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT };
+  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &toTransfer, 0, nullptr, 0, nullptr);
+  vkCmdFillBuffer(m_currCmdBuffer, solverData.statsBuffer, 0, sizeof(uint32_t) * SOLVER_STATS_COUNT, 0);
+  // Jacobi and Gauss-Seidel start from the previous solution, shooting starts from scratch with all the lighting unshot
+  if (mode == SOLVER_SOUTHWELL)
+  {
+    VkBufferCopy region = {};
+    region.size = sizeof(LiteMath::float4) * voxels_count * 6;
+    vkCmdCopyBuffer(m_currCmdBuffer, lightingData.initialLighting, solverData.unshotBuffer, 1, &region);
+    vkCmdFillBuffer(m_currCmdBuffer, lightingData.reflLighting, 0, region.size, 0);
+  }
+  vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &toCompute, 0, nullptr, 0, nullptr);
+}
+
+uint32_t RayTracer_Generated::solveRadiosityCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count, uint32_t mode,
+  uint32_t first_iteration, uint32_t iterations, float shoot_threshold)
+{
+  m_currCmdBuffer = a_commandBuffer;
+  VkMemoryBarrier memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT }; 
+  VkMemoryBarrier toTransfer = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT };
+  VkMemoryBarrier toCompute  = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT };
+  uint32_t blockSizeX = 256;
+
+  struct KernelArgsPC
+  {
+    uint32_t voxelsCount;
+    uint32_t pass;
+    uint32_t param;
+    float threshold;
+  } pcData;
+
+  pcData.voxelsCount = voxels_count;
+  pcData.threshold = shoot_threshold;
+
+  const uint32_t patchesCount = voxels_count * 6;
+  const auto dispatch = [&](uint32_t pass, uint32_t param, uint32_t groups) {
+    pcData.pass = pass;
+    pcData.param = param;
+    vkCmdPushConstants(m_currCmdBuffer, CastSingleRayMegaLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(KernelArgsPC), &pcData);
+    vkCmdDispatch    (m_currCmdBuffer, groups, 1, 1);
+    vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr); 
+  };
+
+  if (mode == SOLVER_JACOBI)
+    iterations += iterations & 1;
+  vkCmdBindDescriptorSets(a_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, solveRadiosityLayout, 0, 1,
+    m_asyncScratch ? &m_asyncScratchDS[2] : &m_allGeneratedDS[9], 0, nullptr);
+  vkCmdBindPipeline(m_currCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, solveRadiosityPipeline);
+  for (uint32_t i = 0; i < iterations; ++i)
+  {
+    const uint32_t parity = (first_iteration + i) & 1;
+    // residual and solution stats are kept for the last iteration only
+    if (i + 1 == iterations)
+    {
+      vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &toTransfer, 0, nullptr, 0, nullptr);
+      vkCmdFillBuffer(m_currCmdBuffer, solverData.statsBuffer, 0, sizeof(uint32_t) * (SOLVER_STAT_SOLUTION + 1), 0);
+      vkCmdPipelineBarrier(m_currCmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &toCompute, 0, nullptr, 0, nullptr);
+    }
+    if (mode == SOLVER_JACOBI)
+      dispatch(SOLVER_PASS_JACOBI, parity, patchesCount);
+    else if (mode == SOLVER_GAUSS_SEIDEL)
+    {
+      dispatch(SOLVER_PASS_GS, 0, patchesCount);
+      dispatch(SOLVER_PASS_GS, 1, patchesCount);
+    }
+    else
+    {
+      dispatch(SOLVER_PASS_SELECT, parity, (patchesCount + blockSizeX - 1) / blockSizeX);
+      dispatch(SOLVER_PASS_SHOOT, parity, patchesCount);
+    }
+  }
+  return iterations;
 }
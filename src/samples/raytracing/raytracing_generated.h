@@ -16,6 +16,8 @@
 #include "raytracing.h"
 
 #include "include/RayTracer_ubo.h"
+#include "../../../resources/shaders/ff_compact.h"
+#include "../../../resources/shaders/radiosity_solver.h"
 
 class RayTracer_Generated : public RayTracer
 {
@@ -25,23 +27,25 @@ public:
   virtual void InitVulkanObjects(VkDevice a_device, VkPhysicalDevice a_physicalDevice, size_t a_maxThreadsCount);
   virtual void SetVulkanContext(vk_utils::VulkanContext a_ctx) { m_ctx = a_ctx; }
 
+  // the kernel stores the colors to a storage image that has to be in the general layout while it runs
   virtual void SetVulkanInOutFor_CastSingleRay(
-    VkBuffer out_colorBuffer,
-    size_t   out_colorOffset,
+    VkImageView out_colorView,
     uint32_t dummyArgument = 0)
   {
-    CastSingleRay_local.out_colorBuffer = out_colorBuffer;
-    CastSingleRay_local.out_colorOffset = out_colorOffset;
+    CastSingleRay_local.out_colorView = out_colorView;
     InitAllGeneratedDescriptorSets_CastSingleRay();
   }
 
   virtual void SetVulkanInOutForGenSamples(
     VkBuffer points,
     VkBuffer indirect_buffer,
-    VkBuffer out_points,
+    VkBuffer sample_positions,
+    VkBuffer sample_normals,
+    VkBuffer sample_materials,
     VkBuffer vertex_buffer,
     VkBuffer index_buffer,
     VkBuffer matrices_buffer,
+    VkBuffer inst_derived_buffer,
     VkBuffer inst_info_buffer,
     VkBuffer prim_counter_buffer,
     VkBuffer ff_clustered_buffer,
@@ -56,21 +60,35 @@ public:
     VkBuffer ff_tmp_row_buffer,
     VkBuffer materials_buffer,
     VkBuffer material_ids_buffer,
+    VkBuffer solver_tmp_buffer,
+    VkBuffer solver_unshot_buffer,
+    VkBuffer solver_stats_buffer,
+    VkBuffer light_cache_buffer,
+    VkBuffer patch_albedo_buffer,
+    VkBuffer brick_cells_buffer,
+    VkBuffer sampling_stats_buffer,
+    VkBuffer grid_cascades_buffer,
+    VkBuffer brick_table_buffer,
+    VkBuffer occupancy_buffer,
     std::vector<VkImageView> image_views,
     std::vector<VkSampler> samplers)
   {
     genSamplesData.indirectBuffer = indirect_buffer;
     genSamplesData.inPointsBuffer = points;
-    genSamplesData.outPointsBuffer = out_points;
+    genSamplesData.samplePositions = sample_positions;
+    genSamplesData.sampleNormals = sample_normals;
+    genSamplesData.sampleMaterials = sample_materials;
     genSamplesData.vertexBuffer = vertex_buffer;
     genSamplesData.indexBuffer = index_buffer;
     genSamplesData.matricesBuffer = matrices_buffer;
+    genSamplesData.instDerivedBuffer = inst_derived_buffer;
     genSamplesData.instInfoBuffer = inst_info_buffer;
     genSamplesData.primCounterBuffer = prim_counter_buffer;
     genSamplesData.debugBuffer = debug_buffer;
     genSamplesData.debugIndirBuffer = debug_indir_buffer;
     genSamplesData.materialsBuffer = materials_buffer;
     genSamplesData.materialIdsBuffer = material_ids_buffer;
+    genSamplesData.samplingStatsBuffer = sampling_stats_buffer;
     genSamplesData.imageViews = std::move(image_views);
     genSamplesData.samplers = std::move(samplers);
     ffData.clusteredBuffer = ff_clustered_buffer;
@@ -81,6 +99,15 @@ public:
     lightingData.finalLighting = final_lighting_buffer;
     voxelsData.voxelsIndices = voxel_indices;
     voxelsData.voxelsIndicesIndir = voxel_indices_indir;
+    solverData.tmpBuffer = solver_tmp_buffer;
+    solverData.unshotBuffer = solver_unshot_buffer;
+    solverData.statsBuffer = solver_stats_buffer;
+    lightingData.lightCache = light_cache_buffer;
+    lightingData.patchAlbedo = patch_albedo_buffer;
+    voxelsData.brickCells = brick_cells_buffer;
+    voxelsData.gridCascades = grid_cascades_buffer;
+    voxelsData.brickTable = brick_table_buffer;
+    voxelsData.occupancy = occupancy_buffer;
     InitAllGeneratedDescriptorSets_GenSamples();
     InitAllGeneratedDescriptorSets_ComputeFF();
     InitAllGeneratedDescriptorSets_packFF();
@@ -89,6 +116,8 @@ public:
     InitAllGeneratedDescriptorSets_AliasLighting();
     InitAllGeneratedDescriptorSets_CorrectFF();
     InitAllGeneratedDescriptorSets_FinalLighting();
+    InitAllGeneratedDescriptorSets_SolveRadiosity();
+    InitAllGeneratedDescriptorSets_AsyncScratch();
   }
 
   virtual ~RayTracer_Generated();
@@ -105,44 +134,112 @@ public:
   
   
   virtual void UpdatePlainMembers(std::shared_ptr<vk_utils::ICopyEngine> a_pCopyEngine);
+  // records the update of the class data into a frame's command buffer instead of a blocking copy
+  virtual void UpdatePlainMembersCmd(VkCommandBuffer a_commandBuffer);
   virtual void UpdateVectorMembers(std::shared_ptr<vk_utils::ICopyEngine> a_pCopyEngine);
   virtual void UpdateTextureMembers(std::shared_ptr<vk_utils::ICopyEngine> a_pCopyEngine);
+
+  // the kernels end with a compute to compute barrier unless the caller derives the barriers between them,
+  // the barriers between the dispatches of one kernel are kept
+  void SetKernelBarriers(bool a_enable) { m_kernelBarriers = a_enable; }
+  // ComputeFF, packFF and solveRadiosity recorded for the async queue bind copies of their descriptor sets with scratch
+  // buffers of its own, so the scratch of the async batches doesn't share memory with the scratch of the frames.
+  // The copies are written by SetVulkanInOutForGenSamples
+  void SetAsyncScratch(VkBuffer ff_tmp_row_buffer, VkBuffer solver_tmp_buffer)
+  {
+    asyncScratchData.ffTmpRowBuffer = ff_tmp_row_buffer;
+    asyncScratchData.solverTmpBuffer = solver_tmp_buffer;
+  }
+  void UseAsyncScratch(bool a_enable) { m_asyncScratch = a_enable; }
+  // the form factors of the voxels that survived a clipmap scroll, in the compact format of the FF renumbered to the
+  // new visible voxels; the descriptors are written by SetVulkanInOutForGenSamples
+  void SetPrevFF(VkBuffer prev_ff_buffer, VkBuffer prev_ff_rows_len_buffer)
+  {
+    ffData.prevClusteredBuffer = prev_ff_buffer;
+    ffData.prevRowsLenBuffer = prev_ff_rows_len_buffer;
+  }
   
   virtual void CastSingleRayCmd(VkCommandBuffer a_commandBuffer, uint32_t tidX, uint32_t tidY, uint32_t* out_color);
+  // GEN_SAMPLES_COUNT counts the points of every voxel, GEN_SAMPLES_WRITE writes them at the offsets stored in indirect_buffer,
+  // max_points_count threads cover the voxels of bricks_count bricks of brick_map.h from first_brick on, the voxels are
+  // placed by their cascades.
+  // GEN_SAMPLES_PROBE gathers the statistics of adaptive_sampling.h, with adaptive_sampling the other passes
+  // shoot only the points per face chosen from them
+  constexpr static uint32_t GEN_SAMPLES_COUNT = 0;
+  constexpr static uint32_t GEN_SAMPLES_WRITE = 1;
+  constexpr static uint32_t GEN_SAMPLES_PROBE = 2;
   virtual void GenSamplesCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel,
-    LiteMath::float3 bmin,
-    LiteMath::float3 bmax,
-    float voxel_size,
     float time,
     LiteMath::float4x4 matrix,
-    uint32_t max_points_count);
+    uint32_t max_points_count,
+    uint32_t pass,
+    uint32_t first_brick,
+    uint32_t bricks_count,
+    bool adaptive_sampling);
+  // the voxelizer writes the same points as GenSamplesCmd without rays: every thread clips a triangle of the instance
+  // by the voxels of all cascades_count grids and places the points on the clipped pieces.
+  // GEN_SAMPLES_COUNT and GEN_SAMPLES_WRITE select the pass, every instance of the scene is recorded by its own call,
+  // the pieces in the bricks before first_brick are skipped
+  virtual void VoxelizeSamplesCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel,
+    uint32_t pass,
+    uint32_t instance_id,
+    uint32_t mesh_id,
+    uint32_t triangles_count,
+    uint32_t cascades_count,
+    uint32_t first_brick);
 
   virtual void copyKernelFloatCmd(uint32_t length);
   
   virtual void CastSingleRayMegaCmd(uint32_t tidX, uint32_t tidY, uint32_t* out_color);
   void GenSamplesCmd(uint32_t points_per_voxel,
-    LiteMath::float3 bmin,
-    LiteMath::float3 bmax,
-    float voxel_size,
     float time,
     LiteMath::float4x4 matrix,
-    uint32_t max_points_count);
-
-  virtual void ComputeFFCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel, uint32_t voxels_count, uint32_t ff_out);
-  virtual void packFFCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel, uint32_t voxels_count, uint32_t ff_out);
+    uint32_t max_points_count,
+    uint32_t pass,
+    uint32_t first_brick,
+    uint32_t bricks_count,
+    bool adaptive_sampling);
+
+  // source voxels whose form factors are packed by one packFFCmd, ComputeFFCmd writes the rows of ff_out to tmp_slot
+  constexpr static uint32_t FF_PACK_BATCH = 16;
+  // per row counts of packFF are stored in the row lengths buffer after the row offsets (one per column block of a row)
+  static uint32_t FFRowCountsOffset(uint32_t voxels_count) { return voxels_count * 6 * FFColumnBlocks(voxels_count * 6) + 1; }
+  static uint32_t FFRowLensSize(uint32_t clusters_count) { return clusters_count * FFColumnBlocks(clusters_count) + 1 + FF_PACK_BATCH * 6; }
+
+  // visibility is FF_VISIBILITY_* of voxel_dda.h, with FF_VISIBILITY_DDA only the point pairs closer than near_field_distance
+  // trace rays and the others march the occupancy of the cascades_count grids. Only the columns of the target voxels from
+  // target_first on are written
+  virtual void ComputeFFCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel, uint32_t voxels_count, uint32_t ff_out, uint32_t tmp_slot,
+    uint32_t visibility, float near_field_distance, uint32_t cascades_count, uint32_t target_first);
+  // values that don't fit ff_capacity are dropped, the row offsets still tell the required size.
+  // The rows and columns of the first prev_voxels voxels start from the form factors of SetPrevFF
+  virtual void packFFCmd(VkCommandBuffer a_commandBuffer, uint32_t points_per_voxel, uint32_t voxels_count, uint32_t ff_first, uint32_t ff_count,
+    uint32_t ff_capacity, uint32_t prev_voxels);
+  // INIT_LIGHTING_USE_CACHE skips the shadow rays of the voxels that were fully lit or shadowed when the light was last
+  // traced for them and the light direction has changed by less than acos(retrace_cos) since then,
+  // INIT_LIGHTING_SHOOT_DELTA adds the change of the initial lighting to the unshot lighting of the Southwell solver,
+  // INIT_LIGHTING_ADAPTIVE normalizes by the points per face of the sampling stats instead of max_points_per_voxel
+  constexpr static uint32_t INIT_LIGHTING_MULTIBOUNCE = 1;
+  constexpr static uint32_t INIT_LIGHTING_USE_CACHE   = 2;
+  constexpr static uint32_t INIT_LIGHTING_SHOOT_DELTA = 4;
+  constexpr static uint32_t INIT_LIGHTING_ADAPTIVE    = 8;
   void initLightingCmd(VkCommandBuffer a_commandBuffer,
     uint32_t voxels_count,
-    float voxel_size,
-    LiteMath::float3 bmin,
-    LiteMath::float3 bmax,
     LiteMath::float3 light_pos,
     uint32_t per_voxels_points_count,
-    uint32_t multibounceFlag);
+    uint32_t flags,
+    float retrace_cos = 1.0f);
 
   void reflLightingCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count);
   void aliasLightingCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count);
   void CorrectFFCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count);
   void finalLightingCmd(VkCommandBuffer a_commandBuffer, uint32_t visible_voxels_count);
+  // modes are in radiosity_solver.h, emission is the initial lighting buffer written by initLightingCmd without multibounce
+  // and the result is left in the reflected lighting buffer. first_iteration counts the iterations since resetSolverCmd,
+  // Jacobi iterations are rounded up to an even count. Returns the number of recorded iterations
+  uint32_t solveRadiosityCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count, uint32_t mode, uint32_t first_iteration,
+    uint32_t iterations, float shoot_threshold);
+  void resetSolverCmd(VkCommandBuffer a_commandBuffer, uint32_t voxels_count, uint32_t mode);
   
   struct MemLoc
   {
@@ -163,6 +260,8 @@ protected:
 
   VkCommandBuffer         m_currCmdBuffer   = VK_NULL_HANDLE;
   uint32_t                m_currThreadFlags = 0;
+  bool                    m_kernelBarriers  = true;
+  bool                    m_asyncScratch    = false;
 
   std::vector<MemLoc>     m_allMems;
 
@@ -187,6 +286,8 @@ protected:
   virtual void InitAllGeneratedDescriptorSets_AliasLighting();
   virtual void InitAllGeneratedDescriptorSets_CorrectFF();
   virtual void InitAllGeneratedDescriptorSets_FinalLighting();
+  virtual void InitAllGeneratedDescriptorSets_SolveRadiosity();
+  virtual void InitAllGeneratedDescriptorSets_AsyncScratch();
 
   virtual void AssignBuffersToMemory(const std::vector<VkBuffer>& a_buffers, VkDeviceMemory a_mem);
 
@@ -204,24 +305,28 @@ protected:
     VkBuffer rayPosAndNearBuffer = VK_NULL_HANDLE;
     size_t   rayPosAndNearOffset = 0;
 
-    VkBuffer out_colorBuffer = VK_NULL_HANDLE;
-    size_t   out_colorOffset = 0;
+    VkImageView out_colorView = VK_NULL_HANDLE;
   } CastSingleRay_local;
 
   struct GenSamplesData
   {
     VkBuffer inPointsBuffer = VK_NULL_HANDLE;
-    VkBuffer outPointsBuffer = VK_NULL_HANDLE;
+    // streams of sample_points.h
+    VkBuffer samplePositions = VK_NULL_HANDLE;
+    VkBuffer sampleNormals = VK_NULL_HANDLE;
+    VkBuffer sampleMaterials = VK_NULL_HANDLE;
     VkBuffer indirectBuffer = VK_NULL_HANDLE;
     VkBuffer vertexBuffer = VK_NULL_HANDLE;
     VkBuffer indexBuffer = VK_NULL_HANDLE;
     VkBuffer matricesBuffer = VK_NULL_HANDLE;
+    VkBuffer instDerivedBuffer = VK_NULL_HANDLE;
     VkBuffer instInfoBuffer = VK_NULL_HANDLE;
     VkBuffer primCounterBuffer = VK_NULL_HANDLE;
     VkBuffer debugBuffer = VK_NULL_HANDLE;
     VkBuffer debugIndirBuffer = VK_NULL_HANDLE;
     VkBuffer materialsBuffer = VK_NULL_HANDLE;
     VkBuffer materialIdsBuffer = VK_NULL_HANDLE;
+    VkBuffer samplingStatsBuffer = VK_NULL_HANDLE;
     std::vector<VkImageView> imageViews;
     std::vector<VkSampler> samplers;
   } genSamplesData;
@@ -230,6 +335,10 @@ protected:
   {
     VkBuffer voxelsIndices = VK_NULL_HANDLE;
     VkBuffer voxelsIndicesIndir = VK_NULL_HANDLE;
+    VkBuffer brickCells = VK_NULL_HANDLE;
+    VkBuffer gridCascades = VK_NULL_HANDLE; // GridCascade of brick_map.h
+    VkBuffer brickTable = VK_NULL_HANDLE;
+    VkBuffer occupancy = VK_NULL_HANDLE;  // bit per voxel slot, see voxel_dda.h
   } voxelsData;
 
   struct FFData
@@ -237,6 +346,8 @@ protected:
     VkBuffer clusteredBuffer = VK_NULL_HANDLE;
     VkBuffer ffRowsLenBuffer = VK_NULL_HANDLE;
     VkBuffer ffTmpRowBuffer = VK_NULL_HANDLE;
+    VkBuffer prevClusteredBuffer = VK_NULL_HANDLE;
+    VkBuffer prevRowsLenBuffer = VK_NULL_HANDLE;
   } ffData;
 
   struct LightingData
@@ -244,8 +355,23 @@ protected:
     VkBuffer initialLighting = VK_NULL_HANDLE;
     VkBuffer reflLighting = VK_NULL_HANDLE;
     VkBuffer finalLighting = VK_NULL_HANDLE;
+    VkBuffer lightCache = VK_NULL_HANDLE;
+    VkBuffer patchAlbedo = VK_NULL_HANDLE; // float4 per cluster, written by initLighting and read by the solver
   } lightingData;
 
+  struct SolverData
+  {
+    VkBuffer tmpBuffer = VK_NULL_HANDLE;
+    VkBuffer unshotBuffer = VK_NULL_HANDLE;
+    VkBuffer statsBuffer = VK_NULL_HANDLE;
+  } solverData;
+
+  struct AsyncScratchData
+  {
+    VkBuffer ffTmpRowBuffer = VK_NULL_HANDLE;
+    VkBuffer solverTmpBuffer = VK_NULL_HANDLE;
+  } asyncScratchData;
+
   struct MembersDataGPU
   {
   } m_vdata;
@@ -265,6 +391,7 @@ protected:
   VkDescriptorSetLayout CreateAliasLightingDSLayout();
   VkDescriptorSetLayout CreateCorrectFFDSLayout();
   VkDescriptorSetLayout CreateFinalLightingDSLayout();
+  VkDescriptorSetLayout CreateSolveRadiosityDSLayout();
   void InitKernel_CastSingleRayMega(const char* a_filePath);
 
   VkPipelineLayout      GenSamplesLayout   = VK_NULL_HANDLE;
@@ -295,6 +422,10 @@ protected:
   VkPipeline            finalLightingPipeline  = VK_NULL_HANDLE;
   VkDescriptorSetLayout finalLightingDSLayout  = VK_NULL_HANDLE;
 
+  VkPipelineLayout      solveRadiosityLayout    = VK_NULL_HANDLE;
+  VkPipeline            solveRadiosityPipeline  = VK_NULL_HANDLE;
+  VkDescriptorSetLayout solveRadiosityDSLayout  = VK_NULL_HANDLE;
+
   VkPipelineLayout      packFFLayout    = VK_NULL_HANDLE;
   VkPipeline            packFFPipeline  = VK_NULL_HANDLE; 
   VkDescriptorSetLayout packFFDSLayout  = VK_NULL_HANDLE;
@@ -307,7 +438,9 @@ protected:
   VkDescriptorSetLayout CreatecopyKernelFloatDSLayout();
 
   VkDescriptorPool m_dsPool = VK_NULL_HANDLE;
-  std::array<VkDescriptorSet, 9>  m_allGeneratedDS;
+  std::array<VkDescriptorSet, 10> m_allGeneratedDS;
+  // ComputeFF, packFF and solveRadiosity with the async scratch
+  std::array<VkDescriptorSet, 3> m_asyncScratchDS;
 
   RayTracer_UBO_Data m_uboData;
   
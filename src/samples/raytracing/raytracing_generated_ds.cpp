@@ -15,21 +15,23 @@ void RayTracer_Generated::AllocateAllDescriptorSets()
 {
   // allocate pool
   //
-  VkDescriptorPoolSize buffersSize;
-  buffersSize.type            = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-  buffersSize.descriptorCount = 1*4 + 100; // mul 4 and add 100 because of AMD bug
+  std::array<VkDescriptorPoolSize, 2> poolSizes;
+  poolSizes[0].type            = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  poolSizes[0].descriptorCount = 1*4 + 100 + 32; // mul 4 and add 100 because of AMD bug, 32 for the async scratch sets
+  poolSizes[1].type            = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  poolSizes[1].descriptorCount = 1;
 
   VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
   descriptorPoolCreateInfo.sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  descriptorPoolCreateInfo.maxSets       = 1 + 10; // add 1 to prevent zero case and one more for internal needs
-  descriptorPoolCreateInfo.poolSizeCount = 1;
-  descriptorPoolCreateInfo.pPoolSizes    = &buffersSize;
+  descriptorPoolCreateInfo.maxSets       = 1 + 10 + 3; // add 1 to prevent zero case and one more for internal needs
+  descriptorPoolCreateInfo.poolSizeCount = uint32_t(poolSizes.size());
+  descriptorPoolCreateInfo.pPoolSizes    = poolSizes.data();
   
   VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, NULL, &m_dsPool));
   
   // allocate all descriptor sets
   //
-  VkDescriptorSetLayout layouts[9] = {};
+  VkDescriptorSetLayout layouts[10] = {};
   layouts[0] = CastSingleRayMegaDSLayout;
   layouts[1] = GenSamplesDSLayout;
   layouts[2] = ComputeFFDSLayout;
@@ -39,6 +41,7 @@ void RayTracer_Generated::AllocateAllDescriptorSets()
   layouts[6] = finalLightingDSLayout;
   layouts[7] = packFFDSLayout;
   layouts[8] = aliasLightingDSLayout;
+  layouts[9] = solveRadiosityDSLayout;
 
   VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {};
   descriptorSetAllocateInfo.sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
@@ -48,6 +51,11 @@ void RayTracer_Generated::AllocateAllDescriptorSets()
 
   auto tmpRes = vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, m_allGeneratedDS.data());
   VK_CHECK_RESULT(tmpRes);
+
+  VkDescriptorSetLayout asyncLayouts[3] = { ComputeFFDSLayout, packFFDSLayout, solveRadiosityDSLayout };
+  descriptorSetAllocateInfo.descriptorSetCount = m_asyncScratchDS.size();
+  descriptorSetAllocateInfo.pSetLayouts        = asyncLayouts;
+  VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, m_asyncScratchDS.data()));
 }
 
 void RayTracer_Generated::InitAllGeneratedDescriptorSets_CastSingleRay()
@@ -64,19 +72,18 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_CastSingleRay()
     std::array<VkWriteDescriptorSetAccelerationStructureKHR,  2 + additionalSize> descriptorAccelInfo;
     std::array<VkWriteDescriptorSet,   2 + additionalSize> writeDescriptorSet;
 
-    descriptorBufferInfo[0]        = VkDescriptorBufferInfo{};
-    descriptorBufferInfo[0].buffer = CastSingleRay_local.out_colorBuffer;
-    descriptorBufferInfo[0].offset = CastSingleRay_local.out_colorOffset;
-    descriptorBufferInfo[0].range  = VK_WHOLE_SIZE;  
+    descriptorImageInfo[0]             = VkDescriptorImageInfo{};
+    descriptorImageInfo[0].imageView   = CastSingleRay_local.out_colorView;
+    descriptorImageInfo[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
     writeDescriptorSet[0]                  = VkWriteDescriptorSet{};
     writeDescriptorSet[0].sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
     writeDescriptorSet[0].dstSet           = m_allGeneratedDS[0];
     writeDescriptorSet[0].dstBinding       = 0;
     writeDescriptorSet[0].descriptorCount  = 1;
-    writeDescriptorSet[0].descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    writeDescriptorSet[0].pBufferInfo      = &descriptorBufferInfo[0];
-    writeDescriptorSet[0].pImageInfo       = nullptr;
+    writeDescriptorSet[0].descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writeDescriptorSet[0].pBufferInfo      = nullptr;
+    writeDescriptorSet[0].pImageInfo       = &descriptorImageInfo[0];
     writeDescriptorSet[0].pTexelBufferView = nullptr; 
 
     {
@@ -117,7 +124,7 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_CastSingleRay()
 
 void RayTracer_Generated::InitAllGeneratedDescriptorSets_GenSamples()
 {
-  const uint32_t BUFFERS_COUNT = 12;
+  const uint32_t BUFFERS_COUNT = 19;
   std::array<VkDescriptorBufferInfo, BUFFERS_COUNT> descriptorBufferInfo;
   VkAccelerationStructureKHR accelStructs = {};
   VkWriteDescriptorSetAccelerationStructureKHR descriptorAccelInfo = {};
@@ -141,7 +148,7 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_GenSamples()
 
   std::array<VkBuffer, BUFFERS_COUNT> buffersToBind = {
     genSamplesData.inPointsBuffer,
-    genSamplesData.outPointsBuffer,
+    genSamplesData.samplePositions,
     genSamplesData.indirectBuffer,
     genSamplesData.vertexBuffer,
     genSamplesData.indexBuffer,
@@ -152,6 +159,13 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_GenSamples()
     voxelsData.voxelsIndicesIndir,
     genSamplesData.materialsBuffer,
     genSamplesData.materialIdsBuffer,
+    voxelsData.brickCells,
+    genSamplesData.samplingStatsBuffer,
+    voxelsData.gridCascades,
+    genSamplesData.sampleNormals,
+    genSamplesData.sampleMaterials,
+    genSamplesData.instDerivedBuffer,
+    voxelsData.brickTable,
   };
 
   for (uint32_t i = 0; i < BUFFERS_COUNT; ++i)
@@ -199,7 +213,7 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_GenSamples()
 
 void RayTracer_Generated::InitAllGeneratedDescriptorSets_ComputeFF()
 {
-  const uint32_t BUFFERS_COUNT = 8;
+  const uint32_t BUFFERS_COUNT = 12;
   std::array<VkDescriptorBufferInfo, BUFFERS_COUNT> descriptorBufferInfo;
   VkAccelerationStructureKHR accelStructs = {};
   VkWriteDescriptorSetAccelerationStructureKHR descriptorAccelInfo = {};
@@ -221,14 +235,18 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_ComputeFF()
   writeDescriptorSet[0].pNext          = &descriptorAccelInfo;
 
   std::array<VkBuffer, descriptorBufferInfo.size()> buffers = {
-    genSamplesData.outPointsBuffer,
+    genSamplesData.samplePositions,
     genSamplesData.indirectBuffer,
     genSamplesData.vertexBuffer,
     genSamplesData.primCounterBuffer,
     ffData.ffTmpRowBuffer,
     genSamplesData.debugIndirBuffer,
     genSamplesData.debugBuffer,
-    voxelsData.voxelsIndices
+    voxelsData.voxelsIndices,
+    genSamplesData.sampleNormals,
+    voxelsData.brickTable,
+    voxelsData.gridCascades,
+    voxelsData.occupancy
   };
 
   for (uint32_t i = 0; i < descriptorBufferInfo.size(); ++i)
@@ -254,14 +272,17 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_ComputeFF()
 
 void RayTracer_Generated::InitAllGeneratedDescriptorSets_packFF()
 {
-  const uint32_t BUFFERS_COUNT = 3;
+  const uint32_t BUFFERS_COUNT = 5;
   std::array<VkDescriptorBufferInfo, BUFFERS_COUNT> descriptorBufferInfo;
   std::array<VkWriteDescriptorSet, BUFFERS_COUNT> writeDescriptorSet;
 
+  // the old form factors are only read after a clipmap scroll, the FF buffers stand in for them until then
   std::array<VkBuffer, descriptorBufferInfo.size()> buffers = {
     ffData.ffTmpRowBuffer,
     ffData.ffRowsLenBuffer,
     ffData.clusteredBuffer,
+    ffData.prevClusteredBuffer != VK_NULL_HANDLE ? ffData.prevClusteredBuffer : ffData.clusteredBuffer,
+    ffData.prevRowsLenBuffer != VK_NULL_HANDLE ? ffData.prevRowsLenBuffer : ffData.ffRowsLenBuffer,
   };
 
   for (uint32_t i = 0; i < descriptorBufferInfo.size(); ++i)
@@ -287,7 +308,7 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_packFF()
 
 void RayTracer_Generated::InitAllGeneratedDescriptorSets_InitLighting()
 {
-  const uint32_t BUFFERS_COUNT = 6;
+  const uint32_t BUFFERS_COUNT = 14;
   std::array<VkDescriptorBufferInfo, BUFFERS_COUNT> descriptorBufferInfo;
   VkAccelerationStructureKHR accelStructs = {};
   VkWriteDescriptorSetAccelerationStructureKHR descriptorAccelInfo = {};
@@ -311,10 +332,18 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_InitLighting()
   std::array<VkBuffer, descriptorBufferInfo.size()> buffers = {
     lightingData.initialLighting,
     voxelsData.voxelsIndices,
-    genSamplesData.outPointsBuffer,
+    genSamplesData.samplePositions,
     genSamplesData.indirectBuffer,
     lightingData.reflLighting,
-    genSamplesData.primCounterBuffer
+    genSamplesData.primCounterBuffer,
+    solverData.unshotBuffer,
+    lightingData.lightCache,
+    voxelsData.brickCells,
+    genSamplesData.samplingStatsBuffer,
+    voxelsData.gridCascades,
+    genSamplesData.sampleNormals,
+    genSamplesData.sampleMaterials,
+    lightingData.patchAlbedo
   };
 
   for (uint32_t i = 0; i < descriptorBufferInfo.size(); ++i)
@@ -470,3 +499,101 @@ void RayTracer_Generated::InitAllGeneratedDescriptorSets_FinalLighting()
   vkUpdateDescriptorSets(device, uint32_t(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, NULL);
 }
 
+
+void RayTracer_Generated::InitAllGeneratedDescriptorSets_SolveRadiosity()
+{
+  const uint32_t BUFFERS_COUNT = 8;
+  std::array<VkDescriptorBufferInfo, BUFFERS_COUNT> descriptorBufferInfo;
+  std::array<VkWriteDescriptorSet, BUFFERS_COUNT> writeDescriptorSet;
+
+  std::array<VkBuffer, descriptorBufferInfo.size()> buffers = {
+    ffData.clusteredBuffer,
+    ffData.ffRowsLenBuffer,
+    lightingData.initialLighting,
+    lightingData.reflLighting,
+    solverData.tmpBuffer,
+    solverData.unshotBuffer,
+    solverData.statsBuffer,
+    lightingData.patchAlbedo
+  };
+
+  for (uint32_t i = 0; i < descriptorBufferInfo.size(); ++i)
+  {
+    descriptorBufferInfo[i]        = VkDescriptorBufferInfo{};
+    descriptorBufferInfo[i].buffer = buffers[i];
+    descriptorBufferInfo[i].offset = 0;
+    descriptorBufferInfo[i].range  = VK_WHOLE_SIZE;  
+
+    writeDescriptorSet[i]                  = VkWriteDescriptorSet{};
+    writeDescriptorSet[i].sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeDescriptorSet[i].dstSet           = m_allGeneratedDS[9];
+    writeDescriptorSet[i].dstBinding       = i;
+    writeDescriptorSet[i].descriptorCount  = 1;
+    writeDescriptorSet[i].descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writeDescriptorSet[i].pBufferInfo      = &descriptorBufferInfo[i];
+    writeDescriptorSet[i].pImageInfo       = nullptr;
+    writeDescriptorSet[i].pTexelBufferView = nullptr;
+  }
+
+  vkUpdateDescriptorSets(device, uint32_t(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, NULL);
+}
+
+void RayTracer_Generated::InitAllGeneratedDescriptorSets_AsyncScratch()
+{
+  if (asyncScratchData.ffTmpRowBuffer == VK_NULL_HANDLE)
+    return;
+
+  // the copies start with every binding of the sets of the frames, then the scratch bindings are replaced
+  const std::array<VkDescriptorSet, 3> sources = { m_allGeneratedDS[2], m_allGeneratedDS[7], m_allGeneratedDS[9] };
+  const std::array<uint32_t, 3> bindingsCount = { 13, 5, 8 };
+  std::vector<VkCopyDescriptorSet> copyDescriptorSet;
+  for (uint32_t set = 0; set < sources.size(); ++set)
+  {
+    for (uint32_t binding = 0; binding < bindingsCount[set]; ++binding)
+    {
+      VkCopyDescriptorSet copy = {};
+      copy.sType           = VK_STRUCTURE_TYPE_COPY_DESCRIPTOR_SET;
+      copy.srcSet          = sources[set];
+      copy.srcBinding      = binding;
+      copy.dstSet          = m_asyncScratchDS[set];
+      copy.dstBinding      = binding;
+      copy.descriptorCount = 1;
+      copyDescriptorSet.push_back(copy);
+    }
+  }
+  vkUpdateDescriptorSets(device, 0, NULL, uint32_t(copyDescriptorSet.size()), copyDescriptorSet.data());
+
+  struct ScratchBinding
+  {
+    VkDescriptorSet set;
+    uint32_t binding;
+    VkBuffer buffer;
+  };
+  const std::array<ScratchBinding, 3> scratch = {{
+    { m_asyncScratchDS[0], 5, asyncScratchData.ffTmpRowBuffer },
+    { m_asyncScratchDS[1], 0, asyncScratchData.ffTmpRowBuffer },
+    { m_asyncScratchDS[2], 4, asyncScratchData.solverTmpBuffer },
+  }};
+  std::array<VkDescriptorBufferInfo, scratch.size()> descriptorBufferInfo;
+  std::array<VkWriteDescriptorSet, scratch.size()> writeDescriptorSet;
+
+  for (uint32_t i = 0; i < scratch.size(); ++i)
+  {
+    descriptorBufferInfo[i]        = VkDescriptorBufferInfo{};
+    descriptorBufferInfo[i].buffer = scratch[i].buffer;
+    descriptorBufferInfo[i].offset = 0;
+    descriptorBufferInfo[i].range  = VK_WHOLE_SIZE;
+
+    writeDescriptorSet[i]                  = VkWriteDescriptorSet{};
+    writeDescriptorSet[i].sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeDescriptorSet[i].dstSet           = scratch[i].set;
+    writeDescriptorSet[i].dstBinding       = scratch[i].binding;
+    writeDescriptorSet[i].descriptorCount  = 1;
+    writeDescriptorSet[i].descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writeDescriptorSet[i].pBufferInfo      = &descriptorBufferInfo[i];
+    writeDescriptorSet[i].pImageInfo       = nullptr;
+    writeDescriptorSet[i].pTexelBufferView = nullptr;
+  }
+
+  vkUpdateDescriptorSets(device, uint32_t(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, NULL);
+}
@@ -82,6 +82,13 @@ RayTracer_Generated::~RayTracer_Generated()
   correctFFDSLayout = VK_NULL_HANDLE;
   reflLightingDSLayout = VK_NULL_HANDLE;
   
+  vkDestroyPipeline(device, solveRadiosityPipeline, nullptr);
+  vkDestroyPipelineLayout(device, solveRadiosityLayout, nullptr);
+  solveRadiosityLayout   = VK_NULL_HANDLE;
+  solveRadiosityPipeline = VK_NULL_HANDLE;
+  vkDestroyDescriptorSetLayout(device, solveRadiosityDSLayout, nullptr);
+  solveRadiosityDSLayout = VK_NULL_HANDLE;
+
   vkDestroyPipeline(device, finalLightingPipeline, nullptr);
   vkDestroyPipelineLayout(device, finalLightingLayout, nullptr);
   finalLightingLayout   = VK_NULL_HANDLE;
@@ -118,7 +125,7 @@ VkDescriptorSetLayout RayTracer_Generated::CreateCastSingleRayMegaDSLayout()
 
   // binding for out_color
   dsBindings[0].binding            = 0;
-  dsBindings[0].descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  dsBindings[0].descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
   dsBindings[0].descriptorCount    = 1;
   dsBindings[0].stageFlags         = VK_SHADER_STAGE_COMPUTE_BIT;
   dsBindings[0].pImmutableSamplers = nullptr;
@@ -149,7 +156,7 @@ VkDescriptorSetLayout RayTracer_Generated::CreateCastSingleRayMegaDSLayout()
 
 VkDescriptorSetLayout RayTracer_Generated::GenSampleDSLayout()
 {
-  const uint32_t BUFFERS_COUNT = 12;
+  const uint32_t BUFFERS_COUNT = 19;
   std::array<VkDescriptorSetLayoutBinding, 2 + BUFFERS_COUNT> dsBindings;
 
   // binding for m_pAccelStruct
@@ -187,7 +194,7 @@ VkDescriptorSetLayout RayTracer_Generated::GenSampleDSLayout()
 
 VkDescriptorSetLayout RayTracer_Generated::CreateComputeFFDSLayout()
 {
-  const uint32_t BUFFERS_COUNT = 8;
+  const uint32_t BUFFERS_COUNT = 12;
   std::array<VkDescriptorSetLayoutBinding, 1 + BUFFERS_COUNT> dsBindings;
 
   // binding for m_pAccelStruct
@@ -219,7 +226,7 @@ VkDescriptorSetLayout RayTracer_Generated::CreateComputeFFDSLayout()
 
 VkDescriptorSetLayout RayTracer_Generated::CreatePackFFDSLayout()
 {
-  const uint32_t BUFFERS_COUNT = 3;
+  const uint32_t BUFFERS_COUNT = 5;
   std::array<VkDescriptorSetLayoutBinding, BUFFERS_COUNT> dsBindings;
 
   // binding for m_pAccelStruct
@@ -251,7 +258,7 @@ VkDescriptorSetLayout RayTracer_Generated::CreatePackFFDSLayout()
 
 VkDescriptorSetLayout RayTracer_Generated::CreateInitLightingDSLayout()
 {
-  const uint32_t BUFFERS_COUNT = 6;
+  const uint32_t BUFFERS_COUNT = 14;
   std::array<VkDescriptorSetLayoutBinding, 1 + BUFFERS_COUNT> dsBindings;
 
   // binding for m_pAccelStruct
@@ -306,6 +313,31 @@ VkDescriptorSetLayout RayTracer_Generated::CreateReflLightingDSLayout()
   return layout;
 }
 
+VkDescriptorSetLayout RayTracer_Generated::CreateSolveRadiosityDSLayout()
+{
+  const uint32_t BUFFERS_COUNT = 8;
+  std::array<VkDescriptorSetLayoutBinding, BUFFERS_COUNT> dsBindings;
+
+  for (uint32_t i = 0; i < BUFFERS_COUNT; ++i)
+  {
+    const uint32_t bindingId = i;
+    dsBindings[bindingId].binding            = bindingId;
+    dsBindings[bindingId].descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    dsBindings[bindingId].descriptorCount    = 1;
+    dsBindings[bindingId].stageFlags         = VK_SHADER_STAGE_COMPUTE_BIT;
+    dsBindings[bindingId].pImmutableSamplers = nullptr;  
+  }
+  
+  VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+  descriptorSetLayoutCreateInfo.sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptorSetLayoutCreateInfo.bindingCount = uint32_t(dsBindings.size());
+  descriptorSetLayoutCreateInfo.pBindings    = dsBindings.data();
+  
+  VkDescriptorSetLayout layout = nullptr;
+  VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorSetLayoutCreateInfo, NULL, &layout));
+  return layout;
+}
+
 VkDescriptorSetLayout RayTracer_Generated::CreateAliasLightingDSLayout()
 {
   const uint32_t BUFFERS_COUNT = 4;
@@ -464,6 +496,12 @@ void RayTracer_Generated::InitKernel_CastSingleRayMega(const char* a_filePath)
   finalLightingDSLayout = CreateFinalLightingDSLayout();
   finalLightingLayout = m_pMaker->MakeLayout(device, { finalLightingDSLayout }, 128);
   finalLightingPipeline = m_pMaker->MakePipeline(device);
+
+  shaderPath = AlterShaderPath("../../../resources/shaders/solveRadiosity.comp.spv");
+  m_pMaker->LoadShader(device, shaderPath.c_str(), nullptr, "main");
+  solveRadiosityDSLayout = CreateSolveRadiosityDSLayout();
+  solveRadiosityLayout = m_pMaker->MakeLayout(device, { solveRadiosityDSLayout }, 128);
+  solveRadiosityPipeline = m_pMaker->MakePipeline(device);
 }
 
 
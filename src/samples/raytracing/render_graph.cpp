@@ -0,0 +1,330 @@
+#include "render_graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+
+namespace
+{
+  constexpr VkAccessFlags WRITE_ACCESS = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+    | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT
+    | VK_ACCESS_MEMORY_WRITE_BIT;
+
+  std::string StageNames(VkPipelineStageFlags a_stages)
+  {
+    static const std::pair<VkPipelineStageFlags, const char*> names[] = {
+      { VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, "top" },
+      { VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, "indirect" },
+      { VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, "vertex" },
+      { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, "fragment" },
+      { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, "color" },
+      { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, "compute" },
+      { VK_PIPELINE_STAGE_TRANSFER_BIT, "transfer" },
+      { VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, "bottom" },
+      { VK_PIPELINE_STAGE_HOST_BIT, "host" },
+    };
+    std::string result;
+    for (const auto &name : names)
+    {
+      if ((a_stages & name.first) == 0)
+        continue;
+      if (!result.empty())
+        result += "|";
+      result += name.second;
+    }
+    return result.empty() ? "none" : result;
+  }
+}
+
+VkBuffer TransientHeap::Add(VkDevice a_device, VkDeviceSize a_size, VkBufferUsageFlags a_usage, uint32_t a_firstPhase,
+  uint32_t a_lastPhase)
+{
+  assert(m_memory == VK_NULL_HANDLE && a_firstPhase <= a_lastPhase);
+  Entry entry = {};
+  entry.buffer = vk_utils::createBuffer(a_device, a_size, a_usage, &entry.requirements);
+  entry.firstPhase = a_firstPhase;
+  entry.lastPhase = a_lastPhase;
+  m_entries.push_back(entry);
+  return entry.buffer;
+}
+
+void TransientHeap::Allocate(VkDevice a_device, VkPhysicalDevice a_physicalDevice)
+{
+  if (m_entries.empty())
+    return;
+
+  // the largest buffers are placed first, every one at the lowest offset that is free during its phases
+  std::vector<Entry*> order;
+  for (Entry &entry : m_entries)
+    order.push_back(&entry);
+  std::stable_sort(order.begin(), order.end(), [](const Entry *a, const Entry *b) {
+    return a->requirements.size > b->requirements.size;
+  });
+
+  uint32_t memoryTypeBits = ~0u;
+  m_size = 0;
+  std::vector<const Entry*> placed;
+  for (Entry *entry : order)
+  {
+    std::vector<const Entry*> live;
+    for (const Entry *other : placed)
+      if (other->firstPhase <= entry->lastPhase && entry->firstPhase <= other->lastPhase)
+        live.push_back(other);
+    std::sort(live.begin(), live.end(), [](const Entry *a, const Entry *b) { return a->offset < b->offset; });
+
+    const VkDeviceSize alignment = entry->requirements.alignment;
+    VkDeviceSize offset = 0;
+    for (const Entry *other : live)
+    {
+      if (offset + entry->requirements.size <= other->offset)
+        break;
+      offset = std::max(offset, (other->offset + other->requirements.size + alignment - 1) / alignment * alignment);
+    }
+    entry->offset = offset;
+    placed.push_back(entry);
+    memoryTypeBits &= entry->requirements.memoryTypeBits;
+    m_size = std::max(m_size, offset + entry->requirements.size);
+  }
+
+  VkMemoryAllocateInfo allocateInfo = {};
+  allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocateInfo.allocationSize = m_size;
+  allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    a_physicalDevice);
+  VK_CHECK_RESULT(vkAllocateMemory(a_device, &allocateInfo, nullptr, &m_memory));
+  for (const Entry &entry : m_entries)
+    VK_CHECK_RESULT(vkBindBufferMemory(a_device, entry.buffer, m_memory, entry.offset));
+}
+
+void TransientHeap::Destroy(VkDevice a_device)
+{
+  for (const Entry &entry : m_entries)
+    vkDestroyBuffer(a_device, entry.buffer, nullptr);
+  m_entries.clear();
+  if (m_memory != VK_NULL_HANDLE)
+    vkFreeMemory(a_device, m_memory, nullptr);
+  m_memory = VK_NULL_HANDLE;
+  m_size = 0;
+}
+
+const TransientHeap::Entry *TransientHeap::Find(VkBuffer a_buffer) const
+{
+  for (const Entry &entry : m_entries)
+    if (entry.buffer == a_buffer)
+      return &entry;
+  return nullptr;
+}
+
+bool TransientHeap::Aliased(VkBuffer a_first, VkBuffer a_second) const
+{
+  const Entry *first = Find(a_first);
+  const Entry *second = Find(a_second);
+  if (first == nullptr || second == nullptr || first == second)
+    return false;
+  return first->offset < second->offset + second->requirements.size
+    && second->offset < first->offset + first->requirements.size;
+}
+
+VkDeviceSize TransientHeap::UnaliasedSize() const
+{
+  VkDeviceSize size = 0;
+  for (const Entry &entry : m_entries)
+    size += entry.requirements.size;
+  return size;
+}
+
+RenderGraph::Use RenderGraph::Buffer(VkBuffer a_buffer, VkPipelineStageFlags a_stages, VkAccessFlags a_access)
+{
+  Use use;
+  use.buffer = a_buffer;
+  use.stages = a_stages;
+  use.access = a_access;
+  return use;
+}
+
+RenderGraph::Use RenderGraph::Image(VkImage a_image, VkPipelineStageFlags a_stages, VkAccessFlags a_access,
+  VkImageLayout a_layout, VkImageLayout a_finalLayout)
+{
+  Use use;
+  use.image = a_image;
+  use.stages = a_stages;
+  use.access = a_access;
+  use.layout = a_layout;
+  use.finalLayout = a_finalLayout == VK_IMAGE_LAYOUT_UNDEFINED ? a_layout : a_finalLayout;
+  return use;
+}
+
+void RenderGraph::ImportImage(VkImage a_image, VkImageLayout a_layout, VkPipelineStageFlags a_stages, VkAccessFlags a_access)
+{
+  State &state = m_images[uint64_t(a_image)];
+  state.layout = a_layout;
+  if (a_access & WRITE_ACCESS)
+  {
+    state.writeStages = a_stages;
+    state.writeAccess = a_access & WRITE_ACCESS;
+  }
+  else
+    state.readStages = a_stages;
+}
+
+void RenderGraph::AddPass(const char *a_name, std::vector<Use> a_uses, std::function<void(VkCommandBuffer)> a_record)
+{
+  Pass pass;
+  pass.name = a_name;
+  pass.uses = std::move(a_uses);
+  pass.record = std::move(a_record);
+  m_passes.push_back(std::move(pass));
+}
+
+RenderGraph::State &RenderGraph::GetState(const Use &a_use)
+{
+  if (a_use.image != VK_NULL_HANDLE)
+    return m_images[uint64_t(a_use.image)];
+  State &state = m_buffers[uint64_t(a_use.buffer)];
+  state.buffer = a_use.buffer;
+  return state;
+}
+
+void RenderGraph::AliasTransient(const Use &a_use, VkPipelineStageFlags &a_srcStages, VkAccessFlags &a_srcAccess,
+  std::string &a_log)
+{
+  if (m_transients == nullptr || a_use.buffer == VK_NULL_HANDLE)
+    return;
+  // the accesses of the buffers that used the memory before have to finish before it is written again
+  for (auto &other : m_buffers)
+  {
+    State &state = other.second;
+    if (state.aliased || !m_transients->Aliased(state.buffer, a_use.buffer))
+      continue;
+    a_srcStages |= state.writeStages | state.readStages;
+    a_srcAccess |= state.writeAccess;
+    state.aliased = true;
+    a_log += ", memory aliased";
+  }
+}
+
+void RenderGraph::RecordBarrier(VkCommandBuffer a_cmdBuff, Pass &a_pass)
+{
+  VkPipelineStageFlags srcStages = 0;
+  VkPipelineStageFlags dstStages = 0;
+  VkAccessFlags srcAccess = 0;
+  VkAccessFlags dstAccess = 0;
+  std::vector<VkImageMemoryBarrier> imageBarriers;
+  std::string log;
+
+  for (const Use &use : a_pass.uses)
+  {
+    const bool firstUse = use.buffer != VK_NULL_HANDLE && m_buffers.find(uint64_t(use.buffer)) == m_buffers.end();
+    State &state = GetState(use);
+    assert(!state.aliased && "the memory of the transient buffer has been taken over by another one");
+    const VkAccessFlags writeAccess = use.access & WRITE_ACCESS;
+
+    VkPipelineStageFlags hazardStages = 0;
+    if (firstUse)
+    {
+      AliasTransient(use, hazardStages, srcAccess, log);
+      if (hazardStages != 0)
+        dstAccess |= use.access;
+    }
+    // undefined layout of a use discards the contents, the render passes transition their attachments themselves
+    if (use.image != VK_NULL_HANDLE && use.layout != VK_IMAGE_LAYOUT_UNDEFINED && use.layout != state.layout)
+    {
+      VkImageMemoryBarrier barrier = {};
+      barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+      barrier.srcAccessMask = state.writeAccess;
+      barrier.dstAccessMask = use.access;
+      barrier.oldLayout = state.layout;
+      barrier.newLayout = use.layout;
+      barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.image = use.image;
+      barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS };
+      imageBarriers.push_back(barrier);
+      srcStages |= state.writeStages | state.readStages;
+      dstStages |= use.stages;
+
+      // the transition is a write that the accesses of the pass wait for
+      state.writeStages = use.stages;
+      state.writeAccess = 0;
+      state.readStages = 0;
+      state.visibleStages = use.stages;
+      state.visibleAccess = use.access;
+    }
+    else
+    {
+      // read or write after write, unless an earlier barrier has made the write visible to these accesses
+      if (state.writeStages != 0 && ((use.stages & ~state.visibleStages) != 0 || (use.access & ~state.visibleAccess) != 0))
+      {
+        hazardStages |= state.writeStages;
+        srcAccess |= state.writeAccess;
+        dstAccess |= use.access;
+        state.visibleStages |= use.stages;
+        state.visibleAccess |= use.access;
+      }
+      // write after read only waits for the reads to execute
+      if (writeAccess != 0)
+        hazardStages |= state.readStages;
+    }
+    if (hazardStages != 0)
+    {
+      srcStages |= hazardStages;
+      dstStages |= use.stages;
+    }
+
+    if (writeAccess != 0)
+    {
+      state.writeStages = use.stages;
+      state.writeAccess = writeAccess;
+      state.readStages = 0;
+      state.visibleStages = 0;
+      state.visibleAccess = 0;
+    }
+    else
+      state.readStages |= use.stages;
+    if (use.image != VK_NULL_HANDLE && use.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED)
+      state.layout = use.finalLayout;
+  }
+
+  if (dstStages == 0)
+    return;
+  if (srcStages == 0)
+    srcStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  VkMemoryBarrier memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, srcAccess, dstAccess };
+  const uint32_t memoryBarriersCount = (srcAccess != 0 || dstAccess != 0) ? 1 : 0;
+  vkCmdPipelineBarrier(a_cmdBuff, srcStages, dstStages, 0, memoryBarriersCount, &memoryBarrier, 0, nullptr,
+    uint32_t(imageBarriers.size()), imageBarriers.data());
+  ++m_barriersCount;
+
+  std::ostringstream description;
+  description << StageNames(srcStages) << " -> " << StageNames(dstStages);
+  // the layout transitions carry the memory dependencies of their images
+  if (memoryBarriersCount == 0 && imageBarriers.empty())
+    description << " execution";
+  if (!imageBarriers.empty())
+    description << ", " << imageBarriers.size() << " layout transition" << (imageBarriers.size() > 1 ? "s" : "");
+  a_pass.barrier = description.str() + log;
+}
+
+void RenderGraph::Execute(VkCommandBuffer a_cmdBuff)
+{
+  m_barriersCount = 0;
+  for (Pass &pass : m_passes)
+  {
+    RecordBarrier(a_cmdBuff, pass);
+    if (pass.record)
+      pass.record(a_cmdBuff);
+  }
+}
+
+std::string RenderGraph::Schedule() const
+{
+  std::ostringstream schedule;
+  schedule << "render graph " << m_name << ": " << m_passes.size() << " passes, " << m_barriersCount << " barriers" << std::endl;
+  for (const Pass &pass : m_passes)
+  {
+    if (!pass.barrier.empty())
+      schedule << "    barrier " << pass.barrier << std::endl;
+    schedule << "  " << pass.name << std::endl;
+  }
+  return schedule.str();
+}
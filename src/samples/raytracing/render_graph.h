@@ -0,0 +1,120 @@
+#ifndef VK_GRAPHICS_RT_RENDER_GRAPH_H
+#define VK_GRAPHICS_RT_RENDER_GRAPH_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vk_utils.h"
+
+// Memory of the transient buffers, whose contents don't outlive the passes of one graph. Every buffer lives in a range
+// of phases of the caller's pass order and the buffers whose ranges don't intersect share memory. RenderGraph checks
+// that a buffer isn't used after an aliased one has taken its memory over.
+class TransientHeap
+{
+public:
+  // the buffer is not bound to memory until Allocate
+  VkBuffer Add(VkDevice a_device, VkDeviceSize a_size, VkBufferUsageFlags a_usage, uint32_t a_firstPhase, uint32_t a_lastPhase);
+  void Allocate(VkDevice a_device, VkPhysicalDevice a_physicalDevice);
+  void Destroy(VkDevice a_device);
+
+  bool Aliased(VkBuffer a_first, VkBuffer a_second) const;
+  VkDeviceSize Size() const { return m_size; }
+  VkDeviceSize UnaliasedSize() const;
+
+private:
+  struct Entry
+  {
+    VkBuffer buffer;
+    VkMemoryRequirements requirements;
+    uint32_t firstPhase;
+    uint32_t lastPhase;
+    VkDeviceSize offset;
+  };
+  std::vector<Entry> m_entries;
+  VkDeviceMemory m_memory = VK_NULL_HANDLE;
+  VkDeviceSize m_size = 0;
+
+  const Entry *Find(VkBuffer a_buffer) const;
+};
+
+// Passes declare the buffers and images they access, the graph records the barriers between them when it is executed.
+// The hazards of the buffers of a pass are merged into one memory barrier and the layout transitions of its images are
+// recorded with it, reads of the data another pass has already waited for don't wait again. Each graph is recorded
+// into one command buffer, the accesses of the earlier submissions are ordered by the barriers of the frame.
+class RenderGraph
+{
+public:
+  struct Use
+  {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkImage image = VK_NULL_HANDLE;
+    VkPipelineStageFlags stages = 0;
+    VkAccessFlags access = 0;
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // the attachments of render passes are left in the final layout of the render pass
+    VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  };
+
+  static Use Buffer(VkBuffer a_buffer, VkPipelineStageFlags a_stages, VkAccessFlags a_access);
+  static Use Image(VkImage a_image, VkPipelineStageFlags a_stages, VkAccessFlags a_access, VkImageLayout a_layout,
+    VkImageLayout a_finalLayout = VK_IMAGE_LAYOUT_UNDEFINED);
+
+  // shorthands of the buffer accesses of the kernels and of the transfer commands
+  static Use ComputeRead(VkBuffer a_buffer) { return Buffer(a_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT); }
+  static Use ComputeWrite(VkBuffer a_buffer)
+  {
+    return Buffer(a_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+  }
+  static Use TransferRead(VkBuffer a_buffer) { return Buffer(a_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT); }
+  static Use TransferWrite(VkBuffer a_buffer) { return Buffer(a_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT); }
+
+  explicit RenderGraph(const char *a_name, const TransientHeap *a_transients = nullptr)
+    : m_name(a_name), m_transients(a_transients) {}
+
+  // images have to be imported with their layout, a_stages and a_access are the accesses that precede the graph
+  void ImportImage(VkImage a_image, VkImageLayout a_layout, VkPipelineStageFlags a_stages = 0, VkAccessFlags a_access = 0);
+  void AddPass(const char *a_name, std::vector<Use> a_uses, std::function<void(VkCommandBuffer)> a_record);
+  bool Empty() const { return m_passes.empty(); }
+
+  void Execute(VkCommandBuffer a_cmdBuff);
+  // the passes of the last execution with the barriers recorded before them
+  std::string Schedule() const;
+
+private:
+  struct Pass
+  {
+    std::string name;
+    std::vector<Use> uses;
+    std::function<void(VkCommandBuffer)> record;
+    std::string barrier; // description of the barrier recorded before the pass
+  };
+
+  struct State
+  {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags writeStages = 0;
+    VkAccessFlags writeAccess = 0;
+    VkPipelineStageFlags readStages = 0;   // since the last write
+    VkPipelineStageFlags visibleStages = 0; // the last write has been made visible to these stages and accesses
+    VkAccessFlags visibleAccess = 0;
+    bool aliased = false; // the memory has been taken over by another transient buffer
+  };
+  using StateMap = std::unordered_map<uint64_t, State>;
+
+  std::string m_name;
+  const TransientHeap *m_transients;
+  std::vector<Pass> m_passes;
+  StateMap m_buffers;
+  StateMap m_images;
+  uint32_t m_barriersCount = 0;
+
+  State &GetState(const Use &a_use);
+  void AliasTransient(const Use &a_use, VkPipelineStageFlags &a_srcStages, VkAccessFlags &a_srcAccess, std::string &a_log);
+  void RecordBarrier(VkCommandBuffer a_cmdBuff, Pass &a_pass);
+};
+
+#endif// VK_GRAPHICS_RT_RENDER_GRAPH_H
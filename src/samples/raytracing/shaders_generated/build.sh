@@ -1,2 +1,2 @@
 #!/bin/sh
-glslangValidator -V CastSingleRayMega.comp -o CastSingleRayMega.comp.spv -DGLSL -I.. -I/home/vs/repos/msu-graphics-group/vk_graphics_rt/external 
+glslangValidator -V CastSingleRayMega.comp -o CastSingleRayMega.comp.spv -DGLSL -I.. -I../../../../external
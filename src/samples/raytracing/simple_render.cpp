@@ -5,10 +5,29 @@
 #include <vk_pipeline.h>
 #include <vk_buffers.h>
 
+#include <algorithm>
+#include <cmath>
 #include <random>
 #include <chrono>
+#include <filesystem>
 #include "stb_image_write.h"
 
+std::string SpirvPath(const std::string &a_path)
+{
+#ifdef RAYTRACING_SPIRV_DIR
+  std::error_code ec;
+  const auto built = std::filesystem::path(RAYTRACING_SPIRV_DIR) / std::filesystem::path(a_path).filename();
+  const auto builtTime = std::filesystem::last_write_time(built, ec);
+  if (!ec)
+  {
+    const auto committedTime = std::filesystem::last_write_time(a_path, ec);
+    if (ec || builtTime >= committedTime)
+      return built.string();
+  }
+#endif
+  return a_path;
+}
+
 SimpleRender::SimpleRender(uint32_t a_width, uint32_t a_height) : m_width(a_width), m_height(a_height)
 {
 #ifdef NDEBUG
@@ -26,6 +45,12 @@ void SimpleRender::SetupDeviceFeatures()
     m_enabledRayQueryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR;
     m_enabledRayQueryFeatures.rayQuery = VK_TRUE;
     m_enabledRayQueryFeatures.pNext = nullptr;
+
+    // the async FF batches and the frames wait for each other by timeline values
+    m_enabledTimelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+    m_enabledTimelineFeatures.timelineSemaphore = VK_TRUE;
+    m_enabledTimelineFeatures.pNext = nullptr;
+    m_enabledRayQueryFeatures.pNext = &m_enabledTimelineFeatures;
     
     m_enabledDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
     m_enabledDeviceAddressFeatures.bufferDeviceAddress = VK_TRUE;
@@ -55,6 +80,7 @@ void SimpleRender::SetupDeviceExtensions()
   m_deviceExtensions.push_back(VK_KHR_SHADER_FLOAT_CONTROLS_EXTENSION_NAME);
 
   m_deviceExtensions.push_back(VK_KHR_SHADER_NON_SEMANTIC_INFO_EXTENSION_NAME);
+  m_deviceExtensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
 }
 
 void SimpleRender::GetRTFeatures()
@@ -95,6 +121,39 @@ void SimpleRender::InitVulkan(const char** a_instanceExtensions, uint32_t a_inst
 
   m_cmdBuffersDrawMain.reserve(m_framesInFlight);
   m_cmdBuffersDrawMain = vk_utils::createCommandBuffers(m_device, m_commandPool, m_framesInFlight);
+  m_cmdBuffersCompute = vk_utils::createCommandBuffers(m_device, m_commandPool, m_framesInFlight);
+
+  {
+    VkMemoryRequirements memReq;
+    solverStatsReadback = CreateSharedBuffer(sizeof(float) * SOLVER_STATS_COUNT * (m_framesInFlight + 1),
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT, &memReq);
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize = memReq.size;
+    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, m_physicalDevice);
+    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &solverStatsReadbackMem));
+    VK_CHECK_RESULT(vkBindBufferMemory(m_device, solverStatsReadback, solverStatsReadbackMem, 0));
+    void *mappedMem = nullptr;
+    vkMapMemory(m_device, solverStatsReadbackMem, 0, VK_WHOLE_SIZE, 0, &mappedMem);
+    solverStatsReadbackData = static_cast<float *>(mappedMem);
+  }
+  {
+    VkMemoryRequirements memReq;
+    ffSizeReadback = CreateSharedBuffer(sizeof(uint32_t) * m_framesInFlight, VK_BUFFER_USAGE_TRANSFER_DST_BIT, &memReq);
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize = memReq.size;
+    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, m_physicalDevice);
+    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &ffSizeReadbackMem));
+    VK_CHECK_RESULT(vkBindBufferMemory(m_device, ffSizeReadback, ffSizeReadbackMem, 0));
+    void *mappedMem = nullptr;
+    vkMapMemory(m_device, ffSizeReadbackMem, 0, VK_WHOLE_SIZE, 0, &mappedMem);
+    ffSizeReadbackData = static_cast<uint32_t *>(mappedMem);
+    ffFrameBatches.resize(m_framesInFlight);
+  }
+  CreateAsyncFFResources();
 
   m_frameFences.resize(m_framesInFlight);
   VkFenceCreateInfo fenceInfo = {};
@@ -105,6 +164,18 @@ void SimpleRender::InitVulkan(const char** a_instanceExtensions, uint32_t a_inst
     VK_CHECK_RESULT(vkCreateFence(m_device, &fenceInfo, nullptr, &m_frameFences[i]));
   }
 
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(m_physicalDevice, &props);
+  if (props.limits.timestampComputeAndGraphics)
+  {
+    m_timestampPeriod = props.limits.timestampPeriod;
+    VkQueryPoolCreateInfo queryPoolInfo = {};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = FRAME_QUERIES_COUNT * m_framesInFlight;
+    VK_CHECK_RESULT(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &m_frameQueryPool));
+  }
+
   m_pCopyHelper = std::make_shared<vk_utils::PingPongCopyHelper>(m_physicalDevice, m_device, m_transferQueue,
     m_queueFamilyIDXs.transfer, STAGING_MEM_SIZE);
 
@@ -129,8 +200,13 @@ void SimpleRender::InitPresentation(VkSurfaceKHR &a_surface)
 
   VkSemaphoreCreateInfo semaphoreInfo = {};
   semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-  VK_CHECK_RESULT(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_presentationResources.imageAvailable));
-  VK_CHECK_RESULT(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_presentationResources.renderingFinished));
+  m_presentationResources.imageAvailable.resize(m_framesInFlight);
+  m_presentationResources.renderingFinished.resize(m_framesInFlight);
+  for (uint32_t i = 0; i < m_framesInFlight; ++i)
+  {
+    VK_CHECK_RESULT(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_presentationResources.imageAvailable[i]));
+    VK_CHECK_RESULT(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_presentationResources.renderingFinished[i]));
+  }
   m_screenRenderPass = vk_utils::createDefaultRenderPass(m_device, m_swapchain.GetFormat());
 
   std::vector<VkFormat> depthFormats = {
@@ -231,24 +307,36 @@ void SimpleRender::CreateDevice(uint32_t a_deviceId)
   SetupDeviceFeatures();
   m_device = vk_utils::createLogicalDevice(m_physicalDevice, m_validationLayers, m_deviceExtensions,
                                            m_enabledDeviceFeatures, m_queueFamilyIDXs,
-                                           VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_TRANSFER_BIT, m_pDeviceFeatures);
+                                           VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT, m_pDeviceFeatures);
 
   vkGetDeviceQueue(m_device, m_queueFamilyIDXs.graphics, 0, &m_graphicsQueue);
   vkGetDeviceQueue(m_device, m_queueFamilyIDXs.transfer, 0, &m_transferQueue);
+  // vk_utils picks a compute family without graphics when there is one
+  if (m_queueFamilyIDXs.compute != m_queueFamilyIDXs.graphics)
+    vkGetDeviceQueue(m_device, m_queueFamilyIDXs.compute, 0, &m_computeQueue);
 }
 
 void SimpleRender::SetupSimplePipeline()
 {
-  m_pBindings->BindBegin(VK_SHADER_STAGE_FRAGMENT_BIT|VK_SHADER_STAGE_VERTEX_BIT);
-  m_pBindings->BindBuffer(0, m_ubo, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-  m_pBindings->BindBuffer(1, appliedLightingBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-  m_pBindings->BindBuffer(2, indirectPointsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-  m_pBindings->BindBuffer(3, m_pScnMgr->GetMaterialsBuffer(), VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-  m_pBindings->BindBuffer(4, m_pScnMgr->GetMaterialPerVertexIDsBuffer(), VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-  m_pBindings->BindAccelStruct(5, m_pScnMgr->GetTLAS(), VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR);
-  m_pBindings->BindImageArray(6, m_pScnMgr->GetTextureViews(), m_pScnMgr->GetTextureSamplers());
-  m_pBindings->BindBuffer(7, indirectPointsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-  m_pBindings->BindEnd(&m_dSet, &m_dSetLayout);
+  // the second half of the sets reads the lighting published by the async FF batches
+  m_dSet.resize(m_framesInFlight * 2);
+  for (uint32_t i = 0; i < m_dSet.size(); ++i)
+  {
+    m_pBindings->BindBegin(VK_SHADER_STAGE_FRAGMENT_BIT|VK_SHADER_STAGE_VERTEX_BIT);
+    m_pBindings->BindBuffer(0, m_ubo[i % m_framesInFlight], VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    m_pBindings->BindBuffer(1, i < m_framesInFlight ? appliedLightingBuffer : publishedLightingBuffer, VK_NULL_HANDLE,
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(2, indirectPointsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(3, m_pScnMgr->GetMaterialsBuffer(), VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(4, m_pScnMgr->GetMaterialPerVertexIDsBuffer(), VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindAccelStruct(5, m_pScnMgr->GetTLAS(), VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR);
+    m_pBindings->BindImageArray(6, m_pScnMgr->GetTextureViews(), m_pScnMgr->GetTextureSamplers());
+    m_pBindings->BindBuffer(7, indirectPointsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(8, brickTableBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(9, gridCascadesBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(10, m_pScnMgr->GetInstanceDerivedBuffer(), VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindEnd(&m_dSet[i], &m_dSetLayout);
+  }
 
   // if we are recreating pipeline (for example, to reload shaders)
   // we need to cleanup old pipeline
@@ -299,8 +387,8 @@ void SimpleRender::SetupSimplePipeline()
   vk_utils::GraphicsPipelineMaker maker;
 
   std::unordered_map<VkShaderStageFlagBits, std::string> shader_paths;
-  shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = FRAGMENT_SHADER_PATH + ".spv";
-  shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = VERTEX_SHADER_PATH + ".spv";
+  shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = SpirvPath(FRAGMENT_SHADER_PATH + ".spv");
+  shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = SpirvPath(VERTEX_SHADER_PATH + ".spv");
 
   maker.LoadShaders(m_device, shader_paths);
 
@@ -312,12 +400,13 @@ void SimpleRender::SetupSimplePipeline()
 
   {
     m_pBindings->BindBegin(VK_SHADER_STAGE_VERTEX_BIT);
-    m_pBindings->BindBuffer(0, samplePointsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(0, samplePositionsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(1, sampleNormalsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
     // m_pBindings->BindBuffer(0, voxelCenterBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
     m_pBindings->BindEnd(&pointsdSet, &pointsdSetLayout);
     std::unordered_map<VkShaderStageFlagBits, std::string> shader_paths;
-    shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = "../../resources/shaders/debug_points.frag.spv";
-    shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = "../../resources/shaders/debug_points.vert.spv";
+    shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = SpirvPath("../../resources/shaders/debug_points.frag.spv");
+    shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = SpirvPath("../../resources/shaders/debug_points.vert.spv");
 
     maker.LoadShaders(m_device, shader_paths);
 
@@ -336,11 +425,13 @@ void SimpleRender::SetupSimplePipeline()
   {
     m_pBindings->BindBegin(VK_SHADER_STAGE_VERTEX_BIT);
     m_pBindings->BindBuffer(0, indirectPointsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
-    m_pBindings->BindBuffer(1, samplePointsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(1, sampleMaterialsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(2, brickCellsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(3, gridCascadesBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
     m_pBindings->BindEnd(&cubesdSet, &cubesdSetLayout);
     std::unordered_map<VkShaderStageFlagBits, std::string> shader_paths;
-    shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = "../../resources/shaders/debug_cubes.frag.spv";
-    shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = "../../resources/shaders/debug_cubes.vert.spv";
+    shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = SpirvPath("../../resources/shaders/debug_cubes.frag.spv");
+    shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = SpirvPath("../../resources/shaders/debug_cubes.vert.spv");
 
     maker.LoadShaders(m_device, shader_paths);
 
@@ -355,12 +446,13 @@ void SimpleRender::SetupSimplePipeline()
 
   {
     m_pBindings->BindBegin(VK_SHADER_STAGE_VERTEX_BIT);
-    m_pBindings->BindBuffer(0, samplePointsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(0, samplePositionsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
     m_pBindings->BindBuffer(1, debugBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    m_pBindings->BindBuffer(2, sampleNormalsBuffer, VK_NULL_HANDLE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
     m_pBindings->BindEnd(&pointsdSet, &pointsdSetLayout);
     std::unordered_map<VkShaderStageFlagBits, std::string> shader_paths;
-    shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = "../../resources/shaders/debug_lines.frag.spv";
-    shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = "../../resources/shaders/debug_lines.vert.spv";
+    shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = SpirvPath("../../resources/shaders/debug_lines.frag.spv");
+    shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = SpirvPath("../../resources/shaders/debug_lines.vert.spv");
 
     maker.LoadShaders(m_device, shader_paths);
 
@@ -385,8 +477,8 @@ void SimpleRender::SetupSimplePipeline()
       m_pBindings->BindEnd(&temporalAccumdSet[i], &temporalAccumdSetLayout[i]);
     }
     std::unordered_map<VkShaderStageFlagBits, std::string> shader_paths;
-    shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = "../../resources/shaders/temporal_accum.frag.spv";
-    shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = "../../resources/shaders/temporal_accum.vert.spv";
+    shader_paths[VK_SHADER_STAGE_FRAGMENT_BIT] = SpirvPath("../../resources/shaders/temporal_accum.frag.spv");
+    shader_paths[VK_SHADER_STAGE_VERTEX_BIT]   = SpirvPath("../../resources/shaders/temporal_accum.vert.spv");
 
     maker.LoadShaders(m_device, shader_paths);
 
@@ -417,6 +509,12 @@ vec2 hammersley2d(uint i, uint N) {
     return vec2(float(i)/float(N), radicalInverse_VdC(i));
 }
 
+// additive recurrence with the plastic number, every prefix is evenly distributed
+vec2 r2Sequence(uint i) {
+    const double g = 1.32471795724474602596;
+    return vec2(float(std::fmod(0.5 + (i + 1) / g, 1.0)), float(std::fmod(0.5 + (i + 1) / (g * g), 1.0)));
+}
+
 void SimpleRender::setObjectName(VkBuffer buffer, const char *name)
 {
   if (!vkDebugMarkerSetObjectNameEXT)
@@ -432,21 +530,29 @@ void SimpleRender::setObjectName(VkBuffer buffer, const char *name)
 void SimpleRender::CreateUniformBuffer()
 {
   VkMemoryRequirements memReq;
-  m_ubo = vk_utils::createBuffer(m_device, sizeof(UniformParams), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, &memReq);
+  m_ubo.resize(m_framesInFlight);
+  for (uint32_t i = 0; i < m_framesInFlight; ++i)
+    m_ubo[i] = vk_utils::createBuffer(m_device, sizeof(UniformParams), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, &memReq);
+  const VkDeviceSize stride = (memReq.size + memReq.alignment - 1) / memReq.alignment * memReq.alignment;
 
   VkMemoryAllocateInfo allocateInfo = {};
   allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
   allocateInfo.pNext = nullptr;
-  allocateInfo.allocationSize = memReq.size;
+  allocateInfo.allocationSize = stride * m_framesInFlight;
   allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
                                                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                                                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                                                           m_physicalDevice);
   VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &m_uboAlloc));
 
-  VK_CHECK_RESULT(vkBindBufferMemory(m_device, m_ubo, m_uboAlloc, 0));
-
-  vkMapMemory(m_device, m_uboAlloc, 0, sizeof(m_uniforms), 0, &m_uboMappedMem);
+  void *mappedMem = nullptr;
+  vkMapMemory(m_device, m_uboAlloc, 0, VK_WHOLE_SIZE, 0, &mappedMem);
+  m_uboMappedMem.resize(m_framesInFlight);
+  for (uint32_t i = 0; i < m_framesInFlight; ++i)
+  {
+    VK_CHECK_RESULT(vkBindBufferMemory(m_device, m_ubo[i], m_uboAlloc, stride * i));
+    m_uboMappedMem[i] = static_cast<char *>(mappedMem) + stride * i;
+  }
 
   m_uniforms.lightPos  = LiteMath::float4(0.0f, 1.0f,  1.0f, 1.0f);
   // m_uniforms.lightPos  = LiteMath::float4(0.685000002f, 50.0000000f,  -39.3330002f, 1.0f);
@@ -454,74 +560,14 @@ void SimpleRender::CreateUniformBuffer()
   m_uniforms.exposureValue = 1.f;
 
   UpdateUniformBuffer(0.0f);
+  for (void *mem : m_uboMappedMem)
+    memcpy(mem, &m_uniforms, sizeof(m_uniforms));
 
-  float3 gridF = to_float3((sceneBbox.boxMax - sceneBbox.boxMin) / VOXEL_SIZE);
-  voxelsGrid = uint3(std::ceil(gridF.x), std::ceil(gridF.y), std::ceil(gridF.z));
-  voxelsCount = voxelsGrid.x * voxelsGrid.y * voxelsGrid.z;
-  maxPointsCount = voxelsCount * 6 * PER_SURFACE_POINTS;
-  std::cout << "Voxels count " << voxelsCount << std::endl;
-  visibleVoxelsApproxCount = voxelsCount * 0.275f;
-  visibleVoxelsApproxCount = voxelsCount * 0.6f;
-  std::cout << "Approximate visible voxels count " << visibleVoxelsApproxCount << std::endl;
+  if (clipmapCascades > 0)
+    ScrollClipmap(true);
+  CreateVoxelBuffers();
 
-  {
-    VkMemoryRequirements memReq;
-    pointsBuffer = vk_utils::createBuffer(m_device, sizeof(float4) * PER_SURFACE_POINTS, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT, &memReq);
-    setObjectName(pointsBuffer, "random_points");
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &pointsMem));
-
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, pointsBuffer, pointsMem, 0));
-
-    std::vector<float4> points;
-    srand(0);
-    for (uint32_t i = 0; i < PER_SURFACE_POINTS; ++i)
-    {
-      float2 p = hammersley2d(i, PER_SURFACE_POINTS) - 0.5;
-      points.push_back(float4(p.x, p.y, 0, 0));
-    }
-    pointsToDraw = points.size();
-    m_pCopyHelper->UpdateBuffer(pointsBuffer, 0, points.data(), points.size() * sizeof(float4));
-  }
-  {
-    VkMemoryRequirements memReq;
-    indirectPointsBuffer = vk_utils::createBuffer(m_device, sizeof(uint4) * voxelsCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT, &memReq);
-    setObjectName(indirectPointsBuffer, "point_counters");
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &indirectPointsMem));
-
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, indirectPointsBuffer, indirectPointsMem, 0));
-  }
-  {
-    VkMemoryRequirements memReq;
-    samplePointsBuffer = vk_utils::createBuffer(m_device, sizeof(float4) * 3 * maxPointsCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &memReq);
-    setObjectName(samplePointsBuffer, "samples");
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &samplePointsMem));
-
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, samplePointsBuffer, samplePointsMem, 0));
-  }
+  CreateSamplePoints();
   {
     trianglesCount = 0;
     for (uint32_t i = 0; i < m_pScnMgr->InstancesNum(); ++i)
@@ -530,7 +576,7 @@ void SimpleRender::CreateUniformBuffer()
     }
     trianglesCount /= 3;
     VkMemoryRequirements memReq;
-    primCounterBuffer = vk_utils::createBuffer(m_device, sizeof(uint32_t) * trianglesCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT, &memReq);
+    primCounterBuffer = CreateSharedBuffer(sizeof(uint32_t) * trianglesCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &memReq);
     setObjectName(primCounterBuffer, "samplesPerTriangles");
 
     VkMemoryAllocateInfo allocateInfo = {};
@@ -546,63 +592,8 @@ void SimpleRender::CreateUniformBuffer()
   }
 
   {
-    clustersCount = visibleVoxelsApproxCount * PER_VOXEL_CLUSTERS;
-    approxColumns = visibleVoxelsApproxCount * 0.03f;
-    approxColumns = visibleVoxelsApproxCount * 0.27f;
     VkMemoryRequirements memReq;
-    FFClusteredBuffer = vk_utils::createBuffer(m_device, 2 * sizeof(float) * approxColumns * clustersCount,
-      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &memReq);
-    setObjectName(FFClusteredBuffer, "FF");
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &FFClusteredMem));
-
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, FFClusteredBuffer, FFClusteredMem, 0));
-  }
-
-  {
-    VkMemoryRequirements memReq;
-    initLightingBuffer = vk_utils::createBuffer(m_device, sizeof(float4) * clustersCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &memReq);
-    setObjectName(initLightingBuffer, "initial_lighting");
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &initLightingMem));
-
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, initLightingBuffer, initLightingMem, 0));
-  }
-
-  {
-    VkMemoryRequirements memReq;
-    reflLightingBuffer = vk_utils::createBuffer(m_device, sizeof(float4) * clustersCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &memReq);
-    setObjectName(reflLightingBuffer, "reflected_lighting");
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &reflLightingMem));
-
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, reflLightingBuffer, reflLightingMem, 0));
-  }
-
-  {
-    VkMemoryRequirements memReq;
-    debugIndirBuffer = vk_utils::createBuffer(m_device, sizeof(uint) * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT, &memReq);
+    debugIndirBuffer = CreateSharedBuffer(sizeof(uint) * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT, &memReq);
     setObjectName(debugIndirBuffer, "debug_lines_counter");
 
     VkMemoryAllocateInfo allocateInfo = {};
@@ -620,7 +611,7 @@ void SimpleRender::CreateUniformBuffer()
   {
     VkMemoryRequirements memReq;
     uint32_t debugLinesCnt = 1000;//maxPointsCount;
-    debugBuffer = vk_utils::createBuffer(m_device, 2 * sizeof(uint) * debugLinesCnt, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &memReq);
+    debugBuffer = CreateSharedBuffer(2 * sizeof(uint) * debugLinesCnt, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &memReq);
     setObjectName(debugBuffer, "debug_lines");
 
     VkMemoryAllocateInfo allocateInfo = {};
@@ -637,24 +628,7 @@ void SimpleRender::CreateUniformBuffer()
 
   {
     VkMemoryRequirements memReq;
-    nonEmptyVoxelsBuffer = vk_utils::createBuffer(m_device, sizeof(uint) * voxelsCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &memReq);
-    setObjectName(nonEmptyVoxelsBuffer, "visible_voxels");
-
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &nonEmptyVoxelsMem));
-
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, nonEmptyVoxelsBuffer, nonEmptyVoxelsMem, 0));
-  }
-
-  {
-    VkMemoryRequirements memReq;
-    indirVoxelsBuffer = vk_utils::createBuffer(m_device, sizeof(uint) * 4 * 2,
+    indirVoxelsBuffer = CreateSharedBuffer(sizeof(uint) * 4 * 2,
       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &memReq);
     setObjectName(indirVoxelsBuffer, "visible_voxels_counter");
 
@@ -670,57 +644,237 @@ void SimpleRender::CreateUniformBuffer()
     VK_CHECK_RESULT(vkBindBufferMemory(m_device, indirVoxelsBuffer, indirVoxelsMem, 0));
   }
 
-  {
-    VkMemoryRequirements memReq;
-    appliedLightingBuffer = vk_utils::createBuffer(m_device, sizeof(float4) * voxelsCount * 6, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT, &memReq);
-    setObjectName(appliedLightingBuffer, "final_lighting");
+  // placeholders until the GenSamples count pass tells the real sizes
+  CreateVisibleVoxelsBuffers(0, 0);
+}
 
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &appliedLightingMem));
+void SimpleRender::CreateVoxelBuffers()
+{
+  BuildBrickMap();
+  maxPointsCount = voxelSlotsCount * 6 * PerFacePointsMax();
+  // zero sized buffers are not allowed, the clipmap scrolls fill the pool up to brickCapacity
+  const uint32_t slots = std::max(brickCapacity * BRICK_VOXELS, 1u);
+  CreateDeviceBuffer(sizeof(uint32_t) * (AdaptiveSampling() ? slots * SAMPLING_STATS_COUNT : 1),
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "sampling_stats", samplingStatsBuffer, samplingStatsMem);
+  CreateDeviceBuffer(sizeof(uint4) * slots,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "point_counters", indirectPointsBuffer, indirectPointsMem);
+  CreateDeviceBuffer(sizeof(uint32_t) * ((slots + 31) / 32), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "occupancy", occupancyBuffer, occupancyMem);
+  CreateDeviceBuffer(sizeof(uint) * slots, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "visible_voxels", nonEmptyVoxelsBuffer, nonEmptyVoxelsMem);
+  CreateDeviceBuffer(sizeof(float4) * slots * 6,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "final_lighting", appliedLightingBuffer, appliedLightingMem);
+  CreateDeviceBuffer(sizeof(float4) * slots * 6, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "published_lighting", publishedLightingBuffer, publishedLightingMem);
+}
 
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, appliedLightingBuffer, appliedLightingMem, 0));
-  }
+void SimpleRender::CreateSamplePoints()
+{
+  CreateDeviceBuffer(sizeof(float4) * PerFacePointsMax(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "random_points", pointsBuffer, pointsMem);
 
+  std::vector<float4> points;
+  for (uint32_t i = 0; i < PerFacePointsMax(); ++i)
   {
-    VkMemoryRequirements memReq;
-    ffRowLenBuffer = vk_utils::createBuffer(m_device, sizeof(uint32_t) * (clustersCount + 1),
-      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &memReq);
-    setObjectName(ffRowLenBuffer, "ff_row_lengths");
+    // adaptive sampling shoots prefixes of the sequence, Hammersley points of a fixed count don't have even prefixes
+    // while the R2 sequence does
+    float2 p = AdaptiveSampling() ? r2Sequence(i) - 0.5 : hammersley2d(i, PER_SURFACE_POINTS) - 0.5;
+    points.push_back(float4(p.x, p.y, 0, 0));
+  }
+  pointsToDraw = points.size();
+  m_pCopyHelper->UpdateBuffer(pointsBuffer, 0, points.data(), points.size() * sizeof(float4));
+}
 
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &ffRowLenMem));
+void SimpleRender::RebuildVoxels()
+{
+  // frames in flight may still read the old buffers
+  vkDeviceWaitIdle(m_device);
+  CreateVoxelBuffers();
+  // adaptive sampling may have been switched, the pattern and its size differ
+  CreateSamplePoints();
+
+  // the scene pass timings of the frames in flight belong to the old layout
+  m_sceneQueryMask = 0;
+  // an async FF batch has finished with the wait above, its results belong to the old voxels
+  asyncFF.inFlight = false;
+  asyncFF.published = false;
+  // the samples, form factors and lighting of the old voxels are useless
+  computeState = ComputeState{};
+  useAlias = false;
+  switchAlias = false;
+  FFComputeProgress = 0.0f;
+  visibleVoxelsCount = 0;
+  prevFFVoxels = 0;
+  ffHostRowLens.clear();
+  ffHostEntries.clear();
+  CreateVisibleVoxelsBuffers(0, 0);
+  UpdateGenSamplesBindings();
+  SetupSimplePipeline();
 
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, ffRowLenBuffer, ffRowLenMem, 0));
+  ffCacheChecked = true;
+  ffCacheLoaded = FFCacheEnabled() && LoadFFCache();
+  if (ffCacheLoaded)
+  {
+    computeState.version = 1;
+    useAlias = true;
+    FFComputeProgress = 1.0f;
   }
+}
 
+void SimpleRender::CreateDeviceBuffer(VkDeviceSize a_size, VkBufferUsageFlags a_usage, const char *a_name,
+  VkBuffer &a_buffer, VkDeviceMemory &a_mem)
+{
+  if (a_buffer != VK_NULL_HANDLE)
   {
-    VkMemoryRequirements memReq;
-    ffTmpRowBuffer = vk_utils::createBuffer(m_device, sizeof(float) * clustersCount * 6, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &memReq);
-    setObjectName(ffTmpRowBuffer, "ff_tmp_row");
+    vkDestroyBuffer(m_device, a_buffer, nullptr);
+    vkFreeMemory(m_device, a_mem, nullptr);
+  }
 
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.pNext = nullptr;
-    allocateInfo.allocationSize = memReq.size;
-    allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                                            m_physicalDevice);
-    VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &ffTmpRowMem));
+  VkMemoryRequirements memReq;
+  a_buffer = CreateSharedBuffer(a_size, a_usage, &memReq);
+  setObjectName(a_buffer, a_name);
 
-    VK_CHECK_RESULT(vkBindBufferMemory(m_device, ffTmpRowBuffer, ffTmpRowMem, 0));
-  }
+  VkMemoryAllocateInfo allocateInfo = {};
+  allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocateInfo.pNext = nullptr;
+  allocateInfo.allocationSize = memReq.size;
+  allocateInfo.memoryTypeIndex = vk_utils::findMemoryType(memReq.memoryTypeBits,
+                                                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                                          m_physicalDevice);
+  VK_CHECK_RESULT(vkAllocateMemory(m_device, &allocateInfo, nullptr, &a_mem));
+
+  VK_CHECK_RESULT(vkBindBufferMemory(m_device, a_buffer, a_mem, 0));
+}
+
+VkBuffer SimpleRender::CreateSharedBuffer(VkDeviceSize a_size, VkBufferUsageFlags a_usage, VkMemoryRequirements *a_memReq)
+{
+  const uint32_t queueFamilies[2] = { m_queueFamilyIDXs.graphics, m_queueFamilyIDXs.compute };
+  VkBufferCreateInfo bufferInfo = {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = a_size;
+  bufferInfo.usage = a_usage;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  if (AsyncFFAvailable())
+  {
+    bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    bufferInfo.queueFamilyIndexCount = 2;
+    bufferInfo.pQueueFamilyIndices = queueFamilies;
+  }
+
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VK_CHECK_RESULT(vkCreateBuffer(m_device, &bufferInfo, nullptr, &buffer));
+  vkGetBufferMemoryRequirements(m_device, buffer, a_memReq);
+  return buffer;
+}
+
+bool SimpleRender::CreateVisibleVoxelsBuffers(uint32_t a_visibleVoxels, uint32_t a_pointsCount)
+{
+  if (samplePositionsBuffer != VK_NULL_HANDLE && a_visibleVoxels * PER_VOXEL_CLUSTERS == clustersCount && a_pointsCount == samplesCount)
+    return false;
+
+  // previous frames may still read the old buffers
+  vkDeviceWaitIdle(m_device);
+  clustersCount = a_visibleVoxels * PER_VOXEL_CLUSTERS;
+  samplesCount = a_pointsCount;
+  // zero sized buffers are not allowed
+  const uint32_t clusters = std::max(clustersCount, 1u);
+
+  const uint32_t samples = std::max(samplesCount, 1u);
+  CreateDeviceBuffer(SAMPLE_POSITION_SIZE * samples,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "sample_positions", samplePositionsBuffer, samplePositionsMem);
+  CreateDeviceBuffer(SAMPLE_NORMAL_SIZE * samples,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "sample_normals", sampleNormalsBuffer, sampleNormalsMem);
+  CreateDeviceBuffer(SAMPLE_MATERIAL_SIZE * samples,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "sample_materials", sampleMaterialsBuffer, sampleMaterialsMem);
+  CreateDeviceBuffer(sizeof(float4) * clusters, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "initial_lighting", initLightingBuffer, initLightingMem);
+  CreateDeviceBuffer(sizeof(float4) * clusters, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "reflected_lighting", reflLightingBuffer, reflLightingMem);
+  CreateDeviceBuffer(sizeof(uint32_t) * RayTracer_GPU::FFRowLensSize(clustersCount),
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "ff_row_lengths", ffRowLenBuffer, ffRowLenMem);
+  CreateDeviceBuffer(sizeof(float4) * clusters, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "solver_unshot", solverUnshotBuffer, solverUnshotMem);
+  CreateDeviceBuffer(sizeof(uint32_t) * SOLVER_STATS_COUNT,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "solver_stats", solverStatsBuffer, solverStatsMem);
+  CreateDeviceBuffer(sizeof(float4) * std::max(a_visibleVoxels, 1u), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    "light_cache", lightCacheBuffer, lightCacheMem);
+  CreateDeviceBuffer(sizeof(float4) * clusters, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    "patch_albedo", patchAlbedoBuffer, patchAlbedoMem);
+  transientHeap.Destroy(m_device);
+  ffTmpRowBuffer = transientHeap.Add(m_device, sizeof(float) * clusters * 6 * RayTracer_GPU::FF_PACK_BATCH,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, PHASE_FF_BATCH, PHASE_FF_BATCH);
+  solverTmpBuffer = transientHeap.Add(m_device, sizeof(float4) * clusters, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    PHASE_LIGHTING, PHASE_LIGHTING);
+  transientHeap.Allocate(m_device, m_physicalDevice);
+  setObjectName(ffTmpRowBuffer, "ff_tmp_row");
+  setObjectName(solverTmpBuffer, "solver_tmp");
+  if (AsyncFFAvailable())
+  {
+    asyncTransientHeap.Destroy(m_device);
+    asyncFFTmpRowBuffer = asyncTransientHeap.Add(m_device, sizeof(float) * clusters * 6 * RayTracer_GPU::FF_PACK_BATCH,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, PHASE_FF_BATCH, PHASE_FF_BATCH);
+    asyncSolverTmpBuffer = asyncTransientHeap.Add(m_device, sizeof(float4) * clusters, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      PHASE_LIGHTING, PHASE_LIGHTING);
+    asyncTransientHeap.Allocate(m_device, m_physicalDevice);
+    setObjectName(asyncFFTmpRowBuffer, "async_ff_tmp_row");
+    setObjectName(asyncSolverTmpBuffer, "async_solver_tmp");
+  }
+  solverState.reset = true;
+  solverStatsPending = 0;
+  // the batches of the frames in flight belong to the old FF
+  ffBatchPending = 0;
+  lightingState.cacheValid = false;
+  lightingState.dirty = true;
+
+  // the old form factors belong to other voxels, start from an empty matrix
+  if (FFClusteredBuffer != VK_NULL_HANDLE)
+  {
+    vkDestroyBuffer(m_device, FFClusteredBuffer, nullptr);
+    vkFreeMemory(m_device, FFClusteredMem, nullptr);
+    FFClusteredBuffer = VK_NULL_HANDLE;
+    FFClusteredMem = VK_NULL_HANDLE;
+  }
+  ffCapacity = 0;
+  ReserveFF(0);
+  return true;
+}
+
+bool SimpleRender::ReserveFF(uint32_t a_required)
+{
+  if (FFClusteredBuffer != VK_NULL_HANDLE && a_required <= ffCapacity)
+    return false;
+
+  const uint32_t capacity = (a_required / FF_GROWTH_CHUNK + 1) * FF_GROWTH_CHUNK;
+  VkBuffer oldBuffer = FFClusteredBuffer;
+  VkDeviceMemory oldMem = FFClusteredMem;
+  FFClusteredBuffer = VK_NULL_HANDLE;
+  FFClusteredMem = VK_NULL_HANDLE;
+  CreateDeviceBuffer(sizeof(uint32_t) * capacity,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT|VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    "FF", FFClusteredBuffer, FFClusteredMem);
+
+  if (oldBuffer != VK_NULL_HANDLE)
+  {
+    // the fence of the copy also covers the earlier submissions that used the old buffer
+    SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+      VkBufferCopy region = {};
+      region.size = sizeof(uint32_t) * ffCapacity;
+      vkCmdCopyBuffer(commandBuffer, oldBuffer, FFClusteredBuffer, 1, &region);
+    });
+    vkDestroyBuffer(m_device, oldBuffer, nullptr);
+    vkFreeMemory(m_device, oldMem, nullptr);
+  }
+  ffCapacity = capacity;
+  std::cout << "FF capacity " << ffCapacity << std::endl;
+  return true;
 }
 
 float modify(float x)
@@ -734,12 +888,32 @@ void SimpleRender::UpdateUniformBuffer(float a_time)
   m_uniforms.lightPos.z = modify(a_time * lightSpeed) * (4.9f+ 6.8f) - 6.8f;
 // most uniforms are updated in GUI -> SetupGUIElements()
   m_uniforms.time = a_time;
-  m_uniforms.bmin = to_float3(sceneBbox.boxMin);
-  m_uniforms.bmax = to_float3(sceneBbox.boxMax);
-  m_uniforms.voxelSize = VOXEL_SIZE;
+  m_uniforms.cascadesCount = uint32_t(gridCascades.size());
   m_uniforms.interpolation = (interpolation ? 1 : 0) | (directLight ? 2 : 0) | (indirectLight ? 4 : 0)
     | (tonemapping ? 8 : 0);
-  memcpy(m_uboMappedMem, &m_uniforms, sizeof(m_uniforms));
+  // BeginFrame copies the uniforms to the buffer of the frame once the frame slot is free
+}
+
+void SimpleRender::RecordFrameBegin(VkCommandBuffer a_cmdBuff)
+{
+  const uint32_t frame = m_presentationResources.currentFrame;
+  if (m_frameQueryPool != VK_NULL_HANDLE)
+  {
+    vkCmdResetQueryPool(a_cmdBuff, m_frameQueryPool, frame * FRAME_QUERIES_COUNT, FRAME_QUERIES_COUNT);
+    vkCmdWriteTimestamp(a_cmdBuff, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_frameQueryPool, frame * FRAME_QUERIES_COUNT + FRAME_QUERY_BEGIN);
+  }
+  // the previous frame may still sample the images of the temporal accumulation ring that this one renders to
+  vkCmdPipelineBarrier(a_cmdBuff, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+}
+
+void SimpleRender::RecordFrameEnd(VkCommandBuffer a_cmdBuff)
+{
+  const uint32_t frame = m_presentationResources.currentFrame;
+  if (m_frameQueryPool == VK_NULL_HANDLE)
+    return;
+  vkCmdWriteTimestamp(a_cmdBuff, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_frameQueryPool, frame * FRAME_QUERIES_COUNT + FRAME_QUERY_END);
+  m_frameQueryMask |= 1u << frame;
 }
 
 void SimpleRender::BuildCommandBufferSimple(VkCommandBuffer a_cmdBuff, VkFramebuffer a_frameBuff,
@@ -752,6 +926,7 @@ void SimpleRender::BuildCommandBufferSimple(VkCommandBuffer a_cmdBuff, VkFramebu
   beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
 
   VK_CHECK_RESULT(vkBeginCommandBuffer(a_cmdBuff, &beginInfo));
+  RecordFrameBegin(a_cmdBuff);
 
   vk_utils::setDefaultViewport(a_cmdBuff, static_cast<float>(m_width), static_cast<float>(m_height));
   vk_utils::setDefaultScissor(a_cmdBuff, m_width, m_height);
@@ -761,7 +936,6 @@ void SimpleRender::BuildCommandBufferSimple(VkCommandBuffer a_cmdBuff, VkFramebu
     VkRenderPassBeginInfo renderPassInfo = {};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderPassInfo.renderPass = m_screenRenderPass;
-    renderPassInfo.framebuffer = mainFramebuffers[0];
     renderPassInfo.renderArea.offset = {0, 0};
     renderPassInfo.renderArea.extent = m_swapchain.GetExtent();
 
@@ -771,221 +945,184 @@ void SimpleRender::BuildCommandBufferSimple(VkCommandBuffer a_cmdBuff, VkFramebu
     renderPassInfo.clearValueCount = 2;
     renderPassInfo.pClearValues = &clearValues[0];
 
-    vkCmdBeginRenderPass(a_cmdBuff, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, a_pipeline);
-
-    vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_basicForwardPipeline.layout, 0, 1,
-                            &m_dSet, 0, VK_NULL_HANDLE);
-
     VkShaderStageFlags stageFlags = (VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
 
-    VkDeviceSize zero_offset = 0u;
-    VkBuffer vertexBuf = m_pScnMgr->GetVertexBuffer();
-    VkBuffer indexBuf = m_pScnMgr->GetIndexBuffer();
-
-    vkCmdBindVertexBuffers(a_cmdBuff, 0, 1, &vertexBuf, &zero_offset);
-    vkCmdBindIndexBuffer(a_cmdBuff, indexBuf, 0, VK_INDEX_TYPE_UINT32);
-
-    for (uint32_t i = 0; i < m_pScnMgr->InstancesNum(); ++i)
-    {
-      auto inst = m_pScnMgr->GetInstanceInfo(i);
-
-      pushConst2M.model = m_pScnMgr->GetInstanceMatrix(i);
-      auto mesh_info = m_pScnMgr->GetMeshInfo(inst.mesh_id);
-      vkCmdPushConstants(a_cmdBuff, m_basicForwardPipeline.layout, stageFlags, 0,
-                         sizeof(pushConst2M), &pushConst2M);
-
-      vkCmdDrawIndexed(a_cmdBuff, mesh_info.m_indNum, 1, mesh_info.m_indexOffset, mesh_info.m_vertexOffset, 0);
-    }
-
-    if (debugPoints)
-    {
-      vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugPointsPipeline.pipeline);
-
-      vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugPointsPipeline.layout, 0, 1,
-                              &pointsdSet, 0, VK_NULL_HANDLE);
-
-      struct KernelArgsPC
-      {
-        LiteMath::float4x4 projView;
-        uint32_t perFacePointsCount;
-      } pcData;
-      pcData.projView = pushConst2M.projView;
-      pcData.perFacePointsCount = PER_SURFACE_POINTS;
-      vkCmdPushConstants(a_cmdBuff, m_debugPointsPipeline.layout, stageFlags, 0,
-                          sizeof(pcData), &pcData);
+    // the frames of the ring are left in the shader read layout, the barrier at the start of the frame orders them
+    // after the previous frame, the wait of the acquire semaphore is at the color attachment output stage
+    RenderGraph graph("frame");
+    for (const auto &frame : framesSequence)
+      graph.ImportImage(frame.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    graph.ImportImage(swapchainData.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+
+    graph.AddPass("scene", { RenderGraph::Image(framesSequence[0].image, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR),
+      RenderGraph::Buffer(indirectPointsBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT),
+      RenderGraph::Buffer(debugIndirBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT) },
+      [&](VkCommandBuffer) {
+        renderPassInfo.framebuffer = mainFramebuffers[0];
+        const uint32_t frameQuery = m_presentationResources.currentFrame * FRAME_QUERIES_COUNT;
+        vkCmdBeginRenderPass(a_cmdBuff, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        if (m_frameQueryPool != VK_NULL_HANDLE)
+          vkCmdWriteTimestamp(a_cmdBuff, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_frameQueryPool, frameQuery + FRAME_QUERY_SCENE_BEGIN);
+        vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, a_pipeline);
+
+        vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_basicForwardPipeline.layout, 0, 1,
+                                &m_dSet[m_presentationResources.currentFrame + (asyncFF.published ? m_framesInFlight : 0)], 0, VK_NULL_HANDLE);
+
+        VkDeviceSize zero_offset = 0u;
+        VkBuffer vertexBuf = m_pScnMgr->GetVertexBuffer();
+        VkBuffer indexBuf = m_pScnMgr->GetIndexBuffer();
+
+        vkCmdBindVertexBuffers(a_cmdBuff, 0, 1, &vertexBuf, &zero_offset);
+        vkCmdBindIndexBuffer(a_cmdBuff, indexBuf, 0, VK_INDEX_TYPE_UINT32);
+
+        for (uint32_t i = 0; i < m_pScnMgr->InstancesNum(); ++i)
+        {
+          auto inst = m_pScnMgr->GetInstanceInfo(i);
+
+          pushConst2M.model = m_pScnMgr->GetInstanceMatrix(i);
+          auto mesh_info = m_pScnMgr->GetMeshInfo(inst.mesh_id);
+          vkCmdPushConstants(a_cmdBuff, m_basicForwardPipeline.layout, stageFlags, 0,
+                             sizeof(pushConst2M), &pushConst2M);
+
+          // the instance index selects the derived data in simple.vert
+          vkCmdDrawIndexed(a_cmdBuff, mesh_info.m_indNum, 1, mesh_info.m_indexOffset, mesh_info.m_vertexOffset, i);
+        }
+        if (m_frameQueryPool != VK_NULL_HANDLE)
+        {
+          vkCmdWriteTimestamp(a_cmdBuff, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_frameQueryPool, frameQuery + FRAME_QUERY_SCENE_END);
+          m_sceneQueryMask |= 1u << m_presentationResources.currentFrame;
+        }
+
+        if (debugPoints)
+        {
+          vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugPointsPipeline.pipeline);
+
+          vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugPointsPipeline.layout, 0, 1,
+                                  &pointsdSet, 0, VK_NULL_HANDLE);
+
+          struct KernelArgsPC
+          {
+            LiteMath::float4x4 projView;
+            uint32_t perFacePointsCount;
+          } pcData;
+          pcData.projView = pushConst2M.projView;
+          pcData.perFacePointsCount = PER_SURFACE_POINTS;
+          vkCmdPushConstants(a_cmdBuff, m_debugPointsPipeline.layout, stageFlags, 0,
+                              sizeof(pcData), &pcData);
       
-      // vkCmdDraw(a_cmdBuff, voxelsCount, 1, 0, 0);
-      vkCmdDrawIndirect(a_cmdBuff, indirectPointsBuffer, 0, voxelsCount, sizeof(uint32_t) * 4);
-    }
-
-    if (debugCubes)
-    {
-      vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugCubesPipeline.pipeline);
-
-      vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugCubesPipeline.layout, 0, 1,
-                              &cubesdSet, 0, VK_NULL_HANDLE);
-
-      struct KernelArgsPC
-      {
-        LiteMath::float4x4 projView;
-        LiteMath::float3 bmin;
-        uint32_t voxelsCount;
-        LiteMath::float3 bmax;
-        float voxelSize;
-        uint32_t maxPointsPerVoxelCount;
-        float debugCubesScale;
-      } pcData;
-      pcData.projView = pushConst2M.projView;
-      pcData.bmin = to_float3(sceneBbox.boxMin);
-      pcData.voxelsCount = voxelsCount;
-      pcData.bmax = to_float3(sceneBbox.boxMax);
-      pcData.voxelSize = VOXEL_SIZE;
-      pcData.maxPointsPerVoxelCount = 6 * PER_SURFACE_POINTS;
-      pcData.debugCubesScale = debugCubesScale;
-      vkCmdPushConstants(a_cmdBuff, m_debugCubesPipeline.layout, stageFlags, 0,
-                          sizeof(pcData), &pcData);
+          // vkCmdDraw(a_cmdBuff, voxelsCount, 1, 0, 0);
+          vkCmdDrawIndirect(a_cmdBuff, indirectPointsBuffer, 0, voxelSlotsCount, sizeof(uint32_t) * 4);
+        }
+
+        if (debugCubes)
+        {
+          vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugCubesPipeline.pipeline);
+
+          vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugCubesPipeline.layout, 0, 1,
+                                  &cubesdSet, 0, VK_NULL_HANDLE);
+
+          struct KernelArgsPC
+          {
+            LiteMath::float4x4 projView;
+            uint32_t voxelsCount;
+            uint32_t maxPointsPerVoxelCount;
+            float debugCubesScale;
+          } pcData;
+          pcData.projView = pushConst2M.projView;
+          pcData.voxelsCount = voxelSlotsCount;
+          pcData.maxPointsPerVoxelCount = 6 * PerFacePointsMax();
+          pcData.debugCubesScale = debugCubesScale;
+          vkCmdPushConstants(a_cmdBuff, m_debugCubesPipeline.layout, stageFlags, 0,
+                              sizeof(pcData), &pcData);
       
-      vkCmdDraw(a_cmdBuff, 36, voxelsCount, 0, 0);
-    }
-
-    {
-      vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugLinesPipeline.pipeline);
-
-      vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugLinesPipeline.layout, 0, 1,
-                              &pointsdSet, 0, VK_NULL_HANDLE);
-
-      struct KernelArgsPC
-      {
-        LiteMath::float4x4 projView;
-        uint32_t perFacePointsCount;
-      } pcData;
-      pcData.projView = pushConst2M.projView;
-      pcData.perFacePointsCount = PER_SURFACE_POINTS;
-      vkCmdPushConstants(a_cmdBuff, m_debugLinesPipeline.layout, stageFlags, 0,
-                          sizeof(pcData), &pcData);
+          vkCmdDraw(a_cmdBuff, 36, voxelSlotsCount, 0, 0);
+        }
+
+        {
+          vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugLinesPipeline.pipeline);
+
+          vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debugLinesPipeline.layout, 0, 1,
+                                  &pointsdSet, 0, VK_NULL_HANDLE);
+
+          struct KernelArgsPC
+          {
+            LiteMath::float4x4 projView;
+            uint32_t perFacePointsCount;
+          } pcData;
+          pcData.projView = pushConst2M.projView;
+          pcData.perFacePointsCount = PER_SURFACE_POINTS;
+          vkCmdPushConstants(a_cmdBuff, m_debugLinesPipeline.layout, stageFlags, 0,
+                              sizeof(pcData), &pcData);
       
-      vkCmdDrawIndirect(a_cmdBuff, debugIndirBuffer, 0, 1, sizeof(uint32_t) * 4);
-    }
-
-    vkCmdEndRenderPass(a_cmdBuff);
-
-    VkImageMemoryBarrier barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = framesSequence[0].image;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-
-    barrier.srcAccessMask = VK_IMAGE_ASPECT_COLOR_BIT; // TODO
-    barrier.dstAccessMask = VK_IMAGE_ASPECT_COLOR_BIT; // TODO
-
-    vkCmdPipelineBarrier(
-        a_cmdBuff,
-        VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT , VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT ,
-        VK_DEPENDENCY_BY_REGION_BIT,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
-
-    renderPassInfo.framebuffer = mainFramebuffers[1];
-    renderPassInfo.renderArea.offset = {0, 0};
-    renderPassInfo.renderArea.extent = m_swapchain.GetExtent();
-
-    vkCmdBeginRenderPass(a_cmdBuff, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-    {
-      vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_temporalAccumPipeline.pipeline);
-
-      vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_temporalAccumPipeline.layout, 0, 1,
-                              &temporalAccumdSet[0], 0, VK_NULL_HANDLE);
-
-      struct KernelArgsPC
-      {
-        float blendFactor;
-      } pcData;
-      pcData.blendFactor = blendFactor;
-      vkCmdPushConstants(a_cmdBuff, m_temporalAccumPipeline.layout, stageFlags, 0,
-                          sizeof(pcData), &pcData);
+          vkCmdDrawIndirect(a_cmdBuff, debugIndirBuffer, 0, 1, sizeof(uint32_t) * 4);
+        }
+
+        vkCmdEndRenderPass(a_cmdBuff);
+      });
+
+    graph.AddPass("temporal_accum", { RenderGraph::Image(framesSequence[0].image, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+      RenderGraph::Image(framesSequence[2].image, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+      RenderGraph::Image(framesSequence[1].image, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR) },
+      [&](VkCommandBuffer) {
+        renderPassInfo.framebuffer = mainFramebuffers[1];
+        vkCmdBeginRenderPass(a_cmdBuff, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+        {
+          vkCmdBindPipeline(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_temporalAccumPipeline.pipeline);
+
+          vkCmdBindDescriptorSets(a_cmdBuff, VK_PIPELINE_BIND_POINT_GRAPHICS, m_temporalAccumPipeline.layout, 0, 1,
+                                  &temporalAccumdSet[0], 0, VK_NULL_HANDLE);
+
+          struct KernelArgsPC
+          {
+            float blendFactor;
+          } pcData;
+          pcData.blendFactor = blendFactor;
+          vkCmdPushConstants(a_cmdBuff, m_temporalAccumPipeline.layout, stageFlags, 0,
+                              sizeof(pcData), &pcData);
       
-      vkCmdDraw(a_cmdBuff, 3, 1, 0, 0);
-    }
-    vkCmdEndRenderPass(a_cmdBuff);
-
-    VkImageCopy cp{};
-    cp.srcOffset = VkOffset3D{0, 0, 0};
-    cp.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    cp.srcSubresource.layerCount = 1;
-    cp.dstOffset = VkOffset3D{0, 0, 0};
-    cp.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    cp.dstSubresource.layerCount = 1;
-    cp.extent = VkExtent3D{m_swapchain.GetExtent().width, m_swapchain.GetExtent().height, 1};
-
-
-    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    barrier.image = swapchainData.image;
-    vkCmdPipelineBarrier(
-        a_cmdBuff,
-        VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT , VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT ,
-        VK_DEPENDENCY_BY_REGION_BIT,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
-
-    barrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    barrier.image = framesSequence[1].image;
-    vkCmdPipelineBarrier(
-        a_cmdBuff,
-        VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT , VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT ,
-        VK_DEPENDENCY_BY_REGION_BIT,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
-
-    vkCmdCopyImage(a_cmdBuff, framesSequence[1].image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 
-      swapchainData.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cp);
-
-    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    barrier.image = framesSequence[1].image;
-    vkCmdPipelineBarrier(
-        a_cmdBuff,
-        VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT , VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT ,
-        VK_DEPENDENCY_BY_REGION_BIT,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
-
-    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-    barrier.image = swapchainData.image;
-    vkCmdPipelineBarrier(
-        a_cmdBuff,
-        VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT , VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT ,
-        VK_DEPENDENCY_BY_REGION_BIT,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
-  }
-
+          vkCmdDraw(a_cmdBuff, 3, 1, 0, 0);
+        }
+        vkCmdEndRenderPass(a_cmdBuff);
+      });
+
+    graph.AddPass("copy_to_swapchain", { RenderGraph::Image(framesSequence[1].image, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL),
+      RenderGraph::Image(swapchainData.image, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) },
+      [&](VkCommandBuffer) {
+        VkImageCopy cp{};
+        cp.srcOffset = VkOffset3D{0, 0, 0};
+        cp.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        cp.srcSubresource.layerCount = 1;
+        cp.dstOffset = VkOffset3D{0, 0, 0};
+        cp.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        cp.dstSubresource.layerCount = 1;
+        cp.extent = VkExtent3D{m_swapchain.GetExtent().width, m_swapchain.GetExtent().height, 1};
+
+        vkCmdCopyImage(a_cmdBuff, framesSequence[1].image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+          swapchainData.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cp);
+      });
+
+    // the temporal image is the history of the next frame
+    graph.AddPass("present", { RenderGraph::Image(framesSequence[1].image, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+      RenderGraph::Image(swapchainData.image, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR) },
+      nullptr);
+    ExecuteGraph(graph, a_cmdBuff);
+  }
+
+  RecordFrameEnd(a_cmdBuff);
   VK_CHECK_RESULT(vkEndCommandBuffer(a_cmdBuff));
 
   if (screenshotRequested)
   {
+    // the frames in flight may still render to the image
+    vkDeviceWaitIdle(m_device);
     std::vector<uint32_t> imageData(m_width * m_height);
     m_pCopyHelper->ReadImage(framesSequence[0].image, imageData.data(), m_width, m_height, 4, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
     for (uint32_t &color : imageData)
@@ -1023,11 +1160,13 @@ void SimpleRender::BuildCommandBufferQuad(VkCommandBuffer a_cmdBuff, VkImageView
   beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
 
   VK_CHECK_RESULT(vkBeginCommandBuffer(a_cmdBuff, &beginInfo));
+  RecordFrameBegin(a_cmdBuff);
   {
     float scaleAndOffset[4] = { 0.5f, 0.5f, -0.5f, +0.5f };
     m_pFSQuad->SetRenderTarget(a_targetImageView);
     m_pFSQuad->DrawCmd(a_cmdBuff, m_quadDS, scaleAndOffset);
   }
+  RecordFrameEnd(a_cmdBuff);
 
   VK_CHECK_RESULT(vkEndCommandBuffer(a_cmdBuff));
 }
@@ -1124,14 +1263,10 @@ void SimpleRender::ProcessInput(const AppInput &input)
     std::system("cd ../../resources/shaders && python3 compile_simple_render_shaders.py");
 #endif
 
+    // the frames in flight still use the old pipelines, the draw command buffers are recorded every frame
+    vkDeviceWaitIdle(m_device);
     m_pRayTracerGPU.reset();
     SetupSimplePipeline();
-
-    for (uint32_t i = 0; i < m_framesInFlight; ++i)
-    {
-      BuildCommandBufferSimple(m_cmdBuffersDrawMain[i], m_frameBuffers[i],
-                               m_swapchain.GetAttachment(i), m_basicForwardPipeline.pipeline);
-    }
   }
 
   if(input.keyPressed[GLFW_KEY_1])
@@ -1198,6 +1333,8 @@ void SimpleRender::UpdateView()
 
 void SimpleRender::LoadScene(const char* path)
 {
+  m_scenePath = path;
+  ffCacheChecked = false;
   m_pScnMgr->LoadScene(path);
   m_pScnMgr->BuildAllBLAS();
   m_pScnMgr->BuildTLAS();
@@ -1211,12 +1348,7 @@ void SimpleRender::LoadScene(const char* path)
   // set large a_maxSets, because every window resize will cause the descriptor set for quad being to be recreated
   m_pBindings = std::make_shared<vk_utils::DescriptorMaker>(m_device, dtypes, 1000);
 
-  SetupRTImage();
-  CreateUniformBuffer();
-
-  SetupSimplePipeline();
-  SetupQuadDescriptors();
-
+  // the clipmap is placed around the camera
   auto loadedCam = m_pScnMgr->GetCamera(0);
   m_cam.fov = loadedCam.fov;
   m_cam.pos = float3(loadedCam.pos);
@@ -1224,21 +1356,118 @@ void SimpleRender::LoadScene(const char* path)
   m_cam.lookAt = float3(loadedCam.lookAt);
   m_cam.tdist  = loadedCam.farPlane;
 
+  SetupRTImage();
+  CreateUniformBuffer();
+
+  SetupSimplePipeline();
+  SetupQuadDescriptors();
+
   UpdateView();
 }
 
+void SimpleRender::BeginFrame()
+{
+  using clock = std::chrono::high_resolution_clock;
+  const auto start = clock::now();
+  if (frameStats.started)
+  {
+    const float frameMs = std::chrono::duration<float, std::milli>(start - frameStats.start).count();
+    frameStats.frameMs = frameStats.frameMs * 0.95f + frameMs * 0.05f;
+    frameStats.cpuMs = frameStats.cpuMs * 0.95f + (frameMs - frameStats.waitMs) * 0.05f;
+    frameStats.blockedMs = frameStats.blockedMs * 0.95f + frameStats.waitMs * 0.05f;
+  }
+  frameStats.start = start;
+  frameStats.started = true;
+
+  const uint32_t frame = m_presentationResources.currentFrame;
+  vkWaitForFences(m_device, 1, &m_frameFences[frame], VK_TRUE, UINT64_MAX);
+  vkResetFences(m_device, 1, &m_frameFences[frame]);
+  frameStats.waitMs = std::chrono::duration<float, std::milli>(clock::now() - start).count();
+
+  // the slot is free, so its timestamps of the frame before last are available
+  uint64_t timestamps[FRAME_QUERIES_COUNT] = {};
+  const uint32_t firstQuery = frame * FRAME_QUERIES_COUNT;
+  if ((m_frameQueryMask >> frame) & 1)
+  {
+    m_frameQueryMask &= ~(1u << frame);
+    if (vkGetQueryPoolResults(m_device, m_frameQueryPool, firstQuery + FRAME_QUERY_BEGIN, 1, sizeof(uint64_t), &timestamps[FRAME_QUERY_BEGIN],
+      sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS && vkGetQueryPoolResults(m_device, m_frameQueryPool,
+      firstQuery + FRAME_QUERY_END, 1, sizeof(uint64_t), &timestamps[FRAME_QUERY_END], sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+    {
+      const float gpuMs = float(timestamps[FRAME_QUERY_END] - timestamps[FRAME_QUERY_BEGIN]) * m_timestampPeriod * 1e-6f;
+      frameStats.gpuMs = frameStats.gpuMs > 0 ? frameStats.gpuMs * 0.95f + gpuMs * 0.05f : gpuMs;
+    }
+  }
+  if ((m_sceneQueryMask >> frame) & 1)
+  {
+    m_sceneQueryMask &= ~(1u << frame);
+    if (vkGetQueryPoolResults(m_device, m_frameQueryPool, firstQuery + FRAME_QUERY_SCENE_BEGIN, 2, 2 * sizeof(uint64_t),
+      &timestamps[FRAME_QUERY_SCENE_BEGIN], sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+      UpdateShadingTime(float(timestamps[FRAME_QUERY_SCENE_END] - timestamps[FRAME_QUERY_SCENE_BEGIN]) * m_timestampPeriod * 1e-6f);
+  }
+  if ((solverStatsPending >> frame) & 1)
+    ReadSolverStats(frame);
+  if ((ffBatchPending >> frame) & 1)
+    ReadFFBatch(frame);
+
+  memcpy(m_uboMappedMem[frame], &m_uniforms, sizeof(m_uniforms));
+}
+
+void SimpleRender::EndFrame()
+{
+  m_presentationResources.currentFrame = (m_presentationResources.currentFrame + 1) % m_framesInFlight;
+  if (!serializeFrames)
+    return;
+  const auto start = std::chrono::high_resolution_clock::now();
+  vkQueueWaitIdle(m_presentationResources.queue);
+  frameStats.waitMs += std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void SimpleRender::SubmitFrame(const std::vector<VkCommandBuffer> &a_cmdBufs, uint32_t a_frame)
+{
+  std::vector<VkSemaphore> waitSemaphores = {m_presentationResources.imageAvailable[a_frame]};
+  std::vector<VkPipelineStageFlags> waitStages = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+  std::vector<uint64_t> waitValues = {0};
+  if (asyncFF.frameWait > 0)
+  {
+    waitSemaphores.push_back(m_computeTimeline);
+    waitStages.push_back(VK_PIPELINE_STAGE_TRANSFER_BIT);
+    waitValues.push_back(asyncFF.frameWait);
+    asyncFF.frameWait = 0;
+  }
+  VkSemaphore signalSemaphores[] = {m_presentationResources.renderingFinished[a_frame], m_frameTimeline};
+  const uint64_t signalValues[] = {0, ++m_frameCounter};
+
+  VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+  timelineInfo.waitSemaphoreValueCount = (uint32_t)waitValues.size();
+  timelineInfo.pWaitSemaphoreValues = waitValues.data();
+  timelineInfo.signalSemaphoreValueCount = 2;
+  timelineInfo.pSignalSemaphoreValues = signalValues;
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.waitSemaphoreCount = (uint32_t)waitSemaphores.size();
+  submitInfo.pWaitSemaphores = waitSemaphores.data();
+  submitInfo.pWaitDstStageMask = waitStages.data();
+  submitInfo.commandBufferCount = (uint32_t)a_cmdBufs.size();
+  submitInfo.pCommandBuffers = a_cmdBufs.data();
+  submitInfo.signalSemaphoreCount = 2;
+  submitInfo.pSignalSemaphores = signalSemaphores;
+
+  VK_CHECK_RESULT(vkQueueSubmit(m_graphicsQueue, 1, &submitInfo, m_frameFences[a_frame]));
+}
+
 void SimpleRender::DrawFrameSimple()
 {
-  vkWaitForFences(m_device, 1, &m_frameFences[m_presentationResources.currentFrame], VK_TRUE, UINT64_MAX);
-  vkResetFences(m_device, 1, &m_frameFences[m_presentationResources.currentFrame]);
+  BeginFrame();
+  const uint32_t frame = m_presentationResources.currentFrame;
 
   uint32_t imageIdx;
-  m_swapchain.AcquireNextImage(m_presentationResources.imageAvailable, &imageIdx);
-
-  auto currentCmdBuf = m_cmdBuffersDrawMain[m_presentationResources.currentFrame];
+  m_swapchain.AcquireNextImage(m_presentationResources.imageAvailable[frame], &imageIdx);
 
-  VkSemaphore waitSemaphores[] = {m_presentationResources.imageAvailable};
-  VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+  auto currentCmdBuf = m_cmdBuffersDrawMain[frame];
 
   if(m_currentRenderMode == RenderMode::RASTERIZATION)
   {
@@ -1252,22 +1481,14 @@ void SimpleRender::DrawFrameSimple()
     BuildCommandBufferQuad(currentCmdBuf, m_swapchain.GetAttachment(imageIdx).view);
   }
 
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.waitSemaphoreCount = 1;
-  submitInfo.pWaitSemaphores = waitSemaphores;
-  submitInfo.pWaitDstStageMask = waitStages;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &currentCmdBuf;
-
-  VkSemaphore signalSemaphores[] = {m_presentationResources.renderingFinished};
-  submitInfo.signalSemaphoreCount = 1;
-  submitInfo.pSignalSemaphores = signalSemaphores;
+  // the compute work goes first in the same submission, it doesn't wait for the swapchain image
+  std::vector<VkCommandBuffer> submitCmdBufs = EndFrameCompute();
+  submitCmdBufs.push_back(currentCmdBuf);
 
-  VK_CHECK_RESULT(vkQueueSubmit(m_graphicsQueue, 1, &submitInfo, m_frameFences[m_presentationResources.currentFrame]));
+  SubmitFrame(submitCmdBufs, frame);
 
   VkResult presentRes = m_swapchain.QueuePresent(m_presentationResources.queue, imageIdx,
-                                                 m_presentationResources.renderingFinished);
+                                                 m_presentationResources.renderingFinished[frame]);
 
   if (presentRes == VK_ERROR_OUT_OF_DATE_KHR || presentRes == VK_SUBOPTIMAL_KHR)
   {
@@ -1278,9 +1499,7 @@ void SimpleRender::DrawFrameSimple()
     RUN_TIME_ERROR("Failed to present swapchain image");
   }
 
-  m_presentationResources.currentFrame = (m_presentationResources.currentFrame + 1) % m_framesInFlight;
-
-  vkQueueWaitIdle(m_presentationResources.queue);
+  EndFrame();
 }
 
 void SimpleRender::DrawFrame(float a_time, DrawMode a_mode)
@@ -1303,6 +1522,9 @@ void SimpleRender::DrawFrame(float a_time, DrawMode a_mode)
 
 void SimpleRender::Cleanup()
 {
+  // the last frames may still be in flight
+  if (m_device != VK_NULL_HANDLE)
+    vkDeviceWaitIdle(m_device);
   m_pGUIRender = nullptr;
   ImGui::DestroyContext();
   CleanupPipelineAndSwapchain();
@@ -1332,15 +1554,41 @@ void SimpleRender::Cleanup()
     m_basicForwardPipeline.layout = VK_NULL_HANDLE;
   }
 
-  if (m_presentationResources.imageAvailable != VK_NULL_HANDLE)
+  for (VkSemaphore semaphore : m_presentationResources.imageAvailable)
+    vkDestroySemaphore(m_device, semaphore, nullptr);
+  m_presentationResources.imageAvailable.clear();
+  for (VkSemaphore semaphore : m_presentationResources.renderingFinished)
+    vkDestroySemaphore(m_device, semaphore, nullptr);
+  m_presentationResources.renderingFinished.clear();
+
+  if (m_ffQueryPool != VK_NULL_HANDLE)
+  {
+    vkDestroyQueryPool(m_device, m_ffQueryPool, nullptr);
+    m_ffQueryPool = VK_NULL_HANDLE;
+  }
+
+  if (m_frameQueryPool != VK_NULL_HANDLE)
+  {
+    vkDestroyQueryPool(m_device, m_frameQueryPool, nullptr);
+    m_frameQueryPool = VK_NULL_HANDLE;
+  }
+
+  if (m_frameTimeline != VK_NULL_HANDLE)
   {
-    vkDestroySemaphore(m_device, m_presentationResources.imageAvailable, nullptr);
-    m_presentationResources.imageAvailable = VK_NULL_HANDLE;
+    vkDestroySemaphore(m_device, m_frameTimeline, nullptr);
+    m_frameTimeline = VK_NULL_HANDLE;
   }
-  if (m_presentationResources.renderingFinished != VK_NULL_HANDLE)
+
+  if (m_computeTimeline != VK_NULL_HANDLE)
   {
-    vkDestroySemaphore(m_device, m_presentationResources.renderingFinished, nullptr);
-    m_presentationResources.renderingFinished = VK_NULL_HANDLE;
+    vkDestroySemaphore(m_device, m_computeTimeline, nullptr);
+    m_computeTimeline = VK_NULL_HANDLE;
+  }
+
+  if (m_computeCommandPool != VK_NULL_HANDLE)
+  {
+    vkDestroyCommandPool(m_device, m_computeCommandPool, nullptr);
+    m_computeCommandPool = VK_NULL_HANDLE;
   }
 
   if (m_commandPool != VK_NULL_HANDLE)
@@ -1349,11 +1597,10 @@ void SimpleRender::Cleanup()
     m_commandPool = VK_NULL_HANDLE;
   }
 
-  if(m_ubo != VK_NULL_HANDLE)
-  {
-    vkDestroyBuffer(m_device, m_ubo, nullptr);
-    m_ubo = VK_NULL_HANDLE;
-  }
+  for (VkBuffer ubo : m_ubo)
+    vkDestroyBuffer(m_device, ubo, nullptr);
+  m_ubo.clear();
+  m_uboMappedMem.clear();
 
   if(m_uboAlloc != VK_NULL_HANDLE)
   {
@@ -1361,28 +1608,45 @@ void SimpleRender::Cleanup()
     m_uboAlloc = VK_NULL_HANDLE;
   }
 
-  if(pointsBuffer != VK_NULL_HANDLE)
+  transientHeap.Destroy(m_device);
+  asyncTransientHeap.Destroy(m_device);
+
+  if(solverStatsReadback != VK_NULL_HANDLE)
   {
-    vkDestroyBuffer(m_device, pointsBuffer, nullptr);
-    pointsBuffer = VK_NULL_HANDLE;
+    vkDestroyBuffer(m_device, solverStatsReadback, nullptr);
+    solverStatsReadback = VK_NULL_HANDLE;
   }
 
-  if(pointsMem != VK_NULL_HANDLE)
+  if(solverStatsReadbackMem != VK_NULL_HANDLE)
   {
-    vkFreeMemory(m_device, pointsMem, nullptr);
-    pointsMem = VK_NULL_HANDLE;
+    vkFreeMemory(m_device, solverStatsReadbackMem, nullptr);
+    solverStatsReadbackMem = VK_NULL_HANDLE;
+    solverStatsReadbackData = nullptr;
+  }
+
+  if(ffSizeReadback != VK_NULL_HANDLE)
+  {
+    vkDestroyBuffer(m_device, ffSizeReadback, nullptr);
+    ffSizeReadback = VK_NULL_HANDLE;
   }
 
-  if(m_genColorBuffer != VK_NULL_HANDLE)
+  if(ffSizeReadbackMem != VK_NULL_HANDLE)
+  {
+    vkFreeMemory(m_device, ffSizeReadbackMem, nullptr);
+    ffSizeReadbackMem = VK_NULL_HANDLE;
+    ffSizeReadbackData = nullptr;
+  }
+
+  if(pointsBuffer != VK_NULL_HANDLE)
   {
-    vkDestroyBuffer(m_device, m_genColorBuffer, nullptr);
-    m_genColorBuffer = VK_NULL_HANDLE;
+    vkDestroyBuffer(m_device, pointsBuffer, nullptr);
+    pointsBuffer = VK_NULL_HANDLE;
   }
 
-  if(m_colorMem != VK_NULL_HANDLE)
+  if(pointsMem != VK_NULL_HANDLE)
   {
-    vkFreeMemory(m_device, m_colorMem, nullptr);
-    m_colorMem = VK_NULL_HANDLE;
+    vkFreeMemory(m_device, pointsMem, nullptr);
+    pointsMem = VK_NULL_HANDLE;
   }
 
   m_pRayTracerGPU = nullptr;
@@ -1421,11 +1685,22 @@ void SimpleRender::SetupGUIElements()
 //    ImGui::ShowDemoWindow();
     ImGui::Begin("Your render settings here");
     ImGui::Text("Form-factors computation progress: %.2f%%", FFComputeProgress * 100.f);
+    if (computeState.version == 0)
+    {
+      ImGui::Text("Form-factors batch: %u voxels, %.3f ms/voxel", ffBatchSize, ffMsPerVoxel);
+      ImGui::SliderFloat("Form-factors budget (ms): ", &ffTimeBudget, 1.0f, 100.0f);
+      ImGui::Checkbox("Compute form-factors offline: ", &ffOffline);
+      if (AsyncFFAvailable())
+        ImGui::Checkbox("Compute form-factors on the async compute queue: ", &asyncFF.enabled);
+    }
     ImGui::NewLine();
 
     ImGui::SliderFloat3("Light source position", m_uniforms.lightPos.M, -50.f, 50.f);
 
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+    ImGui::Text("Frame: CPU %.2f ms, blocked %.2f ms, GPU %.2f ms, overlap %.0f%%", frameStats.cpuMs, frameStats.blockedMs,
+      frameStats.gpuMs, frameStats.Overlap() * 100.0f);
+    ImGui::Checkbox("Wait for the GPU every frame: ", &serializeFrames);
 
     ImGui::NewLine();
     ImGui::Checkbox("Interpolation: ", &interpolation);
@@ -1434,14 +1709,55 @@ void SimpleRender::SetupGUIElements()
     ImGui::Checkbox("Debug points: ", &debugPoints);
     ImGui::Checkbox("Debug cubes: ", &debugCubes);
     ImGui::Checkbox("Update lighting: ", &updateLight);
-    ImGui::Checkbox("Multiple bounce: ", &multibounce);
+    if (ImGui::Checkbox("Multiple bounce: ", &multibounce))
+    {
+      solverState.reset = true;
+      lightingState.dirty = true;
+    }
+    ImGui::SliderFloat("Shadow retrace angle (deg): ", &lightingState.retraceAngle, 0.0f, 10.0f);
+    if (multibounce)
+    {
+      const char *solverModes[SOLVER_MODES_COUNT] = {"Jacobi", "Gauss-Seidel (red-black)", "Southwell (shooting)"};
+      if (ImGui::Combo("Solver: ", &solverState.mode, solverModes, SOLVER_MODES_COUNT))
+        solverState.reset = true;
+      ImGui::SliderInt("Solver iterations per frame: ", &solverState.iterationsPerFrame, 1, 64);
+      ImGui::InputFloat("Solver tolerance: ", &solverState.tolerance, 0.0f, 0.0f, "%.5f");
+      if (solverState.mode == SOLVER_SOUTHWELL)
+        ImGui::SliderFloat("Shooting threshold: ", &solverState.shootThreshold, 0.0f, 1.0f);
+      ImGui::Text("Solver: %u iterations, residual %.2e%s", solverState.iterations, solverState.residual,
+        solverState.converged ? " (converged)" : "");
+    }
     ImGui::Checkbox("Tonemapping: ", &tonemapping);
     ImGui::Checkbox("Temporal accumulation: ", &temporalAccumulation);
     ImGui::SliderFloat("Exposure: ", &(m_uniforms.exposureValue), 0.1, 10.f);
     ImGui::SliderFloat("Blend factor: ", &(blendFactor), 0, 0.97f);
-    ImGui::SliderFloat("Light speed: ", &(lightSpeed), 0.01, 0.5);
+    ImGui::SliderFloat("Light speed: ", &(lightSpeed), 0.0, 0.5);
+    ImGui::SliderFloat("Voxel size: ", &voxelSettings.voxelSize, 0.25f, 10.0f);
+    ImGui::SliderInt("Clipmap cascades (0 is off): ", &voxelSettings.cascades, 0, MAX_CASCADES);
+    const char *voxelLayouts[VOXEL_LAYOUTS_COUNT] = {"Linear", "Morton"};
+    ImGui::Combo("Voxel layout: ", &voxelSettings.layout, voxelLayouts, VOXEL_LAYOUTS_COUNT);
+    ImGui::Checkbox("Voxelize samples: ", &voxelSettings.voxelize);
+    if (!voxelSettings.voxelize)
+      ImGui::Checkbox("Adaptive sampling: ", &voxelSettings.adaptive);
+    const char *visibilityModes[FF_VISIBILITY_MODES_COUNT] = {"Rays", "Voxel DDA"};
+    ImGui::Combo("FF visibility: ", &voxelSettings.visibility, visibilityModes, FF_VISIBILITY_MODES_COUNT);
+    if (voxelSettings.visibility == FF_VISIBILITY_DDA)
+      ImGui::SliderInt("Near field voxels: ", &voxelSettings.nearFieldVoxels, 0, 8);
+    if (ImGui::Button("Rebuild voxels"))
+      voxelSettings.rebuild = true;
+    ImGui::Text("Scene pass: %.3f ms", shadingMs);
+    if (shadingBenchmark.running)
+      ImGui::Text("Benchmarking the %s layout...", voxelLayouts[shadingBenchmark.layout]);
+    else if (m_frameQueryPool != VK_NULL_HANDLE && ImGui::Button("Benchmark voxel layouts"))
+      StartShadingBenchmark();
+    if (shadingBenchmark.results[VOXEL_LAYOUT_LINEAR] > 0)
+      ImGui::Text("Scene pass: linear %.3f ms, Morton %.3f ms", shadingBenchmark.results[VOXEL_LAYOUT_LINEAR],
+        shadingBenchmark.results[VOXEL_LAYOUT_MORTON]);
     
     screenshotRequested = ImGui::Button("Make screenshot");
+    printGraphSchedules = ImGui::Button("Print render graph schedules");
+    ImGui::Text("Transient memory: %.2f MB, %.2f MB without aliasing", (transientHeap.Size() + asyncTransientHeap.Size()) / 1048576.0f,
+      (transientHeap.UnaliasedSize() + asyncTransientHeap.UnaliasedSize()) / 1048576.0f);
     if (useAlias && !switchAlias)
       switchAlias = ImGui::Button("Use alias tables");
     
@@ -1463,11 +1779,11 @@ void SimpleRender::SetupGUIElements()
 
 void SimpleRender::DrawFrameWithGUI()
 {
-  vkWaitForFences(m_device, 1, &m_frameFences[m_presentationResources.currentFrame], VK_TRUE, UINT64_MAX);
-  vkResetFences(m_device, 1, &m_frameFences[m_presentationResources.currentFrame]);
+  BeginFrame();
+  const uint32_t frame = m_presentationResources.currentFrame;
 
   uint32_t imageIdx;
-  auto result = m_swapchain.AcquireNextImage(m_presentationResources.imageAvailable, &imageIdx);
+  auto result = m_swapchain.AcquireNextImage(m_presentationResources.imageAvailable[frame], &imageIdx);
   if (result == VK_ERROR_OUT_OF_DATE_KHR)
   {
     RecreateSwapChain();
@@ -1478,10 +1794,7 @@ void SimpleRender::DrawFrameWithGUI()
     RUN_TIME_ERROR("Failed to acquire the next swapchain image!");
   }
 
-  auto currentCmdBuf = m_cmdBuffersDrawMain[m_presentationResources.currentFrame];
-
-  VkSemaphore waitSemaphores[] = {m_presentationResources.imageAvailable};
-  VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+  auto currentCmdBuf = m_cmdBuffersDrawMain[frame];
 
   if(m_currentRenderMode == RenderMode::RASTERIZATION)
   {
@@ -1498,24 +1811,14 @@ void SimpleRender::DrawFrameWithGUI()
   ImDrawData* pDrawData = ImGui::GetDrawData();
   auto currentGUICmdBuf = m_pGUIRender->BuildGUIRenderCommand(imageIdx, pDrawData);
 
-  std::vector<VkCommandBuffer> submitCmdBufs = { currentCmdBuf, currentGUICmdBuf};
-
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.waitSemaphoreCount = 1;
-  submitInfo.pWaitSemaphores = waitSemaphores;
-  submitInfo.pWaitDstStageMask = waitStages;
-  submitInfo.commandBufferCount = (uint32_t)submitCmdBufs.size();
-  submitInfo.pCommandBuffers = submitCmdBufs.data();
-
-  VkSemaphore signalSemaphores[] = {m_presentationResources.renderingFinished};
-  submitInfo.signalSemaphoreCount = 1;
-  submitInfo.pSignalSemaphores = signalSemaphores;
+  std::vector<VkCommandBuffer> submitCmdBufs = EndFrameCompute();
+  submitCmdBufs.push_back(currentCmdBuf);
+  submitCmdBufs.push_back(currentGUICmdBuf);
 
-  VK_CHECK_RESULT(vkQueueSubmit(m_graphicsQueue, 1, &submitInfo, m_frameFences[m_presentationResources.currentFrame]));
+  SubmitFrame(submitCmdBufs, frame);
 
   VkResult presentRes = m_swapchain.QueuePresent(m_presentationResources.queue, imageIdx,
-    m_presentationResources.renderingFinished);
+    m_presentationResources.renderingFinished[frame]);
 
   if (presentRes == VK_ERROR_OUT_OF_DATE_KHR || presentRes == VK_SUBOPTIMAL_KHR)
   {
@@ -1526,7 +1829,45 @@ void SimpleRender::DrawFrameWithGUI()
     RUN_TIME_ERROR("Failed to present swapchain image");
   }
 
-  m_presentationResources.currentFrame = (m_presentationResources.currentFrame + 1) % m_framesInFlight;
+  EndFrame();
+}
 
-  vkQueueWaitIdle(m_presentationResources.queue);
+void SimpleRender::StartShadingBenchmark()
+{
+  shadingBenchmark.running = true;
+  shadingBenchmark.layout = 0;
+  shadingBenchmark.restoreLayout = voxelSettings.layout;
+  shadingBenchmark.frames = 0;
+  shadingBenchmark.totalMs = 0;
+  shadingBenchmark.results = {};
+  voxelSettings.layout = shadingBenchmark.layout;
+  voxelSettings.rebuild = true;
+}
+
+void SimpleRender::UpdateShadingTime(float a_sceneMs)
+{
+  shadingMs = shadingMs > 0 ? shadingMs * 0.95f + a_sceneMs * 0.05f : a_sceneMs;
+
+  // TraceGenSamples applies the rebuild before the frame is drawn, so the frames after it use the new layout
+  if (!shadingBenchmark.running || voxelSettings.rebuild)
+    return;
+  if (++shadingBenchmark.frames > SHADING_BENCHMARK_WARMUP)
+    shadingBenchmark.totalMs += a_sceneMs;
+  if (shadingBenchmark.frames < SHADING_BENCHMARK_WARMUP + SHADING_BENCHMARK_FRAMES)
+    return;
+
+  shadingBenchmark.results[shadingBenchmark.layout] = float(shadingBenchmark.totalMs / SHADING_BENCHMARK_FRAMES);
+  std::cout << "Scene pass with the " << (shadingBenchmark.layout == VOXEL_LAYOUT_MORTON ? "Morton" : "linear")
+    << " voxel layout: " << shadingBenchmark.results[shadingBenchmark.layout] << " ms" << std::endl;
+  shadingBenchmark.frames = 0;
+  shadingBenchmark.totalMs = 0;
+  if (++shadingBenchmark.layout < VOXEL_LAYOUTS_COUNT)
+  {
+    voxelSettings.layout = shadingBenchmark.layout;
+    voxelSettings.rebuild = true;
+    return;
+  }
+  shadingBenchmark.running = false;
+  voxelSettings.layout = shadingBenchmark.restoreLayout;
+  voxelSettings.rebuild = voxelSettings.layout != int(voxelLayout);
 }
@@ -7,6 +7,12 @@
 #include "../../render/render_common.h"
 #include "../../render/render_gui.h"
 #include "../../../resources/shaders/common.h"
+#include "../../../resources/shaders/ff_compact.h"
+#include "../../../resources/shaders/radiosity_solver.h"
+#include "../../../resources/shaders/brick_map.h"
+#include "../../../resources/shaders/adaptive_sampling.h"
+#include "../../../resources/shaders/sample_points.h"
+#include "../../../resources/shaders/voxel_dda.h"
 #include <geom/vk_mesh.h>
 #include <vk_descriptor_sets.h>
 #include <vk_fbuf_attachment.h>
@@ -15,9 +21,14 @@
 #include <vk_swapchain.h>
 #include <string>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <functional>
 #include <render/CrossRT.h>
 #include "raytracing.h"
 #include "raytracing_generated.h"
+#include "ff_cache.h"
+#include "render_graph.h"
 
 enum class RenderMode
 {
@@ -25,11 +36,15 @@ enum class RenderMode
   RAYTRACING,
 };
 
+// the SPIR-V compiled by the build into RAYTRACING_SPIRV_DIR unless the committed binary a_path is newer, the shaders
+// reloaded with 'B' are compiled next to their sources
+std::string SpirvPath(const std::string &a_path);
+
 class RayTracer_GPU : public RayTracer_Generated
 {
 public:
   RayTracer_GPU(int32_t a_width, uint32_t a_height) : RayTracer_Generated(a_width, a_height) {} 
-  std::string AlterShaderPath(const char* a_shaderPath) override { return std::string("../../src/samples/raytracing/") + std::string(a_shaderPath); }
+  std::string AlterShaderPath(const char* a_shaderPath) override { return SpirvPath(std::string("../../src/samples/raytracing/") + std::string(a_shaderPath)); }
 };
 
 class SimpleRender : public IRender
@@ -91,6 +106,7 @@ protected:
   VkDevice         m_device         = VK_NULL_HANDLE;
   VkQueue          m_graphicsQueue  = VK_NULL_HANDLE;
   VkQueue          m_transferQueue  = VK_NULL_HANDLE;
+  VkQueue          m_computeQueue   = VK_NULL_HANDLE; // only if the compute family differs from the graphics one
 
   std::shared_ptr<vk_utils::ICopyEngine> m_pCopyHelper;
 
@@ -98,16 +114,22 @@ protected:
 
   RenderMode m_currentRenderMode = RenderMode::RASTERIZATION;
 
+  // the CPU records the next frame while the GPU executes the previous ones, every frame in flight has its own
+  // semaphores, fence, command buffer, uniform buffer and timestamp queries
   struct
   {
     uint32_t    currentFrame      = 0u;
     VkQueue     queue             = VK_NULL_HANDLE;
-    VkSemaphore imageAvailable    = VK_NULL_HANDLE;
-    VkSemaphore renderingFinished = VK_NULL_HANDLE;
+    std::vector<VkSemaphore> imageAvailable;
+    std::vector<VkSemaphore> renderingFinished;
   } m_presentationResources;
 
   std::vector<VkFence> m_frameFences;
   std::vector<VkCommandBuffer> m_cmdBuffersDrawMain;
+  // the radiosity work of a frame is gathered into a graph, recorded into the frame's compute command buffer
+  // and submitted with its draws
+  std::vector<VkCommandBuffer> m_cmdBuffersCompute;
+  std::unique_ptr<RenderGraph> m_frameComputeGraph;
 
   struct
   {
@@ -117,9 +139,9 @@ protected:
   } pushConst2M;
 
   UniformParams m_uniforms {};
-  VkBuffer m_ubo = VK_NULL_HANDLE;
+  std::vector<VkBuffer> m_ubo;
   VkDeviceMemory m_uboAlloc = VK_NULL_HANDLE;
-  void* m_uboMappedMem = nullptr;
+  std::vector<void*> m_uboMappedMem;
 
   std::shared_ptr<vk_utils::DescriptorMaker> m_pBindings = nullptr;
 
@@ -129,7 +151,7 @@ protected:
   pipeline_data_t m_debugCubesPipeline {};
   pipeline_data_t m_temporalAccumPipeline {};
 
-  VkDescriptorSet m_dSet = VK_NULL_HANDLE;
+  std::vector<VkDescriptorSet> m_dSet; // per frame in flight, they differ in the uniform buffer
   VkDescriptorSetLayout m_dSetLayout = VK_NULL_HANDLE;
   VkDescriptorSet pointsdSet = VK_NULL_HANDLE;
   VkDescriptorSetLayout pointsdSetLayout = VK_NULL_HANDLE;
@@ -150,6 +172,7 @@ protected:
   VkPhysicalDeviceAccelerationStructureFeaturesKHR m_enabledAccelStructFeatures{};
   VkPhysicalDeviceBufferDeviceAddressFeatures m_enabledDeviceAddressFeatures{};
   VkPhysicalDeviceRayQueryFeaturesKHR m_enabledRayQueryFeatures;
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR m_enabledTimelineFeatures{};
 
   std::vector<uint32_t> m_raytracedImageData;
   std::shared_ptr<vk_utils::IQuad> m_pFSQuad;
@@ -161,9 +184,31 @@ protected:
   std::unique_ptr<RayTracer_GPU> m_pRayTracerGPU;
   void RayTraceGPU();
   void TraceGenSamples();
+  // the compute work of a frame is submitted while the previous frames may still read the voxel buffers in their shaders
+  void RecordFramesInFlightBarrier(VkCommandBuffer a_cmdBuff);
+  RenderGraph &FrameComputeGraph();
+  // the command buffers to submit before the draws of the frame, empty if the frame had no compute work
+  std::vector<VkCommandBuffer> EndFrameCompute();
+  // for the passes whose results are read back by the host before the frame continues
+  void SubmitAndWait(const std::function<void(VkCommandBuffer)> &a_record);
+  // the graphs of the frame print their pass schedules when it is requested from the GUI
+  void ExecuteGraph(RenderGraph &a_graph, VkCommandBuffer a_cmdBuff);
+  bool printGraphSchedules = false;
+
+  // *** form factors disk cache
+  const std::string FF_CACHE_DIR = "../../resources/ff_cache/";
+  std::string m_scenePath;
+  bool useFFCache = true;
+  bool ffCacheLoaded = false;
+  // the cache of a freshly loaded scene is looked up by the first TraceGenSamples, RebuildVoxels looks it up itself
+  bool ffCacheChecked = false;
+  // the clipmap follows the camera, its form factors are never cached
+  bool FFCacheEnabled() const { return useFFCache && clipmapCascades == 0; }
+  uint64_t SceneHash() const;
+  std::string FFCachePath() const;
+  bool LoadFFCache();
+  bool SaveFFCache();
 
-  VkBuffer m_genColorBuffer = VK_NULL_HANDLE;
-  VkDeviceMemory m_colorMem = VK_NULL_HANDLE;
   //
 
   // *** presentation
@@ -198,6 +243,13 @@ protected:
   std::shared_ptr<SceneManager> m_pScnMgr = nullptr;
 
   void DrawFrameSimple();
+  // waits for the frame slot to be free and reads its timestamps, then copies the uniforms of the new frame
+  void BeginFrame();
+  void EndFrame();
+  // the frame signals m_frameTimeline and waits for the async FF batch whose lighting it publishes
+  void SubmitFrame(const std::vector<VkCommandBuffer> &a_cmdBufs, uint32_t a_frame);
+  void RecordFrameBegin(VkCommandBuffer a_cmdBuff);
+  void RecordFrameEnd(VkCommandBuffer a_cmdBuff);
 
   void CreateInstance();
   void CreateDevice(uint32_t a_deviceId);
@@ -218,6 +270,24 @@ protected:
   void RecreateSwapChain();
 
   void CreateUniformBuffer();
+  void CreateDeviceBuffer(VkDeviceSize a_size, VkBufferUsageFlags a_usage, const char *a_name, VkBuffer &a_buffer, VkDeviceMemory &a_mem);
+  // with the async FF the compute family reads and writes the buffers of the voxels between the frames, they are
+  // concurrent over the graphics and compute families instead of being transferred between them
+  VkBuffer CreateSharedBuffer(VkDeviceSize a_size, VkBufferUsageFlags a_usage, VkMemoryRequirements *a_memReq);
+  // buffers sized by the visible voxels and their sample points, returns false if the sizes didn't change
+  bool CreateVisibleVoxelsBuffers(uint32_t a_visibleVoxels, uint32_t a_pointsCount);
+  // grows FF to hold a_required values keeping its contents, returns true if the buffer was recreated
+  bool ReserveFF(uint32_t a_required);
+  void UpdateGenSamplesBindings();
+  void AllocateSamplePoints();
+  // orders the visible voxels registered by the GenSamples count pass from a_first on by cascade and Morton code,
+  // returns the whole list
+  std::vector<uint32_t> SortVisibleVoxels(uint32_t a_first);
+  // turns the statistics of the GenSamples probe pass into the points per face of every voxel, see adaptive_sampling.h
+  void AllocateSampleDensity();
+  // sets the occupancy bits of the voxels with sample points, a_pointCounters is the content of indirectPointsBuffer
+  void UpdateOccupancy(const std::vector<LiteMath::uint4> &a_pointCounters);
+  bool FFBatchOverflowed(uint32_t a_first, uint32_t a_count);
   void UpdateUniformBuffer(float a_time);
 
   LiteMath::Box4f sceneBbox;
@@ -228,17 +298,60 @@ protected:
   void SetupDeviceExtensions();
   void SetupValidationLayers();
   void GetBbox();
+  // allocates the bricks of the cells that geometry may touch in every grid cascade, fills brickTableBuffer,
+  // brickCellsBuffer and gridCascadesBuffer
+  void BuildBrickMap();
+  // marks the brick cells of a_grid that geometry may touch, the cells in [a_knownMin, a_knownMax) are skipped
+  void MarkBrickCells(const GridCascade &a_grid, LiteMath::int3 a_knownMin, LiteMath::int3 a_knownMax,
+    std::vector<uint8_t> &a_cells);
+  // moves the clipmap cascades to the camera, only the newly exposed slabs of cells are tested against geometry;
+  // returns true if any cascade moved
+  bool ScrollClipmap(bool a_reset);
+  // moves the bricks of the scrolled cascades, the cells that stayed in them keep their bricks, the exposed and
+  // uncovered ones get new bricks appended to the pool; a_dropped gets the bricks that are no longer in use.
+  // Returns false if the pool is full
+  bool UpdateBrickMap(const std::vector<LiteMath::int3> &a_oldOrigins, std::vector<uint32_t> &a_dropped);
+  // the voxels that survived the scroll keep their samples and the form factors between them, only the new bricks
+  // get samples and only the FF rows and columns of their voxels are computed. Returns false if the voxels have to
+  // be rebuilt
+  bool ScrollVoxels(const std::vector<LiteMath::int3> &a_oldOrigins);
+  // renumbers the FF of the old visible voxels to the survivors of a scroll, a_newIndex is ~0u for the dropped
+  // voxels; see packFF.comp
+  void UploadPrevFF(const std::vector<uint32_t> &a_ff, const std::vector<uint32_t> &a_rowLens, uint32_t a_oldVoxels,
+    const std::vector<uint32_t> &a_newIndex, uint32_t a_survivors);
+  // brick map and the per voxel slot buffers for the current voxelSize and clipmapCascades
+  void CreateVoxelBuffers();
+  // drops the samples, form factors and lighting of the old voxels and starts over with the new ones
+  void RebuildVoxels();
   void setObjectName(VkBuffer buffer, const char *name);
   const uint32_t PER_SURFACE_POINTS = 42;
   const uint32_t PER_VOXEL_POINTS = PER_SURFACE_POINTS * 6;
+  // voxels shoot from SAMPLING_MIN_POINTS to SAMPLING_MAX_POINTS points per face depending on their geometry,
+  // PER_SURFACE_POINTS per face of a voxel with geometry is the budget
+  bool adaptiveSampling = true;
+  // the triangles are clipped by the voxels and the points are placed on the pieces instead of the rays shot through
+  // the voxel faces, the density of PER_SURFACE_POINTS per face is kept on average and adaptive sampling is off
+  bool voxelizeSamples = false;
+  bool AdaptiveSampling() const { return adaptiveSampling && !voxelizeSamples; }
+  uint32_t PerFacePointsMax() const { return AdaptiveSampling() ? SAMPLING_MAX_POINTS : PER_SURFACE_POINTS; }
+  // the per face point pattern, R2 with adaptive sampling and Hammersley without
+  void CreateSamplePoints();
+  // the pass covers the bricks from a_firstBrick on
+  void AddGenSamplesPass(RenderGraph &a_graph, uint32_t a_pass, uint32_t a_pointsPerFace, uint32_t a_maxPoints, bool a_adaptive,
+    uint32_t a_firstBrick);
   const uint32_t PER_VOXEL_CLUSTERS = 6;
   uint32_t pointsToDraw = 0;
   VkBuffer pointsBuffer = VK_NULL_HANDLE;
   VkDeviceMemory pointsMem = VK_NULL_HANDLE;
   VkBuffer indirectPointsBuffer = VK_NULL_HANDLE;
   VkDeviceMemory indirectPointsMem = VK_NULL_HANDLE;
-  VkBuffer samplePointsBuffer = VK_NULL_HANDLE;
-  VkDeviceMemory samplePointsMem = VK_NULL_HANDLE;
+  // streams of sample_points.h
+  VkBuffer samplePositionsBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory samplePositionsMem = VK_NULL_HANDLE;
+  VkBuffer sampleNormalsBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory sampleNormalsMem = VK_NULL_HANDLE;
+  VkBuffer sampleMaterialsBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory sampleMaterialsMem = VK_NULL_HANDLE;
   VkBuffer primCounterBuffer = VK_NULL_HANDLE;
   VkDeviceMemory primCounterMem = VK_NULL_HANDLE;
   VkBuffer FFClusteredBuffer = VK_NULL_HANDLE;
@@ -257,39 +370,246 @@ protected:
   VkDeviceMemory nonEmptyVoxelsMem = VK_NULL_HANDLE;
   VkBuffer appliedLightingBuffer = VK_NULL_HANDLE;
   VkDeviceMemory appliedLightingMem = VK_NULL_HANDLE;
+  VkBuffer publishedLightingBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory publishedLightingMem = VK_NULL_HANDLE;
   VkBuffer ffRowLenBuffer = VK_NULL_HANDLE;
   VkDeviceMemory ffRowLenMem = VK_NULL_HANDLE;
+  // ffTmpRowBuffer and solverTmpBuffer are scratch of the FF batches and of the solver,
+  // the batches are recorded before the lighting, so the scratch of the solver takes the memory of the FF rows over
+  enum TransientPhase
+  {
+    PHASE_FF_BATCH = 0,
+    PHASE_LIGHTING = 1,
+  };
+  TransientHeap transientHeap;
   VkBuffer ffTmpRowBuffer = VK_NULL_HANDLE;
-  VkDeviceMemory ffTmpRowMem = VK_NULL_HANDLE;
+  VkBuffer solverTmpBuffer = VK_NULL_HANDLE;
+  VkBuffer solverUnshotBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory solverUnshotMem = VK_NULL_HANDLE;
+  VkBuffer solverStatsBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory solverStatsMem = VK_NULL_HANDLE;
+  // host copies of the solver statistics, a slot per frame in flight is read when the frame's fence is signaled,
+  // the last slot is of the async FF batches
+  VkBuffer solverStatsReadback = VK_NULL_HANDLE;
+  VkDeviceMemory solverStatsReadbackMem = VK_NULL_HANDLE;
+  float *solverStatsReadbackData = nullptr;
+  uint32_t solverStatsPending = 0; // bit per frame in flight
+  // the same scratch for the async FF batches, they run on the compute queue while the frames use the scratch above
+  TransientHeap asyncTransientHeap;
+  VkBuffer asyncFFTmpRowBuffer = VK_NULL_HANDLE;
+  VkBuffer asyncSolverTmpBuffer = VK_NULL_HANDLE;
+  bool recordingAsync = false; // the graph being recorded is of the async queue
+  VkBuffer FFTmpRowScratch() const { return recordingAsync ? asyncFFTmpRowBuffer : ffTmpRowBuffer; }
+  VkBuffer SolverTmpScratch() const { return recordingAsync ? asyncSolverTmpBuffer : solverTmpBuffer; }
+  VkBuffer lightCacheBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory lightCacheMem = VK_NULL_HANDLE;
+  VkBuffer patchAlbedoBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory patchAlbedoMem = VK_NULL_HANDLE;
+  VkBuffer brickTableBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory brickTableMem = VK_NULL_HANDLE;
+  VkBuffer brickCellsBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory brickCellsMem = VK_NULL_HANDLE;
+  VkBuffer samplingStatsBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory samplingStatsMem = VK_NULL_HANDLE;
+  VkBuffer gridCascadesBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory gridCascadesMem = VK_NULL_HANDLE;
+  VkBuffer occupancyBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory occupancyMem = VK_NULL_HANDLE;
+  // the FF of the voxels that survived the last clipmap scroll, read by packFF until the FF rows are recomputed
+  VkBuffer prevFFBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory prevFFMem = VK_NULL_HANDLE;
+  VkBuffer prevFFRowLenBuffer = VK_NULL_HANDLE;
+  VkDeviceMemory prevFFRowLenMem = VK_NULL_HANDLE;
+  uint32_t prevFFVoxels = 0;
+  // the FF the alias table was built from, a scroll renumbers it
+  std::vector<uint32_t> ffHostEntries;
+  std::vector<uint32_t> ffHostRowLens;
   uint32_t trianglesCount = 0;
-  //const float VOXEL_SIZE = 2.5f / 4.0;//0.125f;
-  const float VOXEL_SIZE = 2.5f / 1.0;//0.125f;
-  LiteMath::uint3 voxelsGrid;
+  float voxelSize = 2.5f; // of the finest cascade
+  uint32_t voxelLayout = VOXEL_LAYOUT_MORTON;
+  // clipmapCascades nested grids of CLIPMAP_EXTENT^3 voxels around the camera, the voxel size doubles from one to
+  // the next and every cascade leaves out the region of the finer one; 0 is a single grid over the scene bbox
+  static constexpr uint32_t CLIPMAP_EXTENT = 64; // a multiple of 2 * BRICK_SIZE, the finer region has to fit inside
+  uint32_t clipmapCascades = 0;
+  struct ClipmapCascade
+  {
+    LiteMath::int3 originCell;     // min corner of the cascade in its brick cells
+    std::vector<uint8_t> occupied; // per brick cell, geometry may touch it
+  };
+  std::vector<ClipmapCascade> clipmap;
+  std::vector<GridCascade> gridCascades;
+  // host copies of the brick table and the brick cells, the scrolls of the clipmap update them
+  std::vector<uint32_t> brickTableHost;
+  std::vector<uint32_t> brickCellsHost;
+  // applied by TraceGenSamples with a full rebuild of the voxels
+  struct VoxelSettings
+  {
+    float voxelSize = 2.5f;
+    int cascades = 0;
+    int layout = VOXEL_LAYOUT_MORTON;
+    bool voxelize = false;
+    bool adaptive = true;
+    int visibility = FF_VISIBILITY_RAYS;
+    int nearFieldVoxels = 2;
+    bool rebuild = false;
+  } voxelSettings;
   uint32_t voxelsCount = 0;
+  uint32_t bricksCount = 0;
+  uint32_t brickCapacity = 0;   // bricks the per voxel buffers hold, the clipmap scrolls append bricks up to it
+  uint32_t voxelSlotsCount = 0; // bricksCount * BRICK_VOXELS
   uint32_t clustersCount = 0;
   uint32_t maxPointsCount = 0;
+  uint32_t samplesCount = 0;
   uint32_t visibleVoxelsCount = 0;
-  uint32_t visibleVoxelsApproxCount = 0;
-  uint32_t approxColumns = 0;
+  // FF grows by whole chunks of 4 byte words when a batch doesn't fit, the batch is computed again after that
+  static constexpr uint32_t FF_GROWTH_CHUNK = 1u << 20;
+  uint32_t ffCapacity = 0;
 
   struct ComputeState
   {
     uint32_t ff_out = 0;
-    uint32_t ff_in = 0;
     uint32_t version = 0;
+    bool samples = false; // the sample points of the visible voxels are generated
   } computeState;
-  const uint32_t FF_UPDATE_COUNT = 200000;
-  std::vector<float> aliasThresholds;
-  std::vector<uint> aliasIndices;
-  std::vector<uint> aliasRowLengths;
 
-  struct FFValue
+  // form factors are computed in batches of source voxels, the batch is sized to fit ffTimeBudget of GPU time
+  static constexpr uint32_t FF_MAX_BATCH = 1024;
+  VkQueryPool m_ffQueryPool = VK_NULL_HANDLE;
+  float m_timestampPeriod = 1.0f;
+  // GPU time of the scene draws of BuildCommandBufferSimple, the benchmark measures it with every voxel layout
+  // after a rebuild of the voxels, the camera should stay still meanwhile
+  static constexpr uint32_t SHADING_BENCHMARK_WARMUP = 16;
+  static constexpr uint32_t SHADING_BENCHMARK_FRAMES = 256;
+  // timestamps of the main command buffer of every frame in flight, FRAME_QUERIES_COUNT per frame
+  enum FrameQuery { FRAME_QUERY_BEGIN, FRAME_QUERY_SCENE_BEGIN, FRAME_QUERY_SCENE_END, FRAME_QUERY_END, FRAME_QUERIES_COUNT };
+  VkQueryPool m_frameQueryPool = VK_NULL_HANDLE;
+  uint32_t m_frameQueryMask = 0; // frames whose whole command buffer was timed
+  uint32_t m_sceneQueryMask = 0; // frames whose scene draws were timed with the current voxel layout
+  float shadingMs = 0;
+  // CPU time of a frame includes the synchronous compute of TraceGenSamples, waits are the time blocked on the GPU.
+  // With serializeFrames every frame ends with vkQueueWaitIdle as before the frames were pipelined, to compare the two
+  struct FrameStats
+  {
+    std::chrono::high_resolution_clock::time_point start;
+    bool started = false;
+    float waitMs = 0;    // of the current frame
+    float frameMs = 0;   // averages
+    float cpuMs = 0;
+    float gpuMs = 0;
+    float blockedMs = 0;
+    float Overlap() const { return std::clamp((cpuMs + gpuMs - frameMs) / std::max(std::min(cpuMs, gpuMs), 1e-3f), 0.0f, 1.0f); }
+  } frameStats;
+  bool serializeFrames = false;
+  struct ShadingBenchmark
+  {
+    bool running = false;
+    int layout = 0;
+    int restoreLayout = 0;
+    uint32_t frames = 0;
+    double totalMs = 0;
+    std::array<float, VOXEL_LAYOUTS_COUNT> results = {};
+  } shadingBenchmark;
+  void StartShadingBenchmark();
+  void UpdateShadingTime(float a_sceneMs);
+  // visibility test of the form factors, see voxel_dda.h; with FF_VISIBILITY_DDA the pairs within
+  // ffNearFieldVoxels voxels of the finest cascade still trace rays
+  uint32_t ffVisibility = FF_VISIBILITY_RAYS;
+  uint32_t ffNearFieldVoxels = 2;
+  uint32_t ffBatchSize = 1;
+  float ffMsPerVoxel = 0;
+  float ffTimeBudget = 8.0f;
+  bool ffOffline = false;
+  // a_querySlot selects the timestamps of m_ffQueryPool, a frame in flight or AsyncStatsSlot()
+  void RecordFFBatch(RenderGraph &a_graph, uint32_t a_first, uint32_t a_count, uint32_t a_querySlot);
+  void UpdateFFBatchSize(uint32_t a_batch, float a_cpuTimeMs, uint32_t a_querySlot);
+  // the time-sliced batches are recorded into the compute work of the frames, the FF size a batch needed is copied
+  // to the readback slot of its frame and checked once the fence of the frame has been waited for
+  void RecordFFBatchReadback(RenderGraph &a_graph, uint32_t a_slot, uint32_t a_first, uint32_t a_count);
+  void ReadFFBatch(uint32_t a_slot);
+  struct FFFrameBatch
+  {
+    uint32_t first = 0;
+    uint32_t count = 0;
+    std::chrono::high_resolution_clock::time_point recordTime;
+  };
+  std::vector<FFFrameBatch> ffFrameBatches; // per frame in flight
+  uint32_t ffBatchPending = 0;              // bit per frame in flight
+  VkBuffer ffSizeReadback = VK_NULL_HANDLE;
+  VkDeviceMemory ffSizeReadbackMem = VK_NULL_HANDLE;
+  uint32_t *ffSizeReadbackData = nullptr;
+  void ComputeFFOffline();
+  // With a compute family of its own the FF batches of the build run on m_computeQueue in the background together
+  // with the lighting of the FF computed so far. The async queue works on appliedLightingBuffer while the draws read
+  // publishedLightingBuffer: after a batch a frame waits for it on m_computeTimeline and copies the lighting over,
+  // the next batch waits for that frame on m_frameTimeline. Without such a family the batches are time-sliced into
+  // the frames on the graphics queue
+  VkCommandPool m_computeCommandPool = VK_NULL_HANDLE;
+  VkSemaphore m_computeTimeline = VK_NULL_HANDLE; // value of the last batch submitted to m_computeQueue
+  VkSemaphore m_frameTimeline = VK_NULL_HANDLE;   // value of the last frame submitted to m_graphicsQueue
+  uint64_t m_frameCounter = 0;
+  struct AsyncFFState
+  {
+    bool enabled = true;
+    VkCommandBuffer cmdBuff = VK_NULL_HANDLE;
+    bool inFlight = false;
+    uint64_t value = 0; // of the last batch
+    uint32_t first = 0;
+    uint32_t count = 0;
+    std::chrono::high_resolution_clock::time_point submitTime;
+    bool published = false;    // the draws read publishedLightingBuffer
+    uint64_t publishFrame = 0; // the frame that copied the lighting
+    uint64_t frameWait = 0;    // batch the current frame waits for, 0 if none
+  } asyncFF;
+  bool AsyncFFAvailable() const { return m_computeQueue != VK_NULL_HANDLE; }
+  void CreateAsyncFFResources();
+  void UpdateAsyncFF(bool a_computeFF);
+  void RecordPublishLighting(RenderGraph &a_graph);
+  void SubmitAsyncFFBatch();
+  // FF holds compact entries (ff_compact.h) until it is replaced by the alias table,
+  // a sampled entry gives idx if its threshold is above the random value and aliasIdx otherwise
+  static constexpr uint32_t ALIAS_EMPTY = 0xFFFFFFFFu; // energy that is not reflected by any patch
+  struct AliasValue
   {
     uint idx;
-    float value;
+    uint aliasIdx;
+    float threshold;
   };
+  std::vector<AliasValue> aliasTable;
+  std::vector<uint> aliasRowLengths;
+  uint32_t FFRowOffsetsCount() const { return clustersCount * FFColumnBlocks(clustersCount) + 1; }
+
+  void buildAliasTable(const std::vector<uint32_t> &ff, const std::vector<uint32_t> &row_lengths);
+  // multiple bounces are solved iteratively, the solver stops once the residual relative to the largest
+  // reflected lighting is below tolerance and restarts when the light or the FF changes
+  struct SolverState
+  {
+    int mode = SOLVER_JACOBI;
+    int iterationsPerFrame = 4;
+    float tolerance = 1e-3f;
+    float shootThreshold = 0.1f;
+    uint32_t iterations = 0;
+    float residual = 0.0f;
+    bool converged = false;
+    bool reset = true;
+  } solverState;
+  bool RecordSolver(RenderGraph &a_graph, bool a_ffChanged);
+  // lighting is recomputed only when the light of m_uniforms or the FF change, shadow rays of the voxels
+  // without a shadow boundary are reused until the light direction seen from them changes by retraceAngle
+  struct LightingState
+  {
+    LiteMath::float3 lightPos;
+    float retraceAngle = 1.0f; // degrees
+    bool cacheValid = false;
+    bool dirty = true;
+  } lightingState;
+  bool LightMoved() const;
+  void RecordInitLighting(RenderGraph &a_graph, uint32_t a_flags);
+  void RecordFinalLighting(RenderGraph &a_graph);
+  uint32_t AsyncStatsSlot() const { return m_framesInFlight; }
+  void RecordSolverStatsReadback(RenderGraph &a_graph, uint32_t a_slot);
+  void ReadSolverStats(uint32_t a_slot);
+  void RecordLighting(RenderGraph &a_graph, bool a_ffChanged, uint32_t a_statsSlot);
 
-  void buildAliasTable(const std::vector<FFValue> &ff, const std::vector<uint32_t> &row_lengths);
   bool useAlias = false;
   bool switchAlias = false;
   bool interpolation = true;
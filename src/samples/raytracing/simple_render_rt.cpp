@@ -2,6 +2,12 @@
 #include "simple_render.h"
 #include "raytracing_generated.h"
 
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cmath>
+
 // ***************************************************************************************************************************
 // setup full screen quad to display ray traced image
 void SimpleRender::SetupQuadRenderer()
@@ -15,7 +21,8 @@ void SimpleRender::SetupQuadRenderer()
   m_pFSQuad.reset();
   m_pFSQuad = std::make_shared<vk_utils::QuadRenderer>(0,0, m_width, m_height);
   
-  m_pFSQuad->Create(m_device, "../../resources/shaders/quad3_vert.vert.spv", "../../resources/shaders/my_quad.frag.spv", rtargetInfo);
+  m_pFSQuad->Create(m_device, SpirvPath("../../resources/shaders/quad3_vert.vert.spv").c_str(), SpirvPath("../../resources/shaders/my_quad.frag.spv").c_str(),
+    rtargetInfo);
 }
 
 void SimpleRender::SetupQuadDescriptors()
@@ -29,10 +36,10 @@ void SimpleRender::SetupRTImage()
 {
   vk_utils::deleteImg(m_device, &m_rtImage);
 
-  // change format and usage according to your implementation of RT
+  // CastSingleRay stores the colors to the image, the quad samples it into the swapchain
   m_rtImage.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
   createImgAllocAndBind(m_device, m_physicalDevice, m_width, m_height, VK_FORMAT_R8G8B8A8_UNORM,
-    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, &m_rtImage);
+    VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, &m_rtImage);
 
   if(m_rtImageSampler == VK_NULL_HANDLE)
   {
@@ -44,21 +51,297 @@ void SimpleRender::SetupRTImage()
 // convert geometry data and pass it to acceleration structure builder
 void SimpleRender::GetBbox()
 {
+  // the scene manager keeps the exact world bbox of every instance
+  sceneBbox = m_pScnMgr->GetSceneBbox();
+  sceneBbox.boxMin -= 1e-3f;
+  sceneBbox.boxMax += 1e-3f;
+}
+
+// coarse occupancy pass: GenSamples only registers hits inside the voxel a ray starts from,
+// so voxels of the cells no triangle overlaps never get samples and need no storage
+void SimpleRender::MarkBrickCells(const GridCascade &a_grid, LiteMath::int3 a_knownMin, LiteMath::int3 a_knownMax,
+  std::vector<uint8_t> &a_cells)
+{
+  const LiteMath::uint3 bricksGrid = BricksExtent(a_grid.extent);
+  const int32_t bricksGridSize[3] = {int32_t(bricksGrid.x), int32_t(bricksGrid.y), int32_t(bricksGrid.z)};
+  const float brickSize = a_grid.voxelSize * BRICK_SIZE;
+  // the cells are slightly enlarged so that the hits on their faces survive rounding
+  const float halfSize = brickSize * 0.5f + a_grid.voxelSize * 1e-2f;
+  const float3 bmin = a_grid.origin;
+  const float3 bmax = bmin + float3(a_grid.extent.x, a_grid.extent.y, a_grid.extent.z) * a_grid.voxelSize;
+  const auto known = [&](int32_t x, int32_t y, int32_t z) {
+    return x >= a_knownMin.x && x < a_knownMax.x && y >= a_knownMin.y && y < a_knownMax.y
+      && z >= a_knownMin.z && z < a_knownMax.z;
+  };
+
   auto meshesData = m_pScnMgr->GetMeshData();
-  for (size_t i = 0; i < m_pScnMgr->InstancesNum(); ++i)
+  const size_t stride = meshesData->SingleVertexSize() / sizeof(float);
+  for (uint32_t i = 0; i < m_pScnMgr->InstancesNum(); ++i)
   {
+    // instances outside of the grid are skipped by their world bbox
+    const InstanceDerivedData derived = m_pScnMgr->GetInstanceDerived(i);
+    if (any_of(to_float3(derived.bboxMax) < bmin) || any_of(to_float3(derived.bboxMin) > bmax))
+      continue;
     const auto& info = m_pScnMgr->GetMeshInfo(m_pScnMgr->GetInstanceInfo(i).mesh_id);
     auto vertices = reinterpret_cast<float*>((char*)meshesData->VertexData() + info.m_vertexOffset * meshesData->SingleVertexSize());
+    auto indices = meshesData->IndexData() + info.m_indexOffset;
     auto matrix = m_pScnMgr->GetInstanceMatrix(i);
+    for (uint32_t t = 0; t + 2 < info.m_indNum; t += 3)
+    {
+      float3 p[3];
+      for (uint32_t k = 0; k < 3; ++k)
+      {
+        const float *v = vertices + indices[t + k] * stride;
+        p[k] = to_float3(matrix * float4(v[0], v[1], v[2], 1.0f));
+      }
+      const float3 normal = cross(p[1] - p[0], p[2] - p[0]);
+      int32_t first[3], last[3];
+      bool outside = false;
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        const float lo = std::min(std::min(p[0][axis], p[1][axis]), p[2][axis]) - bmin[axis];
+        const float hi = std::max(std::max(p[0][axis], p[1][axis]), p[2][axis]) - bmin[axis];
+        // the triangles of the whole scene are tested, the clipmap cascades cover only a part of it
+        first[axis] = int32_t(std::max(std::ceil((lo - halfSize) / brickSize - 0.5f), 0.0f));
+        last[axis] = int32_t(std::min(std::floor((hi + halfSize) / brickSize - 0.5f), float(bricksGridSize[axis] - 1)));
+        outside = outside || first[axis] > last[axis];
+      }
+      if (outside)
+        continue;
+      for (int32_t x = first[0]; x <= last[0]; ++x)
+        for (int32_t y = first[1]; y <= last[1]; ++y)
+          for (int32_t z = first[2]; z <= last[2]; ++z)
+          {
+            if (known(x, y, z))
+              continue;
+            // the triangle plane has to cross the cell
+            const float3 center = bmin + (float3(x, y, z) + 0.5f) * brickSize;
+            if (std::abs(dot(normal, center - p[0])) <= (std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z)) * halfSize)
+              a_cells[BrickCell(LiteMath::uint3(x, y, z), bricksGrid)] = 1;
+          }
+    }
+  }
+}
+
+bool SimpleRender::ScrollClipmap(bool a_reset)
+{
+  const int32_t cellsExtent = CLIPMAP_EXTENT / BRICK_SIZE;
+  const LiteMath::uint3 bricksGrid(cellsExtent);
+  if (a_reset)
+  {
+    clipmap.assign(clipmapCascades, ClipmapCascade{});
+    gridCascades.assign(clipmapCascades, GridCascade{});
+  }
+
+  bool moved = false;
+  for (uint32_t c = 0; c < clipmapCascades; ++c)
+  {
+    const float cascadeVoxelSize = voxelSize * float(1u << c);
+    const float brickSize = cascadeVoxelSize * BRICK_SIZE;
+    // snapped to pairs of cells, so the region is made of whole cells of the next cascade
+    const float3 corner = (m_cam.pos - 0.5f * float(CLIPMAP_EXTENT) * cascadeVoxelSize) / (2.0f * brickSize);
+    const LiteMath::int3 originCell = LiteMath::int3(int32_t(std::floor(corner.x)), int32_t(std::floor(corner.y)),
+      int32_t(std::floor(corner.z))) * 2;
+    ClipmapCascade &cascade = clipmap[c];
+    if (!a_reset && originCell.x == cascade.originCell.x && originCell.y == cascade.originCell.y
+      && originCell.z == cascade.originCell.z)
+      continue;
 
-    auto stride = meshesData->SingleVertexSize() / sizeof(float);
-    for(size_t v = 0; v < info.m_vertNum; ++v)
+    // the cells both regions share keep their occupancy, only the exposed slabs are tested
+    std::vector<uint8_t> occupied(size_t(cellsExtent) * cellsExtent * cellsExtent, 0);
+    LiteMath::int3 knownMin(0), knownMax(0);
+    if (!a_reset)
     {
-      sceneBbox.include(matrix * float4(vertices[v * stride + 0], vertices[v * stride + 1], vertices[v * stride + 2], 1.0f));
+      const LiteMath::int3 shift = originCell - cascade.originCell;
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        knownMin[axis] = std::max(-shift[axis], 0);
+        knownMax[axis] = std::max(std::min(cellsExtent - shift[axis], cellsExtent), knownMin[axis]);
+      }
+      for (int32_t x = knownMin.x; x < knownMax.x; ++x)
+        for (int32_t y = knownMin.y; y < knownMax.y; ++y)
+          for (int32_t z = knownMin.z; z < knownMax.z; ++z)
+            occupied[BrickCell(LiteMath::uint3(x, y, z), bricksGrid)] =
+              cascade.occupied[BrickCell(LiteMath::uint3(x + shift.x, y + shift.y, z + shift.z), bricksGrid)];
     }
+
+    GridCascade &grid = gridCascades[c];
+    grid.origin = float3(originCell.x, originCell.y, originCell.z) * brickSize;
+    grid.voxelSize = cascadeVoxelSize;
+    grid.extent = LiteMath::uint3(CLIPMAP_EXTENT);
+    for (int axis = 0; axis < 3; ++axis)
+      grid.wrap[axis] = uint32_t((originCell[axis] % cellsExtent + cellsExtent) % cellsExtent);
+    MarkBrickCells(grid, knownMin, knownMax, occupied);
+    cascade.originCell = originCell;
+    cascade.occupied = std::move(occupied);
+    moved = true;
   }
-  sceneBbox.boxMin -= 1e-3f + VOXEL_SIZE * 0.5;
-  sceneBbox.boxMax += 1e-3f + VOXEL_SIZE * 0.5;
+  return moved || a_reset;
+}
+
+// the region of cascade a_cascade the finer cascade covers, in the cells of a_cascade
+static void ClipmapHole(const std::vector<LiteMath::int3> &a_origins, uint32_t a_cascade, int32_t a_cellsExtent,
+  LiteMath::int3 &a_min, LiteMath::int3 &a_max)
+{
+  a_min = LiteMath::int3(0);
+  a_max = LiteMath::int3(0);
+  if (a_cascade == 0)
+    return;
+  a_min = a_origins[a_cascade - 1] / 2 - a_origins[a_cascade];
+  a_max = a_min + LiteMath::int3(a_cellsExtent / 2);
+}
+
+void SimpleRender::BuildBrickMap()
+{
+  std::vector<const std::vector<uint8_t>*> occupied;
+  std::vector<uint8_t> sceneCells;
+  if (clipmapCascades == 0)
+  {
+    GridCascade grid = {};
+    grid.origin = to_float3(sceneBbox.boxMin) - voxelSize * 0.5f;
+    grid.voxelSize = voxelSize;
+    const float3 gridF = (to_float3(sceneBbox.boxMax - sceneBbox.boxMin) + voxelSize) / voxelSize;
+    grid.extent = LiteMath::uint3(std::ceil(gridF.x), std::ceil(gridF.y), std::ceil(gridF.z));
+    gridCascades = {grid};
+    const LiteMath::uint3 bricksGrid = BricksExtent(grid.extent);
+    sceneCells.assign(size_t(bricksGrid.x) * bricksGrid.y * bricksGrid.z, 0);
+    MarkBrickCells(grid, LiteMath::int3(0), LiteMath::int3(0), sceneCells);
+    occupied.push_back(&sceneCells);
+  }
+  else
+  {
+    // ScrollClipmap has placed the cascades and marked their cells
+    for (const ClipmapCascade &cascade : clipmap)
+      occupied.push_back(&cascade.occupied);
+  }
+
+  std::vector<LiteMath::int3> origins;
+  for (const ClipmapCascade &cascade : clipmap)
+    origins.push_back(cascade.originCell);
+  std::vector<uint32_t> &brickTable = brickTableHost;
+  std::vector<uint32_t> &brickCells = brickCellsHost;
+  brickTable.clear();
+  brickCells.clear();
+  voxelsCount = 0;
+  for (uint32_t c = 0; c < gridCascades.size(); ++c)
+  {
+    GridCascade &grid = gridCascades[c];
+    grid.tableOffset = uint32_t(brickTable.size());
+    grid.voxelLayout = voxelLayout;
+    // the bricks of the cascade are allocated in the order of these keys
+    std::vector<std::pair<uint64_t, uint32_t>> allocated;
+    voxelsCount += grid.extent.x * grid.extent.y * grid.extent.z;
+    const LiteMath::uint3 bricksGrid = BricksExtent(grid.extent);
+    LiteMath::int3 holeMin, holeMax;
+    ClipmapHole(origins, c, CLIPMAP_EXTENT / BRICK_SIZE, holeMin, holeMax);
+    brickTable.resize(brickTable.size() + size_t(bricksGrid.x) * bricksGrid.y * bricksGrid.z, BRICK_EMPTY);
+    for (uint32_t x = 0; x < bricksGrid.x; ++x)
+      for (uint32_t y = 0; y < bricksGrid.y; ++y)
+        for (uint32_t z = 0; z < bricksGrid.z; ++z)
+        {
+          const uint32_t cell = BrickCell(LiteMath::uint3(x, y, z), bricksGrid);
+          const bool hole = int32_t(x) >= holeMin.x && int32_t(x) < holeMax.x && int32_t(y) >= holeMin.y
+            && int32_t(y) < holeMax.y && int32_t(z) >= holeMin.z && int32_t(z) < holeMax.z;
+          if (!(*occupied[c])[cell] || hole)
+            continue;
+          allocated.push_back({voxelLayout == VOXEL_LAYOUT_MORTON ? MortonCode(LiteMath::uint3(x, y, z)) : cell,
+            TableCell(grid, LiteMath::uint3(x, y, z))});
+        }
+    std::sort(allocated.begin(), allocated.end());
+    for (const auto &brick : allocated)
+    {
+      brickTable[grid.tableOffset + brick.second] = uint32_t(brickCells.size());
+      brickCells.push_back(brick.second | (c << BRICK_CASCADE_SHIFT));
+    }
+  }
+  bricksCount = uint32_t(brickCells.size());
+  voxelSlotsCount = bricksCount * BRICK_VOXELS;
+  // the scrolls of the clipmap append the bricks of the exposed slabs, RebuildVoxels compacts the pool once they don't fit
+  const uint32_t slabCells = (CLIPMAP_EXTENT / BRICK_SIZE) * (CLIPMAP_EXTENT / BRICK_SIZE);
+  brickCapacity = clipmapCascades > 0 ? bricksCount * 2 + slabCells * clipmapCascades : bricksCount;
+  m_uniforms.cascadesCount = uint32_t(gridCascades.size());
+  std::cout << "Voxels count " << voxelsCount << " in " << gridCascades.size() << " grids, bricks count " << bricksCount
+    << " of " << brickTable.size() << ", voxel slots " << voxelSlotsCount
+    << (voxelLayout == VOXEL_LAYOUT_MORTON ? ", Morton layout" : ", linear layout") << std::endl;
+
+  // zero sized buffers are not allowed
+  CreateDeviceBuffer(sizeof(uint32_t) * brickTable.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "brick_table", brickTableBuffer, brickTableMem);
+  CreateDeviceBuffer(sizeof(uint32_t) * std::max(brickCapacity, 1u), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "brick_cells", brickCellsBuffer, brickCellsMem);
+  CreateDeviceBuffer(sizeof(GridCascade) * MAX_CASCADES, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "grid_cascades", gridCascadesBuffer, gridCascadesMem);
+  m_pCopyHelper->UpdateBuffer(brickTableBuffer, 0, brickTable.data(), sizeof(brickTable[0]) * brickTable.size());
+  if (!brickCells.empty())
+    m_pCopyHelper->UpdateBuffer(brickCellsBuffer, 0, brickCells.data(), sizeof(brickCells[0]) * brickCells.size());
+  m_pCopyHelper->UpdateBuffer(gridCascadesBuffer, 0, gridCascades.data(), sizeof(GridCascade) * gridCascades.size());
+}
+
+bool SimpleRender::UpdateBrickMap(const std::vector<LiteMath::int3> &a_oldOrigins, std::vector<uint32_t> &a_dropped)
+{
+  const int32_t cellsExtent = CLIPMAP_EXTENT / BRICK_SIZE;
+  const LiteMath::uint3 bricksGrid(cellsExtent);
+  std::vector<LiteMath::int3> origins;
+  for (const ClipmapCascade &cascade : clipmap)
+    origins.push_back(cascade.originCell);
+
+  std::vector<uint32_t> brickTable = brickTableHost;
+  std::vector<uint32_t> dropped;
+  // the bricks cells entries of the new bricks in the order they are allocated
+  std::vector<std::pair<uint64_t, uint32_t>> allocated;
+  for (uint32_t c = 0; c < gridCascades.size(); ++c)
+  {
+    const GridCascade &grid = gridCascades[c];
+    const LiteMath::int3 shift = origins[c] - a_oldOrigins[c];
+    LiteMath::int3 holeMin, holeMax;
+    ClipmapHole(origins, c, cellsExtent, holeMin, holeMax);
+    const auto inside = [](LiteMath::int3 a_cell, LiteMath::int3 a_min, LiteMath::int3 a_max) {
+      return a_cell.x >= a_min.x && a_cell.x < a_max.x && a_cell.y >= a_min.y && a_cell.y < a_max.y
+        && a_cell.z >= a_min.z && a_cell.z < a_max.z;
+    };
+    for (int32_t x = 0; x < cellsExtent; ++x)
+      for (int32_t y = 0; y < cellsExtent; ++y)
+        for (int32_t z = 0; z < cellsExtent; ++z)
+        {
+          const LiteMath::uint3 brickCoord(x, y, z);
+          const uint32_t cell = TableCell(grid, brickCoord);
+          uint32_t &brick = brickTable[grid.tableOffset + cell];
+          // the entry held the same cell before the scroll if the cell was inside the old region
+          const bool stayed = inside(LiteMath::int3(x, y, z) + shift, LiteMath::int3(0), LiteMath::int3(cellsExtent));
+          const bool wanted = clipmap[c].occupied[BrickCell(brickCoord, bricksGrid)] && !inside(LiteMath::int3(x, y, z), holeMin, holeMax);
+          if (brick != BRICK_EMPTY && (!stayed || !wanted))
+          {
+            dropped.push_back(brick);
+            brick = BRICK_EMPTY;
+          }
+          if (brick == BRICK_EMPTY && wanted)
+            allocated.push_back({(uint64_t(c) << 60) | (voxelLayout == VOXEL_LAYOUT_MORTON ? MortonCode(brickCoord)
+              : BrickCell(brickCoord, bricksGrid)), cell | (c << BRICK_CASCADE_SHIFT)});
+        }
+  }
+  if (bricksCount + allocated.size() > brickCapacity)
+    return false;
+
+  const uint32_t firstBrick = bricksCount;
+  std::sort(allocated.begin(), allocated.end());
+  for (const auto &brick : allocated)
+  {
+    brickTable[gridCascades[CellCascade(brick.second)].tableOffset + (brick.second & BRICK_CELL_MASK)] = uint32_t(brickCellsHost.size());
+    brickCellsHost.push_back(brick.second);
+  }
+  brickTableHost = std::move(brickTable);
+  a_dropped = std::move(dropped);
+  bricksCount = uint32_t(brickCellsHost.size());
+  voxelSlotsCount = bricksCount * BRICK_VOXELS;
+  std::cout << "Clipmap scroll: " << allocated.size() << " bricks allocated, " << a_dropped.size() << " dropped, "
+    << bricksCount << " of " << brickCapacity << " in use" << std::endl;
+
+  m_pCopyHelper->UpdateBuffer(brickTableBuffer, 0, brickTableHost.data(), sizeof(brickTableHost[0]) * brickTableHost.size());
+  if (bricksCount > firstBrick)
+    m_pCopyHelper->UpdateBuffer(brickCellsBuffer, sizeof(uint32_t) * firstBrick, brickCellsHost.data() + firstBrick,
+      sizeof(brickCellsHost[0]) * (bricksCount - firstBrick));
+  m_pCopyHelper->UpdateBuffer(gridCascadesBuffer, 0, gridCascades.data(), sizeof(GridCascade) * gridCascades.size());
+  return true;
 }
 
 void SimpleRender::RayTraceGPU()
@@ -68,117 +351,101 @@ void SimpleRender::RayTraceGPU()
     m_pRayTracerGPU = std::make_unique<RayTracer_GPU>(m_width, m_height);
     m_pRayTracerGPU->InitVulkanObjects(m_device, m_physicalDevice, m_width * m_height);
     m_pRayTracerGPU->InitMemberBuffers();
-
-    const size_t bufferSize1 = m_width * m_height * sizeof(uint32_t);
-
-    m_genColorBuffer = vk_utils::createBuffer(m_device, bufferSize1,  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-    m_colorMem       = vk_utils::allocateAndBindWithPadding(m_device, m_physicalDevice, {m_genColorBuffer});
+    m_pRayTracerGPU->SetKernelBarriers(false);
 
     auto tmp = std::make_shared<VulkanRTX>(m_pScnMgr);
     tmp->CommitScene();
 
     m_pRayTracerGPU->SetScene(tmp);
-    m_pRayTracerGPU->SetVulkanInOutFor_CastSingleRay(m_genColorBuffer, 0);
+    m_pRayTracerGPU->SetVulkanInOutFor_CastSingleRay(m_rtImage.view);
     m_pRayTracerGPU->UpdateAll(m_pCopyHelper);
   }
 
-  m_pRayTracerGPU->UpdateView(m_cam.pos, m_inverseProjViewMatrix);
-  m_pRayTracerGPU->UpdatePlainMembers(m_pCopyHelper);
-  
   // do ray tracing
   //
-  {
-    VkCommandBuffer commandBuffer = vk_utils::createCommandBuffer(m_device, m_commandPool);
+  RenderGraph &graph = FrameComputeGraph();
+  m_pRayTracerGPU->UpdateView(m_cam.pos, m_inverseProjViewMatrix);
+  // the update of the class data orders itself after the kernels of the earlier submissions
+  graph.AddPass("update_view", {}, [this](VkCommandBuffer a_cmdBuff) { m_pRayTracerGPU->UpdatePlainMembersCmd(a_cmdBuff); });
+  // the quad of the previous frame may still sample the image, its contents are replaced
+  graph.ImportImage(m_rtImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+  graph.AddPass("cast_rays", { RenderGraph::Image(m_rtImage.image, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL) }, [this](VkCommandBuffer a_cmdBuff) {
+      m_pRayTracerGPU->CastSingleRayCmd(a_cmdBuff, m_width, m_height, nullptr);
+    });
+
+  // get back normal image layout
+  graph.AddPass("sample_image", { RenderGraph::Image(m_rtImage.image, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+    VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) }, nullptr);
+}
 
-    VkCommandBufferBeginInfo beginCommandBufferInfo = {};
-    beginCommandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginCommandBufferInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+void SimpleRender::RecordFramesInFlightBarrier(VkCommandBuffer a_cmdBuff)
+{
+  // the reads of the earlier frames have to finish before the writes, and the compute work of the previous frame
+  // may not have been waited for, so its writes are made visible as well
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr,
+    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT };
+  vkCmdPipelineBarrier(a_cmdBuff, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+    | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
 
-    vkBeginCommandBuffer(commandBuffer, &beginCommandBufferInfo);
-    m_pRayTracerGPU->CastSingleRayCmd(commandBuffer, m_width, m_height, nullptr);
-    
-    // prepare buffer and image for copy command
-    {
-      VkBufferMemoryBarrier transferBuff = {};
-      
-      transferBuff.sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-      transferBuff.pNext               = nullptr;
-      transferBuff.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-      transferBuff.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-      transferBuff.size                = VK_WHOLE_SIZE;
-      transferBuff.offset              = 0;
-      transferBuff.buffer              = m_genColorBuffer;
-      transferBuff.srcAccessMask       = VK_ACCESS_SHADER_WRITE_BIT;
-      transferBuff.dstAccessMask       = VK_ACCESS_TRANSFER_READ_BIT;
-
-      VkImageMemoryBarrier transferImage;
-      transferImage.sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-      transferImage.pNext               = nullptr;
-      transferImage.srcAccessMask       = 0;
-      transferImage.dstAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT;
-      transferImage.oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED;
-      transferImage.newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL; 
-      transferImage.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-      transferImage.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-      transferImage.image               = m_rtImage.image;
-
-      transferImage.subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
-      transferImage.subresourceRange.baseMipLevel   = 0;
-      transferImage.subresourceRange.baseArrayLayer = 0;
-      transferImage.subresourceRange.layerCount     = 1;
-      transferImage.subresourceRange.levelCount     = 1;
-    
-      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &transferBuff, 1, &transferImage);
-    }
+RenderGraph &SimpleRender::FrameComputeGraph()
+{
+  if (!m_frameComputeGraph)
+    m_frameComputeGraph = std::make_unique<RenderGraph>("frame_compute", &transientHeap);
+  return *m_frameComputeGraph;
+}
 
-    // execute copy
-    //
-    {
-      VkImageSubresourceLayers subresourceLayers = {};
-      subresourceLayers.aspectMask               = VK_IMAGE_ASPECT_COLOR_BIT;
-      subresourceLayers.mipLevel                 = 0;
-      subresourceLayers.baseArrayLayer           = 0;
-      subresourceLayers.layerCount               = 1;
-
-      VkBufferImageCopy copyRegion = {};
-      copyRegion.bufferOffset      = 0;
-      copyRegion.bufferRowLength   = uint32_t(m_width);
-      copyRegion.bufferImageHeight = uint32_t(m_height);
-      copyRegion.imageExtent       = VkExtent3D{ uint32_t(m_width), uint32_t(m_height), 1 };
-      copyRegion.imageOffset       = VkOffset3D{ 0, 0, 0 };
-      copyRegion.imageSubresource  = subresourceLayers;
-  
-      vkCmdCopyBufferToImage(commandBuffer, m_genColorBuffer, m_rtImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-    }
-    
-    // get back normal image layout
-    {
-      VkImageMemoryBarrier transferImage;
-      transferImage.sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-      transferImage.pNext               = nullptr;
-      transferImage.srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT;
-      transferImage.dstAccessMask       = VK_ACCESS_SHADER_READ_BIT;
-      transferImage.oldLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-      transferImage.newLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL; 
-      transferImage.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-      transferImage.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-      transferImage.image               = m_rtImage.image;
-
-      transferImage.subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
-      transferImage.subresourceRange.baseMipLevel   = 0;
-      transferImage.subresourceRange.baseArrayLayer = 0;
-      transferImage.subresourceRange.layerCount     = 1;
-      transferImage.subresourceRange.levelCount     = 1;
-    
-      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &transferImage);
-    }
+std::vector<VkCommandBuffer> SimpleRender::EndFrameCompute()
+{
+  if (!m_frameComputeGraph)
+    return {};
+  std::unique_ptr<RenderGraph> graph = std::move(m_frameComputeGraph);
 
+  // the fence of the frame has been waited for in BeginFrame, so the buffer can be recorded again
+  VkCommandBuffer commandBuffer = m_cmdBuffersCompute[m_presentationResources.currentFrame];
+  VkCommandBufferBeginInfo beginCommandBufferInfo = {};
+  beginCommandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginCommandBufferInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginCommandBufferInfo));
+  RecordFramesInFlightBarrier(commandBuffer);
+  ExecuteGraph(*graph, commandBuffer);
 
-    vkEndCommandBuffer(commandBuffer);
+  // the draws of the frame read the lighting, the points and the indirect arguments written by the compute work
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr,
+    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT };
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+    1, &barrier, 0, nullptr, 0, nullptr);
+  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+  return { commandBuffer };
+}
 
-    vk_utils::executeCommandBufferNow(commandBuffer, m_graphicsQueue, m_device);
-  }
+void SimpleRender::ExecuteGraph(RenderGraph &a_graph, VkCommandBuffer a_cmdBuff)
+{
+  a_graph.Execute(a_cmdBuff);
+  if (printGraphSchedules)
+    std::cout << a_graph.Schedule();
+}
+
+void SimpleRender::SubmitAndWait(const std::function<void(VkCommandBuffer)> &a_record)
+{
+  VkCommandBuffer commandBuffer = vk_utils::createCommandBuffer(m_device, m_commandPool);
 
+  VkCommandBufferBeginInfo beginCommandBufferInfo = {};
+  beginCommandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginCommandBufferInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  vkBeginCommandBuffer(commandBuffer, &beginCommandBufferInfo);
+  RecordFramesInFlightBarrier(commandBuffer);
+  a_record(commandBuffer);
+  vkEndCommandBuffer(commandBuffer);
+
+  vk_utils::executeCommandBufferNow(commandBuffer, m_graphicsQueue, m_device);
+  vkFreeCommandBuffers(m_device, m_commandPool, 1, &commandBuffer);
 }
 
 void SimpleRender::TraceGenSamples()
@@ -188,6 +455,7 @@ void SimpleRender::TraceGenSamples()
     m_pRayTracerGPU = std::make_unique<RayTracer_GPU>(m_width, m_height);
     m_pRayTracerGPU->InitVulkanObjects(m_device, m_physicalDevice, m_width * m_height);
     m_pRayTracerGPU->InitMemberBuffers();
+    m_pRayTracerGPU->SetKernelBarriers(false);
 
     const size_t bufferSize1 = m_width * m_height * sizeof(uint32_t);
 
@@ -196,219 +464,1226 @@ void SimpleRender::TraceGenSamples()
 
     m_pRayTracerGPU->SetScene(tmp);
     setObjectName(m_pScnMgr->GetInstanceMatBuffer(), "matrices_buffer");
+    setObjectName(m_pScnMgr->GetInstanceDerivedBuffer(), "instance_derived_buffer");
     setObjectName(m_pScnMgr->GetVertexBuffer(), "vertex_buffer");
     setObjectName(m_pScnMgr->GetIndexBuffer(), "index_buffer");
-    m_pRayTracerGPU->SetVulkanInOutForGenSamples(
-      pointsBuffer, indirectPointsBuffer,
-      samplePointsBuffer, m_pScnMgr->GetVertexBuffer(), m_pScnMgr->GetIndexBuffer(),
-      m_pScnMgr->GetInstanceMatBuffer(), m_pScnMgr->GetMeshInfoBuffer(),
-      primCounterBuffer, FFClusteredBuffer, initLightingBuffer, reflLightingBuffer,
-      debugBuffer, debugIndirBuffer, nonEmptyVoxelsBuffer, indirVoxelsBuffer,
-      appliedLightingBuffer, ffRowLenBuffer, ffTmpRowBuffer,
-      m_pScnMgr->GetMaterialsBuffer(), m_pScnMgr->GetMaterialIDsBuffer(),
-      m_pScnMgr->GetTextureViews(), m_pScnMgr->GetTextureSamplers());
+    UpdateGenSamplesBindings();
     m_pRayTracerGPU->UpdateAll(m_pCopyHelper);
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &props);
+    if (props.limits.timestampComputeAndGraphics)
+    {
+      m_timestampPeriod = props.limits.timestampPeriod;
+      VkQueryPoolCreateInfo queryPoolInfo = {};
+      queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+      queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+      // a pair per frame in flight and one for the async queue
+      queryPoolInfo.queryCount = 2 * (m_framesInFlight + 1);
+      VK_CHECK_RESULT(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &m_ffQueryPool));
+    }
   }
 
-  m_pRayTracerGPU->UpdateView(m_cam.pos, m_inverseProjViewMatrix);
-  m_pRayTracerGPU->UpdatePlainMembers(m_pCopyHelper);
-  
   // do ray tracing
   //
-  static bool inited = false;
-  // if (!inited)
+  if (!ffCacheChecked)
+  {
+    ffCacheChecked = true;
+    ffCacheLoaded = FFCacheEnabled() && LoadFFCache();
+    if (ffCacheLoaded)
+    {
+      computeState.version = 1;
+      useAlias = true;
+      FFComputeProgress = 1.0f;
+    }
+  }
+  if (voxelSettings.rebuild)
+  {
+    voxelSettings.rebuild = false;
+    voxelSize = voxelSettings.voxelSize;
+    voxelLayout = uint32_t(voxelSettings.layout);
+    voxelizeSamples = voxelSettings.voxelize;
+    adaptiveSampling = voxelSettings.adaptive;
+    ffVisibility = uint32_t(voxelSettings.visibility);
+    ffNearFieldVoxels = uint32_t(voxelSettings.nearFieldVoxels);
+    clipmapCascades = uint32_t(voxelSettings.cascades);
+    if (clipmapCascades > 0)
+      ScrollClipmap(true);
+    RebuildVoxels();
+  }
+  else if (clipmapCascades > 0 && computeState.version > 0 && !asyncFF.inFlight)
+  {
+    // the cascades follow the camera once the FF of the previous position is complete, the survivors keep
+    // their samples and FF
+    std::vector<LiteMath::int3> oldOrigins;
+    for (const ClipmapCascade &cascade : clipmap)
+      oldOrigins.push_back(cascade.originCell);
+    if (ScrollClipmap(false) && !ScrollVoxels(oldOrigins))
+      RebuildVoxels();
+  }
   {
-    if (computeState.version == 0 && computeState.ff_out == 0 && computeState.ff_in == 0)
+    if (computeState.version == 0 && !computeState.samples)
     {
-      VkCommandBuffer commandBuffer = vk_utils::createCommandBuffer(m_device, m_commandPool);
+      // the host sizes the next passes by the results of the previous ones, so every pass is waited for
+      if (AdaptiveSampling())
+      {
+        SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+          RenderGraph graph("probe_samples");
+          graph.AddPass("clear_sampling_stats", { RenderGraph::TransferWrite(samplingStatsBuffer) },
+            [this](VkCommandBuffer a_cmdBuff) { vkCmdFillBuffer(a_cmdBuff, samplingStatsBuffer, 0, VK_WHOLE_SIZE, 0); });
+          AddGenSamplesPass(graph, RayTracer_GPU::GEN_SAMPLES_PROBE, SAMPLING_PROBE_POINTS,
+            voxelSlotsCount * 6 * SAMPLING_PROBE_POINTS, false, 0);
+          ExecuteGraph(graph, commandBuffer);
+        });
 
-      VkCommandBufferBeginInfo beginCommandBufferInfo = {};
-      beginCommandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-      beginCommandBufferInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        AllocateSampleDensity();
+      }
 
-      vkBeginCommandBuffer(commandBuffer, &beginCommandBufferInfo);
-      vkCmdFillBuffer(commandBuffer, indirectPointsBuffer, 0, sizeof(uint32_t) * 4 * voxelsCount, 0);
-      vkCmdFillBuffer(commandBuffer, debugIndirBuffer, 0, sizeof(uint32_t) * 4, 0);
-      vkCmdFillBuffer(commandBuffer, primCounterBuffer, 0, sizeof(uint32_t) * trianglesCount, 0);
-      vkCmdFillBuffer(commandBuffer, indirVoxelsBuffer, 0, sizeof(uint32_t) * 4 * 2, 0);
-      vkCmdFillBuffer(commandBuffer, ffRowLenBuffer, 0, sizeof(uint32_t) * (clustersCount + 1), 0);
-      m_pRayTracerGPU->GenSamplesCmd(commandBuffer, PER_SURFACE_POINTS,
-        to_float3(sceneBbox.boxMin), to_float3(sceneBbox.boxMax), VOXEL_SIZE, m_uniforms.time, m_pScnMgr->GetInstanceMatrix(0),
-        maxPointsCount);
+      SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+        RenderGraph graph("count_samples");
+        graph.AddPass("clear_counters", { RenderGraph::TransferWrite(indirectPointsBuffer), RenderGraph::TransferWrite(debugIndirBuffer),
+          RenderGraph::TransferWrite(primCounterBuffer), RenderGraph::TransferWrite(indirVoxelsBuffer) },
+          [this](VkCommandBuffer a_cmdBuff) {
+            vkCmdFillBuffer(a_cmdBuff, indirectPointsBuffer, 0, sizeof(uint32_t) * 4 * voxelSlotsCount, 0);
+            vkCmdFillBuffer(a_cmdBuff, debugIndirBuffer, 0, sizeof(uint32_t) * 4, 0);
+            vkCmdFillBuffer(a_cmdBuff, primCounterBuffer, 0, sizeof(uint32_t) * trianglesCount, 0);
+            vkCmdFillBuffer(a_cmdBuff, indirVoxelsBuffer, 0, sizeof(uint32_t) * 4 * 2, 0);
+          });
+        AddGenSamplesPass(graph, RayTracer_GPU::GEN_SAMPLES_COUNT, PerFacePointsMax(), maxPointsCount, AdaptiveSampling(), 0);
+        ExecuteGraph(graph, commandBuffer);
+      });
 
-      vkEndCommandBuffer(commandBuffer);
+      AllocateSamplePoints();
 
-      vk_utils::executeCommandBufferNow(commandBuffer, m_graphicsQueue, m_device);
+      SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+        RenderGraph graph("write_samples");
+        graph.AddPass("clear_ff_rows", { RenderGraph::TransferWrite(ffRowLenBuffer) },
+          [this](VkCommandBuffer a_cmdBuff) {
+            vkCmdFillBuffer(a_cmdBuff, ffRowLenBuffer, 0, sizeof(uint32_t) * FFRowOffsetsCount(), 0);
+          });
+        AddGenSamplesPass(graph, RayTracer_GPU::GEN_SAMPLES_WRITE, PerFacePointsMax(), maxPointsCount, AdaptiveSampling(), 0);
+        ExecuteGraph(graph, commandBuffer);
+      });
+      computeState.samples = true;
     }
-    if (!inited)
+
+    // the FF are replaced by the alias table before the lighting of the frame is recorded, the buffers it rewrites
+    // are still read by the frames in flight
+    if (useAlias && switchAlias)
     {
-      m_pCopyHelper->ReadBuffer(indirVoxelsBuffer, 0, &visibleVoxelsCount, sizeof(visibleVoxelsCount));
-      std::cout << "Visible voxels count " << visibleVoxelsCount << std::endl;
-      assert(visibleVoxelsApproxCount >= visibleVoxelsCount);
+      vkDeviceWaitIdle(m_device);
+      std::vector<uint32_t> rowLens(FFRowOffsetsCount());
+      m_pCopyHelper->ReadBuffer(ffRowLenBuffer, 0, rowLens.data(), sizeof(rowLens[0]) * rowLens.size());
+      std::cout << "FF total count:" << rowLens.back() << std::endl;
+      std::vector<uint32_t> ff(rowLens.back());
+      if (!ff.empty())
+        m_pCopyHelper->ReadBuffer(FFClusteredBuffer, 0, ff.data(), sizeof(ff[0]) * ff.size());
+      const auto start = std::chrono::high_resolution_clock::now();
+      buildAliasTable(ff, rowLens);
+      std::cout << "Alias table built in " << std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count()
+        << " ms" << std::endl;
+      // alias entries are three times as large as FF entries and alias rows can be longer
+      if (ReserveFF(aliasTable.size() * sizeof(AliasValue) / sizeof(uint32_t)))
+        UpdateGenSamplesBindings();
+      if (!aliasTable.empty())
+        m_pCopyHelper->UpdateBuffer(FFClusteredBuffer, 0, aliasTable.data(), aliasTable.size() * sizeof(aliasTable[0]));
+      m_pCopyHelper->UpdateBuffer(ffRowLenBuffer, 0, aliasRowLengths.data(), aliasRowLengths.size() * sizeof(aliasRowLengths[0]));
+      useAlias = false;
+      // a clipmap scroll renumbers the FF for the survivors
+      if (clipmapCascades > 0)
+      {
+        ffHostRowLens = std::move(rowLens);
+        ffHostEntries = std::move(ff);
+      }
     }
-    
-    if (!switchAlias)
-    {
-      VkCommandBuffer commandBuffer = vk_utils::createCommandBuffer(m_device, m_commandPool);
 
-      VkCommandBufferBeginInfo beginCommandBufferInfo = {};
-      beginCommandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-      beginCommandBufferInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    const bool computeFF = !useAlias && !switchAlias && computeState.version == 0;
+    // the batches of the frames in flight may still have to be computed again
+    if (computeFF && ffOffline && !asyncFF.inFlight && ffBatchPending == 0)
+      ComputeFFOffline();
 
-      vkBeginCommandBuffer(commandBuffer, &beginCommandBufferInfo);
-      if (computeState.version == 0 && computeState.ff_out == 0 && computeState.ff_in == 0)
-      {
-        vkCmdFillBuffer(commandBuffer, FFClusteredBuffer, 0, 2 * sizeof(float) * approxColumns * clustersCount, 0);
-        vkCmdFillBuffer(commandBuffer, ffRowLenBuffer, 0, sizeof(uint32_t) * clustersCount, 0);
-      } 
-      vkCmdFillBuffer(commandBuffer, appliedLightingBuffer, 0, sizeof(float) * voxelsCount * 6, 0);
-      if (!useAlias)
-      {
-        m_pRayTracerGPU->ComputeFFCmd(commandBuffer, PER_SURFACE_POINTS, visibleVoxelsCount, computeState.ff_out);
-        m_pRayTracerGPU->packFFCmd(commandBuffer, PER_SURFACE_POINTS, visibleVoxelsCount, computeState.ff_out);
-      }
-      // if (computeState.ff_out + 1 == visibleVoxelsCount && computeState.ff_in + FF_UPDATE_COUNT >= visibleVoxelsCount)
-      //   m_pRayTracerGPU->CorrectFFCmd(commandBuffer, visibleVoxelsCount);
-      if (updateLight)
+    uint32_t ffBatch = 0;
+    // the lighting buffers belong to the async queue until its last batch has been published
+    const bool asyncEnabled = !ffOffline && AsyncFFAvailable() && asyncFF.enabled;
+    const bool asyncCompute = computeFF && asyncEnabled && ffBatchPending == 0;
+    if (asyncCompute || asyncFF.inFlight || asyncFF.published)
+      UpdateAsyncFF(asyncCompute);
+    else if (!switchAlias)
+    {
+      if (computeFF && !asyncEnabled && computeState.ff_out < visibleVoxelsCount)
+        ffBatch = std::min(ffBatchSize, visibleVoxelsCount - computeState.ff_out);
+      // the FF batch goes into the compute work of the frame, its time and the FF size it needed are read once the
+      // fence of the frame has been waited for, see ReadFFBatch
+      RenderGraph &graph = FrameComputeGraph();
+      if (ffBatch > 0)
       {
-        m_pRayTracerGPU->initLightingCmd(commandBuffer, visibleVoxelsCount, VOXEL_SIZE,
-          to_float3(sceneBbox.boxMin), to_float3(sceneBbox.boxMax), to_float3(m_uniforms.lightPos), PER_VOXEL_POINTS,
-          multibounce ? 1 : 0);
-        m_pRayTracerGPU->reflLightingCmd(commandBuffer, visibleVoxelsCount);
-        m_pRayTracerGPU->finalLightingCmd(commandBuffer, visibleVoxelsCount);
+        RecordFFBatch(graph, computeState.ff_out, ffBatch, m_presentationResources.currentFrame);
+        RecordFFBatchReadback(graph, m_presentationResources.currentFrame, computeState.ff_out, ffBatch);
       }
-
-      vkEndCommandBuffer(commandBuffer);
-
-      vk_utils::executeCommandBufferNow(commandBuffer, m_graphicsQueue, m_device);
+      RecordLighting(graph, ffBatch > 0, m_presentationResources.currentFrame);
     }
     else
     {
-      VkCommandBuffer commandBuffer = vk_utils::createCommandBuffer(m_device, m_commandPool);
+      RenderGraph &graph = FrameComputeGraph();
+      RecordInitLighting(graph, multibounce ? RayTracer_GPU::INIT_LIGHTING_MULTIBOUNCE : 0);
+      graph.AddPass("alias_lighting", { RenderGraph::ComputeRead(FFClusteredBuffer), RenderGraph::ComputeRead(initLightingBuffer),
+        RenderGraph::ComputeWrite(reflLightingBuffer), RenderGraph::ComputeRead(ffRowLenBuffer) }, [this](VkCommandBuffer a_cmdBuff) {
+          m_pRayTracerGPU->aliasLightingCmd(a_cmdBuff, visibleVoxelsCount);
+        });
+      RecordFinalLighting(graph);
+    }
+    computeState.ff_out += ffBatch;
+  }
+  if (computeState.version == 0)
+    FFComputeProgress = (float)computeState.ff_out / std::max(visibleVoxelsCount, 1u);
+  if (computeState.version == 0 && computeState.ff_out >= visibleVoxelsCount && ffBatchPending == 0)
+  {
+    computeState.ff_out = 0;
+    computeState.version++;
+    useAlias = true;
+    prevFFVoxels = 0;
+    if (FFCacheEnabled() && !ffCacheLoaded)
+      SaveFFCache();
+  }
+}
 
-      VkCommandBufferBeginInfo beginCommandBufferInfo = {};
-      beginCommandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-      beginCommandBufferInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+void SimpleRender::RecordLighting(RenderGraph &a_graph, bool a_ffChanged, uint32_t a_statsSlot)
+{
+  if (updateLight && multibounce)
+  {
+    if (RecordSolver(a_graph, a_ffChanged))
+      RecordSolverStatsReadback(a_graph, a_statsSlot);
+  }
+  else if (!updateLight)
+  {
+    a_graph.AddPass("clear_lighting", { RenderGraph::TransferWrite(appliedLightingBuffer) }, [this](VkCommandBuffer a_cmdBuff) {
+      vkCmdFillBuffer(a_cmdBuff, appliedLightingBuffer, 0, sizeof(float4) * voxelSlotsCount * 6, 0);
+    });
+    lightingState.dirty = true;
+  }
+  // nothing to do if neither the light nor the FF have changed since the last frame
+  else if (lightingState.dirty || a_ffChanged || LightMoved())
+  {
+    RecordInitLighting(a_graph, 0);
+    a_graph.AddPass("refl_lighting", { RenderGraph::ComputeRead(FFClusteredBuffer), RenderGraph::ComputeRead(initLightingBuffer),
+      RenderGraph::ComputeRead(ffRowLenBuffer), RenderGraph::ComputeWrite(reflLightingBuffer) },
+      [this](VkCommandBuffer a_cmdBuff) {
+        m_pRayTracerGPU->reflLightingCmd(a_cmdBuff, visibleVoxelsCount);
+      });
+    RecordFinalLighting(a_graph);
+  }
+}
 
-      vkBeginCommandBuffer(commandBuffer, &beginCommandBufferInfo);
-      vkCmdFillBuffer(commandBuffer, appliedLightingBuffer, 0, sizeof(float) * voxelsCount * 6, 0);
-      m_pRayTracerGPU->initLightingCmd(commandBuffer, visibleVoxelsCount, VOXEL_SIZE,
-        to_float3(sceneBbox.boxMin), to_float3(sceneBbox.boxMax), to_float3(m_uniforms.lightPos), PER_VOXEL_POINTS,
-        multibounce ? 1 : 0);
-      m_pRayTracerGPU->aliasLightingCmd(commandBuffer, visibleVoxelsCount);
-      m_pRayTracerGPU->finalLightingCmd(commandBuffer, visibleVoxelsCount);
+bool SimpleRender::LightMoved() const
+{
+  return length(to_float3(m_uniforms.lightPos) - lightingState.lightPos) > 0.0f;
+}
 
-      vkEndCommandBuffer(commandBuffer);
+void SimpleRender::RecordInitLighting(RenderGraph &a_graph, uint32_t a_flags)
+{
+  if (lightingState.cacheValid)
+    a_flags |= RayTracer_GPU::INIT_LIGHTING_USE_CACHE;
+  if (AdaptiveSampling())
+    a_flags |= RayTracer_GPU::INIT_LIGHTING_ADAPTIVE;
+  a_graph.AddPass("init_lighting", { RenderGraph::ComputeWrite(initLightingBuffer), RenderGraph::ComputeWrite(solverUnshotBuffer),
+    RenderGraph::ComputeWrite(lightCacheBuffer), RenderGraph::ComputeRead(reflLightingBuffer),
+    RenderGraph::ComputeRead(nonEmptyVoxelsBuffer), RenderGraph::ComputeRead(samplePositionsBuffer),
+    RenderGraph::ComputeRead(indirectPointsBuffer), RenderGraph::ComputeRead(primCounterBuffer),
+    RenderGraph::ComputeRead(brickCellsBuffer), RenderGraph::ComputeRead(samplingStatsBuffer),
+    RenderGraph::ComputeRead(gridCascadesBuffer), RenderGraph::ComputeRead(sampleNormalsBuffer),
+    RenderGraph::ComputeRead(sampleMaterialsBuffer), RenderGraph::ComputeWrite(patchAlbedoBuffer) },
+    [this, a_flags, lightPos = to_float3(m_uniforms.lightPos), retraceCos = std::cos(lightingState.retraceAngle * DEG_TO_RAD)]
+    (VkCommandBuffer a_cmdBuff) {
+      m_pRayTracerGPU->initLightingCmd(a_cmdBuff, visibleVoxelsCount, lightPos, PER_VOXEL_POINTS, a_flags, retraceCos);
+    });
+  lightingState.lightPos = to_float3(m_uniforms.lightPos);
+  lightingState.cacheValid = true;
+  lightingState.dirty = false;
+}
 
-      vk_utils::executeCommandBufferNow(commandBuffer, m_graphicsQueue, m_device);
+void SimpleRender::RecordFinalLighting(RenderGraph &a_graph)
+{
+  a_graph.AddPass("clear_lighting", { RenderGraph::TransferWrite(appliedLightingBuffer) }, [this](VkCommandBuffer a_cmdBuff) {
+    vkCmdFillBuffer(a_cmdBuff, appliedLightingBuffer, 0, sizeof(float4) * voxelSlotsCount * 6, 0);
+  });
+  a_graph.AddPass("final_lighting", { RenderGraph::ComputeRead(reflLightingBuffer), RenderGraph::ComputeRead(nonEmptyVoxelsBuffer),
+    RenderGraph::ComputeWrite(appliedLightingBuffer) }, [this](VkCommandBuffer a_cmdBuff) {
+      m_pRayTracerGPU->finalLightingCmd(a_cmdBuff, visibleVoxelsCount);
+    });
+}
+
+bool SimpleRender::RecordSolver(RenderGraph &a_graph, bool a_ffChanged)
+{
+  if (solverState.reset || a_ffChanged)
+  {
+    RecordInitLighting(a_graph, 0);
+    std::vector<RenderGraph::Use> uses = { RenderGraph::TransferWrite(solverStatsBuffer) };
+    // shooting starts with the initial lighting unshot and nothing reflected
+    if (solverState.mode == SOLVER_SOUTHWELL)
+    {
+      uses.push_back(RenderGraph::TransferRead(initLightingBuffer));
+      uses.push_back(RenderGraph::TransferWrite(solverUnshotBuffer));
+      uses.push_back(RenderGraph::TransferWrite(reflLightingBuffer));
     }
-    inited = true;
+    a_graph.AddPass("reset_solver", std::move(uses), [this, mode = solverState.mode](VkCommandBuffer a_cmdBuff) {
+      m_pRayTracerGPU->resetSolverCmd(a_cmdBuff, visibleVoxelsCount, mode);
+    });
+    solverState.iterations = 0;
+    solverState.converged = false;
+    solverState.reset = false;
+    // the statistics of the frames in flight belong to the old solution
+    solverStatsPending = 0;
   }
-  computeState.ff_in += FF_UPDATE_COUNT;
-  if (computeState.ff_in >= visibleVoxelsCount)
+  // the system is linear, so Jacobi and Gauss-Seidel continue from the old solution
+  // and shooting continues with the change of the initial lighting added to the unshot lighting
+  else if (LightMoved())
   {
-    computeState.ff_in = 0;
-    computeState.ff_out++;
-    FFComputeProgress = (float)computeState.ff_out / visibleVoxelsCount;
+    RecordInitLighting(a_graph, solverState.mode == SOLVER_SOUTHWELL ? RayTracer_GPU::INIT_LIGHTING_SHOOT_DELTA : 0);
+    solverState.converged = false;
+    solverStatsPending = 0;
   }
-  if (computeState.ff_out == visibleVoxelsCount)
+  // the final lighting of the converged solution is still in place
+  if (solverState.converged)
+    return false;
+
+  const VkPipelineStageFlags stages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+  const VkAccessFlags access = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+  a_graph.AddPass("solve_radiosity", { RenderGraph::ComputeRead(FFClusteredBuffer), RenderGraph::ComputeRead(ffRowLenBuffer),
+    RenderGraph::ComputeRead(initLightingBuffer), RenderGraph::ComputeWrite(reflLightingBuffer),
+    RenderGraph::ComputeWrite(SolverTmpScratch()), RenderGraph::ComputeWrite(solverUnshotBuffer),
+    RenderGraph::Buffer(solverStatsBuffer, stages, access), RenderGraph::ComputeRead(patchAlbedoBuffer) },
+    [this, mode = solverState.mode, first = solverState.iterations, count = solverState.iterationsPerFrame,
+      threshold = solverState.shootThreshold](VkCommandBuffer a_cmdBuff) {
+      solverState.iterations = first + m_pRayTracerGPU->solveRadiosityCmd(a_cmdBuff, visibleVoxelsCount, mode, first, count,
+        threshold);
+    });
+  RecordFinalLighting(a_graph);
+  return true;
+}
+
+void SimpleRender::RecordSolverStatsReadback(RenderGraph &a_graph, uint32_t a_slot)
+{
+  a_graph.AddPass("stats_readback", { RenderGraph::TransferRead(solverStatsBuffer), RenderGraph::TransferWrite(solverStatsReadback) },
+    [this, a_slot](VkCommandBuffer a_cmdBuff) {
+      VkBufferCopy region = {};
+      region.dstOffset = sizeof(float) * SOLVER_STATS_COUNT * a_slot;
+      region.size = sizeof(float) * SOLVER_STATS_COUNT;
+      vkCmdCopyBuffer(a_cmdBuff, solverStatsBuffer, solverStatsReadback, 1, &region);
+    });
+  a_graph.AddPass("host_read", { RenderGraph::Buffer(solverStatsReadback, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT) },
+    nullptr);
+  solverStatsPending |= 1u << a_slot;
+}
+
+// the statistics lag the solver by the frames in flight, so it may run a few iterations past the tolerance
+void SimpleRender::ReadSolverStats(uint32_t a_slot)
+{
+  solverStatsPending &= ~(1u << a_slot);
+  const float *stats = solverStatsReadbackData + SOLVER_STATS_COUNT * a_slot;
+  solverState.residual = stats[SOLVER_STAT_RESIDUAL] / std::max(stats[SOLVER_STAT_SOLUTION], 1e-6f);
+  solverState.converged = solverState.residual < solverState.tolerance;
+}
+
+void SimpleRender::RecordFFBatch(RenderGraph &a_graph, uint32_t a_first, uint32_t a_count, uint32_t a_querySlot)
+{
+  const uint32_t firstQuery = 2 * a_querySlot;
+  if (m_ffQueryPool != VK_NULL_HANDLE)
+    a_graph.AddPass("ff_timestamp", {}, [this, firstQuery](VkCommandBuffer a_cmdBuff) {
+      vkCmdResetQueryPool(a_cmdBuff, m_ffQueryPool, firstQuery, 2);
+      vkCmdWriteTimestamp(a_cmdBuff, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_ffQueryPool, firstQuery);
+    });
+  for (uint32_t first = a_first; first < a_first + a_count; first += RayTracer_GPU::FF_PACK_BATCH)
   {
-    computeState.ff_out = 0;
-    computeState.version++;
+    const uint32_t count = std::min(RayTracer_GPU::FF_PACK_BATCH, a_first + a_count - first);
+    // the voxels of a chunk write their own rows of the temporary buffer, so they don't wait for each other
+    a_graph.AddPass("compute_ff", { RenderGraph::ComputeRead(samplePositionsBuffer), RenderGraph::ComputeRead(indirectPointsBuffer),
+      RenderGraph::ComputeRead(m_pScnMgr->GetVertexBuffer()), RenderGraph::ComputeRead(primCounterBuffer),
+      RenderGraph::ComputeRead(nonEmptyVoxelsBuffer), RenderGraph::ComputeRead(sampleNormalsBuffer),
+      RenderGraph::ComputeRead(brickTableBuffer), RenderGraph::ComputeRead(gridCascadesBuffer),
+      RenderGraph::ComputeRead(occupancyBuffer), RenderGraph::ComputeWrite(FFTmpRowScratch()),
+      RenderGraph::ComputeWrite(debugBuffer), RenderGraph::ComputeWrite(debugIndirBuffer) },
+      [this, first, count, visibility = ffVisibility, nearField = ffNearFieldVoxels * voxelSize, prev = prevFFVoxels](VkCommandBuffer a_cmdBuff) {
+        // the rows of the voxels that survived a scroll only miss the columns of the new voxels
+        for (uint32_t i = 0; i < count; ++i)
+          m_pRayTracerGPU->ComputeFFCmd(a_cmdBuff, PER_SURFACE_POINTS, visibleVoxelsCount, first + i, i, visibility,
+            nearField, uint32_t(gridCascades.size()), first + i < prev ? prev : 0);
+      });
+    a_graph.AddPass("pack_ff", { RenderGraph::ComputeWrite(FFTmpRowScratch()), RenderGraph::ComputeWrite(ffRowLenBuffer),
+      RenderGraph::ComputeWrite(FFClusteredBuffer), RenderGraph::ComputeRead(prevFFBuffer), RenderGraph::ComputeRead(prevFFRowLenBuffer) },
+      [this, first, count, capacity = ffCapacity, prev = prevFFVoxels](VkCommandBuffer a_cmdBuff) {
+        m_pRayTracerGPU->packFFCmd(a_cmdBuff, PER_SURFACE_POINTS, visibleVoxelsCount, first, count, capacity, prev);
+      });
   }
-  if (computeState.ff_out == 0 && computeState.ff_in == 0 && computeState.version == 1)
+  if (m_ffQueryPool != VK_NULL_HANDLE)
+    a_graph.AddPass("ff_timestamp", {}, [this, firstQuery](VkCommandBuffer a_cmdBuff) {
+      vkCmdWriteTimestamp(a_cmdBuff, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_ffQueryPool, firstQuery + 1);
+    });
+}
+
+void SimpleRender::RecordFFBatchReadback(RenderGraph &a_graph, uint32_t a_slot, uint32_t a_first, uint32_t a_count)
+{
+  // packFF writes the row offsets even for the values it had to drop
+  const uint32_t rowOffset = (a_first + a_count) * PER_VOXEL_CLUSTERS * FFColumnBlocks(clustersCount);
+  a_graph.AddPass("ff_size_readback", { RenderGraph::TransferRead(ffRowLenBuffer), RenderGraph::TransferWrite(ffSizeReadback) },
+    [this, a_slot, rowOffset](VkCommandBuffer a_cmdBuff) {
+      VkBufferCopy region = {};
+      region.srcOffset = sizeof(uint32_t) * rowOffset;
+      region.dstOffset = sizeof(uint32_t) * a_slot;
+      region.size = sizeof(uint32_t);
+      vkCmdCopyBuffer(a_cmdBuff, ffRowLenBuffer, ffSizeReadback, 1, &region);
+    });
+  a_graph.AddPass("host_read", { RenderGraph::Buffer(ffSizeReadback, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT) },
+    nullptr);
+  ffFrameBatches[a_slot] = { a_first, a_count, std::chrono::high_resolution_clock::now() };
+  ffBatchPending |= 1u << a_slot;
+}
+
+// the lighting of a batch whose rows have been truncated is shown until the batch is computed again
+void SimpleRender::ReadFFBatch(uint32_t a_slot)
+{
+  ffBatchPending &= ~(1u << a_slot);
+  const FFFrameBatch &batch = ffFrameBatches[a_slot];
+  // without timestamps the time until the fence has been seen bounds the time of the batch
+  UpdateFFBatchSize(batch.count, std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now()
+    - batch.recordTime).count(), a_slot);
+  const uint32_t required = ffSizeReadbackData[a_slot];
+  if (required <= ffCapacity)
+    return;
+  // the batches recorded after this one have dropped their values as well, all of them are computed again;
+  // the frames in flight still use the descriptors of the old buffer
+  vkDeviceWaitIdle(m_device);
+  ReserveFF(required);
+  UpdateGenSamplesBindings();
+  computeState.ff_out = batch.first;
+  ffBatchPending = 0;
+}
+
+void SimpleRender::UpdateFFBatchSize(uint32_t a_batch, float a_cpuTimeMs, uint32_t a_querySlot)
+{
+  float batchTimeMs = a_cpuTimeMs;
+  if (m_ffQueryPool != VK_NULL_HANDLE)
   {
-    useAlias = true;
+    uint64_t timestamps[2] = {};
+    if (vkGetQueryPoolResults(m_device, m_ffQueryPool, 2 * a_querySlot, 2, sizeof(timestamps), timestamps, sizeof(timestamps[0]),
+      VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+      batchTimeMs = float(timestamps[1] - timestamps[0]) * m_timestampPeriod * 1e-6f;
   }
-  if (useAlias && switchAlias)
+  const float msPerVoxel = batchTimeMs / a_batch;
+  ffMsPerVoxel = ffMsPerVoxel > 0 ? 0.8f * ffMsPerVoxel + 0.2f * msPerVoxel : msPerVoxel;
+  // at most double the batch per frame so that a single cheap measurement can't cause a long stall
+  const float target = ffMsPerVoxel > 0 ? ffTimeBudget / ffMsPerVoxel : float(FF_MAX_BATCH);
+  ffBatchSize = std::clamp(uint32_t(target), 1u, std::min(ffBatchSize * 2, FF_MAX_BATCH));
+}
+
+void SimpleRender::ComputeFFOffline()
+{
+  std::cout << "Computing form factors offline" << std::endl;
+  const auto start = std::chrono::high_resolution_clock::now();
+  while (computeState.ff_out < visibleVoxelsCount)
   {
-    std::vector<uint32_t> rowLens(visibleVoxelsCount * 6 + 1);
-    m_pCopyHelper->ReadBuffer(ffRowLenBuffer, 0, rowLens.data(), sizeof(rowLens[0]) * rowLens.size());
-    std::cout << "FF total count:" << rowLens.back() << std::endl;
-    // assert(rowLens.size() <= approxColumns * clustersCount);
-    assert(rowLens.back() <= approxColumns * clustersCount);
-    std::vector<FFValue> ff(approxColumns * clustersCount);
-    m_pCopyHelper->ReadBuffer(FFClusteredBuffer, 0, ff.data(), sizeof(ff[0]) * ff.size());
-    buildAliasTable(ff, rowLens);
-    std::vector<FFValue> aliasValues(aliasIndices.size());
-    assert(aliasThresholds.size() == aliasIndices.size());
-    assert(aliasThresholds.size() <= approxColumns * clustersCount);
-    for (uint32_t i = 0; i < aliasThresholds.size(); ++i)
-    {
-      aliasValues[i].idx = aliasIndices[i];
-      aliasValues[i].value = aliasThresholds[i];
-    }
-    m_pCopyHelper->UpdateBuffer(FFClusteredBuffer, 0, aliasValues.data(), aliasValues.size() * sizeof(aliasValues[0]));
-    m_pCopyHelper->UpdateBuffer(ffRowLenBuffer, 0, aliasRowLengths.data(), aliasRowLengths.size() * sizeof(aliasRowLengths[0]));
-    useAlias = false;
+    const uint32_t batch = std::min(FF_MAX_BATCH, visibleVoxelsCount - computeState.ff_out);
+    SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+      RenderGraph graph("offline_ff", &transientHeap);
+      RecordFFBatch(graph, computeState.ff_out, batch, 0);
+      ExecuteGraph(graph, commandBuffer);
+    });
+    if (FFBatchOverflowed(computeState.ff_out, batch))
+      continue;
+    computeState.ff_out += batch;
+    std::cout << "\rForm factors: " << computeState.ff_out << "/" << visibleVoxelsCount << std::flush;
   }
+  const float seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+  std::cout << std::endl << "Form factors computed in " << seconds << " s";
+  if (ffVisibility == FF_VISIBILITY_DDA)
+    std::cout << " with voxel DDA visibility beyond " << ffNearFieldVoxels << " voxels";
+  std::cout << std::endl;
 }
 
-void SimpleRender::buildAliasTable(const std::vector<FFValue> &ff, const std::vector<uint32_t> &row_lengths)
+void SimpleRender::CreateAsyncFFResources()
 {
-  aliasThresholds.clear();
-  aliasIndices.clear();
-  aliasRowLengths.clear();
-  aliasRowLengths.push_back(0);
+  VkSemaphoreTypeCreateInfoKHR typeInfo = {};
+  typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+  typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+  typeInfo.initialValue = 0;
+  VkSemaphoreCreateInfo semaphoreInfo = {};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphoreInfo.pNext = &typeInfo;
+  VK_CHECK_RESULT(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_frameTimeline));
+  if (!AsyncFFAvailable())
+    return;
 
-  for (uint32_t i = 1; i < row_lengths.size(); ++i)
+  VK_CHECK_RESULT(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_computeTimeline));
+  m_computeCommandPool = vk_utils::createCommandPool(m_device, m_queueFamilyIDXs.compute,
+    VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+  asyncFF.cmdBuff = vk_utils::createCommandBuffer(m_device, m_computeCommandPool);
+  std::cout << "Form factors can be computed on the compute queue family " << m_queueFamilyIDXs.compute << std::endl;
+}
+
+void SimpleRender::UpdateAsyncFF(bool a_computeFF)
+{
+  if (asyncFF.inFlight)
   {
-    const uint32_t rowBegin = row_lengths[i - 1];
-    const uint32_t rowEnd = row_lengths[i];
-    struct AliasInst
-    {
-      float threshold;
-      uint2 indices;
-    };
-    std::vector<AliasInst> aliasRow;
-    float sum = 0;
-    for (uint32_t j = rowBegin; j < rowEnd; ++j)
-    {
-      if (ff[j].value < 1e-9)
-        continue;
-      aliasRow.emplace_back(AliasInst{ff[j].value, {ff[j].idx, 0}});
-      sum += ff[j].value;
-    }
-    if (sum > 1)
-    {
-      for (uint32_t j = 0; j < aliasRow.size(); ++j)
+    uint64_t completed = 0;
+    VK_CHECK_RESULT(vkGetSemaphoreCounterValueKHR(m_device, m_computeTimeline, &completed));
+    if (completed < asyncFF.value)
+      return;
+    asyncFF.inFlight = false;
+    if ((solverStatsPending >> AsyncStatsSlot()) & 1)
+      ReadSolverStats(AsyncStatsSlot());
+    // the queue has been busy with the batch since it was submitted, the timestamps are preferred anyway
+    UpdateFFBatchSize(asyncFF.count, std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now()
+      - asyncFF.submitTime).count(), AsyncStatsSlot());
+    // FF has been grown, the same batch is submitted again and its lighting is not published
+    if (FFBatchOverflowed(asyncFF.first, asyncFF.count))
+      return;
+    computeState.ff_out += asyncFF.count;
+    RecordPublishLighting(FrameComputeGraph());
+    return;
+  }
+  if (!a_computeFF || computeState.ff_out >= visibleVoxelsCount)
+  {
+    // appliedLightingBuffer holds what has been published last, the frames read it again
+    asyncFF.published = false;
+    return;
+  }
+  // the draws switch to the copy before the async queue starts to write the lighting
+  if (!asyncFF.published)
+  {
+    RecordPublishLighting(FrameComputeGraph());
+    return;
+  }
+  SubmitAsyncFFBatch();
+}
+
+void SimpleRender::RecordPublishLighting(RenderGraph &a_graph)
+{
+  // the reads of the earlier frames are ordered before the copy by the barrier at the start of the frame's compute
+  a_graph.AddPass("publish_lighting", { RenderGraph::TransferRead(appliedLightingBuffer),
+    RenderGraph::TransferWrite(publishedLightingBuffer) }, [this](VkCommandBuffer a_cmdBuff) {
+      VkBufferCopy region = {};
+      region.size = sizeof(float4) * std::max(voxelSlotsCount, 1u) * 6;
+      vkCmdCopyBuffer(a_cmdBuff, appliedLightingBuffer, publishedLightingBuffer, 1, &region);
+    });
+  asyncFF.published = true;
+  asyncFF.publishFrame = m_frameCounter + 1;
+  asyncFF.frameWait = asyncFF.value;
+}
+
+void SimpleRender::SubmitAsyncFFBatch()
+{
+  asyncFF.first = computeState.ff_out;
+  asyncFF.count = std::min(ffBatchSize, visibleVoxelsCount - computeState.ff_out);
+
+  VkCommandBufferBeginInfo beginCommandBufferInfo = {};
+  beginCommandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginCommandBufferInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK_RESULT(vkBeginCommandBuffer(asyncFF.cmdBuff, &beginCommandBufferInfo));
+  // the previous batch wrote the FF offsets this one continues from, the graphics stages don't exist on this queue
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr,
+    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT };
+  vkCmdPipelineBarrier(asyncFF.cmdBuff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+  // the batch has scratch of its own, the memory of the frames' scratch is in use on the graphics queue
+  recordingAsync = true;
+  RenderGraph graph("async_ff", &asyncTransientHeap);
+  RecordFFBatch(graph, asyncFF.first, asyncFF.count, AsyncStatsSlot());
+  RecordLighting(graph, true, AsyncStatsSlot());
+  m_pRayTracerGPU->UseAsyncScratch(true);
+  ExecuteGraph(graph, asyncFF.cmdBuff);
+  m_pRayTracerGPU->UseAsyncScratch(false);
+  recordingAsync = false;
+  VK_CHECK_RESULT(vkEndCommandBuffer(asyncFF.cmdBuff));
+
+  // the batch overwrites the lighting the last publishing frame copies
+  const uint64_t waitValue = asyncFF.publishFrame;
+  const uint64_t signalValue = ++asyncFF.value;
+  const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+  VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+  timelineInfo.waitSemaphoreValueCount = 1;
+  timelineInfo.pWaitSemaphoreValues = &waitValue;
+  timelineInfo.signalSemaphoreValueCount = 1;
+  timelineInfo.pSignalSemaphoreValues = &signalValue;
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.waitSemaphoreCount = 1;
+  submitInfo.pWaitSemaphores = &m_frameTimeline;
+  submitInfo.pWaitDstStageMask = &waitStage;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &asyncFF.cmdBuff;
+  submitInfo.signalSemaphoreCount = 1;
+  submitInfo.pSignalSemaphores = &m_computeTimeline;
+  VK_CHECK_RESULT(vkQueueSubmit(m_computeQueue, 1, &submitInfo, VK_NULL_HANDLE));
+
+  asyncFF.inFlight = true;
+  asyncFF.submitTime = std::chrono::high_resolution_clock::now();
+}
+
+void SimpleRender::AddGenSamplesPass(RenderGraph &a_graph, uint32_t a_pass, uint32_t a_pointsPerFace, uint32_t a_maxPoints,
+  bool a_adaptive, uint32_t a_firstBrick)
+{
+  std::vector<RenderGraph::Use> uses = { RenderGraph::ComputeWrite(pointsBuffer), RenderGraph::ComputeWrite(samplePositionsBuffer),
+    RenderGraph::ComputeWrite(indirectPointsBuffer), RenderGraph::ComputeWrite(primCounterBuffer),
+    RenderGraph::ComputeWrite(nonEmptyVoxelsBuffer), RenderGraph::ComputeWrite(indirVoxelsBuffer),
+    RenderGraph::ComputeWrite(samplingStatsBuffer), RenderGraph::ComputeWrite(sampleNormalsBuffer),
+    RenderGraph::ComputeWrite(sampleMaterialsBuffer), RenderGraph::ComputeRead(brickCellsBuffer),
+    RenderGraph::ComputeRead(gridCascadesBuffer), RenderGraph::ComputeRead(brickTableBuffer) };
+  const bool voxelize = voxelizeSamples && a_pass != RayTracer_GPU::GEN_SAMPLES_PROBE;
+  a_graph.AddPass(voxelize ? "voxelize_samples" : "gen_samples", std::move(uses),
+    [this, a_pass, a_pointsPerFace, a_maxPoints, a_adaptive, a_firstBrick, voxelize](VkCommandBuffer a_cmdBuff) {
+      if (!voxelize)
+      {
+        m_pRayTracerGPU->GenSamplesCmd(a_cmdBuff, a_pointsPerFace, m_uniforms.time, m_pScnMgr->GetInstanceMatrix(0),
+          a_maxPoints, a_pass, a_firstBrick, bricksCount - a_firstBrick, a_adaptive);
+        return;
+      }
+      // the instances only add to the counters and write the points they have reserved
+      for (uint32_t i = 0; i < m_pScnMgr->InstancesNum(); ++i)
       {
-        aliasRow[j].threshold /= sum;
+        const uint32_t meshId = m_pScnMgr->GetInstanceInfo(i).mesh_id;
+        m_pRayTracerGPU->VoxelizeSamplesCmd(a_cmdBuff, PerFacePointsMax(), a_pass, i, meshId,
+          m_pScnMgr->GetMeshInfo(meshId).m_indNum / 3, uint32_t(gridCascades.size()), a_firstBrick);
       }
-    } else if (sum < 1)
+    });
+}
+
+void SimpleRender::UpdateGenSamplesBindings()
+{
+  m_pRayTracerGPU->SetAsyncScratch(asyncFFTmpRowBuffer, asyncSolverTmpBuffer);
+  m_pRayTracerGPU->SetPrevFF(prevFFBuffer, prevFFRowLenBuffer);
+  m_pRayTracerGPU->SetVulkanInOutForGenSamples(
+    pointsBuffer, indirectPointsBuffer,
+    samplePositionsBuffer, sampleNormalsBuffer, sampleMaterialsBuffer, m_pScnMgr->GetVertexBuffer(), m_pScnMgr->GetIndexBuffer(),
+    m_pScnMgr->GetInstanceMatBuffer(), m_pScnMgr->GetInstanceDerivedBuffer(), m_pScnMgr->GetMeshInfoBuffer(),
+    primCounterBuffer, FFClusteredBuffer, initLightingBuffer, reflLightingBuffer,
+    debugBuffer, debugIndirBuffer, nonEmptyVoxelsBuffer, indirVoxelsBuffer,
+    appliedLightingBuffer, ffRowLenBuffer, ffTmpRowBuffer,
+    m_pScnMgr->GetMaterialsBuffer(), m_pScnMgr->GetMaterialIDsBuffer(),
+    solverTmpBuffer, solverUnshotBuffer, solverStatsBuffer, lightCacheBuffer, patchAlbedoBuffer, brickCellsBuffer,
+    samplingStatsBuffer, gridCascadesBuffer, brickTableBuffer, occupancyBuffer, m_pScnMgr->GetTextureViews(),
+    m_pScnMgr->GetTextureSamplers());
+}
+
+void SimpleRender::AllocateSampleDensity()
+{
+  std::vector<uint32_t> stats(size_t(voxelSlotsCount) * SAMPLING_STATS_COUNT);
+  if (stats.empty())
+    return;
+  m_pCopyHelper->ReadBuffer(samplingStatsBuffer, 0, stats.data(), sizeof(stats[0]) * stats.size());
+
+  // flat voxels with a single primitive have complexity 1, curved surfaces, depth discontinuities and several
+  // primitives add to it
+  std::vector<float> complexity(voxelSlotsCount, 0.0f);
+  uint32_t hitVoxels = 0;
+  for (uint32_t slot = 0; slot < voxelSlotsCount; ++slot)
+  {
+    const uint32_t *voxelStats = &stats[size_t(slot) * SAMPLING_STATS_COUNT];
+    const uint32_t hits = voxelStats[SAMPLING_STAT_HITS];
+    if (hits == 0)
+      continue;
+    ++hitVoxels;
+    const float3 normalSum = float3(int32_t(voxelStats[SAMPLING_STAT_NORMAL]), int32_t(voxelStats[SAMPLING_STAT_NORMAL + 1]),
+      int32_t(voxelStats[SAMPLING_STAT_NORMAL + 2])) / SAMPLING_NORMAL_SCALE;
+    const float normalSpread = std::max(1.0f - length(normalSum) / hits, 0.0f);
+    const float distMean = voxelStats[SAMPLING_STAT_DIST] / SAMPLING_DIST_SCALE / hits;
+    const float distVariance = voxelStats[SAMPLING_STAT_DIST2] / (SAMPLING_DIST_SCALE * SAMPLING_DIST_SCALE) / hits - distMean * distMean;
+    const uint32_t prims = uint32_t(std::bitset<32>(voxelStats[SAMPLING_STAT_PRIMS]).count());
+    complexity[slot] = 1.0f + 4.0f * normalSpread + 4.0f * std::sqrt(std::max(distVariance, 0.0f)) + 0.5f * (prims - 1);
+  }
+
+  // the largest scale of the complexity whose clamped counts fit the budget, the sum grows with the scale
+  const uint64_t budget = uint64_t(PER_SURFACE_POINTS) * hitVoxels;
+  const auto pointsFor = [&](float a_scale, uint32_t a_slot) {
+    return std::clamp(uint32_t(a_scale * complexity[a_slot]), uint32_t(SAMPLING_MIN_POINTS), uint32_t(SAMPLING_MAX_POINTS));
+  };
+  float lo = 0.0f;
+  float hi = float(SAMPLING_MAX_POINTS);
+  for (int i = 0; i < 32; ++i)
+  {
+    const float scale = 0.5f * (lo + hi);
+    uint64_t total = 0;
+    for (uint32_t slot = 0; slot < voxelSlotsCount; ++slot)
+      if (stats[size_t(slot) * SAMPLING_STATS_COUNT + SAMPLING_STAT_HITS] > 0)
+        total += pointsFor(scale, slot);
+    (total <= budget ? lo : hi) = scale;
+  }
+
+  uint64_t total = 0;
+  uint32_t minPoints = SAMPLING_MAX_POINTS;
+  uint32_t maxPoints = 0;
+  for (uint32_t slot = 0; slot < voxelSlotsCount; ++slot)
+  {
+    uint32_t *voxelStats = &stats[size_t(slot) * SAMPLING_STATS_COUNT];
+    // the probe may miss thin geometry, such voxels still get the minimum
+    voxelStats[SAMPLING_STAT_POINTS] = voxelStats[SAMPLING_STAT_HITS] > 0 ? pointsFor(lo, slot) : SAMPLING_MIN_POINTS;
+    if (voxelStats[SAMPLING_STAT_HITS] == 0)
+      continue;
+    total += voxelStats[SAMPLING_STAT_POINTS];
+    minPoints = std::min(minPoints, voxelStats[SAMPLING_STAT_POINTS]);
+    maxPoints = std::max(maxPoints, voxelStats[SAMPLING_STAT_POINTS]);
+  }
+  m_pCopyHelper->UpdateBuffer(samplingStatsBuffer, 0, stats.data(), sizeof(stats[0]) * stats.size());
+  std::cout << "Adaptive sampling: " << hitVoxels << " voxels with geometry, points per face " << minPoints << ".." << maxPoints
+    << ", average " << (hitVoxels > 0 ? float(total) / hitVoxels : 0.0f) << " of " << PER_SURFACE_POINTS << std::endl;
+}
+
+std::vector<uint32_t> SimpleRender::SortVisibleVoxels(uint32_t a_first)
+{
+  // the count pass appends the voxels in the order of its atomics, which changes from run to run
+  std::vector<uint32_t> visibleVoxels(visibleVoxelsCount);
+  if (visibleVoxels.empty())
+    return visibleVoxels;
+  std::vector<uint32_t> brickCells(bricksCount);
+  m_pCopyHelper->ReadBuffer(nonEmptyVoxelsBuffer, 0, visibleVoxels.data(), sizeof(visibleVoxels[0]) * visibleVoxels.size());
+  m_pCopyHelper->ReadBuffer(brickCellsBuffer, 0, brickCells.data(), sizeof(brickCells[0]) * brickCells.size());
+
+  // every slot has its own voxel, so the keys are unique and the order doesn't depend on the input
+  std::vector<std::pair<uint64_t, uint32_t>> keys(visibleVoxels.size() - std::min<size_t>(a_first, visibleVoxels.size()));
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    const uint32_t slot = visibleVoxels[a_first + i];
+    const uint32_t cell = brickCells[slot / BRICK_VOXELS];
+    const uint32_t cascade = CellCascade(cell);
+    const uint3 voxelCoord = SlotVoxelCoord(slot, cell, gridCascades[cascade]);
+    keys[i] = {(uint64_t(cascade) << 60) | MortonCode(voxelCoord), slot};
+  }
+  std::sort(keys.begin(), keys.end());
+  for (size_t i = 0; i < keys.size(); ++i)
+    visibleVoxels[a_first + i] = keys[i].second;
+  m_pCopyHelper->UpdateBuffer(nonEmptyVoxelsBuffer, 0, visibleVoxels.data(), sizeof(visibleVoxels[0]) * visibleVoxels.size());
+  return visibleVoxels;
+}
+
+void SimpleRender::AllocateSamplePoints()
+{
+  // turn the point counts of the count pass into offsets, the write pass counts the points again
+  std::vector<uint4> pointCounters(voxelSlotsCount);
+  m_pCopyHelper->ReadBuffer(indirectPointsBuffer, 0, pointCounters.data(), sizeof(pointCounters[0]) * pointCounters.size());
+  m_pCopyHelper->ReadBuffer(indirVoxelsBuffer, 0, &visibleVoxelsCount, sizeof(visibleVoxelsCount));
+  UpdateOccupancy(pointCounters);
+  // the lighting, FF rows and sample points all follow the visible voxels list, so its spatial order carries over
+  // to them; only the visible voxels have points
+  const std::vector<uint32_t> visibleVoxels = SortVisibleVoxels(0);
+  uint32_t pointsCount = 0;
+  for (uint32_t slot : visibleVoxels)
+  {
+    uint4 &counter = pointCounters[slot];
+    counter.z = pointsCount;
+    pointsCount += counter.x;
+    counter.x = 0;
+  }
+  m_pCopyHelper->UpdateBuffer(indirectPointsBuffer, 0, pointCounters.data(), sizeof(pointCounters[0]) * pointCounters.size());
+  std::cout << "Visible voxels count " << visibleVoxelsCount << ", sample points count " << pointsCount << std::endl;
+
+  if (CreateVisibleVoxelsBuffers(visibleVoxelsCount, pointsCount))
+  {
+    UpdateGenSamplesBindings();
+    SetupSimplePipeline();
+  }
+}
+
+void SimpleRender::UpdateOccupancy(const std::vector<uint4> &a_pointCounters)
+{
+  std::vector<uint32_t> occupancy((voxelSlotsCount + 31) / 32, 0);
+  for (uint32_t slot = 0; slot < voxelSlotsCount; ++slot)
+    if (a_pointCounters[slot].x > 0)
+      occupancy[slot / 32] |= 1u << (slot % 32);
+  if (!occupancy.empty())
+    m_pCopyHelper->UpdateBuffer(occupancyBuffer, 0, occupancy.data(), sizeof(occupancy[0]) * occupancy.size());
+}
+
+bool SimpleRender::ScrollVoxels(const std::vector<LiteMath::int3> &a_oldOrigins)
+{
+  // frames in flight may still read the brick map and the sample streams
+  vkDeviceWaitIdle(m_device);
+  const uint32_t oldBricks = bricksCount;
+  std::vector<uint32_t> dropped;
+  if (!UpdateBrickMap(a_oldOrigins, dropped))
+    return false;
+  const uint32_t newBricks = bricksCount - oldBricks;
+  maxPointsCount = voxelSlotsCount * 6 * PerFacePointsMax();
+  asyncFF.inFlight = false;
+  asyncFF.published = false;
+
+  // the alias table has replaced the FF on the device, the host has kept the FF it was built from
+  const uint32_t oldVoxels = visibleVoxelsCount;
+  std::vector<uint32_t> rowLens, ff;
+  if (switchAlias && !useAlias)
+  {
+    rowLens = std::move(ffHostRowLens);
+    ff = std::move(ffHostEntries);
+  }
+  else
+  {
+    rowLens.resize(FFRowOffsetsCount());
+    m_pCopyHelper->ReadBuffer(ffRowLenBuffer, 0, rowLens.data(), sizeof(rowLens[0]) * rowLens.size());
+    ff.resize(rowLens.back());
+    if (!ff.empty())
+      m_pCopyHelper->ReadBuffer(FFClusteredBuffer, 0, ff.data(), sizeof(ff[0]) * ff.size());
+  }
+  ffHostRowLens.clear();
+  ffHostEntries.clear();
+
+  // the survivors keep their order at the front of the visible voxels list, the count pass appends the new voxels
+  std::vector<uint32_t> oldVisible(oldVoxels);
+  if (!oldVisible.empty())
+    m_pCopyHelper->ReadBuffer(nonEmptyVoxelsBuffer, 0, oldVisible.data(), sizeof(oldVisible[0]) * oldVisible.size());
+  std::vector<uint8_t> droppedBricks(oldBricks, 0);
+  for (uint32_t brick : dropped)
+    droppedBricks[brick] = 1;
+  std::vector<uint32_t> survivors;
+  std::vector<uint32_t> newIndex(oldVoxels, ~0u);
+  for (uint32_t i = 0; i < oldVoxels; ++i)
+    if (!droppedBricks[oldVisible[i] / BRICK_VOXELS])
     {
-      aliasRow.emplace_back(AliasInst{1 - sum, {0xFFFF, 0}});
+      newIndex[i] = uint32_t(survivors.size());
+      survivors.push_back(oldVisible[i]);
     }
-    const auto comparator = [](const AliasInst &a, const AliasInst &b) {return a.threshold < b.threshold;};
-    std::sort(aliasRow.begin(), aliasRow.end(), comparator);
-    for (uint32_t j = 0; j < aliasRow.size(); ++j)
+  const uint32_t survivorsCount = uint32_t(survivors.size());
+  if (!survivors.empty())
+    m_pCopyHelper->UpdateBuffer(nonEmptyVoxelsBuffer, 0, survivors.data(), sizeof(survivors[0]) * survivors.size());
+  const std::array<uint32_t, 8> visibleCounter = {survivorsCount, 1, 1, survivorsCount, survivorsCount, 1, 0, 0};
+  m_pCopyHelper->UpdateBuffer(indirVoxelsBuffer, 0, visibleCounter.data(), sizeof(visibleCounter));
+
+  // the dropped bricks lose their points and statistics, the appended ones start from zero
+  const auto clearBricks = [&](VkCommandBuffer a_cmdBuff, VkBuffer a_buffer, VkDeviceSize a_brickSize) {
+    for (uint32_t brick : dropped)
+      vkCmdFillBuffer(a_cmdBuff, a_buffer, a_brickSize * brick, a_brickSize, 0);
+    if (newBricks > 0)
+      vkCmdFillBuffer(a_cmdBuff, a_buffer, a_brickSize * oldBricks, a_brickSize * newBricks, 0);
+  };
+  if (AdaptiveSampling())
+  {
+    SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+      RenderGraph graph("probe_samples");
+      graph.AddPass("clear_sampling_stats", { RenderGraph::TransferWrite(samplingStatsBuffer) }, [&](VkCommandBuffer a_cmdBuff) {
+        clearBricks(a_cmdBuff, samplingStatsBuffer, sizeof(uint32_t) * SAMPLING_STATS_COUNT * BRICK_VOXELS);
+      });
+      if (newBricks > 0)
+        AddGenSamplesPass(graph, RayTracer_GPU::GEN_SAMPLES_PROBE, SAMPLING_PROBE_POINTS,
+          newBricks * BRICK_VOXELS * 6 * SAMPLING_PROBE_POINTS, false, oldBricks);
+      ExecuteGraph(graph, commandBuffer);
+    });
+    if (newBricks > 0)
+      AllocateSampleDensity();
+  }
+
+  // primCounter keeps the hits of the dropped voxels, the samples of a triangle split by a scroll are slightly
+  // down weighted until the next rebuild
+  const uint32_t newPointsMax = newBricks * BRICK_VOXELS * 6 * PerFacePointsMax();
+  SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+    RenderGraph graph("count_samples");
+    graph.AddPass("clear_counters", { RenderGraph::TransferWrite(indirectPointsBuffer) }, [&](VkCommandBuffer a_cmdBuff) {
+      clearBricks(a_cmdBuff, indirectPointsBuffer, sizeof(uint4) * BRICK_VOXELS);
+    });
+    if (newBricks > 0)
+      AddGenSamplesPass(graph, RayTracer_GPU::GEN_SAMPLES_COUNT, PerFacePointsMax(), newPointsMax, AdaptiveSampling(), oldBricks);
+    ExecuteGraph(graph, commandBuffer);
+  });
+
+  std::vector<uint4> pointCounters(voxelSlotsCount);
+  m_pCopyHelper->ReadBuffer(indirectPointsBuffer, 0, pointCounters.data(), sizeof(pointCounters[0]) * pointCounters.size());
+  m_pCopyHelper->ReadBuffer(indirVoxelsBuffer, 0, &visibleVoxelsCount, sizeof(visibleVoxelsCount));
+  UpdateOccupancy(pointCounters);
+  const std::vector<uint32_t> visibleVoxels = SortVisibleVoxels(survivorsCount);
+  // the points of the survivors are compacted to the front of the new streams, consecutive survivors make one copy
+  std::vector<VkBufferCopy> regions;
+  uint32_t pointsCount = 0;
+  for (uint32_t i = 0; i < visibleVoxelsCount; ++i)
+  {
+    uint4 &counter = pointCounters[visibleVoxels[i]];
+    if (i < survivorsCount && counter.x > 0)
     {
-      aliasRow[j].threshold *= aliasRow.size();
+      if (!regions.empty() && regions.back().srcOffset + regions.back().size == counter.z
+        && regions.back().dstOffset + regions.back().size == pointsCount)
+        regions.back().size += counter.x;
+      else
+        regions.push_back({counter.z, pointsCount, counter.x});
     }
-    for (uint32_t j = 0; j + 1 < aliasRow.size(); ++j)
+    counter.z = pointsCount;
+    pointsCount += counter.x;
+    if (i >= survivorsCount)
+      counter.x = 0;
+  }
+  m_pCopyHelper->UpdateBuffer(indirectPointsBuffer, 0, pointCounters.data(), sizeof(pointCounters[0]) * pointCounters.size());
+
+  // the old streams are detached, so CreateVisibleVoxelsBuffers makes new ones instead of destroying them
+  VkBuffer oldStreams[3] = {samplePositionsBuffer, sampleNormalsBuffer, sampleMaterialsBuffer};
+  VkDeviceMemory oldStreamsMem[3] = {samplePositionsMem, sampleNormalsMem, sampleMaterialsMem};
+  const VkDeviceSize streamSizes[3] = {SAMPLE_POSITION_SIZE, SAMPLE_NORMAL_SIZE, SAMPLE_MATERIAL_SIZE};
+  samplePositionsBuffer = sampleNormalsBuffer = sampleMaterialsBuffer = VK_NULL_HANDLE;
+  samplePositionsMem = sampleNormalsMem = sampleMaterialsMem = VK_NULL_HANDLE;
+  CreateVisibleVoxelsBuffers(visibleVoxelsCount, pointsCount);
+  const VkBuffer newStreams[3] = {samplePositionsBuffer, sampleNormalsBuffer, sampleMaterialsBuffer};
+  if (!regions.empty())
+  {
+    SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+      for (int stream = 0; stream < 3; ++stream)
+      {
+        std::vector<VkBufferCopy> copies = regions;
+        for (VkBufferCopy &copy : copies)
+        {
+          copy.srcOffset *= streamSizes[stream];
+          copy.dstOffset *= streamSizes[stream];
+          copy.size *= streamSizes[stream];
+        }
+        vkCmdCopyBuffer(commandBuffer, oldStreams[stream], newStreams[stream], uint32_t(copies.size()), copies.data());
+      }
+    });
+  }
+  for (int stream = 0; stream < 3; ++stream)
+  {
+    vkDestroyBuffer(m_device, oldStreams[stream], nullptr);
+    vkFreeMemory(m_device, oldStreamsMem[stream], nullptr);
+  }
+  UploadPrevFF(ff, rowLens, oldVoxels, newIndex, survivorsCount);
+  UpdateGenSamplesBindings();
+  SetupSimplePipeline();
+
+  SubmitAndWait([&](VkCommandBuffer commandBuffer) {
+    RenderGraph graph("write_samples");
+    graph.AddPass("clear_ff_rows", { RenderGraph::TransferWrite(ffRowLenBuffer) },
+      [this](VkCommandBuffer a_cmdBuff) {
+        vkCmdFillBuffer(a_cmdBuff, ffRowLenBuffer, 0, sizeof(uint32_t) * FFRowOffsetsCount(), 0);
+      });
+    if (newBricks > 0)
+      AddGenSamplesPass(graph, RayTracer_GPU::GEN_SAMPLES_WRITE, PerFacePointsMax(), newPointsMax, AdaptiveSampling(), oldBricks);
+    ExecuteGraph(graph, commandBuffer);
+  });
+
+  // every FF row is packed again, the rows of the survivors only compute the columns of the new voxels
+  m_sceneQueryMask = 0;
+  computeState = ComputeState{};
+  computeState.samples = true;
+  prevFFVoxels = survivorsCount;
+  useAlias = false;
+  switchAlias = false;
+  FFComputeProgress = 0.0f;
+  std::cout << "Clipmap scroll: " << survivorsCount << " of " << oldVoxels << " visible voxels kept, "
+    << visibleVoxelsCount - survivorsCount << " added, sample points count " << pointsCount << std::endl;
+  return true;
+}
+
+void SimpleRender::UploadPrevFF(const std::vector<uint32_t> &a_ff, const std::vector<uint32_t> &a_rowLens, uint32_t a_oldVoxels,
+  const std::vector<uint32_t> &a_newIndex, uint32_t a_survivors)
+{
+  // the survivors keep their order, so the renumbered rows and columns stay ascending
+  const uint32_t oldBlocks = FFColumnBlocks(a_oldVoxels * PER_VOXEL_CLUSTERS);
+  const uint32_t blocks = FFColumnBlocks(clustersCount);
+  std::vector<uint32_t> rowLens(size_t(a_survivors) * PER_VOXEL_CLUSTERS * blocks + 1, 0);
+  std::vector<uint32_t> ff;
+  std::vector<uint32_t> columns;
+  std::vector<uint32_t> values;
+  for (uint32_t voxel = 0; voxel < a_oldVoxels; ++voxel)
+  {
+    if (a_newIndex[voxel] == ~0u)
+      continue;
+    for (uint32_t face = 0; face < PER_VOXEL_CLUSTERS; ++face)
     {
-      assert(aliasRow.back().threshold >= 1 - aliasRow[j].threshold);
-      aliasRow.back().threshold -= 1 - aliasRow[j].threshold;
-      aliasRow[j].indices.y = aliasRow.back().indices.x;
-      if (j < aliasRow.size() - 2 && aliasRow.back().threshold < aliasRow[aliasRow.size() - 2].threshold)
+      const uint32_t oldRow = voxel * PER_VOXEL_CLUSTERS + face;
+      const uint32_t row = a_newIndex[voxel] * PER_VOXEL_CLUSTERS + face;
+      columns.clear();
+      values.clear();
+      for (uint32_t block = 0; block < oldBlocks; ++block)
+        for (uint32_t i = a_rowLens[oldRow * oldBlocks + block]; i < a_rowLens[oldRow * oldBlocks + block + 1]; ++i)
+        {
+          const uint32_t column = block * FF_COLUMN_BLOCK + FFDecodeColumn(a_ff[i]);
+          const uint32_t target = a_newIndex[column / PER_VOXEL_CLUSTERS];
+          if (target == ~0u)
+            continue;
+          columns.push_back(target * PER_VOXEL_CLUSTERS + column % PER_VOXEL_CLUSTERS);
+          values.push_back(a_ff[i] & ~0xFFFFu);
+        }
+      size_t k = 0;
+      for (uint32_t block = 0; block < blocks; ++block)
       {
-        auto it = std::lower_bound(aliasRow.begin() + j + 1, aliasRow.begin() + aliasRow.size() - 1, aliasRow.back(), comparator);
-        const auto value = aliasRow.back();
-        aliasRow.pop_back();
-        aliasRow.insert(it, value);
-        assert(aliasRow.back().threshold >= aliasRow[aliasRow.size() - 2].threshold);
+        for (; k < columns.size() && columns[k] / FF_COLUMN_BLOCK == block; ++k)
+          ff.push_back(values[k] | (columns[k] % FF_COLUMN_BLOCK));
+        rowLens[size_t(row) * blocks + block + 1] = uint32_t(ff.size());
       }
     }
-    for (int j = aliasRow.size() - 1; j >= 0 && aliasRow[j].threshold > 1; --j)
+  }
+
+  // zero sized buffers are not allowed
+  CreateDeviceBuffer(sizeof(uint32_t) * std::max<size_t>(ff.size(), 1), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "prev_FF", prevFFBuffer, prevFFMem);
+  CreateDeviceBuffer(sizeof(uint32_t) * rowLens.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    "prev_ff_row_lengths", prevFFRowLenBuffer, prevFFRowLenMem);
+  if (!ff.empty())
+    m_pCopyHelper->UpdateBuffer(prevFFBuffer, 0, ff.data(), sizeof(ff[0]) * ff.size());
+  m_pCopyHelper->UpdateBuffer(prevFFRowLenBuffer, 0, rowLens.data(), sizeof(rowLens[0]) * rowLens.size());
+}
+
+bool SimpleRender::FFBatchOverflowed(uint32_t a_first, uint32_t a_count)
+{
+  // packFF writes the row offsets even for the values it had to drop
+  uint32_t required = 0;
+  const uint32_t rowOffset = (a_first + a_count) * PER_VOXEL_CLUSTERS * FFColumnBlocks(clustersCount);
+  m_pCopyHelper->ReadBuffer(ffRowLenBuffer, sizeof(uint32_t) * rowOffset, &required, sizeof(required));
+  if (required <= ffCapacity)
+    return false;
+  ReserveFF(required);
+  UpdateGenSamplesBindings();
+  return true;
+}
+
+uint64_t SimpleRender::SceneHash() const
+{
+  auto meshData = m_pScnMgr->GetMeshData();
+  const size_t vertexSize = meshData->SingleVertexSize();
+  const size_t indexSize = meshData->SingleIndexSize();
+  uint64_t hash = ff_cache::Hash(m_scenePath.data(), m_scenePath.size());
+  for (uint32_t i = 0; i < m_pScnMgr->MeshesNum(); ++i)
+  {
+    const auto info = m_pScnMgr->GetMeshInfo(i);
+    hash = ff_cache::Hash(reinterpret_cast<const uint8_t*>(meshData->VertexData()) + info.m_vertexOffset * vertexSize,
+      info.m_vertNum * vertexSize, hash);
+    hash = ff_cache::Hash(reinterpret_cast<const uint8_t*>(meshData->IndexData()) + info.m_indexOffset * indexSize,
+      info.m_indNum * indexSize, hash);
+  }
+  for (uint32_t i = 0; i < m_pScnMgr->InstancesNum(); ++i)
+  {
+    const uint32_t meshId = m_pScnMgr->GetInstanceInfo(i).mesh_id;
+    const float4x4 matrix = m_pScnMgr->GetInstanceMatrix(i);
+    hash = ff_cache::Hash(&meshId, sizeof(meshId), hash);
+    hash = ff_cache::Hash(&matrix, sizeof(matrix), hash);
+  }
+  // the samples store the materials of their triangles and the lighting is gathered from the emission, the fields
+  // are hashed one by one because the float3 members of MaterialData_pbrMR may be padded
+  const auto &matIds = m_pScnMgr->GetMaterialIDs();
+  hash = ff_cache::Hash(matIds.data(), matIds.size() * sizeof(matIds[0]), hash);
+  for (const auto &mat : m_pScnMgr->GetMaterials())
+  {
+    const float values[] = {mat.baseColor.x, mat.baseColor.y, mat.baseColor.z, mat.baseColor.w, mat.metallic, mat.roughness,
+      mat.emissionColor.x, mat.emissionColor.y, mat.emissionColor.z, mat.alphaCutoff};
+    const int ids[] = {mat.baseColorTexId, mat.metallicRoughnessTexId, mat.emissionTexId, mat.normalTexId, mat.occlusionTexId,
+      mat.alphaMode};
+    hash = ff_cache::Hash(values, sizeof(values), hash);
+    hash = ff_cache::Hash(ids, sizeof(ids), hash);
+  }
+  for (const auto &tex : m_pScnMgr->GetTextureInfos())
+    hash = ff_cache::Hash(tex.path.data(), tex.path.size(), hash);
+  return hash;
+}
+
+std::string SimpleRender::FFCachePath() const
+{
+  return FF_CACHE_DIR + ff_cache::FileName(SceneHash(), voxelSize, voxelLayout, PerFacePointsMax(), AdaptiveSampling(),
+    voxelizeSamples, ffVisibility, ffNearFieldVoxels);
+}
+
+bool SimpleRender::LoadFFCache()
+{
+  const std::string path = FFCachePath();
+  ff_cache::MappedFile file;
+  if (!file.Open(path))
+    return false;
+
+  const ff_cache::Header &header = *file.GetHeader();
+  if (header.voxelSize != voxelSize || header.voxelLayout != voxelLayout || header.perSurfacePoints != PerFacePointsMax()
+    || header.voxelsCount != voxelSlotsCount
+    || header.trianglesCount != trianglesCount || header.ffEncoding != FF_ENCODING || header.adaptiveSampling != uint32_t(AdaptiveSampling())
+    || header.voxelizedSamples != uint32_t(voxelizeSamples) || header.ffVisibility != ffVisibility
+    || header.nearFieldVoxels != ffNearFieldVoxels)
+  {
+    std::cout << "FF cache " << path << " doesn't match the scene, ignored" << std::endl;
+    return false;
+  }
+  const uint32_t visibleCount = header.visibleVoxelsCount;
+  const uint32_t *rowOffsets = reinterpret_cast<const uint32_t*>(file.Section(ff_cache::SECTION_ROW_OFFSETS));
+  const uint32_t rowOffsetsCount = visibleCount * PER_VOXEL_CLUSTERS * FFColumnBlocks(visibleCount * PER_VOXEL_CLUSTERS) + 1;
+  const uint64_t pointsCount = header.sizes[ff_cache::SECTION_SAMPLE_POSITIONS] / SAMPLE_POSITION_SIZE;
+  if (header.sizes[ff_cache::SECTION_ROW_OFFSETS] != sizeof(uint32_t) * rowOffsetsCount
+    || header.sizes[ff_cache::SECTION_FF] != sizeof(uint32_t) * rowOffsets[rowOffsetsCount - 1]
+    || header.sizes[ff_cache::SECTION_POINT_COUNTERS] != sizeof(uint4) * voxelSlotsCount
+    || header.sizes[ff_cache::SECTION_SAMPLE_POSITIONS] != SAMPLE_POSITION_SIZE * pointsCount
+    || header.sizes[ff_cache::SECTION_SAMPLE_NORMALS] != SAMPLE_NORMAL_SIZE * pointsCount
+    || header.sizes[ff_cache::SECTION_SAMPLE_MATERIALS] != SAMPLE_MATERIAL_SIZE * pointsCount
+    || header.sizes[ff_cache::SECTION_SAMPLING_STATS] != (AdaptiveSampling() ? sizeof(uint32_t) * SAMPLING_STATS_COUNT * voxelSlotsCount : 0))
+  {
+    std::cout << "FF cache " << path << " is corrupted, ignored" << std::endl;
+    return false;
+  }
+
+  visibleVoxelsCount = visibleCount;
+  CreateVisibleVoxelsBuffers(visibleCount, uint32_t(pointsCount));
+  ReserveFF(rowOffsets[rowOffsetsCount - 1]);
+  UpdateGenSamplesBindings();
+  SetupSimplePipeline();
+
+  const auto upload = [&](VkBuffer a_buffer, ff_cache::Section a_section) {
+    if (header.sizes[a_section] > 0)
+      m_pCopyHelper->UpdateBuffer(a_buffer, 0, file.Section(a_section), header.sizes[a_section]);
+  };
+  upload(FFClusteredBuffer, ff_cache::SECTION_FF);
+  upload(ffRowLenBuffer, ff_cache::SECTION_ROW_OFFSETS);
+  upload(nonEmptyVoxelsBuffer, ff_cache::SECTION_VISIBLE_VOXELS);
+  upload(indirVoxelsBuffer, ff_cache::SECTION_VISIBLE_COUNTER);
+  upload(indirectPointsBuffer, ff_cache::SECTION_POINT_COUNTERS);
+  upload(primCounterBuffer, ff_cache::SECTION_PRIM_COUNTER);
+  upload(samplePositionsBuffer, ff_cache::SECTION_SAMPLE_POSITIONS);
+  upload(sampleNormalsBuffer, ff_cache::SECTION_SAMPLE_NORMALS);
+  upload(sampleMaterialsBuffer, ff_cache::SECTION_SAMPLE_MATERIALS);
+  upload(samplingStatsBuffer, ff_cache::SECTION_SAMPLING_STATS);
+  if (header.sizes[ff_cache::SECTION_POINT_COUNTERS] > 0)
+  {
+    const uint4 *pointCounters = reinterpret_cast<const uint4*>(file.Section(ff_cache::SECTION_POINT_COUNTERS));
+    UpdateOccupancy(std::vector<uint4>(pointCounters, pointCounters + voxelSlotsCount));
+  }
+
+  std::cout << "FF loaded from " << path << ", FF total count:" << rowOffsets[rowOffsetsCount - 1] << std::endl;
+  return true;
+}
+
+bool SimpleRender::SaveFFCache()
+{
+  std::vector<uint32_t> rowOffsets(FFRowOffsetsCount());
+  m_pCopyHelper->ReadBuffer(ffRowLenBuffer, 0, rowOffsets.data(), sizeof(rowOffsets[0]) * rowOffsets.size());
+  std::vector<uint32_t> ff(rowOffsets.back());
+  if (!ff.empty())
+    m_pCopyHelper->ReadBuffer(FFClusteredBuffer, 0, ff.data(), sizeof(ff[0]) * ff.size());
+  std::vector<uint32_t> visibleVoxels(visibleVoxelsCount);
+  if (!visibleVoxels.empty())
+    m_pCopyHelper->ReadBuffer(nonEmptyVoxelsBuffer, 0, visibleVoxels.data(), sizeof(visibleVoxels[0]) * visibleVoxels.size());
+  std::array<uint32_t, 8> visibleCounter;
+  m_pCopyHelper->ReadBuffer(indirVoxelsBuffer, 0, visibleCounter.data(), sizeof(visibleCounter));
+  std::vector<uint4> pointCounters(voxelSlotsCount);
+  m_pCopyHelper->ReadBuffer(indirectPointsBuffer, 0, pointCounters.data(), sizeof(pointCounters[0]) * pointCounters.size());
+  std::vector<uint32_t> primCounter(trianglesCount);
+  m_pCopyHelper->ReadBuffer(primCounterBuffer, 0, primCounter.data(), sizeof(primCounter[0]) * primCounter.size());
+  std::vector<uint8_t> samplePositions(size_t(samplesCount) * SAMPLE_POSITION_SIZE);
+  std::vector<uint8_t> sampleNormals(size_t(samplesCount) * SAMPLE_NORMAL_SIZE);
+  std::vector<uint8_t> sampleMaterials(size_t(samplesCount) * SAMPLE_MATERIAL_SIZE);
+  if (samplesCount > 0)
+  {
+    m_pCopyHelper->ReadBuffer(samplePositionsBuffer, 0, samplePositions.data(), samplePositions.size());
+    m_pCopyHelper->ReadBuffer(sampleNormalsBuffer, 0, sampleNormals.data(), sampleNormals.size());
+    m_pCopyHelper->ReadBuffer(sampleMaterialsBuffer, 0, sampleMaterials.data(), sampleMaterials.size());
+  }
+  std::vector<uint32_t> samplingStats(AdaptiveSampling() ? size_t(voxelSlotsCount) * SAMPLING_STATS_COUNT : 0);
+  if (!samplingStats.empty())
+    m_pCopyHelper->ReadBuffer(samplingStatsBuffer, 0, samplingStats.data(), sizeof(samplingStats[0]) * samplingStats.size());
+
+  ff_cache::Header header;
+  header.sceneHash = SceneHash();
+  header.voxelSize = voxelSize;
+  header.voxelLayout = voxelLayout;
+  header.perSurfacePoints = PerFacePointsMax();
+  header.voxelsCount = voxelSlotsCount;
+  header.visibleVoxelsCount = visibleVoxelsCount;
+  header.trianglesCount = trianglesCount;
+  header.ffEncoding = FF_ENCODING;
+  header.adaptiveSampling = AdaptiveSampling() ? 1 : 0;
+  header.voxelizedSamples = voxelizeSamples ? 1 : 0;
+  header.ffVisibility = ffVisibility;
+  header.nearFieldVoxels = ffNearFieldVoxels;
+
+  std::array<ff_cache::SectionData, ff_cache::SECTIONS_COUNT> sections;
+  sections[ff_cache::SECTION_FF] = {ff.data(), sizeof(ff[0]) * ff.size()};
+  sections[ff_cache::SECTION_ROW_OFFSETS] = {rowOffsets.data(), sizeof(rowOffsets[0]) * rowOffsets.size()};
+  sections[ff_cache::SECTION_VISIBLE_VOXELS] = {visibleVoxels.data(), sizeof(visibleVoxels[0]) * visibleVoxels.size()};
+  sections[ff_cache::SECTION_VISIBLE_COUNTER] = {visibleCounter.data(), sizeof(visibleCounter)};
+  sections[ff_cache::SECTION_POINT_COUNTERS] = {pointCounters.data(), sizeof(pointCounters[0]) * pointCounters.size()};
+  sections[ff_cache::SECTION_PRIM_COUNTER] = {primCounter.data(), sizeof(primCounter[0]) * primCounter.size()};
+  sections[ff_cache::SECTION_SAMPLE_POSITIONS] = {samplePositions.data(), samplePositions.size()};
+  sections[ff_cache::SECTION_SAMPLE_NORMALS] = {sampleNormals.data(), sampleNormals.size()};
+  sections[ff_cache::SECTION_SAMPLE_MATERIALS] = {sampleMaterials.data(), sampleMaterials.size()};
+  sections[ff_cache::SECTION_SAMPLING_STATS] = {samplingStats.data(), sizeof(samplingStats[0]) * samplingStats.size()};
+
+  const std::string path = FFCachePath();
+  if (!ff_cache::Write(path, header, sections))
+  {
+    std::cout << "Can't write FF cache to " << path << std::endl;
+    return false;
+  }
+  std::cout << "FF saved to " << path << std::endl;
+  return true;
+}
+
+// Vose's alias method, rows are independent and are built in parallel straight into aliasTable
+void SimpleRender::buildAliasTable(const std::vector<uint32_t> &ff, const std::vector<uint32_t> &row_lengths)
+{
+  const uint32_t blocks = FFColumnBlocks(clustersCount);
+  const float MIN_VALUE = 1e-9f;
+  // sub-rows of a row are contiguous, so the whole row is [row_lengths[i * blocks], row_lengths[(i + 1) * blocks])
+  const auto rowSum = [&](uint32_t i, uint32_t &count) {
+    float sum = 0;
+    count = 0;
+    for (uint32_t j = row_lengths[i * blocks]; j < row_lengths[(i + 1) * blocks]; ++j)
     {
-      aliasRow[j].threshold = 1;
+      const float value = FFDecodeValue(ff[j], FF_ENCODING);
+      if (value < MIN_VALUE)
+        continue;
+      sum += value;
+      ++count;
     }
-    aliasRowLengths.push_back(aliasRow.size() + aliasRowLengths.back());
-    for (uint32_t j = 0; j < aliasRow.size(); ++j)
+    return sum;
+  };
+
+  aliasRowLengths.assign(clustersCount + 1, 0);
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < int(clustersCount); ++i)
+  {
+    uint32_t count;
+    const float sum = rowSum(i, count);
+    aliasRowLengths[i + 1] = count + (sum < 1 ? 1 : 0);
+  }
+  for (uint32_t i = 0; i < clustersCount; ++i)
+    aliasRowLengths[i + 1] += aliasRowLengths[i];
+  aliasTable.resize(aliasRowLengths.back());
+
+  #pragma omp parallel
+  {
+    std::vector<uint32_t> small, large;
+    #pragma omp for schedule(dynamic, 256)
+    for (int i = 0; i < int(clustersCount); ++i)
     {
-      aliasThresholds.push_back(aliasRow[j].threshold);
-      assert(aliasRow[j].indices.y <= 0xFFFF && aliasRow[j].indices.x <= 0xFFFF);
-      aliasIndices.push_back((((unsigned short)aliasRow[j].indices.y) << 16) | ((unsigned short)aliasRow[j].indices.x));
+      AliasValue *row = aliasTable.data() + aliasRowLengths[i];
+      const uint32_t rowSize = aliasRowLengths[i + 1] - aliasRowLengths[i];
+      uint32_t count;
+      const float sum = rowSum(i, count);
+      // probabilities are normalized only if the row reflects more than it receives
+      const float scale = rowSize / std::max(sum, 1.0f);
+
+      uint32_t k = 0;
+      for (uint32_t block = 0; block < blocks; ++block)
+      {
+        for (uint32_t j = row_lengths[i * blocks + block]; j < row_lengths[i * blocks + block + 1]; ++j)
+        {
+          const float value = FFDecodeValue(ff[j], FF_ENCODING);
+          if (value < MIN_VALUE)
+            continue;
+          row[k++] = AliasValue{block * FF_COLUMN_BLOCK + FFDecodeColumn(ff[j]), 0, value * scale};
+        }
+      }
+      if (k < rowSize)
+        row[k++] = AliasValue{ALIAS_EMPTY, 0, (1 - sum) * scale};
+
+      small.clear();
+      large.clear();
+      for (k = 0; k < rowSize; ++k)
+        (row[k].threshold < 1 ? small : large).push_back(k);
+      while (!small.empty() && !large.empty())
+      {
+        const uint32_t s = small.back();
+        const uint32_t l = large.back();
+        small.pop_back();
+        row[s].aliasIdx = row[l].idx;
+        row[l].threshold -= 1 - row[s].threshold;
+        if (row[l].threshold < 1)
+        {
+          large.pop_back();
+          small.push_back(l);
+        }
+      }
+      // what is left is 1 up to the rounding errors
+      for (uint32_t idx : small)
+        row[idx] = AliasValue{row[idx].idx, row[idx].idx, 1};
+      for (uint32_t idx : large)
+        row[idx] = AliasValue{row[idx].idx, row[idx].idx, 1};
     }
   }
 }